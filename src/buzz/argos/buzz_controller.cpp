@@ -2,6 +2,7 @@
 #include <buzz/buzzasm.h>
 #include <buzz/buzzdebug.h>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <cerrno>
 #include <argos3/core/utility/logging/argos_log.h>
@@ -11,15 +12,18 @@
 
 pthread_mutex_t CBuzzController::TRAJECTORY_MUTEX;
 CSet<CBuzzController*> CBuzzController::TRAJECTORY_CONTROLLERS;
+pthread_mutex_t CBuzzController::PROGRAMS_MUTEX;
+std::map<std::string, CBuzzController::SProgram*> CBuzzController::PROGRAMS;
 
 /*
- * A class used to trick the linker to initialize the trajectory mutex
- * during static initialization.
+ * A class used to trick the linker to initialize the trajectory and
+ * program mutexes during static initialization.
  */
 class CBuzzControllerMutexInitializer {
 public:
    CBuzzControllerMutexInitializer() {
       pthread_mutex_init(&CBuzzController::TRAJECTORY_MUTEX, NULL);
+      pthread_mutex_init(&CBuzzController::PROGRAMS_MUTEX, NULL);
    }
 } __cBuzzControllerMutexInitializer;
 
@@ -28,7 +32,7 @@ public:
 
 int BuzzLOG (buzzvm_t vm) {
    LOG << "BUZZ: ";
-   for(UInt32 i = 1; i < buzzdarray_size(vm->lsyms->syms); ++i) {
+   for(UInt32 i = 1; i <= buzzvm_lnum(vm); ++i) {
       buzzvm_lload(vm, i);
       buzzobj_t o = buzzvm_stack_at(vm, 1);
       buzzvm_pop(vm);
@@ -43,7 +47,7 @@ int BuzzLOG (buzzvm_t vm) {
             LOG << o->f.value;
             break;
          case BUZZTYPE_TABLE:
-            LOG << "[table with " << (buzzdict_size(o->t.value)) << " elems]";
+            LOG << "[table with " << (buzztable_size(o)) << " elems]";
             break;
          case BUZZTYPE_CLOSURE:
             if(o->c.value.isnative)
@@ -57,6 +61,9 @@ int BuzzLOG (buzzvm_t vm) {
          case BUZZTYPE_USERDATA:
             LOG << "[userdata @" << o->u.value << "]";
             break;
+         case BUZZTYPE_COROUTINE:
+            LOG << "[coroutine @" << o->r.value << "]";
+            break;
          default:
             break;
       }
@@ -100,7 +107,7 @@ int BuzzDebugPrint(buzzvm_t vm) {
    CBuzzController& cContr = *reinterpret_cast<CBuzzController*>(buzzvm_stack_at(vm, 1)->u.value);
    /* Fill message */
    std::ostringstream oss;
-   for(UInt32 i = 1; i < buzzdarray_size(vm->lsyms->syms); ++i) {
+   for(UInt32 i = 1; i <= buzzvm_lnum(vm); ++i) {
       buzzvm_lload(vm, i);
       buzzobj_t o = buzzvm_stack_at(vm, 1);
       buzzvm_pop(vm);
@@ -115,7 +122,7 @@ int BuzzDebugPrint(buzzvm_t vm) {
             oss << o->f.value;
             break;
          case BUZZTYPE_TABLE:
-            oss << "[table with " << (buzzdict_size(o->t.value)) << " elems]";
+            oss << "[table with " << (buzztable_size(o)) << " elems]";
             break;
          case BUZZTYPE_CLOSURE:
             if(o->c.value.isnative)
@@ -129,6 +136,9 @@ int BuzzDebugPrint(buzzvm_t vm) {
          case BUZZTYPE_USERDATA:
             oss << "[userdata @" << o->u.value << "]";
             break;
+         case BUZZTYPE_COROUTINE:
+            oss << "[coroutine @" << o->r.value << "]";
+            break;
          default:
             break;
       }
@@ -428,7 +438,10 @@ CBuzzController::CBuzzController() :
    m_pcPos(NULL),
    m_pcBattery(NULL),
    m_tBuzzVM(NULL),
-   m_tBuzzDbgInfo(NULL) {}
+   m_tSnapshot(NULL),
+   m_unStepBudget(0),
+   m_tBuzzDbgInfo(NULL),
+   m_psProgram(NULL) {}
 
 /****************************************/
 /****************************************/
@@ -458,6 +471,8 @@ void CBuzzController::Init(TConfigurationNode& t_node) {
       /* Get the script name */
       std::string strDbgFName;
       GetNodeAttributeOrDefault(t_node, "debug_file", strDbgFName, strDbgFName);
+      /* Get the maximum number of instructions per step, 0 for no limit */
+      GetNodeAttributeOrDefault(t_node, "step_budget", m_unStepBudget, m_unStepBudget);
       /* Initialize the rest */
       bool bIDSuccess = false;
       m_unRobotId = 0;
@@ -501,12 +516,14 @@ void CBuzzController::Init(TConfigurationNode& t_node) {
 /****************************************/
 
 void CBuzzController::Reset() {
+   /* Drop the step() that ran out of budget, if any */
+   buzzvm_abort(m_tBuzzVM);
    if(buzzvm_function_call(m_tBuzzVM, "reset", 0) != BUZZVM_STATE_READY) {
       fprintf(stderr, "[ROBOT %u] %s: execution terminated abnormally: %s\n\n",
               m_tBuzzVM->robot,
               m_strBytecodeFName.c_str(),
               ErrorInfo().c_str());
-      for(UInt32 i = 1; i <= buzzdarray_size(m_tBuzzVM->stacks); ++i) {
+      for(UInt32 i = 1; i <= buzzvm_frame_count(m_tBuzzVM); ++i) {
          buzzdebug_stack_dump(m_tBuzzVM, i, stdout);
       }
       return;
@@ -517,8 +534,10 @@ void CBuzzController::Reset() {
    m_sDebug.TrajectoryDisable();
    m_sDebug.RayClear();
    try {
-      /* Set the bytecode again */
-      if(m_strBytecodeFName != "" && m_strDbgInfoFName != "")
+      /* Go back to the state after init(), or set the bytecode again */
+      if(m_tSnapshot && buzzvm_restore(m_tBuzzVM, m_tSnapshot))
+         UpdateSensors();
+      else if(m_strBytecodeFName != "" && m_strDbgInfoFName != "")
          SetBytecode(m_strBytecodeFName, m_strDbgInfoFName);
       else
          UpdateSensors();
@@ -539,17 +558,27 @@ void CBuzzController::ControlStep() {
       m_sDebug.TrajectoryAdd(sPosRead.Position);
    }
    /* Take care of the rest */
-   if(m_tBuzzVM && m_tBuzzVM->state == BUZZVM_STATE_READY) {
-      ProcessInMsgs();
-      UpdateSensors();
-      if(buzzvm_function_call(m_tBuzzVM, "step", 0) != BUZZVM_STATE_READY) {
+   if(m_tBuzzVM && (m_tBuzzVM->state == BUZZVM_STATE_READY ||
+                    m_tBuzzVM->state == BUZZVM_STATE_YIELDED)) {
+      if(m_tBuzzVM->state == BUZZVM_STATE_YIELDED) {
+         /* Go on with the step() that ran out of budget */
+         buzzvm_resume(m_tBuzzVM, m_unStepBudget);
+      }
+      else {
+         ProcessInMsgs();
+         UpdateSensors();
+         buzzvm_function_invoke_budget(m_tBuzzVM, m_tStepFun, m_unStepBudget, "");
+      }
+      /* step() is not over yet */
+      if(m_tBuzzVM->state == BUZZVM_STATE_YIELDED) return;
+      if(m_tBuzzVM->state != BUZZVM_STATE_READY) {
          LOG.Flush();
          LOGERR.Flush();
          fprintf(stderr, "[ROBOT %u] %s: execution terminated abnormally: %s\n\n",
                  m_tBuzzVM->robot,
                  m_strBytecodeFName.c_str(),
                  ErrorInfo().c_str());
-         for(UInt32 i = 1; i <= buzzdarray_size(m_tBuzzVM->stacks); ++i) {
+         for(UInt32 i = 1; i <= buzzvm_frame_count(m_tBuzzVM); ++i) {
             buzzdebug_stack_dump(m_tBuzzVM, i, stdout);
          }
          return;
@@ -570,10 +599,18 @@ void CBuzzController::ControlStep() {
 void CBuzzController::Destroy() {
    /* Get rid of the VM */
    if(m_tBuzzVM) {
+      /* Drop the step() that ran out of budget, if any */
+      buzzvm_abort(m_tBuzzVM);
       buzzvm_function_call(m_tBuzzVM, "destroy", 0);
       buzzvm_destroy(&m_tBuzzVM);
       if(m_tBuzzDbgInfo) buzzdebug_destroy(&m_tBuzzDbgInfo);
    }
+   if(m_tSnapshot) buzzsnapshot_destroy(&m_tSnapshot);
+   /* Stop using the program once the VM is gone */
+   if(m_psProgram) {
+      ProgramRelease(m_psProgram);
+      m_psProgram = NULL;
+   }
 }
 
 /****************************************/
@@ -583,29 +620,27 @@ void CBuzzController::SetBytecode(const std::string& str_bc_fname,
                                   const std::string& str_dbg_fname) {
    /* Reset the BuzzVM */
    if(m_tBuzzVM) buzzvm_destroy(&m_tBuzzVM);
+   if(m_tSnapshot) buzzsnapshot_destroy(&m_tSnapshot);
    m_tBuzzVM = buzzvm_new(m_unRobotId);
+   /* Stop using the old program once the VM is gone */
+   if(m_psProgram) {
+      ProgramRelease(m_psProgram);
+      m_psProgram = NULL;
+   }
    /* Get rid of debug info */
    if(m_tBuzzDbgInfo) buzzdebug_destroy(&m_tBuzzDbgInfo);
    m_tBuzzDbgInfo = buzzdebug_new();
    /* Save the filenames */
    m_strBytecodeFName = str_bc_fname;
    m_strDbgInfoFName = str_dbg_fname;
-   /* Load the bytecode */
-   std::ifstream cBCodeFile(str_bc_fname.c_str(), std::ios::binary | std::ios::ate);
-   if(cBCodeFile.fail()) {
-      THROW_ARGOSEXCEPTION("Can't open file \"" << str_bc_fname << "\": " << strerror(errno));
-   }
-   std::ifstream::pos_type unFileSize = cBCodeFile.tellg();
-   m_cBytecode.Clear();
-   m_cBytecode.Resize(unFileSize);
-   cBCodeFile.seekg(0, std::ios::beg);
-   cBCodeFile.read(reinterpret_cast<char*>(m_cBytecode.ToCArray()), unFileSize);
+   /* Load the bytecode, shared by the controllers that run it */
+   m_psProgram = ProgramAcquire(str_bc_fname);
    /* Load the debug symbols */
    if(!buzzdebug_fromfile(m_tBuzzDbgInfo, m_strDbgInfoFName.c_str())) {
       THROW_ARGOSEXCEPTION("Can't open file \"" << str_dbg_fname << "\": " << strerror(errno));
    }
    /* Load the script */
-   if(buzzvm_set_bcode(m_tBuzzVM, m_cBytecode.ToCArray(), m_cBytecode.Size()) != BUZZVM_STATE_READY) {
+   if(buzzvm_set_program(m_tBuzzVM, m_psProgram->Program) != BUZZVM_STATE_READY) {
       THROW_ARGOSEXCEPTION("Error loading Buzz script \"" << str_bc_fname << "\": " << ErrorInfo());
    }
    /* Register basic function */
@@ -617,19 +652,83 @@ void CBuzzController::SetBytecode(const std::string& str_bc_fname,
    if(buzzvm_execute_script(m_tBuzzVM) != BUZZVM_STATE_DONE) {
       THROW_ARGOSEXCEPTION("Error while executing global portion of Buzz script: " << ErrorInfo());
    }
+   /* Look up the step() function once */
+   m_tStepFun = buzzvm_function_lookup(m_tBuzzVM, "step");
    /* Call the Init() function */
    if(buzzvm_function_call(m_tBuzzVM, "init", 0) != BUZZVM_STATE_READY) {
       fprintf(stderr, "[ROBOT %u] %s: execution terminated abnormally: %s\n\n",
               m_tBuzzVM->robot,
               m_strBytecodeFName.c_str(),
               ErrorInfo().c_str());
-      for(UInt32 i = 1; i <= buzzdarray_size(m_tBuzzVM->stacks); ++i) {
+      for(UInt32 i = 1; i <= buzzvm_frame_count(m_tBuzzVM); ++i) {
          buzzdebug_stack_dump(m_tBuzzVM, i, stdout);
       }
       return;
    }
    /* Remove useless return value from stack */
    buzzvm_pop(m_tBuzzVM);
+   /* Keep the state after init() for Reset() */
+   m_tSnapshot = buzzvm_snapshot(m_tBuzzVM);
+}
+
+/****************************************/
+/****************************************/
+
+CBuzzController::SProgram* CBuzzController::ProgramAcquire(const std::string& str_bc_fname) {
+   /* Read the bytecode */
+   std::ifstream cBCodeFile(str_bc_fname.c_str(), std::ios::binary | std::ios::ate);
+   if(cBCodeFile.fail()) {
+      THROW_ARGOSEXCEPTION("Can't open file \"" << str_bc_fname << "\": " << strerror(errno));
+   }
+   std::ifstream::pos_type unFileSize = cBCodeFile.tellg();
+   CByteArray cBytecode;
+   cBytecode.Resize(unFileSize);
+   cBCodeFile.seekg(0, std::ios::beg);
+   cBCodeFile.read(reinterpret_cast<char*>(cBytecode.ToCArray()), unFileSize);
+   /* Look for the program of the file */
+   pthread_mutex_lock(&PROGRAMS_MUTEX);
+   SProgram*& psProg = PROGRAMS[str_bc_fname];
+   /* Load the program again if the file changed, as when the editor
+    * compiles it again; the controllers using the old program keep it
+    * until they release it */
+   if(psProg == NULL ||
+      psProg->Program->bcode_size != cBytecode.Size() ||
+      ::memcmp(psProg->Program->bcode, cBytecode.ToCArray(), cBytecode.Size()) != 0) {
+      buzzprogram_t tProg = buzzprogram_new(cBytecode.ToCArray(), cBytecode.Size());
+      if(tProg == NULL) {
+         if(psProg == NULL) PROGRAMS.erase(str_bc_fname);
+         pthread_mutex_unlock(&PROGRAMS_MUTEX);
+         THROW_ARGOSEXCEPTION("Error loading Buzz script \"" << str_bc_fname << "\"");
+      }
+      psProg = new SProgram;
+      psProg->Program = tProg;
+      psProg->Users = 0;
+   }
+   ++psProg->Users;
+   SProgram* psRet = psProg;
+   pthread_mutex_unlock(&PROGRAMS_MUTEX);
+   return psRet;
+}
+
+/****************************************/
+/****************************************/
+
+void CBuzzController::ProgramRelease(SProgram* ps_prog) {
+   pthread_mutex_lock(&PROGRAMS_MUTEX);
+   if(--ps_prog->Users == 0) {
+      /* Forget the program, unless a newer one replaced it */
+      for(std::map<std::string, SProgram*>::iterator it = PROGRAMS.begin();
+          it != PROGRAMS.end();
+          ++it) {
+         if(it->second == ps_prog) {
+            PROGRAMS.erase(it);
+            break;
+         }
+      }
+      buzzprogram_destroy(&ps_prog->Program);
+      delete ps_prog;
+   }
+   pthread_mutex_unlock(&PROGRAMS_MUTEX);
 }
 
 /****************************************/
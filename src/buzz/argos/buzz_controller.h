@@ -11,9 +11,12 @@
 #include <argos3/core/utility/math/ray3.h>
 #include <argos3/core/utility/datatypes/set.h>
 #include <buzz/buzzvm.h>
+#include <buzz/buzzprogram.h>
+#include <buzz/buzzsnapshot.h>
 #include <buzz/buzzdebug.h>
 #include <string>
 #include <list>
+#include <map>
 
 using namespace argos;
 
@@ -68,6 +71,14 @@ public:
       void RayClear();
    };
 
+   /* A program shared by the controllers that run the same bytecode */
+   struct SProgram {
+      /* The program */
+      buzzprogram_t Program;
+      /* Number of controllers using it */
+      UInt32 Users;
+   };
+
 public:
 
    CBuzzController();
@@ -222,18 +233,33 @@ protected:
    UInt16 m_unRobotId;
    /* Buzz VM state */
    buzzvm_t m_tBuzzVM;
+   /* Snapshot of the VM after init(), restored by Reset() */
+   buzzsnapshot_t m_tSnapshot;
+   /* Handle to the step() function of the script */
+   buzzvm_fun_t m_tStepFun;
+   /* Maximum number of instructions per control step, 0 for no limit */
+   UInt32 m_unStepBudget;
    /* Buzz debug info */
    buzzdebug_t m_tBuzzDbgInfo;
    /* Name of the bytecode file */
    std::string m_strBytecodeFName;
    /* Name of the debug info file */
    std::string m_strDbgInfoFName;
-   /* The actual bytecode */
-   CByteArray m_cBytecode;
+   /* The program of the bytecode, shared with the other controllers */
+   SProgram* m_psProgram;
    /* Debugging information */
    SDebug m_sDebug;
 
 public:
+
+   /* Mutex for the shared programs */
+   static pthread_mutex_t PROGRAMS_MUTEX;
+   /* Shared programs, by bytecode file name */
+   static std::map<std::string, SProgram*> PROGRAMS;
+   /* Returns the program of a bytecode file, loading it if it changed */
+   static SProgram* ProgramAcquire(const std::string& str_bc_fname);
+   /* Stops using a program, which is destroyed when no one uses it */
+   static void ProgramRelease(SProgram* ps_prog);
    
    /* Mutex for trajectory tracking */
    static pthread_mutex_t TRAJECTORY_MUTEX;
@@ -629,7 +629,10 @@ void CBuzzQTMainWindow::CheckBuzzStatus(int n_step) {
    m_pcRunTimeErrorTable->clearContents();
    m_pcRunTimeErrorTable->setRowCount(m_vecControllers.size());
    for(size_t i = 0; i < m_vecControllers.size(); ++i) {
-      if(m_vecControllers[i]->GetBuzzVM()->state != BUZZVM_STATE_READY) {
+      /* A step() that ran out of budget goes on at the next step */
+      buzzvm_state eState = m_vecControllers[i]->GetBuzzVM()->state;
+      if(eState != BUZZVM_STATE_READY &&
+         eState != BUZZVM_STATE_YIELDED) {
          SetRunTimeError(nRow,
                          QString::fromStdString(m_vecControllers[i]->GetId()),
                          QString::fromStdString(m_vecControllers[i]->ErrorInfo()));
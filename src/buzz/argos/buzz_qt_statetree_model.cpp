@@ -189,6 +189,9 @@ void ProcessBuzzObjectsInTable(const void* pt_key,
          case BUZZTYPE_USERDATA:
             cData << "[userdata]";
             break;
+         case BUZZTYPE_COROUTINE:
+            cData << "[coroutine]";
+            break;
          default:
             return;
       }
@@ -205,7 +208,7 @@ void ProcessBuzzObjectsInTable(const void* pt_key,
          .Item = pcChild,
          .NoEmptyTables = psParams->NoEmptyTables
       };
-      buzzdict_foreach(tData->t.value, ProcessBuzzObjectsInTable, &sParams2);
+      buzztable_foreach(tData, ProcessBuzzObjectsInTable, &sParams2);
       /* If no elements were added, remove the child */
       if(psParams->NoEmptyTables) {
          if(pcChild->GetNumChildren() == 0) {
@@ -245,6 +248,9 @@ void ProcessBuzzObjects(const void* pt_key,
          case BUZZTYPE_USERDATA:
             cData << "[userdata]";
             break;
+         case BUZZTYPE_COROUTINE:
+            cData << "[coroutine]";
+            break;
          default:
             return;
       }
@@ -261,7 +267,7 @@ void ProcessBuzzObjects(const void* pt_key,
          .Item = pcChild,
          .NoEmptyTables = psParams->NoEmptyTables
       };
-      buzzdict_foreach(tData->t.value, ProcessBuzzObjectsInTable, &sParams2);
+      buzztable_foreach(tData, ProcessBuzzObjectsInTable, &sParams2);
       /* If no elements were added, remove the child */
       if(psParams->NoEmptyTables) {
          if(pcChild->GetNumChildren() == 0) {
@@ -348,7 +354,7 @@ void ProcessBuzzFunctionsInTable(const void* pt_key,
          .Item = pcChild,
          .NoEmptyTables = psParams->NoEmptyTables
       };
-      buzzdict_foreach(tData->t.value, ProcessBuzzFunctionsInTable, &sParams2);
+      buzztable_foreach(tData, ProcessBuzzFunctionsInTable, &sParams2);
       /* If no elements were added, remove the child */
       if(psParams->NoEmptyTables) {
          if(pcChild->GetNumChildren() == 0)
@@ -389,7 +395,7 @@ void ProcessBuzzFunctions(const void* pt_key,
          .Item = pcChild,
          .NoEmptyTables = psParams->NoEmptyTables
       };
-      buzzdict_foreach(tData->t.value, ProcessBuzzFunctionsInTable, &sParams2);
+      buzztable_foreach(tData, ProcessBuzzFunctionsInTable, &sParams2);
       /* If no elements were added, remove the child */
       if(psParams->NoEmptyTables) {
          if(pcChild->GetNumChildren() == 0)
@@ -303,6 +303,17 @@ int buzz_asm(const char* fname,
       l_arg_instr(BUZZVM_INSTR_JUMP);
       l_arg_instr(BUZZVM_INSTR_JUMPZ);
       l_arg_instr(BUZZVM_INSTR_JUMPNZ);
+      i_arg_instr(BUZZVM_INSTR_GLOADS);
+      i_arg_instr(BUZZVM_INSTR_TGETS);
+      i_arg_instr(BUZZVM_INSTR_CALLCI);
+      i_arg_instr(BUZZVM_INSTR_ADDI);
+      l_arg_instr(BUZZVM_INSTR_LTJUMPZ);
+      l_arg_instr(BUZZVM_INSTR_GTJUMPZ);
+      l_arg_instr(BUZZVM_INSTR_EQJUMPZ);
+      l_arg_instr(BUZZVM_INSTR_NEQJUMPZ);
+      i_arg_instr(BUZZVM_INSTR_LCAP);
+      noarg_instr(BUZZVM_INSTR_TAILCALL);
+      noarg_instr(BUZZVM_INSTR_YIELD);
       /* No match, error */
       fprintf(stderr, "ERROR: %s:%zu unknown instruction \"%s\"\n", fname, lineno, instr);
       return 2;
@@ -400,7 +411,7 @@ int buzz_deasm(const uint8_t* buf,
          /* Float argument */
          write_arg(float, "%f");
       }
-      else if(op > BUZZVM_INSTR_PUSHF) {
+      else if(buzzvm_instr_hasarg[op]) {
          /* Integer argument */
          write_arg(int32_t, "%" PRId32);
       }
@@ -437,7 +448,7 @@ int buzz_instruction_deasm(const uint8_t* bcode,
                buzzvm_instr_desc[op],
                *(float*)(bcode+off+1));
    }
-   else if(op > BUZZVM_INSTR_PUSHF) {
+   else if(buzzvm_instr_hasarg[op]) {
       /* Integer argument */
       asprintf(buf, "%s %d",
                buzzvm_instr_desc[op],
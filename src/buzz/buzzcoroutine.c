@@ -0,0 +1,236 @@
+#include "buzzcoroutine.h"
+#include "buzztype.h"
+#include <stdio.h>
+#include <string.h>
+
+/****************************************/
+/****************************************/
+
+const char *buzzcoroutine_status_desc[] = { "suspended", "running", "dead" };
+
+/****************************************/
+/****************************************/
+
+#define function_register(TABLE, FNAME, FUNP)                             \
+   buzzvm_push(vm, TABLE);                                                \
+   buzzvm_pushs(vm, buzzvm_string_register(vm, FNAME, 1));                \
+   buzzvm_pushcc(vm, buzzvm_function_register(vm, FUNP));                 \
+   buzzvm_tput(vm);
+
+/*
+ * Moves the values of 'src' from position 'from' onwards to the end
+ * of 'dst'.
+ */
+static void buzzcoroutine_move(buzzdarray_t dst,
+                               buzzdarray_t src,
+                               int64_t from) {
+   int64_t n = buzzdarray_size(src) - from;
+   buzzdarray_reserve(dst, buzzdarray_size(dst) + n);
+   memcpy(buzzdarray_getp(dst, buzzdarray_size(dst), buzzval_t),
+          buzzdarray_getp(src, from, buzzval_t),
+          n * sizeof(buzzval_t));
+   dst->size += n;
+   src->size = from;
+}
+
+/*
+ * Applies the write barrier to the values saved in a coroutine.
+ */
+static void buzzcoroutine_wbarrier(buzzvm_t vm,
+                                   buzzobj_t co,
+                                   buzzdarray_t vals) {
+   buzzval_t* v = buzzdarray_getp(vals, 0, buzzval_t);
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(vals); ++i)
+      if(v[i].o) buzzheap_wbarrier(vm, co, v[i].o);
+}
+
+/****************************************/
+/****************************************/
+
+int buzzcoroutine_register(buzzvm_t vm) {
+   /* Make "coroutine" table */
+   buzzobj_t t = buzzheap_newobj(vm, BUZZTYPE_TABLE);
+   /* Register methods */
+   function_register(t, "create", buzzcoroutine_create);
+   function_register(t, "resume", buzzcoroutine_resume);
+   function_register(t, "status", buzzcoroutine_status_get);
+   /* Register "coroutine" table */
+   buzzvm_pushs(vm, buzzvm_string_register(vm, "coroutine", 1));
+   buzzvm_push(vm, t);
+   buzzvm_gstore(vm);
+   /* All done */
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
+int buzzcoroutine_create(buzzvm_t vm) {
+   buzzvm_lnum_assert(vm, 1);
+   /* Get the closure */
+   buzzvm_lload(vm, 1);
+   buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
+   /* Make the coroutine, it starts when first resumed */
+   buzzobj_t co = buzzheap_newobj(vm, BUZZTYPE_COROUTINE);
+   co->r.value->closure = buzzvm_stack_val(vm, 1).o;
+   buzzvm_push(vm, co);
+   return buzzvm_ret1(vm);
+}
+
+/****************************************/
+/****************************************/
+
+int buzzcoroutine_resume(buzzvm_t vm) {
+   /* Make sure one or two parameters have been passed */
+   if(buzzvm_lnum(vm) != 1 &&
+      buzzvm_lnum(vm) != 2) {
+      buzzvm_seterror(vm,
+                      BUZZVM_ERROR_LNUM,
+                      "expected 1 or 2 parameters, got %" PRId64,
+                      buzzvm_lnum(vm));
+      return vm->state;
+   }
+   /* Get the coroutine and the value to pass */
+   buzzvm_lload(vm, 1);
+   buzzvm_type_assert(vm, 1, BUZZTYPE_COROUTINE);
+   buzzobj_t co = buzzvm_stack_val(vm, 1).o;
+   buzzcoroutine_state_t c = co->r.value;
+   uint32_t argc = buzzvm_lnum(vm) - 1;
+   buzzval_t arg;
+   if(argc) arg = buzzvm_lsym(vm, 2);
+   else buzzval_setnil(arg);
+   if(c->status != BUZZCOROUTINE_SUSPENDED) {
+      buzzvm_seterror(vm,
+                      BUZZVM_ERROR_STACK,
+                      "cannot resume a %s coroutine",
+                      buzzcoroutine_status_desc[c->status]);
+      return vm->state;
+   }
+   /* Get rid of the current call structure, the coroutine returns to
+    * the caller of resume() */
+   if(buzzvm_ret0(vm) != BUZZVM_STATE_READY) return vm->state;
+   buzzvm_pop(vm);
+   /* Make it the running coroutine */
+   c->status = BUZZCOROUTINE_RUNNING;
+   c->framebase = buzzvm_frame_count(vm);
+   c->loops = vm->loops;
+   c->prev = vm->coroutine;
+   /* The resumer may be kept only by the coroutine, which may be old */
+   if(c->prev) buzzheap_wbarrier(vm, co, c->prev);
+   vm->coroutine = co;
+   if(c->closure) {
+      /* First resume, call the closure */
+      buzzvm_pushnil(vm);
+      buzzvm_push(vm, c->closure);
+      if(argc) buzzvm_pushv(vm, arg);
+      buzzvm_pushi(vm, argc);
+      c->closure = NULL;
+      return buzzvm_callc(vm);
+   }
+   /* Put the saved frames back on top of the call stack */
+   int64_t sbase = buzzdarray_size(vm->stack);
+   int64_t lbase = buzzdarray_size(vm->lsyms);
+   buzzvm_frame_t* f = buzzdarray_getp(c->frames, 0, buzzvm_frame_t);
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(c->frames); ++i) {
+      f[i].sbase += sbase;
+      f[i].cbase += lbase;
+      f[i].lbase += lbase;
+      buzzdarray_push(vm->frames, f + i);
+   }
+   c->frames->size = 0;
+   /* The first frame returns to the caller of resume() */
+   buzzdarray_getp(vm->frames, c->framebase, buzzvm_frame_t)->retpc = vm->pc;
+   /* Put the saved values and local symbols back */
+   buzzcoroutine_move(vm->stack, c->stack, 0);
+   buzzcoroutine_move(vm->lsyms, c->lsyms, 0);
+   vm->sbase = buzzvm_frame_at(vm, 1).sbase;
+   vm->lbase = buzzvm_frame_at(vm, 1).lbase;
+   /* The value passed is the result of the pending yield */
+   buzzvm_pushv(vm, arg);
+   /* Continue after the yield */
+   vm->oldpc = vm->pc;
+   vm->pc = c->pc;
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
+int buzzcoroutine_status_get(buzzvm_t vm) {
+   buzzvm_lnum_assert(vm, 1);
+   /* Get the coroutine */
+   buzzvm_lload(vm, 1);
+   buzzvm_type_assert(vm, 1, BUZZTYPE_COROUTINE);
+   buzzobj_t co = buzzvm_stack_val(vm, 1).o;
+   /* A running coroutine that resumed another one is 'normal' */
+   const char* s =
+      (co->r.value->status == BUZZCOROUTINE_RUNNING && co != vm->coroutine) ?
+      "normal" :
+      buzzcoroutine_status_desc[co->r.value->status];
+   buzzvm_pushs(vm, buzzvm_string_register(vm, s, 1));
+   return buzzvm_ret1(vm);
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzcoroutine_yield(buzzvm_t vm) {
+   buzzvm_stack_assert(vm, 1);
+   if(!vm->coroutine) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "yield outside of a coroutine");
+      return vm->state;
+   }
+   buzzobj_t co = vm->coroutine;
+   buzzcoroutine_state_t c = co->r.value;
+   /* The C functions that run closures can't be suspended */
+   if(c->loops != vm->loops) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "cannot yield across a C function call");
+      return vm->state;
+   }
+   /* The yielded value is the result of resume() */
+   buzzval_t ret = buzzvm_stack_val(vm, 1);
+   buzzvm_pop(vm);
+   /* Save the frames of the coroutine, relative to its first one */
+   const buzzvm_frame_t* base = buzzdarray_getp(vm->frames, c->framebase, buzzvm_frame_t);
+   int64_t sbase = base->sbase;
+   int64_t lbase = base->cbase;
+   int32_t retpc = base->retpc;
+   int64_t i;
+   for(i = c->framebase; i < buzzvm_frame_count(vm); ++i) {
+      buzzvm_frame_t f = buzzdarray_get(vm->frames, i, buzzvm_frame_t);
+      f.sbase -= sbase;
+      f.cbase -= lbase;
+      f.lbase -= lbase;
+      buzzdarray_push(c->frames, &f);
+   }
+   vm->frames->size = c->framebase;
+   /* Save its values and local symbols */
+   buzzcoroutine_move(c->stack, vm->stack, sbase);
+   buzzcoroutine_move(c->lsyms, vm->lsyms, lbase);
+   buzzcoroutine_wbarrier(vm, co, c->stack);
+   buzzcoroutine_wbarrier(vm, co, c->lsyms);
+   c->pc = vm->pc;
+   c->status = BUZZCOROUTINE_SUSPENDED;
+   /* Go back to the caller of resume() */
+   vm->coroutine = c->prev;
+   c->prev = NULL;
+   vm->sbase = buzzvm_frame_at(vm, 1).sbase;
+   vm->lbase = buzzvm_frame_at(vm, 1).lbase;
+   vm->pc = retpc;
+   return buzzvm_pushv(vm, ret);
+}
+
+/****************************************/
+/****************************************/
+
+void buzzcoroutine_end(buzzvm_t vm) {
+   buzzcoroutine_state_t c = vm->coroutine->r.value;
+   c->status = BUZZCOROUTINE_DEAD;
+   vm->coroutine = c->prev;
+   c->prev = NULL;
+}
+
+/****************************************/
+/****************************************/
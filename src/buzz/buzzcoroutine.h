@@ -0,0 +1,114 @@
+#ifndef BUZZCOROUTINE_H
+#define BUZZCOROUTINE_H
+
+#include <buzz/buzzvm.h>
+
+/*
+ * Coroutines.
+ *
+ * A coroutine runs a closure on the stacks of the VM, on top of the
+ * frame that resumed it, and suspends itself with the yield
+ * instruction. When it yields, its call frames, values and local
+ * symbols are moved out of the VM into the coroutine object, along
+ * with the address to continue at. Resuming it moves them back on top
+ * of the frame that resumes it.
+ *
+ * A C function that runs Buzz code (as neighbors.foreach() does) can't
+ * be suspended, so a coroutine can't yield from within one.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   /*
+    * Coroutine status
+    */
+   typedef enum {
+      BUZZCOROUTINE_SUSPENDED = 0, // Not started yet, or yielded
+      BUZZCOROUTINE_RUNNING,       // Running, or waiting for a coroutine it resumed
+      BUZZCOROUTINE_DEAD           // Its closure returned
+   } buzzcoroutine_status;
+   extern const char *buzzcoroutine_status_desc[];
+
+   /*
+    * The execution state of a coroutine.
+    */
+   struct buzzcoroutine_s {
+      /* The closure to call when first resumed, NULL afterwards */
+      buzzobj_t closure;
+      /* Saved call frames (buzzvm_frame_t), positions relative to the saved stacks */
+      buzzdarray_t frames;
+      /* Saved values (buzzval_t) */
+      buzzdarray_t stack;
+      /* Saved local symbols (buzzval_t) */
+      buzzdarray_t lsyms;
+      /* Address of the instruction to continue at */
+      int32_t pc;
+      /* Current status */
+      buzzcoroutine_status status;
+      /* While running, position of the first frame of the coroutine in vm->frames */
+      uint32_t framebase;
+      /* While running, the interpreter loop nesting when it was resumed */
+      uint32_t loops;
+      /* While running, the coroutine that resumed this one, NULL if none */
+      buzzobj_t prev;
+   };
+   typedef struct buzzcoroutine_s* buzzcoroutine_state_t;
+
+   /*
+    * Registers the coroutine functions.
+    * @param vm The Buzz VM data.
+    * @return The new state of the VM.
+    */
+   extern int buzzcoroutine_register(buzzvm_t vm);
+
+   /*
+    * Creates a coroutine for a closure.
+    * coroutine.create(f)
+    * @param vm The Buzz VM data.
+    * @return The new state of the VM.
+    */
+   extern int buzzcoroutine_create(buzzvm_t vm);
+
+   /*
+    * Runs a coroutine until it yields or returns.
+    * coroutine.resume(co [, value])
+    * The first resume passes 'value', if given, as the argument of the
+    * closure. The next ones make it the value of the pending yield.
+    * Returns the yielded value, or the return value of the closure.
+    * @param vm The Buzz VM data.
+    * @return The new state of the VM.
+    */
+   extern int buzzcoroutine_resume(buzzvm_t vm);
+
+   /*
+    * Returns the status of a coroutine as a string: "suspended",
+    * "running", "normal" (waiting for a coroutine it resumed) or "dead".
+    * coroutine.status(co)
+    * @param vm The Buzz VM data.
+    * @return The new state of the VM.
+    */
+   extern int buzzcoroutine_status_get(buzzvm_t vm);
+
+   /*
+    * Suspends the running coroutine (BUZZVM_INSTR_YIELD).
+    * The value on top of the stack is returned by the resume call.
+    * vm->pc must be the address to continue at.
+    * @param vm The Buzz VM data.
+    * @return The new state of the VM.
+    */
+   extern buzzvm_state buzzcoroutine_yield(buzzvm_t vm);
+
+   /*
+    * Marks the running coroutine as dead.
+    * Called when its first frame has been popped.
+    * @param vm The Buzz VM data.
+    */
+   extern void buzzcoroutine_end(buzzvm_t vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -122,6 +122,22 @@ void* buzzdarray_makeslot(buzzdarray_t da,
 /****************************************/
 /****************************************/
 
+void buzzdarray_reserve(buzzdarray_t da,
+                        uint32_t size) {
+   /* The capacity is always kept above the size */
+   if(size < da->capacity) return;
+   do { da->capacity *= 2; } while(size >= da->capacity);
+   void* nd = realloc(da->data, da->capacity * da->elem_size);
+   if(!nd) {
+      fprintf(stderr, "[FATAL] Can't reallocate dynamic array.\n");
+      abort();
+   }
+   da->data = nd;
+}
+
+/****************************************/
+/****************************************/
+
 void buzzdarray_insert(buzzdarray_t da,
                        uint32_t pos,
                        const void* data) {
@@ -93,6 +93,16 @@ extern "C" {
    extern void* buzzdarray_makeslot(buzzdarray_t da,
                                     uint32_t pos);
 
+   /*
+    * Makes room for the given number of elements.
+    * After this call, the array can grow up to that size without
+    * reallocation. The size of the array is not changed.
+    * @param da The dynamic array.
+    * @param size The number of elements to make room for.
+    */
+   extern void buzzdarray_reserve(buzzdarray_t da,
+                                  uint32_t size);
+
    /*
     * Inserts an element at the given position.
     * The element must be passed as a pointer. The pointed data is copied
@@ -178,6 +188,16 @@ extern "C" {
  */
 #define buzzdarray_get(da, pos, type) (*((const type*)((da)->data) + (pos)))
 
+/*
+ * Returns a pointer to the element at the given position.
+ * The pointer is invalidated when the array is resized.
+ * @param da The dynamic array.
+ * @param pos The position.
+ * @param type The type of the element.
+ * @return A pointer to the element at the given position.
+ */
+#define buzzdarray_getp(da, pos, type) ((type*)((da)->data) + (pos))
+
 /*
  * Returns the size of the dynamic array.
  * @param da The dynamic array.
@@ -19,15 +19,11 @@ buzzdebug_entry_t buzzdebug_entry_new(uint64_t l,
 }
 
 void buzzdebug_off2script_destroyf(const void* key, void* data, void* params) {
-   free((void*)key);
    free(*(buzzdebug_entry_t*)data);
-   free(data);
 }
 
 void buzzdebug_script2off_destroyf(const void* key, void* data, void* params) {
    free(*(buzzdebug_entry_t*)key);
-   free((void*)key);
-   free(data);
 }
 
 uint32_t buzzdebug_entryhash(const void* key) {
@@ -92,6 +88,8 @@ buzzdebug_t buzzdebug_new() {
                                 buzzdebug_entryhash,
                                 buzzdebug_entrycmp,
                                 buzzdebug_script2off_destroyf);
+   /* Function entry points are not in the debug information file */
+   x->feps = NULL;
    /* Make list of breakpoints */
    x->breakpoints = buzzdarray_new(5, sizeof(int32_t), NULL);
    return x;
@@ -308,13 +306,15 @@ buzzvm_state buzzdebug_closure_call(buzzvm_t vm,
       else return vm->state;
    }
    /* Insert the self table */
-   buzzdarray_insert(vm->stack, buzzdarray_size(vm->stack) - argc - 1, buzzobj_new(BUZZTYPE_NIL));
+   buzzval_t nil;
+   buzzval_setnil(nil);
+   buzzdarray_insert(vm->stack, buzzdarray_size(vm->stack) - argc - 1, &nil);
    /* Push the argument count */
    buzzvm_pushi(vm, argc);
-   /* Save the current stack depth */
-   uint32_t stacks = buzzdarray_size(vm->stacks);
+   /* Save the current call depth */
+   uint32_t depth = buzzvm_frame_count(vm);
    /* Call the closure and keep stepping until
-    * the stack count is back to the saved value */
+    * the frame count is back to the saved value */
    buzzvm_callc(vm);
    do {
       if(buzzdebug_breakpoint_exists(dbg, vm->pc))
@@ -322,7 +322,7 @@ buzzvm_state buzzdebug_closure_call(buzzvm_t vm,
       if(buzzvm_step(vm) != BUZZVM_STATE_READY)
          return vm->state;
    }
-   while(stacks < buzzdarray_size(vm->stacks));
+   while(depth < buzzvm_frame_count(vm));
    return vm->state;
 }
 
@@ -348,10 +348,11 @@ buzzvm_state buzzdebug_function_call(buzzvm_t vm,
    buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
    /* Move closure before arguments */
    if(argc > 0) {
-      buzzdarray_insert(vm->stack,
-                        buzzdarray_size(vm->stack) - argc - 1,
-                        buzzvm_stack_at(vm, 1));
+      buzzval_t c = buzzvm_stack_val(vm, 1);
       buzzvm_pop(vm);
+      buzzdarray_insert(vm->stack,
+                        buzzdarray_size(vm->stack) - argc,
+                        &c);
    }
    /* Call the closure */
    return buzzdebug_closure_call(vm, argc, dbg);
@@ -382,14 +383,14 @@ static void buzzdebug_print_table_elem(const void* key,
 }
 
 static void buzzdebug_print_table(FILE* stream,
-                                  buzzdict_t t,
+                                  buzzobj_t t,
                                   buzzvm_t vm) {
-   fprintf(stream, "[table] %" PRIu32 " elements\n", buzzdict_size(t));
+   fprintf(stream, "[table] %" PRIu32 " elements\n", buzztable_size(t));
    struct buzzdebug_print_table_params_s params = {
       .stream = stream,
       .vm = vm
    };
-   buzzdict_foreach(t, buzzdebug_print_table_elem, &params);
+   buzztable_foreach(t, buzzdebug_print_table_elem, &params);
 }
 
 void buzzdebug_print_obj(FILE* stream,
@@ -406,7 +407,7 @@ void buzzdebug_print_obj(FILE* stream,
          fprintf(stream, "[float] %f", o->f.value);
          break;
       case BUZZTYPE_TABLE:
-         buzzdebug_print_table(stream, o->t.value, vm);
+         buzzdebug_print_table(stream, o, vm);
          break;
       case BUZZTYPE_CLOSURE:
          if(o->c.value.isnative)
@@ -426,7 +427,9 @@ void buzzdebug_stack_dump(buzzvm_t vm,
                           uint32_t idx,
                           FILE* stream) {
    int64_t i;
-   buzzdarray_t s = buzzdarray_get(vm->stacks, vm->stacks->size - idx, buzzdarray_t);
+   /* The values of the frame end where those of the frame above begin */
+   int64_t base = buzzvm_frame_at(vm, idx).sbase;
+   int64_t end = idx > 1 ? buzzvm_frame_at(vm, idx - 1).sbase : buzzdarray_size(vm->stack);
    char* curinstr = NULL;
    if(!buzz_instruction_deasm(vm->bcode, vm->oldpc, &curinstr)) curinstr = "deasm error";
    char* nextinstr = NULL;
@@ -434,12 +437,13 @@ void buzzdebug_stack_dump(buzzvm_t vm,
    fprintf(stream, "============================================================\n");
    fprintf(stream, "state: %s\terror: %d\n", buzzvm_state_desc[vm->state], vm->error);
    fprintf(stream, "code size: %u\toldpc: %d\tpc: %d\n", vm->bcode_size, vm->oldpc, vm->pc);
-   fprintf(stream, "stacks: %" PRIu64 "\tcur: %u\n", buzzdarray_size(vm->stacks), idx);
+   fprintf(stream, "frames: %" PRIu64 "\tcur: %u\n", buzzvm_frame_count(vm), idx);
    fprintf(stream, "cur instr: %s\n", curinstr);
    fprintf(stream, "next instr: %s\n", nextinstr);
-   for(i = buzzdarray_size(s)-1; i >= 0; --i) {
-      fprintf(stream, "\t%" PRIu64 "\t", i);
-      buzzobj_t o = buzzdarray_get(s, i, buzzobj_t);
+   for(i = end - 1; i >= base; --i) {
+      fprintf(stream, "\t%" PRIu64 "\t", i - base);
+      union buzzobj_u tmp;
+      buzzobj_t o = buzzval_peek(buzzdarray_get(vm->stack, i, buzzval_t), tmp);
       buzzdebug_print_obj(stream, o, vm);
       fprintf(stream, "\n");
    }
@@ -465,6 +469,20 @@ void buzzdebug_backtrace_entry(uint32_t idx,
                                uint32_t pc,
                                FILE* stream) {
    fprintf(stream, "#%u: ", idx);
+   /* Without function entry points, print the script position */
+   if(!dbg->feps) {
+      /* The pc may be the last byte of an instruction with argument */
+      const buzzdebug_entry_t* e = NULL;
+      int32_t off;
+      for(off = pc; !e && off >= 0 && off + 4 >= (int32_t)pc; --off)
+         e = buzzdebug_info_get_fromoffset(dbg, &off);
+      if(e)
+         fprintf(stream, "%s:%" PRIu64 ":%" PRIu64 "\n",
+                 (*e)->fname, (*e)->line, (*e)->col);
+      else
+         fprintf(stream, "<bytecode offset %u>\n", pc);
+      return;
+   }
    /* Look for the pc of the function entry point */
    struct buzzdebug_fep_entry_s test = {
       .off = pc,
@@ -493,30 +511,42 @@ void buzzdebug_backtrace_entry(uint32_t idx,
    fprintf(stream, ")\n");
 }
 
+/*
+ * Prints a note for the frames replaced by tail calls in a frame.
+ * Their calls don't appear in the backtrace.
+ */
+static void buzzdebug_backtrace_tailcalls(buzzvm_t vm,
+                                          uint32_t idx,
+                                          FILE* stream) {
+   uint32_t n = buzzvm_frame_at(vm, idx).tailcalls;
+   if(n > 0)
+      fprintf(stream, "    (%u tail call%s)\n", n, n > 1 ? "s" : "");
+}
+
 void buzzdebug_backtrace(buzzvm_t vm,
                          buzzdebug_t dbg,
                          FILE* stream) {
-   /* Make sure there's at least one stack present */
-   if(buzzdarray_isempty(vm->stacks)) {
+   /* Make sure there's at least one frame present */
+   if(buzzdarray_isempty(vm->frames)) {
       fprintf(stream, "<no backtrace>\n");
       return;
    }
-   /* If we're here, it's because there's at least one stack active */
-   /* The top stack corresponds to the current pc */
+   /* If we're here, it's because there's at least one frame active */
+   /* The top frame corresponds to the current pc */
    buzzdebug_backtrace_entry(1, dbg, vm->pc, stream);
-   /* Go through the stacks beneath */
-   /* For the stacks beneath, the return pc is at the stack top */
+   buzzdebug_backtrace_tailcalls(vm, 1, stream);
+   /* Go through the frames beneath */
+   /* For the frames beneath, the return pc is in the frame above */
    /* The effective pc is that of the call instruction */
-   for(int64_t i = buzzdarray_size(vm->stacks) - 2; i >=0; --i) {
-      /* Get the return value */
-      int32_t pc = buzzvm_stack_at(vm, 1)->i.value;
-      /* Calculate the actual pc */
-      pc -= 1;
+   for(uint32_t i = 1; i < buzzvm_frame_count(vm); ++i) {
+      /* Get the return address and calculate the actual pc */
+      int32_t pc = buzzvm_frame_at(vm, i).retpc - 1;
       /* Handle the backtrace entry */
-      buzzdebug_backtrace_entry(buzzdarray_size(vm->stacks) - i,
+      buzzdebug_backtrace_entry(i + 1,
                                 dbg,
                                 pc,
                                 stream);
+      buzzdebug_backtrace_tailcalls(vm, i + 1, stream);
    }
 }
 
@@ -175,11 +175,11 @@ extern "C" {
                                                buzzdebug_t dbg);
 
    /**
-    * Dumps the current state of a stack.
-    * The index goes from 1 to (vm->stacks->size).
-    * The currently active stack is at index 1.
+    * Dumps the stack of a call frame.
+    * The index goes from 1 to buzzvm_frame_count(vm).
+    * The currently active frame is at index 1.
     * @param vm The VM data.
-    * @param idx The index of the stack to dump.
+    * @param idx The index of the frame to dump.
     * @param stream The output stream.
     */
    extern void buzzdebug_stack_dump(buzzvm_t vm,
@@ -5,27 +5,112 @@
 /****************************************/
 /****************************************/
 
-struct buzzdict_entry_s {
-   void* key;
-   void* data;
-};
-
-#define buzzdict_entry_new(dt, e, k, d)         \
-   struct buzzdict_entry_s e;                   \
-   e.key = malloc(dt->key_size);                \
-   memcpy(e.key, k, dt->key_size);              \
-   e.data = malloc(dt->data_size);              \
-   memcpy(e.data, d, dt->data_size);
-
-void buzzdict_entry_destroy(const void* key, void* data, void* params) {
-   free((void*)key);
-   free(data);
+#define BUZZDICT_MIN_CAPACITY 4
+
+/* Keys and data are aligned like pointers */
+#define buzzdict_align(x) (((x) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/* The slot at the given index */
+#define buzzdict_slot(dt, i) ((struct buzzdict_slot_s*)((dt)->slots + (size_t)(i) * (dt)->slot_size))
+
+/* The key and data stored in a slot */
+#define buzzdict_slot_key(s) ((void*)((uint8_t*)(s) + sizeof(struct buzzdict_slot_s)))
+#define buzzdict_slot_data(dt, s) ((void*)((uint8_t*)(s) + (dt)->data_offset))
+
+/*
+ * The home slot of a hash. Fibonacci hashing spreads keys whose hash
+ * only differs in the upper bits, such as pointers and small integers.
+ */
+#define buzzdict_home(dt, h) (((h) * 2654435769u) >> (dt)->shift)
+
+/* Maximum load factor is 7/8, minimum is 1/4 */
+#define buzzdict_isfull(dt) (((uint64_t)(dt)->size + 1) * 8 > (uint64_t)(dt)->capacity * 7)
+#define buzzdict_issparse(dt) ((dt)->capacity > (dt)->min_capacity && (dt)->size < (dt)->capacity / 4)
+
+/*
+ * Swaps the contents of two slots.
+ */
+static void buzzdict_slot_swap(buzzdict_t dt,
+                               struct buzzdict_slot_s* a,
+                               struct buzzdict_slot_s* b) {
+   uint8_t* x = (uint8_t*)a;
+   uint8_t* y = (uint8_t*)b;
+   uint32_t i;
+   for(i = 0; i < dt->slot_size; ++i) {
+      uint8_t t = x[i];
+      x[i] = y[i];
+      y[i] = t;
+   }
+}
+
+/*
+ * Places the entry in the scratch slot, whose key is known not to be
+ * in the table. Richer entries (closer to their home slot) are moved
+ * along to make room for poorer ones.
+ */
+static void buzzdict_place(buzzdict_t dt) {
+   struct buzzdict_slot_s* e = buzzdict_slot(dt, dt->capacity);
+   uint32_t mask = dt->capacity - 1;
+   uint32_t i = buzzdict_home(dt, e->hash);
+   e->dist = 1;
+   while(1) {
+      struct buzzdict_slot_s* s = buzzdict_slot(dt, i);
+      if(s->dist == 0) {
+         memcpy(s, e, dt->slot_size);
+         return;
+      }
+      if(s->dist < e->dist)
+         buzzdict_slot_swap(dt, s, e);
+      i = (i + 1) & mask;
+      ++e->dist;
+   }
+}
+
+/*
+ * Changes the capacity of the table and reinserts all the entries.
+ * The allocation has one extra slot, used as scratch space.
+ */
+static void buzzdict_resize(buzzdict_t dt,
+                            uint32_t capacity) {
+   uint8_t* old = dt->slots;
+   uint32_t oldcap = dt->capacity, i;
+   dt->slots = (uint8_t*)calloc((size_t)capacity + 1, dt->slot_size);
+   dt->capacity = capacity;
+   dt->shift = 32;
+   while(capacity > 1) { capacity >>= 1; --dt->shift; }
+   for(i = 0; i < oldcap; ++i) {
+      struct buzzdict_slot_s* s = (struct buzzdict_slot_s*)(old + (size_t)i * dt->slot_size);
+      if(s->dist) {
+         memcpy(buzzdict_slot(dt, dt->capacity), s, dt->slot_size);
+         buzzdict_place(dt);
+      }
+   }
+   free(old);
+}
+
+/*
+ * Returns the slot holding the given key, or NULL.
+ */
+static struct buzzdict_slot_s* buzzdict_find(buzzdict_t dt,
+                                             const void* key,
+                                             uint32_t h) {
+   if(!dt->slots) return NULL;
+   uint32_t mask = dt->capacity - 1;
+   uint32_t i = buzzdict_home(dt, h), d;
+   for(d = 1; ; ++d) {
+      struct buzzdict_slot_s* s = buzzdict_slot(dt, i);
+      /* An empty slot, or a richer entry, ends the search */
+      if(s->dist < d) return NULL;
+      if(s->hash == h && dt->keycmpf(key, buzzdict_slot_key(s)) == 0)
+         return s;
+      i = (i + 1) & mask;
+   }
 }
 
 /****************************************/
 /****************************************/
 
-buzzdict_t buzzdict_new(uint32_t buckets,
+buzzdict_t buzzdict_new(uint32_t capacity,
                         uint32_t key_size,
                         uint32_t data_size,
                         buzzdict_hashfunp hashf,
@@ -34,14 +119,16 @@ buzzdict_t buzzdict_new(uint32_t buckets,
    /* Create new dict. calloc() zeroes everything */
    buzzdict_t dt = (buzzdict_t)calloc(1, sizeof(struct buzzdict_s));
    /* Fill in the info */
-   dt->num_buckets = buckets;
    dt->hashf = hashf;
    dt->keycmpf = keycmpf;
-   dt->dstryf = dstryf ? dstryf : buzzdict_entry_destroy;
+   dt->dstryf = dstryf;
    dt->key_size = key_size;
    dt->data_size = data_size;
-   /* Create buckets. Unused buckets are NULL by default. */
-   dt->buckets = (buzzdarray_t*)calloc(dt->num_buckets, sizeof(buzzdarray_t*));
+   dt->data_offset = sizeof(struct buzzdict_slot_s) + buzzdict_align(key_size);
+   dt->slot_size = dt->data_offset + buzzdict_align(data_size);
+   /* The slots are allocated on the first insertion */
+   dt->min_capacity = BUZZDICT_MIN_CAPACITY;
+   while(dt->min_capacity < capacity) dt->min_capacity <<= 1;
    /* All done */
    return dt;
 }
@@ -50,21 +137,16 @@ buzzdict_t buzzdict_new(uint32_t buckets,
 /****************************************/
 
 void buzzdict_destroy(buzzdict_t* dt) {
-   /* Destroy buckets */
-   uint32_t i, j;
-   for(i = 0; i < (*dt)->num_buckets; ++i) {
-      /* Is the bucket used? */
-      if((*dt)->buckets[i] != NULL) {
-         /* Destroy elements in the bucket */
-         for(j = 0; j < buzzdarray_size((*dt)->buckets[i]); ++j) {
-            const struct buzzdict_entry_s* e = &buzzdarray_get((*dt)->buckets[i], j, struct buzzdict_entry_s);
-            (*dt)->dstryf(e->key, e->data, *dt);
-         }
-         /* Destroy bucket */
-         buzzdarray_destroy(&((*dt)->buckets[i]));
+   /* Destroy elements */
+   if((*dt)->dstryf) {
+      uint32_t i;
+      for(i = 0; i < (*dt)->capacity; ++i) {
+         struct buzzdict_slot_s* s = buzzdict_slot(*dt, i);
+         if(s->dist)
+            (*dt)->dstryf(buzzdict_slot_key(s), buzzdict_slot_data(*dt, s), *dt);
       }
    }
-   free((*dt)->buckets);
+   free((*dt)->slots);
    /* Destroy the rest */
    free(*dt);
    *dt = NULL;
@@ -75,18 +157,17 @@ void buzzdict_destroy(buzzdict_t* dt) {
 
 void* buzzdict_rawget(buzzdict_t dt,
                       const void* key) {
-   /* Hash the key */
-   uint32_t h = dt->hashf(key) % dt->num_buckets, i;
-   /* Is the bucket empty? */
-   if(!dt->buckets[h]) return NULL;
-   /* Bucket not empty - is the entry present? */
-   for(i = 0; i < buzzdarray_size(dt->buckets[h]); ++i) {
-      const struct buzzdict_entry_s* e = &buzzdarray_get(dt->buckets[h], i, struct buzzdict_entry_s);
-      if(dt->keycmpf(key, e->key) == 0)
-         return e->data;
-   }
-   /* Entry not found */
-   return NULL;
+   struct buzzdict_slot_s* s = buzzdict_find(dt, key, dt->hashf(key));
+   return s ? buzzdict_slot_data(dt, s) : NULL;
+}
+
+/****************************************/
+/****************************************/
+
+int64_t buzzdict_index(buzzdict_t dt,
+                       const void* key) {
+   struct buzzdict_slot_s* s = buzzdict_find(dt, key, dt->hashf(key));
+   return s ? (int64_t)(((uint8_t*)s - dt->slots) / dt->slot_size) : -1;
 }
 
 /****************************************/
@@ -96,36 +177,30 @@ void buzzdict_set(buzzdict_t dt,
                   const void* key,
                   const void* data) {
    /* Hash the key */
-   uint32_t h = dt->hashf(key) % dt->num_buckets;
-   /* Is the bucket empty? */
-   if(!dt->buckets[h]) {
-      /* Create new entry list */
-      dt->buckets[h] = buzzdarray_new(1, sizeof(struct buzzdict_entry_s), NULL);
-      /* Add entry */
-      buzzdict_entry_new(dt, e, key, data);
-      buzzdarray_push(dt->buckets[h], &e);
-      /* Increase size */
-      ++(dt->size);
-   }
-   else {
-      /* Bucket not empty - is the entry present? */
-      uint32_t i;
-      for(i = 0; i < buzzdarray_size(dt->buckets[h]); ++i) {
-         const struct buzzdict_entry_s* e = &buzzdarray_get(dt->buckets[h], i, struct buzzdict_entry_s);
-         if(dt->keycmpf(key, e->key) == 0) {
-            /* Yes, destroy the entry */
-            dt->dstryf(e->key, e->data, dt);
-            buzzdarray_remove(dt->buckets[h], i);
-            --(dt->size);
-            break;
-         }
-      }
-      /* Add new entry */
-      buzzdict_entry_new(dt, e, key, data);
-      buzzdarray_push(dt->buckets[h], &e);
-      /* Increase size */
-      ++(dt->size);
+   uint32_t h = dt->hashf(key);
+   /* Is the entry present? */
+   struct buzzdict_slot_s* s = buzzdict_find(dt, key, h);
+   if(s) {
+      /* Yes, destroy the old entry and overwrite it */
+      if(dt->dstryf)
+         dt->dstryf(buzzdict_slot_key(s), buzzdict_slot_data(dt, s), dt);
+      memcpy(buzzdict_slot_key(s), key, dt->key_size);
+      memcpy(buzzdict_slot_data(dt, s), data, dt->data_size);
+      return;
    }
+   /* Make room for the new entry */
+   if(!dt->slots)
+      buzzdict_resize(dt, dt->min_capacity);
+   else if(buzzdict_isfull(dt))
+      buzzdict_resize(dt, dt->capacity << 1);
+   /* Prepare the entry in the scratch slot and place it */
+   s = buzzdict_slot(dt, dt->capacity);
+   s->hash = h;
+   memcpy(buzzdict_slot_key(s), key, dt->key_size);
+   memcpy(buzzdict_slot_data(dt, s), data, dt->data_size);
+   buzzdict_place(dt);
+   /* Increase size */
+   ++(dt->size);
 }
 
 /****************************************/
@@ -133,28 +208,30 @@ void buzzdict_set(buzzdict_t dt,
 
 int buzzdict_remove(buzzdict_t dt,
                     const void* key) {
-   /* Hash the key */
-   uint32_t h = dt->hashf(key) % dt->num_buckets, i;
-   /* Is the bucket empty? */
-   if(!dt->buckets[h]) return 0;
-   /* Bucket not empty - is the entry present? */
-   for(i = 0; i < buzzdarray_size(dt->buckets[h]); ++i) {
-      const struct buzzdict_entry_s* e = &buzzdarray_get(dt->buckets[h], i, struct buzzdict_entry_s);
-      if(dt->keycmpf(key, e->key) == 0) {
-         /* Entry found - remove it */
-         dt->dstryf(e->key, e->data, dt);
-         buzzdarray_remove(dt->buckets[h], i);
-         /* Is the entry list empty? If so, free the memory */
-         if(buzzdarray_isempty(dt->buckets[h]))
-            buzzdarray_destroy(&(dt->buckets[h]));
-         /* Increase size */
-         --(dt->size);
-         /* Done */
-         return 1;
-      }
+   /* Look for the entry */
+   struct buzzdict_slot_s* s = buzzdict_find(dt, key, dt->hashf(key));
+   if(!s) return 0;
+   /* Entry found - remove it */
+   if(dt->dstryf)
+      dt->dstryf(buzzdict_slot_key(s), buzzdict_slot_data(dt, s), dt);
+   /* Shift the following entries back, so no tombstone is needed */
+   uint32_t mask = dt->capacity - 1;
+   uint32_t i = ((uint8_t*)s - dt->slots) / dt->slot_size;
+   uint32_t j = (i + 1) & mask;
+   while(buzzdict_slot(dt, j)->dist > 1) {
+      memcpy(buzzdict_slot(dt, i), buzzdict_slot(dt, j), dt->slot_size);
+      --buzzdict_slot(dt, i)->dist;
+      i = j;
+      j = (j + 1) & mask;
    }
-   /* Entry not found, nothing to do */
-   return 0;
+   buzzdict_slot(dt, i)->dist = 0;
+   /* Decrease size */
+   --(dt->size);
+   /* Give memory back if the table is mostly empty */
+   if(buzzdict_issparse(dt))
+      buzzdict_resize(dt, dt->capacity >> 1);
+   /* Done */
+   return 1;
 }
 
 /****************************************/
@@ -163,17 +240,12 @@ int buzzdict_remove(buzzdict_t dt,
 void buzzdict_foreach(buzzdict_t dt,
                       buzzdict_elem_funp fun,
                       void* params) {
-   /* Go through buckets */
-   uint32_t i, j;
-   for(i = 0; i < dt->num_buckets; ++i) {
-      /* Is the bucket used? */
-      if(dt->buckets[i] != NULL) {
-         /* Go through elements in the bucket */
-         for(j = 0; j < buzzdarray_size(dt->buckets[i]); ++j) {
-            const struct buzzdict_entry_s* e = &buzzdarray_get(dt->buckets[i], j, struct buzzdict_entry_s);
-            fun(e->key, e->data, params);
-         }
-      }
+   /* Go through the slots; fun() might resize the table */
+   uint32_t i;
+   for(i = 0; i < dt->capacity; ++i) {
+      struct buzzdict_slot_s* s = buzzdict_slot(dt, i);
+      if(s->dist)
+         fun(buzzdict_slot_key(s), buzzdict_slot_data(dt, s), params);
    }
 }
 
@@ -7,10 +7,6 @@
 extern "C" {
 #endif
 
-   // TODO
-   // CONSIDER USING BRENT'S VARIATION ON HASH COLLISION SOLVING
-   // TODO
-
    /*
     * Function pointer for an element-wise function:
     *
@@ -19,6 +15,9 @@ extern "C" {
     * This function pointer is used to destroy elements by
     * buzzdict_destroy() and in methods such as
     * buzzdict_foreach().
+    * Keys and data are stored inside the dictionary: a destroy
+    * function must release what they refer to, but not free the
+    * key and data pointers themselves.
     */
    typedef void (*buzzdict_elem_funp)(const void* key, void* data, void* params);
 
@@ -41,13 +40,30 @@ extern "C" {
     */
    typedef int (*buzzdict_key_cmpp)(const void* a, const void* b);
 
+   /*
+    * Header of a dictionary slot. The key follows, then the data.
+    */
+   struct buzzdict_slot_s {
+      uint32_t hash; // Hash of the key
+      uint32_t dist; // Distance from the home slot plus one; 0 if empty
+   };
+
    /*
     * The Buzz dictionary.
+    * This is an open-addressing hash table with Robin Hood probing.
+    * Each slot stores the key hash, the distance of the entry from
+    * its home slot, the key and the data. The capacity is always a
+    * power of two; the table grows and shrinks with the load factor.
+    * Slots are allocated on the first insertion.
     */
    struct buzzdict_s {
-      buzzdarray_t* buckets;     // Bucket data
+      uint8_t* slots;            // Slot data
       uint32_t size;             // Number of inserted elements
-      uint32_t num_buckets;      // Number of buckets
+      uint32_t capacity;         // Number of slots
+      uint32_t min_capacity;     // The table never shrinks below this
+      uint32_t shift;            // Shift to turn a hash into a slot index
+      uint32_t slot_size;        // Slot size in bytes
+      uint32_t data_offset;      // Offset of the data in a slot
       buzzdict_hashfunp hashf;   // Key hashing function
       buzzdict_key_cmpp keycmpf; // Key comparison function
       buzzdict_elem_funp dstryf; // Element destroy function
@@ -58,7 +74,7 @@ extern "C" {
 
    /*
     * Create a new dictionary.
-    * @param buckets The number of buckets.
+    * @param capacity The initial capacity, rounded up to a power of two.
     * @param key_size The size of a key.
     * @param data_size The size of a data element.
     * @param hashf The function to hash the keys.
@@ -66,7 +82,7 @@ extern "C" {
     * @param dstryf The function to destroy an element. Can be NULL.
     * @return A new dictionary.
     */
-   extern buzzdict_t buzzdict_new(uint32_t buckets,
+   extern buzzdict_t buzzdict_new(uint32_t capacity,
                                   uint32_t key_size,
                                   uint32_t data_size,
                                   buzzdict_hashfunp hashf,
@@ -81,6 +97,7 @@ extern "C" {
 
    /*
     * Looks for the element with the given key.
+    * The returned pointer is valid until the dictionary is modified.
     * @param dt The dictionary.
     * @param key The key.
     * @return A void pointer to the element if found, or NULL.
@@ -89,6 +106,19 @@ extern "C" {
    extern void* buzzdict_rawget(buzzdict_t dt,
                                 const void* key);
 
+   /*
+    * Looks for the slot holding the element with the given key.
+    * The index can be kept as a hint to find the key again quickly
+    * with buzzdict_keyat() and buzzdict_dataat(). Modifying the
+    * dictionary can move elements to other slots, so the key in the
+    * slot must be checked before the data is used.
+    * @param dt The dictionary.
+    * @param key The key.
+    * @return The index of the slot, or -1 if the key is not found.
+    */
+   extern int64_t buzzdict_index(buzzdict_t dt,
+                                 const void* key);
+
    /*
     * Sets a (key, data) pair.
     * @param dt The dictionary.
@@ -111,6 +141,9 @@ extern "C" {
 
    /*
     * Applies the given function to each element in the dictionary.
+    * The function may replace the data of existing keys. Inserting or
+    * removing elements while iterating is safe, but elements may then
+    * be skipped or visited twice.
     * @param dt The dictionary.
     * @param fun The function.
     * @param params A buffer to pass along.
@@ -229,4 +262,33 @@ extern "C" {
  */
 #define buzzdict_get(dt, key, type) ((const type*)buzzdict_rawget(dt, key))
 
+/*
+ * Returns 1 if the slot at the given index holds an element, 0 otherwise.
+ * Any index can be passed; indices beyond the capacity are never used.
+ * @param dt The dictionary.
+ * @param i The slot index.
+ * @see buzzdict_index
+ */
+#define buzzdict_isusedat(dt, i) ((i) < (dt)->capacity && ((struct buzzdict_slot_s*)((dt)->slots + (size_t)(i) * (dt)->slot_size))->dist != 0)
+
+/*
+ * Returns the key stored in the slot at the given index.
+ * The key is casted to a pointer to the given type.
+ * @param dt The dictionary.
+ * @param i The slot index, which must hold an element.
+ * @param type The key type.
+ * @see buzzdict_isusedat
+ */
+#define buzzdict_keyat(dt, i, type) ((const type*)((dt)->slots + (size_t)(i) * (dt)->slot_size + sizeof(struct buzzdict_slot_s)))
+
+/*
+ * Returns the data stored in the slot at the given index.
+ * The data is casted to a pointer to the given type.
+ * @param dt The dictionary.
+ * @param i The slot index, which must hold an element.
+ * @param type The data type.
+ * @see buzzdict_isusedat
+ */
+#define buzzdict_dataat(dt, i, type) ((type*)((dt)->slots + (size_t)(i) * (dt)->slot_size + (dt)->data_offset))
+
 #endif
@@ -1,29 +1,240 @@
 #include "buzzheap.h"
 #include "buzzvm.h"
+#include "buzzcoroutine.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 /****************************************/
 /****************************************/
 
 #define BUZZHEAP_GC_INIT_MAXOBJS 1
 
+/*
+ * The default number of objects processed per GC step
+ */
+#define BUZZHEAP_GC_DEFAULT_BUDGET 1000
+
+/*
+ * The default number of young objects that triggers a minor collection
+ */
+#define BUZZHEAP_GC_DEFAULT_NURSERY 4096
+
+/*
+ * Accessors for the cycle part of an object marker
+ */
+#define buzzheap_cycle(OBJ) ((OBJ)->o.marker & BUZZHEAP_MARKER_CYCLE)
+#define buzzheap_setcycle(OBJ, C) (OBJ)->o.marker = ((OBJ)->o.marker & ~BUZZHEAP_MARKER_CYCLE) | (C);
+
+/*
+ * The size of a slab in bytes, header included
+ */
+#define BUZZHEAP_SLAB_SIZE 4096
+
+/*
+ * A slab of objects. The objects follow the header.
+ */
+struct buzzheap_slab_s {
+   struct buzzheap_slab_s* next;
+};
+
+/*
+ * Rounds an object size up to a multiple of the pointer size, so that
+ * any object can hold a free list link.
+ */
+#define BUZZHEAP_OBJSIZE(SZ) (((SZ) + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*))
+
+/****************************************/
+/****************************************/
+
+static const uint32_t BUZZHEAP_CLASS_SIZE[BUZZHEAP_CLASSES] = {
+   BUZZHEAP_OBJSIZE(sizeof(buzzint_t)),
+   BUZZHEAP_OBJSIZE(sizeof(buzztable_t) > sizeof(buzzstring_t) ?
+                    sizeof(buzztable_t) : sizeof(buzzstring_t)),
+   BUZZHEAP_OBJSIZE(sizeof(buzzclosure_t))
+};
+
+static const uint8_t BUZZHEAP_TYPE_CLASS[] = {
+   BUZZHEAP_CLASS_NUMBER, // BUZZTYPE_NIL
+   BUZZHEAP_CLASS_NUMBER, // BUZZTYPE_INT
+   BUZZHEAP_CLASS_NUMBER, // BUZZTYPE_FLOAT
+   BUZZHEAP_CLASS_REF,    // BUZZTYPE_STRING
+   BUZZHEAP_CLASS_REF,    // BUZZTYPE_TABLE
+   BUZZHEAP_CLASS_CLOS,   // BUZZTYPE_CLOSURE
+   BUZZHEAP_CLASS_REF,    // BUZZTYPE_USERDATA
+   BUZZHEAP_CLASS_REF     // BUZZTYPE_COROUTINE
+};
+
+/****************************************/
+/****************************************/
+
+static buzzobj_t buzzheap_alloc(buzzheap_t h,
+                                uint16_t type) {
+   struct buzzheap_pool_s* p = h->pools + BUZZHEAP_TYPE_CLASS[type];
+   /* Make a new slab if the free list is empty */
+   if(!p->freelist) {
+      struct buzzheap_slab_s* s =
+         (struct buzzheap_slab_s*)malloc(BUZZHEAP_SLAB_SIZE);
+      s->next = p->slabs;
+      p->slabs = s;
+      ++p->numslabs;
+      /* Thread the objects of the slab into the free list */
+      uint8_t* mem = (uint8_t*)(s + 1);
+      uint32_t i;
+      for(i = 0; i < p->slabobjs; ++i) {
+         *(void**)mem = p->freelist;
+         p->freelist = mem;
+         mem += p->objsize;
+      }
+   }
+   /* Pop an object from the free list */
+   buzzobj_t o = (buzzobj_t)p->freelist;
+   p->freelist = *(void**)o;
+   ++p->numused;
+   /* Fill it with zeroes */
+   memset(o, 0, p->objsize);
+   return o;
+}
+
+/****************************************/
+/****************************************/
+
+static void buzzheap_free(buzzheap_t h,
+                          buzzobj_t o) {
+   struct buzzheap_pool_s* p = h->pools + BUZZHEAP_TYPE_CLASS[o->o.type];
+   buzzobj_fini(o);
+   /* Push the object onto the free list */
+   *(void**)o = p->freelist;
+   p->freelist = o;
+   --p->numused;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the marker for a new object.
+ * While marking, new objects are white, so they are collected unless
+ * something reachable refers to them by the end of the mark phase.
+ * Otherwise, they are black and survive the current cycle.
+ */
+static uint16_t buzzheap_newmarker(buzzheap_t h) {
+   return (h->phase == BUZZHEAP_PHASE_MARK) ?
+      ((h->marker - 1) & BUZZHEAP_MARKER_CYCLE) :
+      h->marker;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Adds a new object to the nursery, or to the old generation if the
+ * nursery is disabled, and schedules GC if necessary.
+ */
+static void buzzheap_track(buzzheap_t h,
+                           buzzobj_t o) {
+   o->o.marker = buzzheap_newmarker(h);
+   if(h->nursery) {
+      o->o.marker |= BUZZHEAP_MARKER_YOUNG;
+      buzzdarray_push(h->young, &o);
+      if(buzzdarray_size(h->young) >= h->nursery)
+         h->gcpending = 1;
+   }
+   else {
+      buzzdarray_push(h->objs, &o);
+      if(buzzdarray_size(h->objs) >= h->max_objs)
+         h->gcpending = 1;
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Sweeps at most budget objects (0 for no limit).
+ * Returns the number of objects processed.
+ */
+static uint32_t buzzheap_sweep(buzzheap_t h,
+                               uint32_t budget) {
+   /*
+    * Go through the objects in the object list and delete the unmarked ones
+    * The surviving objects are compacted in place in a single pass, which
+    * may span several steps
+    */
+   buzzobj_t* objs = buzzdarray_getp(h->objs, 0, buzzobj_t);
+   uint32_t work = 0;
+   while(h->sweeppos < buzzdarray_size(h->objs)) {
+      if(budget && work >= budget) return work;
+      /* Check whether the marker is set to the latest value */
+      if(buzzheap_cycle(objs[h->sweeppos]) == h->marker)
+         /* Yes, keep the element */
+         objs[h->sweeplive++] = objs[h->sweeppos];
+      else
+         /* No, erase the element */
+         buzzheap_free(h, objs[h->sweeppos]);
+      ++h->sweeppos;
+      ++work;
+   }
+   /* Sweep complete */
+   h->objs->size = h->sweeplive;
+   h->phase = BUZZHEAP_PHASE_IDLE;
+   return work;
+}
+
 /****************************************/
 /****************************************/
 
 void buzzheap_destroy_obj(uint32_t pos, void* data, void* params) {
-   buzzobj_destroy((buzzobj_t*)data);
+   /* The memory is released with the slabs */
+   buzzobj_fini(*(buzzobj_t*)data);
 }
 
 buzzheap_t buzzheap_new() {
    /* Create heap state */
    buzzheap_t h = (buzzheap_t)malloc(sizeof(struct buzzheap_s));
-   /* Create object list */
+   /* Create object lists */
    h->objs = buzzdarray_new(10, sizeof(buzzobj_t), buzzheap_destroy_obj);
+   h->young = buzzdarray_new(10, sizeof(buzzobj_t), buzzheap_destroy_obj);
+   h->remembered = buzzdarray_new(10, sizeof(buzzobj_t), NULL);
+   h->nursery = BUZZHEAP_GC_DEFAULT_NURSERY;
+   /* Initialize the object pools */
+   int i;
+   for(i = 0; i < BUZZHEAP_CLASSES; ++i) {
+      h->pools[i].objsize = BUZZHEAP_CLASS_SIZE[i];
+      h->pools[i].slabobjs = (BUZZHEAP_SLAB_SIZE - sizeof(struct buzzheap_slab_s)) / BUZZHEAP_CLASS_SIZE[i];
+      h->pools[i].slabs = NULL;
+      h->pools[i].freelist = NULL;
+      h->pools[i].numslabs = 0;
+      h->pools[i].numused = 0;
+   }
    /* Initialize GC max object threshold */
    h->max_objs = BUZZHEAP_GC_INIT_MAXOBJS;
+   h->gcpending = 0;
+   /* Create root stack */
+   h->roots = buzzdarray_new(10, sizeof(buzzobj_t), NULL);
+   /* Create grey object stacks */
+   h->grey = buzzdarray_new(10, sizeof(buzzobj_t), NULL);
+   h->ygrey = buzzdarray_new(10, sizeof(buzzobj_t), NULL);
+   /* Initialize the collector state */
+   h->phase = BUZZHEAP_PHASE_IDLE;
+   h->sweeppos = 0;
+   h->sweeplive = 0;
+   h->budget = BUZZHEAP_GC_DEFAULT_BUDGET;
+   h->maxpause = 0;
+   h->minor = 0;
    /* Initialize the marker */
    h->marker = 0;
+   /* Make the immortal objects */
+   h->consts = (union buzzobj_u*)malloc(
+      (2 + BUZZHEAP_SMALLINT_MAX - BUZZHEAP_SMALLINT_MIN) * sizeof(union buzzobj_u));
+   buzzobj_init(h->consts, BUZZTYPE_NIL);
+   int32_t v;
+   for(v = BUZZHEAP_SMALLINT_MIN; v <= BUZZHEAP_SMALLINT_MAX; ++v) {
+      buzzobj_t o = h->consts + 1 + v - BUZZHEAP_SMALLINT_MIN;
+      buzzobj_init(o, BUZZTYPE_INT);
+      o->i.value = v;
+   }
    /* All done */
    return h;
 }
@@ -32,8 +243,30 @@ buzzheap_t buzzheap_new() {
 /****************************************/
 
 void buzzheap_destroy(buzzheap_t* h) {
-   /* Get rid of object list */
+   /* Close the gap left by an interrupted sweep */
+   if((*h)->phase == BUZZHEAP_PHASE_SWEEP)
+      buzzheap_sweep(*h, 0);
+   /* Get rid of object lists */
    buzzdarray_destroy(&((*h)->objs));
+   buzzdarray_destroy(&((*h)->young));
+   buzzdarray_destroy(&((*h)->remembered));
+   /* Get rid of the slabs in bulk */
+   int i;
+   for(i = 0; i < BUZZHEAP_CLASSES; ++i) {
+      struct buzzheap_slab_s* s = (*h)->pools[i].slabs;
+      while(s) {
+         struct buzzheap_slab_s* n = s->next;
+         free(s);
+         s = n;
+      }
+   }
+   /* Get rid of root stack */
+   buzzdarray_destroy(&((*h)->roots));
+   /* Get rid of grey object stacks */
+   buzzdarray_destroy(&((*h)->grey));
+   buzzdarray_destroy(&((*h)->ygrey));
+   /* Get rid of the immortal objects */
+   free((*h)->consts);
    /* Get rid of heap state */
    free(*h);
    /* Set heap to NULL */
@@ -45,12 +278,11 @@ void buzzheap_destroy(buzzheap_t* h) {
 
 buzzobj_t buzzheap_newobj(buzzvm_t vm,
                           uint16_t type) {
-   /* Create a new object. calloc() fills it with zeroes */
-   buzzobj_t o = buzzobj_new(type);
-   /* Set the object marker */
-   o->o.marker = vm->heap->marker;
-   /* Add object to list */
-   buzzdarray_push(vm->heap->objs, &o);
+   /* Create a new object */
+   buzzobj_t o = buzzheap_alloc(vm->heap, type);
+   buzzobj_init(o, type);
+   /* Add object to the heap */
+   buzzheap_track(vm->heap, o);
    /* All done */
    return o;
 }
@@ -58,31 +290,41 @@ buzzobj_t buzzheap_newobj(buzzvm_t vm,
 /****************************************/
 /****************************************/
 
+buzzobj_t buzzheap_newint(buzzvm_t vm,
+                          int32_t i) {
+   if(i >= BUZZHEAP_SMALLINT_MIN && i <= BUZZHEAP_SMALLINT_MAX)
+      return vm->heap->consts + 1 + i - BUZZHEAP_SMALLINT_MIN;
+   buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_INT);
+   o->i.value = i;
+   return o;
+}
+
+/****************************************/
+/****************************************/
+
 struct buzzheap_clone_tableelem_s {
    buzzvm_t vm;
-   buzzdict_t t;
+   buzzobj_t t;
 };
 
 void buzzheap_clone_tableelem(const void* key, void* data, void* params) {
    struct buzzheap_clone_tableelem_s* p = (struct buzzheap_clone_tableelem_s*)params;
-   buzzobj_t k = buzzheap_clone(p->vm, *(buzzobj_t*)key);
-   buzzobj_t d = buzzheap_clone(p->vm, *(buzzobj_t*)data);
-   buzzdict_set(p->t, &k, &d);
+   buzzval_t d;
+   buzzval_setobj(d, *(buzzobj_t*)data);
+   if(d.o) d.o = buzzheap_clone(p->vm, d.o);
+   buzztable_put(p->vm, p->t, *(buzzobj_t*)key, d);
 }
 
 buzzobj_t buzzheap_clone(buzzvm_t vm, const buzzobj_t o) {
-   buzzobj_t x = (buzzobj_t)malloc(sizeof(union buzzobj_u));
+   /* Nil and integers are immutable */
+   if(o->o.type == BUZZTYPE_NIL) return buzzheap_nil(vm);
+   if(o->o.type == BUZZTYPE_INT) return buzzheap_newint(vm, o->i.value);
+   /* A running coroutine can't be copied, so copies refer to the same one */
+   if(o->o.type == BUZZTYPE_COROUTINE) return o;
+   buzzobj_t x = buzzheap_alloc(vm->heap, o->o.type);
    x->o.type = o->o.type;
-   x->o.marker = o->o.marker;
-   buzzdarray_push(vm->heap->objs, &x);
+   buzzheap_track(vm->heap, x);
    switch(o->o.type) {
-      case BUZZTYPE_NIL: {
-         return x;
-      }
-      case BUZZTYPE_INT: {
-         x->i.value = o->i.value;
-         return x;
-      }
       case BUZZTYPE_FLOAT: {
          x->f.value = o->f.value;
          return x;
@@ -104,7 +346,7 @@ buzzobj_t buzzheap_clone(buzzvm_t vm, const buzzobj_t o) {
       }
       case BUZZTYPE_TABLE: {
          buzzdict_t orig = o->t.value;
-         x->t.value = buzzdict_new(orig->num_buckets,
+         x->t.value = buzzdict_new(orig->min_capacity,
                                    orig->key_size,
                                    orig->data_size,
                                    orig->hashf,
@@ -112,9 +354,9 @@ buzzobj_t buzzheap_clone(buzzvm_t vm, const buzzobj_t o) {
                                    orig->dstryf);
          struct buzzheap_clone_tableelem_s p = {
             .vm = vm,
-            .t = x->t.value
+            .t = x
          };
-         buzzdict_foreach(orig, buzzheap_clone_tableelem, &p);
+         buzztable_foreach(o, buzzheap_clone_tableelem, &p);
          return x;
       }
       default:
@@ -128,25 +370,65 @@ buzzobj_t buzzheap_clone(buzzvm_t vm, const buzzobj_t o) {
 
 void buzzheap_obj_mark(buzzobj_t o,
                        buzzvm_t vm) {
+   buzzheap_t h = vm->heap;
+   if(h->minor) {
+      /*
+       * Minor collection: only young objects are marked, the old ones
+       * are assumed to be alive
+       */
+      if((o->o.marker & (BUZZHEAP_MARKER_YOUNG | BUZZHEAP_MARKER_KEPT)) != BUZZHEAP_MARKER_YOUNG) return;
+      o->o.marker |= BUZZHEAP_MARKER_KEPT;
+      if(o->o.type == BUZZTYPE_TABLE ||
+         o->o.type == BUZZTYPE_CLOSURE ||
+         o->o.type == BUZZTYPE_COROUTINE)
+         buzzdarray_push(h->ygrey, &o);
+      return;
+   }
    /*
-    * Nothing to do if the object is already marked
+    * Nothing to do if the object is already marked (grey or black)
     * This avoids infinite looping when cycles are present
     */
-   if(o->o.marker == vm->heap->marker) return;
+   if(buzzheap_cycle(o) == h->marker) return;
    /* Update marker */
-   o->o.marker = vm->heap->marker;
-   /* Take care of composite types */
-   if(o->o.type == BUZZTYPE_TABLE)
+   buzzheap_setcycle(o, h->marker);
+   /* Composite types are grey until their elements are marked */
+   if(o->o.type == BUZZTYPE_TABLE ||
+      o->o.type == BUZZTYPE_CLOSURE ||
+      o->o.type == BUZZTYPE_COROUTINE)
+      buzzdarray_push(h->grey, &o);
+   else if(o->o.type == BUZZTYPE_STRING)
+      buzzstrman_gc_mark(vm->strings,
+                         o->s.value.sid);
+}
+
+/*
+ * Marks the elements of a grey object, making it black.
+ * Returns the amount of work done, in objects.
+ */
+static uint32_t buzzheap_obj_scan(buzzobj_t o,
+                                  buzzvm_t vm) {
+   if(o->o.type == BUZZTYPE_TABLE) {
       buzzdict_foreach(o->t.value,
                        buzzheap_dictobj_mark,
                        vm);
-   else if(o->o.type == BUZZTYPE_CLOSURE)
-      buzzdarray_foreach(o->c.value.actrec,
-                         buzzheap_darrayobj_mark,
+      if(!o->t.array) return 1 + buzzdict_size(o->t.value);
+      buzzdarray_foreach(o->t.array,
+                         buzzheap_darrayval_mark,
                          vm);
-   else if(o->o.type == BUZZTYPE_STRING)
-      buzzstrman_gc_mark(vm->strings,
-                         o->s.value.sid);
+      return 1 + buzzdict_size(o->t.value) + buzzdarray_size(o->t.array);
+   }
+   if(o->o.type == BUZZTYPE_COROUTINE) {
+      buzzcoroutine_state_t c = o->r.value;
+      if(c->closure) buzzheap_obj_mark(c->closure, vm);
+      if(c->prev) buzzheap_obj_mark(c->prev, vm);
+      buzzdarray_foreach(c->stack, buzzheap_darrayval_mark, vm);
+      buzzdarray_foreach(c->lsyms, buzzheap_darrayval_mark, vm);
+      return 1 + buzzdarray_size(c->stack) + buzzdarray_size(c->lsyms);
+   }
+   buzzdarray_foreach(o->c.value.actrec,
+                      buzzheap_darrayval_mark,
+                      vm);
+   return 1 + buzzdarray_size(o->c.value.actrec);
 }
 
 void buzzheap_dictobj_mark(const void* key, void* data, void* params) {
@@ -158,16 +440,10 @@ void buzzheap_darrayobj_mark(uint32_t pos, void* data, void* params) {
    buzzheap_obj_mark(*(buzzobj_t*)data, (buzzvm_t)params);
 }
 
-void buzzheap_stack_mark(uint32_t pos, void* data, void* params) {
-   buzzdarray_foreach(*(buzzdarray_t*)data,
-                      buzzheap_darrayobj_mark,
-                      params);
-}
-
-void buzzheap_lsyms_mark(uint32_t pos, void* data, void* params) {
-   buzzdarray_foreach((*(buzzvm_lsyms_t*)data)->syms,
-                      buzzheap_darrayobj_mark,
-                      params);
+void buzzheap_darrayval_mark(uint32_t pos, void* data, void* params) {
+   /* Unboxed values have nothing to mark */
+   if(((buzzval_t*)data)->o)
+      buzzheap_obj_mark(((buzzval_t*)data)->o, (buzzvm_t)params);
 }
 
 void buzzheap_vstigobj_mark(const void* key, void* data, void* params) {
@@ -187,7 +463,8 @@ void buzzheap_vstig_mark(const void* key, void* data, void* params) {
 }
 
 void buzzheap_listener_mark(const void* key, void* data, void* params) {
-   buzzstrman_gc_mark(((buzzvm_t)params)->strings, *(uint16_t*)key);
+   if(!((buzzvm_t)params)->heap->minor)
+      buzzstrman_gc_mark(((buzzvm_t)params)->strings, *(uint16_t*)key);
    buzzheap_obj_mark(*(buzzobj_t*)data, params);
 }
 
@@ -195,41 +472,241 @@ void buzzheap_gsymobj_mark(const void* key, void* data, void* params) {
    buzzheap_obj_mark(*(buzzobj_t*)data, params);
 }
 
-void buzzheap_gc(struct buzzvm_s* vm) {
+/*
+ * Starts a collection cycle.
+ * The roots that change only through write barriers are marked here.
+ */
+static void buzzheap_gc_start(buzzvm_t vm) {
    buzzheap_t h = vm->heap;
-   /* Is GC necessary? */
-   if(buzzdarray_size(h->objs) < h->max_objs) return;
-   /* Increase the marker */
-   ++h->marker;
+   /* Increase the marker, making all the objects white */
+   h->marker = (h->marker + 1) & BUZZHEAP_MARKER_CYCLE;
+   h->phase = BUZZHEAP_PHASE_MARK;
    /* Prepare string gc */
    buzzstrman_gc_clear(vm->strings);
    /* Go through all the objects in the global symbols and mark them */
    buzzdict_foreach(vm->gsyms, buzzheap_gsymobj_mark, vm);
-   /* Go through all the objects in the VM stack and mark them */
-   buzzdarray_foreach(vm->stacks, buzzheap_stack_mark, vm);
-   /* Go through all the objects in the local symbol stack and mark them */
-   buzzdarray_foreach(vm->lsymts, buzzheap_lsyms_mark, vm);
    /* Go through all the objects in the virtual stigmergy and mark them */
    buzzdict_foreach(vm->vstigs, buzzheap_vstig_mark, vm);
+}
+
+/*
+ * Ends the mark phase.
+ * The roots that change without write barriers are marked here, then
+ * marking is completed without interruption.
+ */
+static void buzzheap_gc_finish_mark(buzzvm_t vm) {
+   buzzheap_t h = vm->heap;
+   /* Go through all the objects in the VM stack and mark them */
+   buzzdarray_foreach(vm->stack, buzzheap_darrayval_mark, vm);
+   /* Go through all the objects in the local symbol stack and mark them */
+   buzzdarray_foreach(vm->lsyms, buzzheap_darrayval_mark, vm);
+   /* Mark the running coroutine, whose state is on the stacks */
+   if(vm->coroutine) buzzheap_obj_mark(vm->coroutine, vm);
    /* Go through all the objects in the listeners and mark them */
    buzzdict_foreach(vm->listeners, buzzheap_listener_mark, vm);
    /* Go through all the objects in the out message queue and mark them */
    buzzoutmsg_gc(vm);
-   /* Go through all the objects in the object list and delete the unmarked ones */
-   int64_t i = buzzdarray_size(h->objs) - 1;
-   while(i >= 0) {
-      /* Check whether the marker is set to the latest value */
-      if(buzzdarray_get(h->objs, i, buzzobj_t)->o.marker != h->marker) {
-         /* No, erase the element */
-         buzzdarray_remove(h->objs, i);
-      }
-      /* Next element */
-      --i;
+   /* Go through all the objects held by C code and mark them */
+   buzzdarray_foreach(h->roots, buzzheap_darrayobj_mark, vm);
+   /* Mark everything that is still grey */
+   while(!buzzdarray_isempty(h->grey)) {
+      buzzobj_t o = buzzdarray_last(h->grey, buzzobj_t);
+      buzzdarray_pop(h->grey);
+      buzzheap_obj_scan(o, vm);
    }
    /* Perform string gc */
    buzzstrman_gc_prune(vm->strings);
-   /* Update the max objects threshold */
-   h->max_objs = buzzdarray_isempty(h->objs) ? BUZZHEAP_GC_INIT_MAXOBJS : 2 * buzzdarray_size(h->objs);
+   /* Start sweeping */
+   h->phase = BUZZHEAP_PHASE_SWEEP;
+   h->sweeppos = 0;
+   h->sweeplive = 0;
+}
+
+/*
+ * Advances the collection cycle by at most budget objects (0 for no limit).
+ */
+static void buzzheap_gc_work(buzzvm_t vm,
+                             uint32_t budget) {
+   buzzheap_t h = vm->heap;
+   uint32_t work = 0;
+   if(h->phase == BUZZHEAP_PHASE_IDLE)
+      buzzheap_gc_start(vm);
+   if(h->phase == BUZZHEAP_PHASE_MARK) {
+      /* Mark the grey objects within the budget */
+      while(!buzzdarray_isempty(h->grey) &&
+            (!budget || work < budget)) {
+         buzzobj_t o = buzzdarray_last(h->grey, buzzobj_t);
+         buzzdarray_pop(h->grey);
+         work += buzzheap_obj_scan(o, vm);
+      }
+      if(buzzdarray_isempty(h->grey))
+         buzzheap_gc_finish_mark(vm);
+   }
+   if(h->phase == BUZZHEAP_PHASE_SWEEP &&
+      (!budget || work < budget)) {
+      buzzheap_sweep(h, budget ? budget - work : 0);
+      if(h->phase == BUZZHEAP_PHASE_IDLE) {
+         /* Cycle complete, update the max objects threshold */
+         h->max_objs = buzzdarray_isempty(h->objs) ? BUZZHEAP_GC_INIT_MAXOBJS : 2 * buzzdarray_size(h->objs);
+         h->gcpending = 0;
+      }
+   }
+}
+
+/*
+ * Collects the nursery.
+ * The young objects that are still reachable are promoted to the old
+ * generation. Old objects are not visited: the young objects they refer
+ * to were recorded by the write barrier.
+ */
+static void buzzheap_gc_minor(buzzvm_t vm) {
+   buzzheap_t h = vm->heap;
+   if(buzzdarray_isempty(h->young)) return;
+   h->minor = 1;
+   /* Go through the young objects stored in old containers and mark them */
+   buzzdarray_foreach(h->remembered, buzzheap_darrayobj_mark, vm);
+   /* Go through the young objects already reached by the major collection and mark them */
+   buzzobj_t* young = buzzdarray_getp(h->young, 0, buzzobj_t);
+   int64_t i;
+   if(h->phase == BUZZHEAP_PHASE_MARK)
+      for(i = 0; i < buzzdarray_size(h->young); ++i)
+         if(buzzheap_cycle(young[i]) == h->marker)
+            buzzheap_obj_mark(young[i], vm);
+   /* Go through all the objects in the VM stack and mark them */
+   buzzdarray_foreach(vm->stack, buzzheap_darrayval_mark, vm);
+   /* Go through all the objects in the local symbol stack and mark them */
+   buzzdarray_foreach(vm->lsyms, buzzheap_darrayval_mark, vm);
+   /* Mark the running coroutine, whose state is on the stacks */
+   if(vm->coroutine) buzzheap_obj_mark(vm->coroutine, vm);
+   /* Go through all the objects in the listeners and mark them */
+   buzzdict_foreach(vm->listeners, buzzheap_listener_mark, vm);
+   /* Go through all the objects in the out message queue and mark them */
+   buzzoutmsg_gc(vm);
+   /* Go through all the objects held by C code and mark them */
+   buzzdarray_foreach(h->roots, buzzheap_darrayobj_mark, vm);
+   /* Mark the elements of the young objects reached so far */
+   while(!buzzdarray_isempty(h->ygrey)) {
+      buzzobj_t o = buzzdarray_last(h->ygrey, buzzobj_t);
+      buzzdarray_pop(h->ygrey);
+      buzzheap_obj_scan(o, vm);
+   }
+   h->minor = 0;
+   /* Promote the marked objects and delete the others */
+   for(i = 0; i < buzzdarray_size(h->young); ++i) {
+      if(young[i]->o.marker & BUZZHEAP_MARKER_KEPT) {
+         young[i]->o.marker &= BUZZHEAP_MARKER_CYCLE;
+         /* Outside of the mark phase, survivors must be black */
+         if(h->phase != BUZZHEAP_PHASE_MARK)
+            buzzheap_setcycle(young[i], h->marker);
+         buzzdarray_push(h->objs, young + i);
+      }
+      else
+         buzzheap_free(h, young[i]);
+   }
+   h->young->size = 0;
+   h->remembered->size = 0;
+   /* Schedule a major collection if the old generation is too large */
+   if(buzzdarray_size(h->objs) >= h->max_objs)
+      h->gcpending = 1;
+}
+
+/*
+ * Keeps track of the longest pause.
+ */
+static void buzzheap_gc_pause(buzzheap_t h,
+                              const struct timespec* start) {
+   struct timespec end;
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   uint32_t pause = (end.tv_sec - start->tv_sec) * 1000000 +
+      (end.tv_nsec - start->tv_nsec) / 1000;
+   if(pause > h->maxpause) h->maxpause = pause;
+}
+
+void buzzheap_gc(struct buzzvm_s* vm) {
+   buzzheap_t h = vm->heap;
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   /* Empty the nursery */
+   buzzheap_gc_minor(vm);
+   /* Run the major cycle to completion, if necessary */
+   if(h->phase != BUZZHEAP_PHASE_IDLE ||
+      buzzdarray_size(h->objs) >= h->max_objs)
+      buzzheap_gc_work(vm, 0);
+   buzzheap_gc_pause(h, &start);
+}
+
+/****************************************/
+/****************************************/
+
+void buzzheap_gcstep(struct buzzvm_s* vm) {
+   buzzheap_t h = vm->heap;
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   /* Collect the nursery if it is full */
+   if(buzzdarray_size(h->young) >= h->nursery)
+      buzzheap_gc_minor(vm);
+   /* Advance the major cycle, if necessary */
+   if(h->phase != BUZZHEAP_PHASE_IDLE ||
+      buzzdarray_size(h->objs) >= h->max_objs)
+      buzzheap_gc_work(vm, h->budget);
+   else
+      h->gcpending = 0;
+   buzzheap_gc_pause(h, &start);
+}
+
+/****************************************/
+/****************************************/
+
+void buzzheap_gcminor(struct buzzvm_s* vm) {
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   buzzheap_gc_minor(vm);
+   buzzheap_gc_pause(vm->heap, &start);
+}
+
+/****************************************/
+/****************************************/
+
+void buzzheap_remember(struct buzzvm_s* vm,
+                       buzzobj_t o) {
+   buzzdarray_push(vm->heap->remembered, &o);
+}
+
+/****************************************/
+/****************************************/
+
+void buzzheap_stats(struct buzzvm_s* vm,
+                    buzzheap_stats_t* stats) {
+   memset(stats, 0, sizeof(buzzheap_stats_t));
+   int i;
+   for(i = 0; i < BUZZHEAP_CLASSES; ++i) {
+      struct buzzheap_pool_s* p = vm->heap->pools + i;
+      stats->objs += p->numused;
+      stats->live_bytes += (uint64_t)p->numused * p->objsize;
+      stats->total_bytes += (uint64_t)p->numslabs * BUZZHEAP_SLAB_SIZE;
+      stats->slabs += p->numslabs;
+   }
+   stats->young = buzzdarray_size(vm->heap->young);
+   stats->max_pause_us = vm->heap->maxpause;
+   if(stats->total_bytes > 0)
+      stats->fragmentation = 1.0f - (float)stats->live_bytes / stats->total_bytes;
+}
+
+/****************************************/
+/****************************************/
+
+void buzzheap_pushroot(struct buzzvm_s* vm,
+                       buzzobj_t o) {
+   buzzdarray_push(vm->heap->roots, &o);
+}
+
+/****************************************/
+/****************************************/
+
+void buzzheap_poproots(struct buzzvm_s* vm,
+                       uint32_t n) {
+   while(n-- > 0 && !buzzdarray_isempty(vm->heap->roots))
+      buzzdarray_pop(vm->heap->roots);
 }
 
 /****************************************/
@@ -4,6 +4,41 @@
 #include <buzz/buzztype.h>
 #include <buzz/buzzdarray.h>
 
+/*
+ * Size classes of heap objects
+ */
+#define BUZZHEAP_CLASS_NUMBER 0 /* nil, int, float */
+#define BUZZHEAP_CLASS_REF    1 /* string, table, userdata */
+#define BUZZHEAP_CLASS_CLOS   2 /* closure */
+#define BUZZHEAP_CLASSES      3
+
+/*
+ * Phases of a collection cycle
+ */
+#define BUZZHEAP_PHASE_IDLE  0
+#define BUZZHEAP_PHASE_MARK  1
+#define BUZZHEAP_PHASE_SWEEP 2
+
+/*
+ * Bits of the object marker
+ * The lower bits hold the last major collection cycle that reached the
+ * object. The upper bits hold the generation of the object.
+ */
+#define BUZZHEAP_MARKER_CYCLE 0x3FFF /* cycle of the last major collection */
+#define BUZZHEAP_MARKER_KEPT  0x4000 /* young object reached by a minor collection */
+#define BUZZHEAP_MARKER_YOUNG 0x8000 /* object in the nursery */
+
+/*
+ * Range of the integers preallocated by the heap, see buzzheap_newint()
+ * Define these at build time to change the range.
+ */
+#ifndef BUZZHEAP_SMALLINT_MIN
+#define BUZZHEAP_SMALLINT_MIN -128
+#endif
+#ifndef BUZZHEAP_SMALLINT_MAX
+#define BUZZHEAP_SMALLINT_MAX 1023
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,16 +48,85 @@ extern "C" {
     */
    struct buzzvm_s;
 
+   /**
+    * A pool of fixed-size objects, carved out of slabs
+    */
+   struct buzzheap_pool_s {
+      /* The size of an object in this pool */
+      uint32_t objsize;
+      /* The number of objects in a slab */
+      uint32_t slabobjs;
+      /* The list of slabs */
+      struct buzzheap_slab_s* slabs;
+      /* The list of free objects */
+      void* freelist;
+      /* The number of slabs */
+      uint32_t numslabs;
+      /* The number of objects in use */
+      uint32_t numused;
+   };
+
+   /**
+    * Allocator statistics
+    */
+   struct buzzheap_stats_s {
+      /* The number of objects in use */
+      uint32_t objs;
+      /* The number of objects in the nursery */
+      uint32_t young;
+      /* The number of bytes used by objects */
+      uint64_t live_bytes;
+      /* The number of bytes reserved for objects */
+      uint64_t total_bytes;
+      /* The number of slabs */
+      uint32_t slabs;
+      /* The fraction of reserved memory not in use, in [0,1] */
+      float fragmentation;
+      /* The longest GC step so far, in microseconds */
+      uint32_t max_pause_us;
+   };
+   typedef struct buzzheap_stats_s buzzheap_stats_t;
+
    /**
     * The state of the object heap
     */
    struct buzzheap_s {
-      /* The list of all objects */
+      /* The list of old objects */
       buzzdarray_t objs;
-      /* The maximum number of vars after which GC is triggered */
+      /* The list of young objects (the nursery) */
+      buzzdarray_t young;
+      /* Young objects stored in old containers */
+      buzzdarray_t remembered;
+      /* The number of young objects that triggers a minor collection (0 to disable the nursery) */
+      uint32_t nursery;
+      /* The object pools, one per size class */
+      struct buzzheap_pool_s pools[BUZZHEAP_CLASSES];
+      /* The maximum number of old objects after which GC is triggered */
       uint32_t max_objs;
+      /* Objects held by C code that must survive a collection */
+      buzzdarray_t roots;
+      /* Marked objects whose elements are yet to be marked */
+      buzzdarray_t grey;
+      /* Same as grey, during a minor collection */
+      buzzdarray_t ygrey;
+      /* 1 during a minor collection */
+      uint8_t minor;
+      /* The current phase of the collection cycle */
+      uint8_t phase;
+      /* The position of the sweeper in the object list */
+      int64_t sweeppos;
+      /* The number of objects kept so far by the sweeper */
+      int64_t sweeplive;
+      /* The maximum number of objects processed per GC step (0 for no limit) */
+      uint32_t budget;
+      /* The longest GC step so far, in microseconds */
+      uint32_t maxpause;
       /* Current marker for garbage collection */
       uint16_t marker;
+      /* 1 if the threshold was crossed and GC must run at the next safe point */
+      uint8_t gcpending;
+      /* Nil followed by the small integers; immortal, they are in no object list */
+      union buzzobj_u* consts;
    };
    typedef struct buzzheap_s* buzzheap_t;
 
@@ -47,6 +151,18 @@ extern "C" {
    buzzobj_t buzzheap_newobj(struct buzzvm_s* vm,
                              uint16_t type);
 
+   /**
+    * Returns an integer object.
+    * The integers between BUZZHEAP_SMALLINT_MIN and BUZZHEAP_SMALLINT_MAX
+    * are preallocated and shared: they are never collected, and they
+    * must not be modified.
+    * @param vm The Buzz VM.
+    * @param i The integer value.
+    * @return The integer object.
+    */
+   buzzobj_t buzzheap_newint(struct buzzvm_s* vm,
+                             int32_t i);
+
    /*
     * Internally used to clones a Buzz object.
     * @param vm The Buzz VM.
@@ -58,13 +174,80 @@ extern "C" {
 
    /**
     * Performs garbage collection, if necessary.
-    * Internally uses a simple mark-and-sweep algorithm.
+    * The heap has two generations. New objects are allocated in the
+    * nursery, which is collected often and cheaply; the survivors are
+    * promoted to the old generation. The old generation is collected
+    * with a tri-color mark-and-sweep algorithm.
+    * This function empties the nursery and runs the major collection
+    * cycle to completion.
     * @param vm The Buzz VM.
+    * @see buzzheap_gcstep()
+    * @see buzzheap_gcminor()
     */
    void buzzheap_gc(struct buzzvm_s* vm);
 
+   /**
+    * Collects the nursery.
+    * The cost depends on the number of young objects and on the size of
+    * the VM stacks, not on the size of the old generation.
+    * @param vm The Buzz VM.
+    */
+   void buzzheap_gcminor(struct buzzvm_s* vm);
+
+   /**
+    * Performs a step of garbage collection, if necessary.
+    * A step collects the nursery if it is full, then processes at most
+    * as many objects as the heap budget. The end of the mark phase is
+    * the only part that is not interruptible; its cost is proportional
+    * to the VM stacks, not to the heap.
+    * Collection never happens during allocation: buzzheap_newobj() only
+    * flags that the threshold was crossed, and the flag is honored at
+    * the next safe point (see buzzheap_safepoint()).
+    * @param vm The Buzz VM.
+    */
+   void buzzheap_gcstep(struct buzzvm_s* vm);
+
+   /**
+    * Returns the allocator statistics.
+    * Objects that became garbage count as used until they are collected.
+    * @param vm The Buzz VM.
+    * @param stats The statistics to fill.
+    */
+   void buzzheap_stats(struct buzzvm_s* vm,
+                       buzzheap_stats_t* stats);
+
+   /**
+    * Records a young object stored in an old container.
+    * Internally used by buzzheap_wbarrier().
+    * @param vm The Buzz VM.
+    * @param o The young object.
+    */
+   void buzzheap_remember(struct buzzvm_s* vm,
+                          buzzobj_t o);
+
+   /**
+    * Protects an object from garbage collection.
+    * Use this for objects that C code holds across a safe point
+    * (typically, a Buzz closure call) without keeping them on the
+    * VM stack. Roots are released in LIFO order with buzzheap_poproots().
+    * @param vm The Buzz VM.
+    * @param o The object to protect.
+    */
+   void buzzheap_pushroot(struct buzzvm_s* vm,
+                          buzzobj_t o);
+
+   /**
+    * Releases the most recently protected objects.
+    * @param vm The Buzz VM.
+    * @param n The number of objects to release.
+    * @see buzzheap_pushroot()
+    */
+   void buzzheap_poproots(struct buzzvm_s* vm,
+                          uint32_t n);
+
    extern void buzzheap_obj_mark(buzzobj_t o, struct buzzvm_s* vm);
    extern void buzzheap_darrayobj_mark(uint32_t pos, void* data, void* params);
+   extern void buzzheap_darrayval_mark(uint32_t pos, void* data, void* params);
    extern void buzzheap_dictobj_mark(const void* key, void* data, void* params);
    extern void buzzheap_vstigobj_mark(const void* key, void* data, void* params);
 
@@ -74,4 +257,61 @@ extern "C" {
 
 #define buzzheap_addvar();
 
+/**
+ * Declares a garbage collection safe point.
+ * Collects garbage if an allocation crossed the GC threshold since
+ * the last collection. At a safe point, every live object must be
+ * reachable from the VM state or from the root stack.
+ * @param vm The Buzz VM.
+ */
+#define buzzheap_safepoint(vm)                                  \
+   do { if((vm)->heap->gcpending) buzzheap_gcstep(vm); } while(0)
+
+/**
+ * Returns the nil object.
+ * The object is shared: it is never collected, and it must not be modified.
+ * @param vm The Buzz VM.
+ */
+#define buzzheap_nil(vm) ((vm)->heap->consts)
+
+/**
+ * Sets the number of objects processed per GC step.
+ * @param vm The Buzz VM.
+ * @param b The budget, or 0 to collect without interruption.
+ */
+#define buzzheap_setbudget(vm, b) do { (vm)->heap->budget = (b); } while(0)
+
+/**
+ * Sets the number of young objects that triggers a minor collection.
+ * @param vm The Buzz VM.
+ * @param n The nursery size, or 0 to allocate in the old generation.
+ */
+#define buzzheap_setnursery(vm, n) do { (vm)->heap->nursery = (n); } while(0)
+
+/**
+ * Returns 1 if the object is in the nursery, 0 otherwise.
+ * @param OBJ The object.
+ */
+#define buzzheap_isyoung(OBJ) (((OBJ)->o.marker & BUZZHEAP_MARKER_YOUNG) != 0)
+
+/**
+ * Write barrier.
+ * Must be called when an object is stored in a container that might
+ * have been marked already or that might be old: tables, global
+ * symbols, virtual stigmergy. A store into an object created since the
+ * last safe point needs no barrier.
+ * The local symbols and the stacks need no barrier, because they are
+ * marked again at the end of the mark phase and by every minor collection.
+ * @param vm The Buzz VM.
+ * @param CONT The container object, or NULL for global symbols and virtual stigmergy.
+ * @param OBJ The stored object.
+ */
+#define buzzheap_wbarrier(vm, CONT, OBJ)                                            \
+   {                                                                                \
+      if((vm)->heap->phase == BUZZHEAP_PHASE_MARK)                                  \
+         buzzheap_obj_mark((OBJ), (vm));                                            \
+      if(buzzheap_isyoung(OBJ) && !((CONT) && buzzheap_isyoung((buzzobj_t)(CONT)))) \
+         buzzheap_remember((vm), (OBJ));                                            \
+   }
+
 #endif
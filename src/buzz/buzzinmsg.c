@@ -9,9 +9,7 @@
 /****************************************/
 
 void buzzvm_inmsg_queue_destroy_entry(const void* key, void* data, void* param) {
-   free((void*)key);
    buzzdarray_destroy((buzzdarray_t*)data);
-   free(data);
 }
 
 /****************************************/
@@ -36,29 +34,27 @@ void buzzinmsg_queue_append(buzzvm_t vm,
 /****************************************/
 /****************************************/
 
-struct buzzdict_entry_s {
-   void* key;
-   void* data;
+struct buzzinmsg_queue_first_s {
+   uint16_t* rid;
+   buzzdarray_t q;
 };
 
+static void buzzinmsg_queue_first(const void* key, void* data, void* params) {
+   struct buzzinmsg_queue_first_s* f = (struct buzzinmsg_queue_first_s*)params;
+   if(f->q) return;
+   *(f->rid) = *(uint16_t*)key;
+   f->q = *(buzzdarray_t*)data;
+}
+
 int buzzinmsg_queue_extract(buzzvm_t vm,
                             uint16_t* rid,
                             buzzmsg_payload_t* payload) {
    /* Nothing to do if queue is empty */
    if(buzzinmsg_queue_isempty(vm->inmsgs)) return 0;
-   /* Look for (id,queue) in first non-empty bucket in dict */
-   buzzdarray_t q = NULL;
-   for(uint32_t i = 0; i < vm->inmsgs->num_buckets; ++i) {
-      if(vm->inmsgs->buckets[i]) {
-         const struct buzzdict_entry_s* e =
-            &buzzdarray_get(vm->inmsgs->buckets[i],
-                            0,
-                            struct buzzdict_entry_s);
-         *rid = *(uint16_t*)(e->key);
-         q = *(buzzdarray_t*)(e->data);
-         break;
-      }
-   }
+   /* Look for the first (id,queue) in the dict */
+   struct buzzinmsg_queue_first_s f = { .rid = rid, .q = NULL };
+   buzzdict_foreach(vm->inmsgs, buzzinmsg_queue_first, &f);
+   buzzdarray_t q = f.q;
    /* Extract payload from array */
    *payload = buzzdarray_last(q, buzzmsg_payload_t);
    buzzdarray_pop(q);
@@ -157,6 +157,7 @@ int buzzio_fforeach(buzzvm_t vm) {
    /* Get closure */
    buzzvm_lload(vm, 2);
    buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
+   buzzobj_t c = buzzvm_stack_at(vm, 1);
    /* Go through the file lines */
    int vmstate = vm->state;
    size_t cap; /* line buffer capacity */
@@ -166,17 +167,16 @@ int buzzio_fforeach(buzzvm_t vm) {
          vmstate == BUZZVM_STATE_READY) {
       /* Remove newline if present */
       if(line[len-1] == '\n') line[len-1] = '\0';
-      /* Put closure on the stack (will be wiped by buzzvm_closure_call) */
-      buzzvm_dup(vm);
-      /* Push string argument */
+      /* Push string argument, it stays on the stack during the call */
       buzzvm_pushs(vm, buzzvm_string_register(vm, line, 0));
       /* Call closure */
-      vmstate = buzzvm_closure_call(vm, 1);
+      vmstate = buzzvm_invoke(vm, c, 1, &buzzvm_stack_val(vm, 1));
+      if(vmstate != BUZZVM_STATE_READY) break;
+      /* Remove the return value and the string */
+      buzzvm_pop(vm);
       buzzvm_pop(vm);
       /* Next line */
       len = getline(&line, &cap, f);
-      /* Remove the nil (return value) left by closure_call */
-      buzzvm_pop(vm);
    }
    /* Register error information */
    buzzio_update_error(vm);
@@ -218,7 +218,7 @@ int buzzio_fwrite(buzzvm_t vm) {
             err = fprintf(f, "%f", o->f.value);
             break;
          case BUZZTYPE_TABLE:
-            err = fprintf(f, "[table with %" PRIu32" elems]", buzzdict_size(o->t.value));
+            err = fprintf(f, "[table with %" PRIu32" elems]", buzztable_size(o));
             break;
          case BUZZTYPE_CLOSURE:
             if(o->c.value.isnative)
@@ -232,6 +232,9 @@ int buzzio_fwrite(buzzvm_t vm) {
          case BUZZTYPE_USERDATA:
             err = fprintf(f, "[userdata @%p]", o->u.value);
             break;
+         case BUZZTYPE_COROUTINE:
+            err = fprintf(f, "[coroutine @%p]", o->r.value);
+            break;
          default:
             err = -1;
             break;
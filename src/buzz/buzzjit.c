@@ -0,0 +1,889 @@
+#include "buzzjit.h"
+#include "buzzheap.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/****************************************/
+/****************************************/
+
+/*
+ * A block of executable memory.
+ */
+struct buzzjit_code_s {
+   void* mem;
+   size_t size;
+};
+typedef struct buzzjit_code_s buzzjit_code_t;
+
+/*
+ * The entry code: buzzvm_state f(buzzvm_t vm, void* nat)
+ */
+typedef buzzvm_state (*buzzjit_entry_funp)(buzzvm_t vm, void* nat);
+
+/*
+ * The registers used by native code.
+ * rbx holds the VM, r12 the value stack and r14 the local symbols, so
+ * they survive the calls to C functions.
+ */
+enum {
+   X86_RAX = 0,
+   X86_RCX = 1,
+   X86_RDX = 2,
+   X86_RBX = 3,
+   X86_RSI = 6,
+   X86_RDI = 7,
+   X86_R12 = 12,
+   X86_R14 = 14
+};
+
+/*
+ * Condition codes of jcc and setcc.
+ */
+enum {
+   X86_CC_AE = 0x3,
+   X86_CC_E  = 0x4,
+   X86_CC_NE = 0x5,
+   X86_CC_L  = 0xC,
+   X86_CC_GE = 0xD,
+   X86_CC_LE = 0xE,
+   X86_CC_G  = 0xF
+};
+
+/*
+ * Offsets of the fields read and written by native code.
+ */
+#define VM_STATE  ((int32_t)offsetof(struct buzzvm_s, state))
+#define VM_PC     ((int32_t)offsetof(struct buzzvm_s, pc))
+#define VM_OLDPC  ((int32_t)offsetof(struct buzzvm_s, oldpc))
+#define VM_STACK  ((int32_t)offsetof(struct buzzvm_s, stack))
+#define VM_LSYMS  ((int32_t)offsetof(struct buzzvm_s, lsyms))
+#define VM_SBASE  ((int32_t)offsetof(struct buzzvm_s, sbase))
+#define VM_LBASE  ((int32_t)offsetof(struct buzzvm_s, lbase))
+#define VM_HEAP   ((int32_t)offsetof(struct buzzvm_s, heap))
+#define DA_DATA   ((int32_t)offsetof(struct buzzdarray_s, data))
+#define DA_SIZE   ((int32_t)offsetof(struct buzzdarray_s, size))
+#define DA_CAP    ((int32_t)offsetof(struct buzzdarray_s, capacity))
+#define HEAP_GC   ((int32_t)offsetof(struct buzzheap_s, gcpending))
+#define VAL_TYPE  ((int32_t)offsetof(buzzval_t, type))
+#define VAL_V     ((int32_t)offsetof(buzzval_t, v))
+#define VAL_O     ((int32_t)offsetof(buzzval_t, o))
+
+/*
+ * Native code relies on values being 16 bytes long (see buzzjit_gen_top()).
+ */
+#define BUZZJIT_VAL_SHIFT 4
+
+/*
+ * Jump target standing for the exit of the native code.
+ */
+#define BUZZJIT_EXIT UINT32_MAX
+
+/*
+ * Returns the address of a C function as an immediate.
+ */
+#define buzzjit_fun(F) ((uint64_t)(uintptr_t)(F))
+
+/*
+ * A jump to resolve once all the code is generated.
+ */
+struct buzzjit_fixup_s {
+   /* Position of the 32-bit displacement in the code */
+   uint32_t pos;
+   /* Index of the target instruction, or BUZZJIT_EXIT */
+   uint32_t target;
+};
+
+/*
+ * The state of the code generator.
+ */
+struct buzzjit_gen_s {
+   /* The code */
+   uint8_t* buf;
+   uint32_t size;
+   uint32_t cap;
+   /* Position of the code of each instruction, UINT32_MAX if none */
+   uint32_t* label;
+   /* Jumps to other instructions (struct buzzjit_fixup_s) */
+   buzzdarray_t fixups;
+   /* Jumps to the slow path of the current instruction */
+   uint32_t slow[4];
+   uint32_t nslow;
+};
+typedef struct buzzjit_gen_s* buzzjit_gen_t;
+
+/****************************************/
+/****************************************/
+
+static void buzzjit_code_destroy(uint32_t pos, void* data, void* params) {
+   buzzjit_code_t* c = (buzzjit_code_t*)data;
+   munmap(c->mem, c->size);
+}
+
+/*
+ * Copies generated code into a new block of executable memory.
+ * Returns NULL if the memory can't be had.
+ */
+static uint8_t* buzzjit_code_new(buzzjit_t jit,
+                                 const uint8_t* buf,
+                                 uint32_t size) {
+   buzzjit_code_t c;
+   c.size = size;
+   c.mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(c.mem == MAP_FAILED) return NULL;
+   memcpy(c.mem, buf, size);
+   if(mprotect(c.mem, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(c.mem, size);
+      return NULL;
+   }
+   buzzdarray_push(jit->code, &c);
+   return (uint8_t*)c.mem;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Instruction encoding.
+ */
+
+static void buzzjit_byte(buzzjit_gen_t g, uint8_t b) {
+   g->buf[g->size++] = b;
+}
+
+static void buzzjit_u16(buzzjit_gen_t g, uint16_t x) {
+   memcpy(g->buf + g->size, &x, sizeof(x));
+   g->size += sizeof(x);
+}
+
+static void buzzjit_u32(buzzjit_gen_t g, uint32_t x) {
+   memcpy(g->buf + g->size, &x, sizeof(x));
+   g->size += sizeof(x);
+}
+
+static void buzzjit_u64(buzzjit_gen_t g, uint64_t x) {
+   memcpy(g->buf + g->size, &x, sizeof(x));
+   g->size += sizeof(x);
+}
+
+/*
+ * Makes room for the code of one instruction.
+ */
+static void buzzjit_reserve(buzzjit_gen_t g) {
+   if(g->size + 512 > g->cap) {
+      g->cap *= 2;
+      g->buf = (uint8_t*)realloc(g->buf, g->cap);
+   }
+}
+
+/*
+ * Emits an instruction with a [base + disp32] operand.
+ * 'w' selects a 64-bit operand size, 'p66' a 16-bit one.
+ */
+static void buzzjit_mem(buzzjit_gen_t g,
+                        int p66, int w,
+                        const char* op, int oplen,
+                        int reg, int base, int32_t disp) {
+   if(p66) buzzjit_byte(g, 0x66);
+   uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+   if(rex != 0x40) buzzjit_byte(g, rex);
+   int i;
+   for(i = 0; i < oplen; ++i) buzzjit_byte(g, op[i]);
+   buzzjit_byte(g, 0x80 | ((reg & 7) << 3) | (base & 7));
+   /* rsp and r12 as base need a SIB byte */
+   if((base & 7) == 4) buzzjit_byte(g, 0x24);
+   buzzjit_u32(g, disp);
+}
+
+/*
+ * Emits an instruction with register operands.
+ */
+static void buzzjit_rr(buzzjit_gen_t g,
+                       int w,
+                       const char* op, int oplen,
+                       int reg, int rm) {
+   uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+   if(rex != 0x40) buzzjit_byte(g, rex);
+   int i;
+   for(i = 0; i < oplen; ++i) buzzjit_byte(g, op[i]);
+   buzzjit_byte(g, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* mov r64, [base + disp] */
+#define buzzjit_load64(g, r, b, d) buzzjit_mem(g, 0, 1, "\x8B", 1, r, b, d)
+/* mov r32, [base + disp] */
+#define buzzjit_load32(g, r, b, d) buzzjit_mem(g, 0, 0, "\x8B", 1, r, b, d)
+/* mov [base + disp], r64 */
+#define buzzjit_store64(g, b, d, r) buzzjit_mem(g, 0, 1, "\x89", 1, r, b, d)
+/* mov [base + disp], r32 */
+#define buzzjit_store32(g, b, d, r) buzzjit_mem(g, 0, 0, "\x89", 1, r, b, d)
+/* add r64, [base + disp] */
+#define buzzjit_add64(g, r, b, d) buzzjit_mem(g, 0, 1, "\x03", 1, r, b, d)
+/* sub r64, [base + disp] */
+#define buzzjit_sub64(g, r, b, d) buzzjit_mem(g, 0, 1, "\x2B", 1, r, b, d)
+/* cmp r64, [base + disp] */
+#define buzzjit_cmp64(g, r, b, d) buzzjit_mem(g, 0, 1, "\x3B", 1, r, b, d)
+/* inc qword [base + disp] */
+#define buzzjit_inc64(g, b, d) buzzjit_mem(g, 0, 1, "\xFF", 1, 0, b, d)
+/* dec qword [base + disp] */
+#define buzzjit_dec64(g, b, d) buzzjit_mem(g, 0, 1, "\xFF", 1, 1, b, d)
+/* mov r64, r64 */
+#define buzzjit_mov(g, dst, src) buzzjit_rr(g, 1, "\x89", 1, src, dst)
+/* cmp r64, r64 */
+#define buzzjit_cmp(g, a, b) buzzjit_rr(g, 1, "\x39", 1, b, a)
+/* test r64, r64 */
+#define buzzjit_test(g, r) buzzjit_rr(g, 1, "\x85", 1, r, r)
+/* shl r64, BUZZJIT_VAL_SHIFT */
+#define buzzjit_shlval(g, r) { buzzjit_rr(g, 1, "\xC1", 1, 4, r); buzzjit_byte(g, BUZZJIT_VAL_SHIFT); }
+/* cmp r, imm8 (32 or 64 bits) */
+#define buzzjit_cmpi8(g, w, r, x) { buzzjit_rr(g, w, "\x83", 1, 7, r); buzzjit_byte(g, x); }
+/* cmp word [base + disp], imm8 */
+#define buzzjit_cmptype(g, b, d, t) { buzzjit_mem(g, 1, 0, "\x83", 1, 7, b, (d) + VAL_TYPE); buzzjit_byte(g, t); }
+/* mov word [base + disp], imm16 */
+#define buzzjit_store16i(g, b, d, x) { buzzjit_mem(g, 1, 0, "\xC7", 1, 0, b, d); buzzjit_u16(g, x); }
+/* mov dword [base + disp], imm32 */
+#define buzzjit_store32i(g, b, d, x) { buzzjit_mem(g, 0, 0, "\xC7", 1, 0, b, d); buzzjit_u32(g, x); }
+/* mov qword [base + disp], imm32 */
+#define buzzjit_store64i(g, b, d, x) { buzzjit_mem(g, 0, 1, "\xC7", 1, 0, b, d); buzzjit_u32(g, x); }
+
+/*
+ * mov r32, imm32
+ */
+static void buzzjit_movi32(buzzjit_gen_t g, int r, uint32_t x) {
+   if(r >= 8) buzzjit_byte(g, 0x41);
+   buzzjit_byte(g, 0xB8 + (r & 7));
+   buzzjit_u32(g, x);
+}
+
+/*
+ * Calls a C function. The arguments are in rdi, rsi and rdx.
+ */
+static void buzzjit_call(buzzjit_gen_t g, uint64_t fun) {
+   /* mov rax, imm64; call rax */
+   buzzjit_byte(g, 0x48);
+   buzzjit_byte(g, 0xB8);
+   buzzjit_u64(g, fun);
+   buzzjit_byte(g, 0xFF);
+   buzzjit_byte(g, 0xD0);
+}
+
+/*
+ * Emits a jcc with an unknown target, and returns the position of the
+ * displacement.
+ */
+static uint32_t buzzjit_jcc(buzzjit_gen_t g, int cc) {
+   buzzjit_byte(g, 0x0F);
+   buzzjit_byte(g, 0x80 + cc);
+   buzzjit_u32(g, 0);
+   return g->size - 4;
+}
+
+/*
+ * Sets the target of a jump to the current position.
+ */
+static void buzzjit_here(buzzjit_gen_t g, uint32_t pos) {
+   int32_t rel = g->size - (pos + 4);
+   memcpy(g->buf + pos, &rel, sizeof(rel));
+}
+
+/*
+ * Emits a jump to an instruction, or to the exit.
+ * cc < 0 emits an unconditional jump.
+ */
+static void buzzjit_jump_to(buzzjit_gen_t g, int cc, uint32_t target) {
+   struct buzzjit_fixup_s f;
+   if(cc < 0) {
+      buzzjit_byte(g, 0xE9);
+      buzzjit_u32(g, 0);
+      f.pos = g->size - 4;
+   }
+   else f.pos = buzzjit_jcc(g, cc);
+   f.target = target;
+   buzzdarray_push(g->fixups, &f);
+}
+
+/*
+ * Emits a jump to the slow path of the current instruction.
+ */
+static void buzzjit_slow(buzzjit_gen_t g, int cc) {
+   g->slow[g->nslow++] = buzzjit_jcc(g, cc);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Executes an instruction with the interpreter.
+ * Returns the native code to go on with, or NULL to leave native code.
+ */
+static void* buzzjit_step(buzzvm_t vm, uint32_t idx) {
+   vm->pc = vm->dcode[idx].offset;
+   if(buzzvm_step(vm) != BUZZVM_STATE_READY) return NULL;
+   return vm->jit->native[buzzvm_dcode_index(vm, vm->pc)];
+}
+
+/*
+ * Sets reg to the address past the top of the value stack.
+ */
+static void buzzjit_gen_top(buzzjit_gen_t g, int r) {
+   buzzjit_load64(g, r, X86_R12, DA_SIZE);
+   buzzjit_shlval(g, r);
+   buzzjit_add64(g, r, X86_R12, DA_DATA);
+}
+
+/*
+ * Sets rax to the address past the top of the value stack, making sure
+ * there is room for one more value.
+ */
+static void buzzjit_gen_room(buzzjit_gen_t g) {
+   buzzjit_load64(g, X86_RAX, X86_R12, DA_SIZE);
+   buzzjit_load32(g, X86_RDX, X86_R12, DA_CAP);
+   buzzjit_cmp(g, X86_RAX, X86_RDX);
+   buzzjit_slow(g, X86_CC_AE);
+   buzzjit_shlval(g, X86_RAX);
+   buzzjit_add64(g, X86_RAX, X86_R12, DA_DATA);
+}
+
+/*
+ * Sets rcx to the number of values in the current frame.
+ */
+static void buzzjit_gen_stacktop(buzzjit_gen_t g) {
+   buzzjit_load64(g, X86_RCX, X86_R12, DA_SIZE);
+   buzzjit_sub64(g, X86_RCX, X86_RBX, VM_SBASE);
+}
+
+/*
+ * Sets rcx to the position of a local symbol, going to the slow path if
+ * the symbol does not exist.
+ */
+static void buzzjit_gen_lsym(buzzjit_gen_t g, int32_t idx) {
+   buzzjit_load64(g, X86_RCX, X86_RBX, VM_LBASE);
+   buzzjit_rr(g, 1, "\x81", 1, 0, X86_RCX);
+   buzzjit_u32(g, idx);
+   buzzjit_cmp64(g, X86_RCX, X86_R14, DA_SIZE);
+   buzzjit_slow(g, X86_CC_GE);
+}
+
+/*
+ * Copies the 16-byte value at [src] to [dst], through rdx.
+ */
+static void buzzjit_gen_copy(buzzjit_gen_t g,
+                             int dst, int32_t ddisp,
+                             int src, int32_t sdisp) {
+   buzzjit_load64(g, X86_RDX, src, sdisp);
+   buzzjit_store64(g, dst, ddisp, X86_RDX);
+   buzzjit_load64(g, X86_RDX, src, sdisp + 8);
+   buzzjit_store64(g, dst, ddisp + 8, X86_RDX);
+}
+
+/*
+ * Runs a GC step if one is pending, as buzzheap_safepoint().
+ */
+static void buzzjit_gen_safepoint(buzzjit_gen_t g) {
+   buzzjit_load64(g, X86_RAX, X86_RBX, VM_HEAP);
+   buzzjit_mem(g, 0, 0, "\x80", 1, 7, X86_RAX, HEAP_GC);
+   buzzjit_byte(g, 0);
+   uint32_t j = buzzjit_jcc(g, X86_CC_E);
+   buzzjit_mov(g, X86_RDI, X86_RBX);
+   buzzjit_call(g, buzzjit_fun(buzzheap_gcstep));
+   buzzjit_here(g, j);
+}
+
+/*
+ * Executes instruction idx with the interpreter.
+ */
+static void buzzjit_gen_step(buzzjit_gen_t g, uint32_t idx) {
+   buzzjit_mov(g, X86_RDI, X86_RBX);
+   buzzjit_movi32(g, X86_RSI, idx);
+   buzzjit_call(g, buzzjit_fun(buzzjit_step));
+   buzzjit_test(g, X86_RAX);
+   buzzjit_jump_to(g, X86_CC_E, BUZZJIT_EXIT);
+   /* jmp rax */
+   buzzjit_byte(g, 0xFF);
+   buzzjit_byte(g, 0xE0);
+}
+
+/*
+ * Calls a buzzvm_*() function with up to two arguments after the VM.
+ * On error, the program counter is set to 'errpc'.
+ */
+static void buzzjit_gen_callout(buzzjit_gen_t g,
+                                const buzzvm_dinstr_t* d,
+                                uint32_t idx,
+                                uint64_t fun,
+                                int argc,
+                                uint32_t a1,
+                                uint32_t a2,
+                                int32_t errpc) {
+   buzzjit_mov(g, X86_RDI, X86_RBX);
+   if(argc > 0) buzzjit_movi32(g, X86_RSI, a1);
+   if(argc > 1) buzzjit_movi32(g, X86_RDX, a2);
+   buzzjit_call(g, fun);
+   buzzjit_cmpi8(g, 0, X86_RAX, BUZZVM_STATE_READY);
+   buzzjit_jump_to(g, X86_CC_E, idx + 1);
+   buzzjit_store32i(g, X86_RBX, VM_OLDPC, d->offset);
+   buzzjit_store32i(g, X86_RBX, VM_PC, errpc);
+   buzzjit_jump_to(g, -1, BUZZJIT_EXIT);
+}
+
+/*
+ * Pushes a constant value.
+ */
+static void buzzjit_gen_pushk(buzzjit_gen_t g, uint16_t type, uint32_t bits) {
+   buzzjit_gen_room(g);
+   buzzjit_store16i(g, X86_RAX, VAL_TYPE, type);
+   buzzjit_store32i(g, X86_RAX, VAL_V, bits);
+   buzzjit_store64i(g, X86_RAX, VAL_O, 0);
+   buzzjit_inc64(g, X86_R12, DA_SIZE);
+}
+
+/*
+ * Executes a verified binary operation on integers, as loop_vbinary().
+ * The other operands take the slow path.
+ */
+static void buzzjit_gen_vbinary(buzzjit_gen_t g, uint8_t op) {
+   buzzjit_gen_top(g, X86_RAX);
+   buzzjit_cmptype(g, X86_RAX, -32, BUZZTYPE_INT);
+   buzzjit_slow(g, X86_CC_NE);
+   buzzjit_cmptype(g, X86_RAX, -16, BUZZTYPE_INT);
+   buzzjit_slow(g, X86_CC_NE);
+   buzzjit_load32(g, X86_RCX, X86_RAX, -32 + VAL_V);
+   int cc = -1;
+   switch(op) {
+      case BUZZVM_DINSTR_VADD:
+         buzzjit_mem(g, 0, 0, "\x03", 1, X86_RCX, X86_RAX, -16 + VAL_V);
+         break;
+      case BUZZVM_DINSTR_VSUB:
+         buzzjit_mem(g, 0, 0, "\x2B", 1, X86_RCX, X86_RAX, -16 + VAL_V);
+         break;
+      case BUZZVM_DINSTR_VMUL:
+         buzzjit_mem(g, 0, 0, "\x0F\xAF", 2, X86_RCX, X86_RAX, -16 + VAL_V);
+         break;
+      case BUZZVM_DINSTR_VEQ:  cc = X86_CC_E;  break;
+      case BUZZVM_DINSTR_VNEQ: cc = X86_CC_NE; break;
+      case BUZZVM_DINSTR_VGT:  cc = X86_CC_G;  break;
+      case BUZZVM_DINSTR_VGTE: cc = X86_CC_GE; break;
+      case BUZZVM_DINSTR_VLT:  cc = X86_CC_L;  break;
+      case BUZZVM_DINSTR_VLTE: cc = X86_CC_LE; break;
+   }
+   if(cc >= 0) {
+      /* cmp ecx, [rax - 16]; setcc dl; movzx ecx, dl */
+      buzzjit_mem(g, 0, 0, "\x3B", 1, X86_RCX, X86_RAX, -16 + VAL_V);
+      buzzjit_byte(g, 0x0F);
+      buzzjit_byte(g, 0x90 + cc);
+      buzzjit_byte(g, 0xC0 | X86_RDX);
+      buzzjit_rr(g, 0, "\x0F\xB6", 2, X86_RCX, X86_RDX);
+   }
+   buzzjit_store32(g, X86_RAX, -32 + VAL_V, X86_RCX);
+   buzzjit_store64i(g, X86_RAX, -32 + VAL_O, 0);
+   buzzjit_dec64(g, X86_R12, DA_SIZE);
+}
+
+/*
+ * Executes a comparison on integers followed by jumpz, as
+ * loop_cmpjumpz(). The other operands take the slow path.
+ * 'cc' is the condition to jump on.
+ */
+static void buzzjit_gen_cmpjumpz(buzzjit_gen_t g, int cc, uint32_t target) {
+   buzzjit_gen_stacktop(g);
+   buzzjit_cmpi8(g, 1, X86_RCX, 1);
+   buzzjit_slow(g, X86_CC_LE);
+   buzzjit_gen_top(g, X86_RAX);
+   buzzjit_cmptype(g, X86_RAX, -32, BUZZTYPE_INT);
+   buzzjit_slow(g, X86_CC_NE);
+   buzzjit_cmptype(g, X86_RAX, -16, BUZZTYPE_INT);
+   buzzjit_slow(g, X86_CC_NE);
+   /* The operands are not touched by the collector */
+   buzzjit_gen_safepoint(g);
+   buzzjit_gen_top(g, X86_RAX);
+   /* sub qword [r12 + size], 2 */
+   buzzjit_mem(g, 0, 1, "\x83", 1, 5, X86_R12, DA_SIZE);
+   buzzjit_byte(g, 2);
+   buzzjit_load32(g, X86_RCX, X86_RAX, -32 + VAL_V);
+   buzzjit_mem(g, 0, 0, "\x3B", 1, X86_RCX, X86_RAX, -16 + VAL_V);
+   buzzjit_jump_to(g, cc, target);
+}
+
+/*
+ * Pops the stack top and jumps if it is false (jz) or true (!jz).
+ */
+static void buzzjit_gen_vjump(buzzjit_gen_t g, int jz, uint32_t idx, uint32_t target) {
+   buzzjit_gen_safepoint(g);
+   buzzjit_dec64(g, X86_R12, DA_SIZE);
+   buzzjit_gen_top(g, X86_RAX);
+   /* movzx ecx, word [rax]; test ecx, ecx */
+   buzzjit_mem(g, 0, 0, "\x0F\xB7", 2, X86_RCX, X86_RAX, VAL_TYPE);
+   buzzjit_rr(g, 0, "\x85", 1, X86_RCX, X86_RCX);
+   /* nil is false, ints are false when zero, the rest is true */
+   buzzjit_jump_to(g, X86_CC_E, jz ? target : idx + 1);
+   buzzjit_cmpi8(g, 0, X86_RCX, BUZZTYPE_INT);
+   buzzjit_jump_to(g, X86_CC_NE, jz ? idx + 1 : target);
+   buzzjit_mem(g, 0, 0, "\x83", 1, 7, X86_RAX, VAL_V);
+   buzzjit_byte(g, 0);
+   buzzjit_jump_to(g, jz ? X86_CC_E : X86_CC_NE, target);
+}
+
+/*
+ * Leaves native code, the interpreter executing instruction 'd'.
+ */
+static void buzzjit_gen_leave(buzzjit_gen_t g, const buzzvm_dinstr_t* d) {
+   buzzjit_store32i(g, X86_RBX, VM_PC, d->offset);
+   buzzjit_jump_to(g, -1, BUZZJIT_EXIT);
+}
+
+/*
+ * Generates the code of an instruction.
+ */
+static void buzzjit_gen_instr(buzzjit_gen_t g,
+                              buzzvm_t vm,
+                              uint32_t idx) {
+   const buzzvm_dinstr_t* d = vm->dcode + idx;
+   /* The next instruction, for the errors raised after moving on */
+   int32_t next = idx < vm->dcode_size ? d[1].offset : d->offset;
+   g->nslow = 0;
+   switch(d->opcode) {
+      case BUZZVM_INSTR_NOP:
+         break;
+      case BUZZVM_INSTR_PUSHNIL:
+         buzzjit_gen_pushk(g, BUZZTYPE_NIL, 0);
+         break;
+      case BUZZVM_INSTR_PUSHI:
+         buzzjit_gen_pushk(g, BUZZTYPE_INT, d->arg.u);
+         break;
+      case BUZZVM_INSTR_PUSHF:
+         buzzjit_gen_pushk(g, BUZZTYPE_FLOAT, d->arg.u);
+         break;
+      case BUZZVM_DINSTR_VDUP:
+         buzzjit_gen_room(g);
+         buzzjit_gen_copy(g, X86_RAX, 0, X86_RAX, -16);
+         buzzjit_inc64(g, X86_R12, DA_SIZE);
+         break;
+      case BUZZVM_DINSTR_VPOP:
+         buzzjit_dec64(g, X86_R12, DA_SIZE);
+         break;
+      case BUZZVM_DINSTR_VLLOAD:
+         /* Captured variables go through the interpreter */
+         if(d->arg.i < 0) {
+            buzzjit_gen_step(g, idx);
+            break;
+         }
+         buzzjit_gen_lsym(g, d->arg.i);
+         buzzjit_gen_room(g);
+         buzzjit_shlval(g, X86_RCX);
+         buzzjit_add64(g, X86_RCX, X86_R14, DA_DATA);
+         buzzjit_gen_copy(g, X86_RAX, 0, X86_RCX, 0);
+         buzzjit_inc64(g, X86_R12, DA_SIZE);
+         break;
+      case BUZZVM_DINSTR_VLSTORE:
+         /* New local symbols are added by the interpreter */
+         buzzjit_gen_lsym(g, d->arg.i);
+         buzzjit_shlval(g, X86_RCX);
+         buzzjit_add64(g, X86_RCX, X86_R14, DA_DATA);
+         buzzjit_dec64(g, X86_R12, DA_SIZE);
+         buzzjit_gen_top(g, X86_RAX);
+         buzzjit_gen_copy(g, X86_RCX, 0, X86_RAX, 0);
+         break;
+      case BUZZVM_DINSTR_VADD:
+      case BUZZVM_DINSTR_VSUB:
+      case BUZZVM_DINSTR_VMUL:
+      case BUZZVM_DINSTR_VEQ:
+      case BUZZVM_DINSTR_VNEQ:
+      case BUZZVM_DINSTR_VGT:
+      case BUZZVM_DINSTR_VGTE:
+      case BUZZVM_DINSTR_VLT:
+      case BUZZVM_DINSTR_VLTE:
+         buzzjit_gen_vbinary(g, d->opcode);
+         break;
+      case BUZZVM_INSTR_ADDI:
+         buzzjit_gen_stacktop(g);
+         buzzjit_test(g, X86_RCX);
+         buzzjit_slow(g, X86_CC_LE);
+         buzzjit_gen_top(g, X86_RAX);
+         buzzjit_cmptype(g, X86_RAX, -16, BUZZTYPE_INT);
+         buzzjit_slow(g, X86_CC_NE);
+         /* add dword [rax - 16], imm32 */
+         buzzjit_mem(g, 0, 0, "\x81", 1, 0, X86_RAX, -16 + VAL_V);
+         buzzjit_u32(g, d->arg.u);
+         buzzjit_store64i(g, X86_RAX, -16 + VAL_O, 0);
+         break;
+      case BUZZVM_INSTR_JUMP:
+         buzzjit_gen_safepoint(g);
+         buzzjit_jump_to(g, -1, d->arg.u);
+         break;
+      case BUZZVM_DINSTR_VJUMPZ:
+         buzzjit_gen_vjump(g, 1, idx, d->arg.u);
+         break;
+      case BUZZVM_DINSTR_VJUMPNZ:
+         buzzjit_gen_vjump(g, 0, idx, d->arg.u);
+         break;
+      case BUZZVM_INSTR_LTJUMPZ:
+         buzzjit_gen_cmpjumpz(g, X86_CC_GE, d->arg.u);
+         break;
+      case BUZZVM_INSTR_GTJUMPZ:
+         buzzjit_gen_cmpjumpz(g, X86_CC_LE, d->arg.u);
+         break;
+      case BUZZVM_INSTR_EQJUMPZ:
+         buzzjit_gen_cmpjumpz(g, X86_CC_NE, d->arg.u);
+         break;
+      case BUZZVM_INSTR_NEQJUMPZ:
+         buzzjit_gen_cmpjumpz(g, X86_CC_E, d->arg.u);
+         break;
+      /* Call-outs with the same errors as the interpreter */
+#define buzzjit_case_callout(OP, FUN, PC)                               \
+      case BUZZVM_INSTR_ ## OP:                                         \
+         buzzjit_gen_callout(g, d, idx, buzzjit_fun(FUN), 0, 0, 0, PC); \
+         break;
+      buzzjit_case_callout(DUP,    buzzvm_dup,    next)
+      buzzjit_case_callout(POP,    buzzvm_pop,    d->offset)
+      buzzjit_case_callout(ADD,    buzzvm_add,    d->offset)
+      buzzjit_case_callout(SUB,    buzzvm_sub,    d->offset)
+      buzzjit_case_callout(MUL,    buzzvm_mul,    d->offset)
+      buzzjit_case_callout(DIV,    buzzvm_div,    d->offset)
+      buzzjit_case_callout(MOD,    buzzvm_mod,    d->offset)
+      buzzjit_case_callout(POW,    buzzvm_pow,    d->offset)
+      buzzjit_case_callout(UNM,    buzzvm_unm,    d->offset)
+      buzzjit_case_callout(LAND,   buzzvm_land,   d->offset)
+      buzzjit_case_callout(LOR,    buzzvm_lor,    d->offset)
+      buzzjit_case_callout(LNOT,   buzzvm_lnot,   d->offset)
+      buzzjit_case_callout(BAND,   buzzvm_band,   d->offset)
+      buzzjit_case_callout(BOR,    buzzvm_bor,    d->offset)
+      buzzjit_case_callout(BNOT,   buzzvm_bnot,   d->offset)
+      buzzjit_case_callout(LSHIFT, buzzvm_lshift, d->offset)
+      buzzjit_case_callout(RSHIFT, buzzvm_rshift, d->offset)
+      buzzjit_case_callout(EQ,     buzzvm_eq,     d->offset)
+      buzzjit_case_callout(NEQ,    buzzvm_neq,    d->offset)
+      buzzjit_case_callout(GT,     buzzvm_gt,     d->offset)
+      buzzjit_case_callout(GTE,    buzzvm_gte,    d->offset)
+      buzzjit_case_callout(LT,     buzzvm_lt,     d->offset)
+      buzzjit_case_callout(LTE,    buzzvm_lte,    d->offset)
+      buzzjit_case_callout(GLOAD,  buzzvm_gload,  next)
+      buzzjit_case_callout(GSTORE, buzzvm_gstore, next)
+      buzzjit_case_callout(TPUT,   buzzvm_tput,   d->offset)
+      buzzjit_case_callout(TGET,   buzzvm_tget,   d->offset)
+#undef buzzjit_case_callout
+      case BUZZVM_INSTR_PUSHCN:
+         buzzjit_gen_callout(g, d, idx, buzzjit_fun(buzzvm_pushc), 2, d->arg.u, 1, d->offset);
+         break;
+      case BUZZVM_INSTR_PUSHCC:
+         buzzjit_gen_callout(g, d, idx, buzzjit_fun(buzzvm_pushc), 2, d->arg.u, 0, d->offset);
+         break;
+      case BUZZVM_INSTR_PUSHL:
+         buzzjit_gen_callout(g, d, idx, buzzjit_fun(buzzvm_pushl), 1, d->arg.u, 0, d->offset);
+         break;
+      case BUZZVM_INSTR_LLOAD:
+         buzzjit_gen_callout(g, d, idx, buzzjit_fun(buzzvm_lload), 1, d->arg.u, 0, d->offset);
+         break;
+      case BUZZVM_INSTR_LSTORE:
+         buzzjit_gen_callout(g, d, idx, buzzjit_fun(buzzvm_lstore), 1, d->arg.u, 0, d->offset);
+         break;
+      case BUZZVM_INSTR_LCAP:
+         buzzjit_gen_callout(g, d, idx, buzzjit_fun(buzzvm_lcap), 1, d->arg.u, 0, d->offset);
+         break;
+      /* Instructions that need the internals of the interpreter */
+      case BUZZVM_INSTR_PUSHS:
+      case BUZZVM_INSTR_PUSHT:
+      case BUZZVM_INSTR_GLOADS:
+      case BUZZVM_INSTR_TGETS:
+      case BUZZVM_INSTR_JUMPZ:
+      case BUZZVM_INSTR_JUMPNZ:
+         buzzjit_gen_step(g, idx);
+         break;
+      /* Calls, returns, the end of the script and errors */
+      default:
+         buzzjit_gen_leave(g, d);
+         break;
+   }
+   if(g->nslow > 0) {
+      /* The slow path goes through the interpreter */
+      buzzjit_jump_to(g, -1, idx + 1);
+      uint32_t i;
+      for(i = 0; i < g->nslow; ++i)
+         buzzjit_here(g, g->slow[i]);
+      buzzjit_gen_step(g, idx);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the instructions that can follow the given one in native code.
+ * Instructions executed by the interpreter can go on anywhere, these are
+ * just the usual ones.
+ */
+static uint32_t buzzjit_successors(buzzvm_t vm,
+                                   uint32_t idx,
+                                   uint32_t* succ) {
+   const buzzvm_dinstr_t* d = vm->dcode + idx;
+   switch(d->opcode) {
+      case BUZZVM_INSTR_DONE:
+      case BUZZVM_INSTR_RET0:
+      case BUZZVM_INSTR_RET1:
+      case BUZZVM_INSTR_TAILCALL:
+      case BUZZVM_DINSTR_END:
+      case BUZZVM_DINSTR_BADSTR:
+         return 0;
+      case BUZZVM_INSTR_JUMP:
+         succ[0] = d->arg.u;
+         return 1;
+      case BUZZVM_INSTR_JUMPZ:
+      case BUZZVM_INSTR_JUMPNZ:
+      case BUZZVM_DINSTR_VJUMPZ:
+      case BUZZVM_DINSTR_VJUMPNZ:
+      case BUZZVM_INSTR_LTJUMPZ:
+      case BUZZVM_INSTR_GTJUMPZ:
+      case BUZZVM_INSTR_EQJUMPZ:
+      case BUZZVM_INSTR_NEQJUMPZ:
+         succ[0] = idx + 1;
+         succ[1] = d->arg.u;
+         return 2;
+      case BUZZVM_INSTR_PUSHS:
+         /* The interpreter merges pushs with a following gload or tget */
+         succ[0] = idx + 1;
+         succ[1] = idx + 2;
+         return 2;
+      default:
+         /* Unknown opcodes leave native code */
+         if(d->opcode >= BUZZVM_INSTR_COUNT &&
+            (d->opcode < BUZZVM_DINSTR_VDUP || d->opcode > BUZZVM_DINSTR_VJUMPNZ))
+            return 0;
+         succ[0] = idx + 1;
+         return 1;
+   }
+}
+
+/*
+ * Compiles the instructions reachable from the given one.
+ */
+static void buzzjit_compile(buzzvm_t vm, uint32_t entry) {
+   buzzjit_t jit = vm->jit;
+   uint32_t n = jit->size;
+   /* Find the reachable instructions */
+   uint8_t* reached = (uint8_t*)calloc(n, sizeof(uint8_t));
+   buzzdarray_t work = buzzdarray_new(16, sizeof(uint32_t), NULL);
+   reached[entry] = 1;
+   buzzdarray_push(work, &entry);
+   while(!buzzdarray_isempty(work)) {
+      uint32_t i = buzzdarray_last(work, uint32_t);
+      buzzdarray_pop(work);
+      uint32_t succ[2];
+      uint32_t ns = buzzjit_successors(vm, i, succ);
+      uint32_t s;
+      for(s = 0; s < ns; ++s) {
+         if(succ[s] < n && !reached[succ[s]]) {
+            reached[succ[s]] = 1;
+            buzzdarray_push(work, &succ[s]);
+         }
+      }
+   }
+   buzzdarray_destroy(&work);
+   /* Generate the code in the order of the instructions */
+   struct buzzjit_gen_s g;
+   g.cap = 4096;
+   g.size = 0;
+   g.buf = (uint8_t*)malloc(g.cap);
+   g.label = (uint32_t*)malloc(n * sizeof(uint32_t));
+   memset(g.label, 0xFF, n * sizeof(uint32_t));
+   g.fixups = buzzdarray_new(64, sizeof(struct buzzjit_fixup_s), NULL);
+   uint32_t i;
+   for(i = 0; i < n; ++i) {
+      if(!reached[i]) continue;
+      buzzjit_reserve(&g);
+      g.label[i] = g.size;
+      buzzjit_gen_instr(&g, vm, i);
+   }
+   /* The exit: return vm->state, restoring the registers set by the entry */
+   buzzjit_reserve(&g);
+   uint32_t exitpos = g.size;
+   buzzjit_load32(&g, X86_RAX, X86_RBX, VM_STATE);
+   buzzjit_byte(&g, 0x41); buzzjit_byte(&g, 0x5E); /* pop r14 */
+   buzzjit_byte(&g, 0x41); buzzjit_byte(&g, 0x5C); /* pop r12 */
+   buzzjit_byte(&g, 0x5B);                         /* pop rbx */
+   buzzjit_byte(&g, 0xC3);                         /* ret */
+   /* Resolve the jumps */
+   for(i = 0; i < buzzdarray_size(g.fixups); ++i) {
+      const struct buzzjit_fixup_s* f =
+         buzzdarray_getp(g.fixups, i, struct buzzjit_fixup_s);
+      int32_t to = (f->target == BUZZJIT_EXIT) ? exitpos : g.label[f->target];
+      int32_t rel = to - (int32_t)(f->pos + 4);
+      memcpy(g.buf + f->pos, &rel, sizeof(rel));
+   }
+   /* Make the code executable and use it */
+   uint8_t* code = buzzjit_code_new(jit, g.buf, g.size);
+   if(code) {
+      for(i = 0; i < n; ++i)
+         if(reached[i] && !jit->native[i])
+            jit->native[i] = code + g.label[i];
+   }
+   buzzdarray_destroy(&g.fixups);
+   free(g.label);
+   free(g.buf);
+   free(reached);
+}
+
+/****************************************/
+/****************************************/
+
+buzzjit_t buzzjit_new(buzzvm_t vm) {
+   /* Native code relies on the layout of values */
+   if(sizeof(buzzval_t) != (1 << BUZZJIT_VAL_SHIFT)) return NULL;
+   buzzjit_t jit = (buzzjit_t)calloc(1, sizeof(struct buzzjit_s));
+   jit->size = vm->dcode_size + 1;
+   jit->native = (void**)calloc(jit->size, sizeof(void*));
+   jit->hits = (uint32_t*)calloc(jit->size, sizeof(uint32_t));
+   jit->threshold = BUZZJIT_THRESHOLD;
+   jit->code = buzzdarray_new(8, sizeof(buzzjit_code_t), buzzjit_code_destroy);
+   /* The entry saves the registers used by native code, sets them up and
+    * jumps to the given native code */
+   struct buzzjit_gen_s g;
+   uint8_t buf[64];
+   g.buf = buf;
+   g.size = 0;
+   g.cap = sizeof(buf);
+   buzzjit_byte(&g, 0x53);                         /* push rbx */
+   buzzjit_byte(&g, 0x41); buzzjit_byte(&g, 0x54); /* push r12 */
+   buzzjit_byte(&g, 0x41); buzzjit_byte(&g, 0x56); /* push r14 */
+   buzzjit_mov(&g, X86_RBX, X86_RDI);
+   buzzjit_load64(&g, X86_R12, X86_RBX, VM_STACK);
+   buzzjit_load64(&g, X86_R14, X86_RBX, VM_LSYMS);
+   buzzjit_byte(&g, 0xFF); buzzjit_byte(&g, 0xE6); /* jmp rsi */
+   jit->entry = buzzjit_code_new(jit, g.buf, g.size);
+   if(!jit->entry) buzzjit_destroy(&jit);
+   return jit;
+}
+
+/****************************************/
+/****************************************/
+
+void buzzjit_destroy(buzzjit_t* jit) {
+   if(!*jit) return;
+   buzzdarray_destroy(&(*jit)->code);
+   free((*jit)->hits);
+   free((*jit)->native);
+   free(*jit);
+   *jit = NULL;
+}
+
+/****************************************/
+/****************************************/
+
+void* buzzjit_lookup(buzzvm_t vm, uint32_t idx, int count) {
+   buzzjit_t jit = vm->jit;
+   if(!jit->native[idx] && count && ++jit->hits[idx] == jit->threshold)
+      buzzjit_compile(vm, idx);
+   return jit->native[idx];
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzjit_run(buzzvm_t vm, void* nat) {
+   buzzjit_entry_funp f;
+   memcpy(&f, &vm->jit->entry, sizeof(f));
+   return f(vm, nat);
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,93 @@
+#ifndef BUZZJIT_H
+#define BUZZJIT_H
+
+#include <buzz/buzzvm.h>
+
+/*
+ * Baseline compiler of the decoded instructions to x86-64 code.
+ *
+ * The interpreter counts the entries into each Buzz function. When a
+ * function has been entered BUZZJIT_THRESHOLD times, the instructions
+ * reachable from its entry are compiled. Simple instructions are turned
+ * into native code; the others call the buzzvm_*() functions, or
+ * execute through buzzvm_step().
+ *
+ * Native code only runs between two instructions of the interpreter
+ * loop: calls, returns and the end of the script go back to the
+ * interpreter, which enters native code again at the next instruction
+ * that has some. The VM state is always that of the interpreter, so
+ * stepping through the code (as buzzdebug does) simply uses the
+ * interpreter.
+ */
+
+/*
+ * The number of entries into a function that triggers its compilation.
+ * It can be changed for each VM after the bytecode is set, through
+ * vm->jit->threshold.
+ */
+#ifndef BUZZJIT_THRESHOLD
+#define BUZZJIT_THRESHOLD 64
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   /*
+    * The compiled code of a VM.
+    */
+   struct buzzjit_s {
+      /* Native code of each decoded instruction, NULL if there is none */
+      void** native;
+      /* Number of entries into each decoded instruction */
+      uint32_t* hits;
+      /* Number of entries that triggers compilation, BUZZJIT_THRESHOLD by default */
+      uint32_t threshold;
+      /* Number of decoded instructions, end marker included */
+      uint32_t size;
+      /* The code that sets up the registers and jumps to native code */
+      void* entry;
+      /* Blocks of executable memory (buzzjit_code_t) */
+      buzzdarray_t code;
+   };
+   typedef struct buzzjit_s* buzzjit_t;
+
+   /*
+    * Creates the compiler state for the decoded instructions of a VM.
+    * @param vm The VM data.
+    * @return The compiler state, or NULL if executable memory can't be had.
+    */
+   extern buzzjit_t buzzjit_new(buzzvm_t vm);
+
+   /*
+    * Destroys the compiler state and the compiled code.
+    * @param jit The compiler state.
+    */
+   extern void buzzjit_destroy(buzzjit_t* jit);
+
+   /*
+    * Returns the native code of a decoded instruction.
+    * If 'count' is not zero, the instruction is the entry of a function,
+    * which is compiled when it reaches jit->threshold entries.
+    * @param vm The VM data.
+    * @param idx The index of the decoded instruction.
+    * @param count 1 to count this as an entry, 0 not to.
+    * @return The native code, or NULL if there is none.
+    */
+   extern void* buzzjit_lookup(buzzvm_t vm, uint32_t idx, int count);
+
+   /*
+    * Runs native code until the next instruction left to the interpreter.
+    * On return, vm->pc is the offset of that instruction. If an error
+    * occurred, vm->oldpc is the offset of the failed instruction.
+    * @param vm The VM data.
+    * @param nat The native code, as returned by buzzjit_lookup().
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzjit_run(buzzvm_t vm, void* nat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,7 +12,7 @@
 char *buzztok_desc[] = {
       "identifier", "numeric constant", "string", "variable",
       "nil", "if", "else", "function", "return",
-      "for", "while", "logic and/or", "logic not", "+ or -", "* or /",
+      "yield", "for", "while", "logic and/or", "logic not", "+ or -", "* or /",
       "%", "^", "bit shift", "bitwise and/or", "bitwise not",
       "{", "}", "(", ")", "[", "]", "; or newline",
       ",", "=", ".", "== != < <= > >=", "end-of-file" };
@@ -426,6 +426,7 @@ buzztok_t buzzlex_nexttok(buzzlex_t lex) {
       checkkeyword("else",     BUZZTOK_ELSE);
       checkkeyword("function", BUZZTOK_FUN);
       checkkeyword("return",   BUZZTOK_RETURN);
+      checkkeyword("yield",    BUZZTOK_YIELD);
       checkkeyword("for",      BUZZTOK_FOR);
       checkkeyword("while",    BUZZTOK_WHILE);
       checkkeyword("and",      BUZZTOK_LANDOR);
@@ -22,6 +22,7 @@ extern "C" {
       BUZZTOK_ELSE,
       BUZZTOK_FUN,
       BUZZTOK_RETURN,
+      BUZZTOK_YIELD,
       BUZZTOK_FOR,
       BUZZTOK_WHILE,
       BUZZTOK_LANDOR,
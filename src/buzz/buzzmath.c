@@ -8,7 +8,7 @@
 /****************************************/
 
 /* RNG period parameters */
-#define N          624
+#define N          BUZZMATH_RNG_SIZE
 #define M          397
 #define MATRIX_A   0x9908b0dfUL /* constant vector a */
 #define UPPER_MASK 0x80000000UL /* most significant w-r bits */
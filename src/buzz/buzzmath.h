@@ -3,6 +3,11 @@
 
 #include <buzz/buzzvm.h>
 
+/*
+ * Number of words in the random number generator state (vm->rngstate)
+ */
+#define BUZZMATH_RNG_SIZE 624
+
 #ifdef __cplusplus
 extern "C" {
 #endif
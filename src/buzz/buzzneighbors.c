@@ -14,7 +14,7 @@
 struct neighbor_filter_s {
    buzzvm_t vm;
    int32_t swarm_id;
-   buzzdict_t result;
+   buzzobj_t result;
 };
 
 /****************************************/
@@ -160,10 +160,11 @@ int buzzneighbors_listen(buzzvm_t vm) {
    buzzvm_lload(vm, 2);
    buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
    /* Install listener */
+   buzzobj_t l = buzzvm_stack_at(vm, 1);
    buzzdict_set(
       vm->listeners,
       &buzzvm_stack_at(vm, 2)->s.value.sid,
-      &buzzvm_stack_at(vm, 1));
+      &l);
    return buzzvm_ret0(vm);
 }
 
@@ -199,7 +200,9 @@ void neighbor_filter_kin(const void* key, void* data, void* params) {
                                    rid->i.value,
                                    fdata->swarm_id))) {
       /* Add entry to the return table */
-      buzzdict_set(fdata->result, &rid, (buzzobj_t*)data);
+      buzzval_t v;
+      buzzval_setobj(v, *(buzzobj_t*)data);
+      buzztable_put(fdata->vm, fdata->result, rid, v);
    }
 }
 
@@ -211,8 +214,8 @@ int buzzneighbors_kin(buzzvm_t vm) {
    if(!buzzdarray_isempty(vm->swarmstack)) {
       /* Get position in swarm stack */
       uint16_t sstackpos = 1;
-      if(buzzdarray_size(vm->lsyms->syms) > 1)
-         sstackpos = buzzdarray_get(vm->lsyms->syms, 1, buzzobj_t)->i.value;
+      if(buzzvm_lnum(vm) > 0)
+         sstackpos = buzzvm_lsym(vm, 1).v.i;
       /* Get swarm id */
       if(sstackpos <= buzzdarray_size(vm->swarmstack))
          swarmid = buzzdarray_get(vm->swarmstack,
@@ -235,8 +238,8 @@ int buzzneighbors_kin(buzzvm_t vm) {
       /* Create a new data table */
       buzzobj_t kindata = buzzheap_newobj(vm, BUZZTYPE_TABLE);
       /* Filter the neighbors in data and add them to kindata */
-      struct neighbor_filter_s fdata = { .vm = vm, .swarm_id = swarmid, .result = kindata->t.value };
-      buzzdict_foreach(data->t.value, neighbor_filter_kin, &fdata);
+      struct neighbor_filter_s fdata = { .vm = vm, .swarm_id = swarmid, .result = kindata };
+      buzztable_foreach(data, neighbor_filter_kin, &fdata);
       /* Add kindata as the POSES field in t */
       buzzvm_push(vm, t);
       buzzvm_pushs(vm, buzzvm_string_register(vm, POSES, 1));
@@ -262,7 +265,9 @@ void neighbor_filter_nonkin(const void* key, void* data, void* params) {
                                    rid->i.value,
                                    fdata->swarm_id)) {
       /* Add entry to the return table */
-      buzzdict_set(fdata->result, &rid, (buzzobj_t*)data);
+      buzzval_t v;
+      buzzval_setobj(v, *(buzzobj_t*)data);
+      buzztable_put(fdata->vm, fdata->result, rid, v);
    }
 }
 
@@ -274,8 +279,8 @@ int buzzneighbors_nonkin(buzzvm_t vm) {
    if(!buzzdarray_isempty(vm->swarmstack)) {
       /* Get position in swarm stack */
       uint16_t sstackpos = 1;
-      if(buzzdarray_size(vm->lsyms->syms) > 1)
-         sstackpos = buzzdarray_get(vm->lsyms->syms, 1, buzzobj_t)->i.value;
+      if(buzzvm_lnum(vm) > 0)
+         sstackpos = buzzvm_lsym(vm, 1).v.i;
       /* Get swarm id */
       if(sstackpos <= buzzdarray_size(vm->swarmstack))
          swarmid = buzzdarray_get(vm->swarmstack,
@@ -299,8 +304,8 @@ int buzzneighbors_nonkin(buzzvm_t vm) {
          /* Create a new data table */
          buzzobj_t nonkindata = buzzheap_newobj(vm, BUZZTYPE_TABLE);
          /* Filter the neighbors in data and add them to nonkindata */
-         struct neighbor_filter_s fdata = { .vm = vm, .swarm_id = swarmid, .result = nonkindata->t.value };
-         buzzdict_foreach(data->t.value, neighbor_filter_nonkin, &fdata);
+         struct neighbor_filter_s fdata = { .vm = vm, .swarm_id = swarmid, .result = nonkindata };
+         buzztable_foreach(data, neighbor_filter_nonkin, &fdata);
          /* Add nonkindata as the POSES field in t */
          buzzvm_push(vm, t);
          buzzvm_pushs(vm, buzzvm_string_register(vm, POSES, 1));
@@ -349,12 +354,14 @@ void neighbor_for_each(const void* key, void* data, void* params) {
    /* Cast params */
    struct neighbor_for_each_s* d = (struct neighbor_for_each_s*)params;
    if(d->vm->state != BUZZVM_STATE_READY) return;
-   /* Push closure and params (key and value) */
-   buzzvm_push(d->vm, d->closure);
-   buzzvm_push(d->vm, *(buzzobj_t*)key);
-   buzzvm_push(d->vm, *(buzzobj_t*)data);
-   /* Call closure */
-   d->vm->state = buzzvm_closure_call(d->vm, 2);
+   /* Call closure with key and value */
+   buzzval_t args[2];
+   buzzval_setobj(args[0], *(buzzobj_t*)key);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   d->vm->state = buzzvm_invoke(d->vm, d->closure, 2, args);
+   if(d->vm->state != BUZZVM_STATE_READY) return;
+   /* Get rid of return value */
+   buzzvm_pop(d->vm);
 }
 
 int buzzneighbors_foreach(struct buzzvm_s* vm) {
@@ -375,9 +382,9 @@ int buzzneighbors_foreach(struct buzzvm_s* vm) {
          .vm = vm,
          .closure = closure
       };
-      buzzdict_foreach(data->t.value,
-                       neighbor_for_each,
-                       &edata);
+      buzztable_foreach(data,
+                        neighbor_for_each,
+                        &edata);
    }
    return buzzvm_ret0(vm);
 }
@@ -388,7 +395,7 @@ int buzzneighbors_foreach(struct buzzvm_s* vm) {
 struct neighbor_map_each_s {
    buzzvm_t vm;
    buzzobj_t closure;
-   buzzdict_t result;
+   buzzobj_t result;
 };
 
 void neighbor_map_each(const void* key, void* data, void* params) {
@@ -397,12 +404,11 @@ void neighbor_map_each(const void* key, void* data, void* params) {
    buzzobj_t rid = *(buzzobj_t*)key;
    /* Save current stack size */
    uint32_t ss = buzzvm_stack_top(d->vm);
-   /* Push closure and params (key, value) */
-   buzzvm_push(d->vm, d->closure);
-   buzzvm_push(d->vm, rid);
-   buzzvm_push(d->vm, *(buzzobj_t*)data);
-   /* Call closure */
-   d->vm->state = buzzvm_closure_call(d->vm, 2);
+   /* Call closure with key and value */
+   buzzval_t args[2];
+   buzzval_setobj(args[0], rid);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   d->vm->state = buzzvm_invoke(d->vm, d->closure, 2, args);
    if(d->vm->state != BUZZVM_STATE_READY) return;
    /* Make sure a value was returned */
    if(buzzvm_stack_top(d->vm) <= ss) {
@@ -413,8 +419,7 @@ void neighbor_map_each(const void* key, void* data, void* params) {
       return;
    }
    /* Add entry to the return table */
-   buzzobj_t retval = buzzvm_stack_at(d->vm, 1);
-   buzzdict_set(d->result, &rid, &retval);
+   buzztable_put(d->vm, d->result, rid, buzzvm_stack_val(d->vm, 1));
    /* Get rid of return value */
    buzzvm_pop(d->vm);
 }
@@ -450,9 +455,9 @@ int buzzneighbors_map(buzzvm_t vm) {
       struct neighbor_map_each_s fdata = {
          .vm = vm,
          .closure = closure,
-         .result = mapdata->t.value
+         .result = mapdata
       };
-      buzzdict_foreach(data->t.value, neighbor_map_each, &fdata);
+      buzztable_foreach(data, neighbor_map_each, &fdata);
    }
    /* Return the table */
    buzzvm_push(vm, t);
@@ -471,18 +476,16 @@ void neighbor_reduce(const void* key, void* data, void* params) {
    /* Cast params */
    struct neighbor_reduce_s* d = (struct neighbor_reduce_s*)params;
    if(d->vm->state != BUZZVM_STATE_READY) return;
-   /* Save and pop accumulator from the stack */
-   buzzobj_t accum = buzzvm_stack_at(d->vm, 1);
+   /* Call closure with key, value and accumulator */
+   buzzval_t args[3];
+   buzzval_setobj(args[0], *(buzzobj_t*)key);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   args[2] = buzzvm_stack_val(d->vm, 1);
+   /* Pop accumulator from the stack and save current stack size */
    buzzvm_pop(d->vm);
-   /* Save current stack size */
    uint32_t ss = buzzvm_stack_top(d->vm);
-   /* Push closure and params (key, value, accumulator) */
-   buzzvm_push(d->vm, d->closure);
-   buzzvm_push(d->vm, *(buzzobj_t*)key);
-   buzzvm_push(d->vm, *(buzzobj_t*)data);
-   buzzvm_push(d->vm, accum);
-   /* Call closure - the accumulator is left on the stack */
-   d->vm->state = buzzvm_closure_call(d->vm, 3);
+   /* The new accumulator is left on the stack */
+   d->vm->state = buzzvm_invoke(d->vm, d->closure, 3, args);
    if(d->vm->state != BUZZVM_STATE_READY) return;
    /* Make sure a value was returned */
    if(buzzvm_stack_top(d->vm) <= ss) {
@@ -517,9 +520,9 @@ int buzzneighbors_reduce(struct buzzvm_s* vm) {
          .vm = vm,
          .closure = closure
       };
-      buzzdict_foreach(data->t.value,
-                       neighbor_reduce,
-                       &edata);
+      buzztable_foreach(data,
+                        neighbor_reduce,
+                        &edata);
       /* The final value of the accumulator is on the stack */
    }
    /* Return value */
@@ -532,7 +535,7 @@ int buzzneighbors_reduce(struct buzzvm_s* vm) {
 struct neighbor_filter_each_s {
    buzzvm_t vm;
    buzzobj_t closure;
-   buzzdict_t result;
+   buzzobj_t result;
 };
 
 void neighbor_filter_each(const void* key, void* data, void* params) {
@@ -541,12 +544,11 @@ void neighbor_filter_each(const void* key, void* data, void* params) {
    buzzobj_t rid = *(buzzobj_t*)key;
    /* Save current stack size */
    uint32_t ss = buzzvm_stack_top(d->vm);
-   /* Push closure and params (key, value) */
-   buzzvm_push(d->vm, d->closure);
-   buzzvm_push(d->vm, rid);
-   buzzvm_push(d->vm, *(buzzobj_t*)data);
-   /* Call closure */
-   d->vm->state = buzzvm_closure_call(d->vm, 2);
+   /* Call closure with key and value */
+   buzzval_t args[2];
+   buzzval_setobj(args[0], rid);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   d->vm->state = buzzvm_invoke(d->vm, d->closure, 2, args);
    if(d->vm->state != BUZZVM_STATE_READY) return;
    /* Make sure a value was returned */
    if(buzzvm_stack_top(d->vm) <= ss) {
@@ -561,7 +563,9 @@ void neighbor_filter_each(const void* key, void* data, void* params) {
    if(retval->o.type != BUZZTYPE_NIL &&
       (retval->o.type != BUZZTYPE_INT ||
        retval->i.value != 0)) {
-      buzzdict_set(d->result, &rid, data);
+      buzzval_t v;
+      buzzval_setobj(v, *(buzzobj_t*)data);
+      buzztable_put(d->vm, d->result, rid, v);
    }
    /* Get rid of return value */
    buzzvm_pop(d->vm);
@@ -598,9 +602,9 @@ int buzzneighbors_filter(struct buzzvm_s* vm) {
       struct neighbor_map_each_s fdata = {
          .vm = vm,
          .closure = closure,
-         .result = mapdata->t.value
+         .result = mapdata
       };
-      buzzdict_foreach(data->t.value, neighbor_filter_each, &fdata);
+      buzztable_foreach(data, neighbor_filter_each, &fdata);
    }
    /* Return the table */
    buzzvm_push(vm, t);
@@ -619,7 +623,7 @@ int buzzneighbors_count(struct buzzvm_s* vm) {
    buzzvm_tget(vm);
    int32_t count = 0;
    if(buzzvm_stack_at(vm, 1)->o.type != BUZZTYPE_NIL) {
-      count = buzzdarray_size(buzzvm_stack_at(vm, 1)->t.value);
+      count = buzztable_size(buzzvm_stack_at(vm, 1));
    }
    buzzvm_pushi(vm, count);
    return buzzvm_ret1(vm);
@@ -10,48 +10,6 @@
 /****************************************/
 /****************************************/
 
-/*
- * Broadcast message data
- */
-struct buzzoutmsg_broadcast_s {
-   int type;
-   buzzobj_t topic;
-   buzzobj_t value;
-};
-
-/*
- * Swarm message data
- */
-struct buzzoutmsg_swarm_s {
-   int type;
-   uint16_t* ids;
-   uint16_t size;
-};
-
-/*
- * Virtual stigmergy message data
- */
-struct buzzoutmsg_vstig_s {
-   int type;
-   uint16_t id;
-   buzzobj_t key;
-   buzzvstig_elem_t data;
-};
-
-/*
- * Generic message data
- */
-union buzzoutmsg_u {
-   int type;
-   struct buzzoutmsg_broadcast_s bc;
-   struct buzzoutmsg_swarm_s     sw;
-   struct buzzoutmsg_vstig_s     vs;
-};
-typedef union buzzoutmsg_u* buzzoutmsg_t;
-
-/****************************************/
-/****************************************/
-
 uint32_t buzzoutmsg_obj_hash(const void* key) {
    return buzzobj_hash(*(buzzobj_t*)key);
 }
@@ -79,9 +37,7 @@ void buzzoutmsg_destroy(uint32_t pos, void* data, void* params) {
 }
 
 void buzzoutmsg_vstig_destroy(const void* key, void* data, void* params) {
-   free((void*)key);
    buzzdict_destroy((buzzdict_t*)data);
-   free(data);
 }
 
 int buzzoutmsg_vstig_cmp(const void* a, const void* b) {
@@ -11,6 +11,45 @@ struct buzzvm_s;
 extern "C" {
 #endif
 
+   /*
+    * Broadcast message data
+    */
+   struct buzzoutmsg_broadcast_s {
+      int type;
+      buzzobj_t topic;
+      buzzobj_t value;
+   };
+
+   /*
+    * Swarm message data
+    */
+   struct buzzoutmsg_swarm_s {
+      int type;
+      uint16_t* ids;
+      uint16_t size;
+   };
+
+   /*
+    * Virtual stigmergy message data
+    */
+   struct buzzoutmsg_vstig_s {
+      int type;
+      uint16_t id;
+      buzzobj_t key;
+      buzzvstig_elem_t data;
+   };
+
+   /*
+    * Generic message data
+    */
+   union buzzoutmsg_u {
+      int type;
+      struct buzzoutmsg_broadcast_s bc;
+      struct buzzoutmsg_swarm_s     sw;
+      struct buzzoutmsg_vstig_s     vs;
+   };
+   typedef union buzzoutmsg_u* buzzoutmsg_t;
+
    /*
     * Data of a Buzz message queue.
     */
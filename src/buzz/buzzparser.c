@@ -80,7 +80,7 @@ void string_print(uint32_t pos, void* data, void* params) {
 /****************************************/
 
 struct sym_s {
-   /* Position of the symbol in the activation record (-1 for unknown) */
+   /* Position of the symbol in the activation record (negative for captured symbols) */
    int64_t pos;
    /* Symbol type
     * Can be any of the TYPE_* declarations
@@ -91,12 +91,40 @@ struct sym_s {
    int global;
 };
 
-const struct sym_s* sym_lookup(const char* sym,
-                               buzzdarray_t symstack) {
+/*
+ * A lambda being parsed.
+ * A lambda has its own symbol tables. The local symbols it uses from
+ * the enclosing functions are captured when the lambda is created:
+ * in its symbol tables, they get negative positions, starting at -1.
+ */
+struct lambda_s {
+   /* Position of the first symbol table of the lambda in the stack */
+   int64_t symt;
+   /* Positions of the captured symbols in the enclosing function (int64_t) */
+   buzzdarray_t captures;
+};
+
+void lambda_destroy(uint32_t pos, void* data, void* params) {
+   buzzdarray_destroy(&((struct lambda_s*)data)->captures);
+}
+
+/*
+ * Returns the number of symbols captured by the innermost lambda being
+ * parsed, which are in all its symbol tables.
+ */
+uint32_t sym_ncaptures(buzzparser_t par) {
+   if(buzzdarray_isempty(par->lambdas)) return 0;
+   return buzzdarray_size(buzzdarray_last(par->lambdas, struct lambda_s).captures);
+}
+
+const struct sym_s* sym_lookup_below(const char* sym,
+                                     buzzdarray_t symstack,
+                                     int64_t start,
+                                     int64_t end) {
    const struct sym_s* symdata = NULL;
    /* Go through the symbol tables, from the top to the bottom */
    int64_t i;
-   for(i = buzzdarray_size(symstack)-1; i >= 0; --i) {
+   for(i = end-1; i >= start; --i) {
       /* Get symbol table */
       buzzdict_t st = buzzdarray_get(symstack, i, buzzdict_t);
       /* Look for the symbol - if found, return immediately */
@@ -107,6 +135,11 @@ const struct sym_s* sym_lookup(const char* sym,
    return NULL;
 }
 
+const struct sym_s* sym_lookup(const char* sym,
+                               buzzdarray_t symstack) {
+   return sym_lookup_below(sym, symstack, 0, buzzdarray_size(symstack));
+}
+
 void sym_add(buzzparser_t par, const char* sym, int scope) {
    /* Copy string */
    char* key = strdup(sym);
@@ -123,7 +156,7 @@ void sym_add(buzzparser_t par, const char* sym, int scope) {
    /* For a global symbol, the position corresponds to the string id */
    if(global) pos = string_add(par->strings, sym);
    /* For a local symbol, the position is that in the activation record */
-   else       pos = buzzdict_size(par->syms);
+   else       pos = buzzdict_size(par->syms) - sym_ncaptures(par);
    /* Create symbol and save it */
    struct sym_s symdata = {
       .pos  = pos,
@@ -155,8 +188,6 @@ void sym_destroy(const void* key,
                 void* data,
                 void* params) {
    free(*(char**)key);
-   free((void*)key);
-   free(data);
 }
 
 #define SYMT_BUCKETS 100
@@ -189,15 +220,60 @@ void symt_destroy(uint32_t pos, void* data, void* params) {
 }
 
 struct idrefinfo_s {
-   /* When < 0 correspond to TYPE_*; when >=0 corresponds to offset in variable list */
+   /* For variables, the string id or the position in the variable list; otherwise TYPE_* */
    int info;
-   /* For info >=0, says whether the idref is for local or global variable */
+   /* 1 if the idref is for a global variable */
    int global;
+   /* 1 if the idref is for a local variable */
+   int local;
 };
 
 /****************************************/
 /****************************************/
 
+/*
+ * Looks up a symbol used within the given lambda nesting level, where
+ * -1 is outside of any lambda. If the symbol is local to an enclosing
+ * function, it is captured by the lambdas in between.
+ */
+const struct sym_s* sym_ref_level(buzzparser_t par,
+                                  const char* sym,
+                                  int64_t lvl) {
+   /* Get the symbol tables of the level */
+   int64_t end = buzzdarray_size(par->symstack);
+   if(lvl + 1 < buzzdarray_size(par->lambdas))
+      end = buzzdarray_getp(par->lambdas, lvl + 1, struct lambda_s)->symt;
+   if(lvl < 0) return sym_lookup_below(sym, par->symstack, 0, end);
+   struct lambda_s* l = buzzdarray_getp(par->lambdas, lvl, struct lambda_s);
+   const struct sym_s* s = sym_lookup_below(sym, par->symstack, l->symt, end);
+   if(s) return s;
+   /* Look for the symbol in the enclosing scope */
+   s = sym_ref_level(par, sym, lvl - 1);
+   if(!s || s->global) return s;
+   /* The symbol is local to the enclosing scope, capture it */
+   buzzdarray_push(l->captures, &s->pos);
+   struct sym_s cap = {
+      .pos  = -(int64_t)buzzdarray_size(l->captures),
+      .type = s->type,
+      .global = 0
+   };
+   /* Add it to all the symbol tables of the lambda, as nested blocks clone them */
+   int64_t i;
+   for(i = l->symt; i < end; ++i) {
+      char* key = strdup(sym);
+      buzzdict_set(buzzdarray_get(par->symstack, i, buzzdict_t), &key, &cap);
+   }
+   return sym_lookup_below(sym, par->symstack, l->symt, end);
+}
+
+/*
+ * Looks up a symbol used in the code being parsed.
+ */
+#define sym_ref(SYM) sym_ref_level(par, (SYM), (int64_t)buzzdarray_size(par->lambdas) - 1)
+
+/****************************************/
+/****************************************/
+
 #define LABELREF "@__label_"
 
 /*
@@ -300,6 +376,152 @@ void chunk_print(uint32_t pos, void* data, void* params) {
    fprintf(f, "%s", c->code);
 }
 
+/*
+ * Superinstructions that replace common pairs of instructions.
+ * Each entry lists the pair and the superinstruction. The argument
+ * of the superinstruction is that of the instruction of the pair
+ * that has one.
+ */
+static const char* CHUNK_FUSIONS[][3] = {
+   { "pushs", "gload", "gloads"   },
+   { "pushs", "tget",  "tgets"    },
+   { "pushi", "callc", "callci"   },
+   { "pushi", "add",   "addi"     },
+   { "lt",    "jumpz", "ltjumpz"  },
+   { "gt",    "jumpz", "gtjumpz"  },
+   { "eq",    "jumpz", "eqjumpz"  },
+   { "neq",   "jumpz", "neqjumpz" }
+};
+
+/*
+ * A line of code, split into its parts
+ */
+struct chunk_line_s {
+   /* The instruction, NULL if the line is not an instruction */
+   const char* instr;
+   size_t ilen;
+   /* The argument, NULL if none */
+   const char* arg;
+   size_t alen;
+   /* The debug information (from the '|'), NULL if none */
+   const char* dbg;
+   size_t dlen;
+};
+
+void chunk_line_split(const char* line, size_t len, struct chunk_line_s* l) {
+   memset(l, 0, sizeof(struct chunk_line_s));
+   /* Instructions start with a tab, labels don't */
+   if(*line != '\t') return;
+   l->instr = line + 1;
+   l->ilen = strcspn(l->instr, " \t|\n");
+   if(l->instr[l->ilen] == ' ') {
+      l->arg = l->instr + l->ilen + 1;
+      l->alen = strcspn(l->arg, "\t|\n");
+   }
+   const char* bar = memchr(line, '|', len);
+   if(bar) {
+      l->dbg = bar;
+      l->dlen = strcspn(bar, "\n");
+   }
+}
+
+/*
+ * Returns the superinstruction for the given pair of lines, or NULL.
+ */
+const char* chunk_fusion(const struct chunk_line_s* l1,
+                         const struct chunk_line_s* l2) {
+   if(!l1->instr || !l2->instr) return NULL;
+   size_t i;
+   for(i = 0; i < sizeof(CHUNK_FUSIONS) / sizeof(CHUNK_FUSIONS[0]); ++i) {
+      if(strlen(CHUNK_FUSIONS[i][0]) == l1->ilen &&
+         strncmp(CHUNK_FUSIONS[i][0], l1->instr, l1->ilen) == 0 &&
+         strlen(CHUNK_FUSIONS[i][1]) == l2->ilen &&
+         strncmp(CHUNK_FUSIONS[i][1], l2->instr, l2->ilen) == 0)
+         return CHUNK_FUSIONS[i][2];
+   }
+   return NULL;
+}
+
+/*
+ * Replaces the common pairs of instructions in a chunk with
+ * superinstructions. Labels separate pairs, so jump targets are kept.
+ * The superinstruction takes the debug information of the second
+ * instruction, which is the one that can fail.
+ */
+void chunk_fuse(uint32_t pos, void* data, void* params) {
+   chunk_t c = *(chunk_t*)data;
+   /* The fused code is never longer than the original */
+   char* code = (char*)malloc(c->csize + 1);
+   size_t csize = 0;
+   /* The previous line, not written yet */
+   const char* prev = NULL;
+   size_t plen = 0;
+   struct chunk_line_s pl;
+   const char* line = c->code;
+   const char* end = c->code + c->csize;
+   while(line < end) {
+      const char* eol = memchr(line, '\n', end - line);
+      size_t len = eol ? (size_t)(eol - line + 1) : (size_t)(end - line);
+      struct chunk_line_s cl;
+      chunk_line_split(line, len, &cl);
+      const char* fused = prev ? chunk_fusion(&pl, &cl) : NULL;
+      if(fused) {
+         /* Write the superinstruction in place of both lines */
+         const struct chunk_line_s* a = pl.arg ? &pl : &cl;
+         const struct chunk_line_s* d = cl.dbg ? &cl : &pl;
+         csize += sprintf(code + csize, "\t%s", fused);
+         if(a->arg) csize += sprintf(code + csize, " %.*s", (int)a->alen, a->arg);
+         if(d->dbg) csize += sprintf(code + csize, "\t%.*s", (int)d->dlen, d->dbg);
+         code[csize++] = '\n';
+         prev = NULL;
+      }
+      else {
+         if(prev) {
+            memcpy(code + csize, prev, plen);
+            csize += plen;
+         }
+         prev = line;
+         plen = len;
+         pl = cl;
+      }
+      line += len;
+   }
+   if(prev) {
+      memcpy(code + csize, prev, plen);
+      csize += plen;
+   }
+   code[csize] = 0;
+   free(c->code);
+   c->code = code;
+   c->csize = csize;
+   c->ccap = csize + 1;
+}
+
+/*
+ * Turns a call at the end of a chunk into a tail call, which returns
+ * the value of the call from the current closure.
+ * @return 1 if the chunk ends with a call, 0 otherwise.
+ */
+int chunk_tailcall(chunk_t c) {
+   if(c->csize == 0) return 0;
+   /* Find the last line */
+   size_t start = c->csize - 1;
+   while(start > 0 && c->code[start - 1] != '\n') --start;
+   struct chunk_line_s l;
+   chunk_line_split(c->code + start, c->csize - start, &l);
+   if(!l.instr || l.ilen != 5 || strncmp(l.instr, "callc", 5) != 0)
+      return 0;
+   /* Replace the instruction, keeping the debug information */
+   const char* rest = l.instr + l.ilen;
+   char* str;
+   asprintf(&str, "\ttailcall%.*s",
+            (int)(c->code + c->csize - 1 - rest), rest);
+   c->csize = start;
+   chunk_addcode(c, str, NULL);
+   free(str);
+   return 1;
+}
+
 #define chunk_push(SYM)                                        \
    chunk_t oldc = par->chunk;                                  \
    par->chunk = chunk_new(par->labels, (SYM));                 \
@@ -516,7 +738,7 @@ int parse_block(buzzparser_t par, int pushsymt) {
          }
       }
       /* Save the current number of variables */
-      uint32_t numvars = buzzdict_size(par->syms);
+      uint32_t numvars = buzzdict_size(par->syms) - sym_ncaptures(par);
       if(parse_statlist(par)) {
          tokmatch(BUZZTOK_BLOCKCLOSE);
          fetchtok();
@@ -1052,6 +1274,22 @@ int parse_operand(buzzparser_t par) {
       fetchtok();
       return PARSE_OK;
    }
+   else if(par->tok->type == BUZZTOK_YIELD) {
+      /* yield(value) evaluates to the value passed by the next resume */
+      fetchtok();
+      tokmatch(BUZZTOK_PAROPEN);
+      fetchtok();
+      if(par->tok->type == BUZZTOK_PARCLOSE) {
+         chunk_append("\tpushnil");
+      }
+      else {
+         if(!parse_condition(par)) return PARSE_ERROR;
+         tokmatch(BUZZTOK_PARCLOSE);
+      }
+      fetchtok();
+      chunk_append("\tyield");
+      return PARSE_OK;
+   }
    else if(par->tok->type == BUZZTOK_PAROPEN) {
       fetchtok();
       if(!parse_condition(par)) return PARSE_ERROR;
@@ -1097,10 +1335,30 @@ int parse_command(buzzparser_t par) {
       }
       else {
          if(!parse_condition(par)) return PARSE_ERROR;
+         /* A call in tail position reuses the frame, C closures
+          * return through the ret1 after it */
+         chunk_tailcall(par->chunk);
          chunk_append("\tret1");
       }
       return PARSE_OK;
    }
+   else if(par->tok->type == BUZZTOK_YIELD) {
+      /* Yield statement, the value passed by the next resume is discarded */
+      /* The end of the line ends the statement, so don't skip it */
+      buzzlex_destroytok(&par->tok);
+      par->tok = buzzlex_nexttok(par->lex);
+      if(par->tok->type == BUZZTOK_STATEND ||
+         par->tok->type == BUZZTOK_BLOCKCLOSE ||
+         par->tok->type == BUZZTOK_EOF) {
+         chunk_append("\tpushnil");
+      }
+      else {
+         if(!parse_condition(par)) return PARSE_ERROR;
+      }
+      chunk_append("\tyield");
+      chunk_append("\tpop");
+      return PARSE_OK;
+   }
    else {
       /* Function call or assignment, both begin with an id */
       struct idrefinfo_s idrefinfo;
@@ -1128,7 +1386,7 @@ int parse_command(buzzparser_t par) {
          }
          else {
             /* The lvalue is a local symbol or a table reference */
-            if(idrefinfo.info >= 0) {
+            if(idrefinfo.local) {
                /* Local variable */
                chunk_append("\tlstore %d", idrefinfo.info);
             }
@@ -1162,15 +1420,11 @@ int parse_idlist(buzzparser_t par) {
       return PARSE_OK;
    /* Match an id for the first argument */
    tokmatch(BUZZTOK_ID);
-   /* Look for the argument symbol in the context
-    * If a symbol is found and is not global,
-    * do not add a new symbol; otherwise do
-    * This allows lambdas and nested functions to
-    * reuse the parameters and local variables of
-    * the parent
+   /* Add a symbol for the argument, unless the function already has
+    * one with the same name
+    * The arguments hide the symbols of the enclosing functions
     */
-   const struct sym_s* sym = sym_lookup(par->tok->value, par->symstack);
-   if(!sym || sym->global) {
+   if(!buzzdict_get(par->syms, &par->tok->value, struct sym_s)) {
       sym_add(par, par->tok->value, SCOPE_LOCAL);
    }
    fetchtok();
@@ -1178,8 +1432,7 @@ int parse_idlist(buzzparser_t par) {
    while(par->tok->type == BUZZTOK_LISTSEP) {
       fetchtok();
       tokmatch(BUZZTOK_ID);
-      const struct sym_s* sym = sym_lookup(par->tok->value, par->symstack);
-      if(!sym || sym->global) {
+      if(!buzzdict_get(par->syms, &par->tok->value, struct sym_s)) {
          sym_add(par, par->tok->value, SCOPE_LOCAL);
       }
       fetchtok();
@@ -1217,7 +1470,7 @@ int parse_idref(buzzparser_t par,
    /* Start with an id */
    tokmatch(BUZZTOK_ID);
    /* Look it up in the symbol table */
-   const struct sym_s* s = sym_lookup(par->tok->value, par->symstack);
+   const struct sym_s* s = sym_ref(par->tok->value);
    if(!s) {
       /* Symbol not found, add it */
       sym_add(par, par->tok->value, SCOPE_GLOBAL);
@@ -1226,6 +1479,7 @@ int parse_idref(buzzparser_t par,
    /* Save symbol info */
    idrefinfo->info = s->pos;
    idrefinfo->global = s->global;
+   idrefinfo->local = !s->global;
    /* Go on parsing the reference */
    fetchtok();
    chunk_buf_push();
@@ -1240,7 +1494,7 @@ int parse_idref(buzzparser_t par,
          chunk_append("\tpushs %d", idrefinfo->info);
          chunk_append("\tgload");
       }
-      else if(idrefinfo->info >= 0) {
+      else if(idrefinfo->local) {
          // If the next token is a closure and is not called from a table, we push nil for the self table.
          if(par->tok->type == BUZZTOK_PAROPEN)
             chunk_append("\tpushnil");
@@ -1249,6 +1503,7 @@ int parse_idref(buzzparser_t par,
       else if(idrefinfo->info == TYPE_TABLE)   { chunk_append("\ttget"); }
       else if(idrefinfo->info == TYPE_CLOSURE) { chunk_append("\tcallc"); }
       idrefinfo->global = 0;
+      idrefinfo->local = 0;
       /* Go on parsing structure type */
       if(par->tok->type == BUZZTOK_DOT) {
          idrefinfo->info = TYPE_TABLE;
@@ -1291,7 +1546,7 @@ int parse_idref(buzzparser_t par,
          chunk_append("\tpushs %d", idrefinfo->info);
          chunk_append("\tgload");
       }
-      else if(idrefinfo->info >= 0) {
+      else if(idrefinfo->local) {
          chunk_append("\tlload %d", idrefinfo->info);
       }
       else if(idrefinfo->info == TYPE_TABLE) {
@@ -1315,21 +1570,16 @@ int parse_lambda(buzzparser_t par) {
    chunk_push(NULL);
    tokmatch(BUZZTOK_PAROPEN);
    fetchtok();
-   /* Check whether it's necessary to create a brand new symbol table
-    * or clone the current one
-    * If the parent symtable is the global one, it is necessary;
-    * otherwise, clone the parent's
-    */
-   if(buzzdarray_size(par->symstack) == 1) {
-      /* Add new symtable */
-      symt_push();
-      /* Add "self" symbol */
-      const struct sym_s* sym = sym_lookup("self", par->symstack);
-      if(!sym || sym->global) { sym_add(par, "self", SCOPE_LOCAL); }
-   }
-   else {
-      symt_clone();
-   }
+   /* Make a new symbol table, the symbols of the enclosing
+    * functions are captured as they are used */
+   symt_push();
+   struct lambda_s lambda = {
+      .symt = buzzdarray_size(par->symstack) - 1,
+      .captures = buzzdarray_new(1, sizeof(int64_t), NULL)
+   };
+   buzzdarray_push(par->lambdas, &lambda);
+   /* Add "self" symbol, which is the self table of the enclosing function */
+   sym_add(par, "self", SCOPE_LOCAL);
    /* Parse lambda arguments */
    if(!parse_idlist(par)) return PARSE_ERROR;
    tokmatch(BUZZTOK_PARCLOSE);
@@ -1341,6 +1591,12 @@ int parse_lambda(buzzparser_t par) {
    /* Get rid of symbol table and close chunk */
    symt_pop();
    chunk_pop();
+   /* Capture the symbols in the closure, right after its creation */
+   buzzdarray_t captures = buzzdarray_last(par->lambdas, struct lambda_s).captures;
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(captures); ++i)
+      chunk_append("\tlcap %" PRId64, buzzdarray_get(captures, i, int64_t));
+   buzzdarray_pop(par->lambdas);
    return PARSE_OK;
 }
 
@@ -1381,6 +1637,8 @@ buzzparser_t buzzparser_new(int argc,
    /* Initialize symbol table stack */
    par->symstack = buzzdarray_new(10, sizeof(buzzdict_t), symt_destroy);
    par->syms = NULL;
+   /* Initialize lambda stack */
+   par->lambdas = buzzdarray_new(1, sizeof(struct lambda_s), lambda_destroy);
    /* Initialize string list */
    par->strings = buzzdict_new(100,
                                sizeof(char*),
@@ -1424,6 +1682,7 @@ void buzzparser_destroy(buzzparser_t* par) {
    buzzdict_destroy(&((*par)->strings));
    buzzdarray_destroy(&((*par)->chunks));
    buzzdarray_destroy(&((*par)->symstack));
+   buzzdarray_destroy(&((*par)->lambdas));
    free((*par)->asmfn);
    fclose((*par)->asmstream);
    free((*par)->scriptfn);
@@ -1455,6 +1714,8 @@ int buzzparser_parse(buzzparser_t par) {
    /* Write chunk registration code (end it with a nop) */
    buzzdarray_foreach(par->chunks, chunk_register, par->asmstream);
    fprintf(par->asmstream, "\tnop\n");
+   /* Use superinstructions for common sequences */
+   buzzdarray_foreach(par->chunks, chunk_fuse, NULL);
    /* Write actual chunks */
    buzzdarray_foreach(par->chunks, chunk_print, par->asmstream);
    return PARSE_OK;
@@ -37,6 +37,8 @@ extern "C" {
       buzzdarray_t symstack;
       /* The top of the symbol table stack */
       buzzdict_t syms;
+      /* Stack of the lambdas being parsed */
+      buzzdarray_t lambdas;
       /* List of string symbols */
       buzzdict_t strings;
       /* Label counter */
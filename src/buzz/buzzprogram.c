@@ -0,0 +1,53 @@
+#include "buzzprogram.h"
+#include <stdlib.h>
+#include <string.h>
+
+/****************************************/
+/****************************************/
+
+buzzprogram_t buzzprogram_new(const uint8_t* bcode,
+                              uint32_t bcode_size) {
+   /* Keep a copy of the bytecode */
+   uint8_t* bc = (uint8_t*)malloc(bcode_size);
+   memcpy(bc, bcode, bcode_size);
+   /* Load it into a scratch VM */
+   buzzvm_t vm = buzzvm_new(0);
+   if(buzzvm_set_bcode(vm, bc, bcode_size) != BUZZVM_STATE_READY) {
+      buzzvm_destroy(&vm);
+      free(bc);
+      return NULL;
+   }
+   /* Take what can be shared from the VM */
+   buzzprogram_t x = (buzzprogram_t)malloc(sizeof(struct buzzprogram_s));
+   x->bcode = bc;
+   x->bcode_size = bcode_size;
+   x->dcode = vm->dcode;
+   x->dcode_size = vm->dcode_size;
+   x->dcode_index = vm->dcode_index;
+   x->verified = vm->verified;
+   vm->dcode = NULL;
+   vm->dcode_index = NULL;
+   x->strings = vm->strings;
+   vm->strings = buzzstrman_new();
+   x->flist = vm->flist;
+   vm->flist = buzzdarray_new(1, sizeof(buzzvm_funp), NULL);
+   /* The rest is made by each VM */
+   buzzvm_destroy(&vm);
+   return x;
+}
+
+/****************************************/
+/****************************************/
+
+void buzzprogram_destroy(buzzprogram_t* prog) {
+   free((*prog)->bcode);
+   free((*prog)->dcode);
+   free((*prog)->dcode_index);
+   buzzstrman_destroy(&(*prog)->strings);
+   buzzdarray_destroy(&(*prog)->flist);
+   free(*prog);
+   *prog = NULL;
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,71 @@
+#ifndef BUZZPROGRAM_H
+#define BUZZPROGRAM_H
+
+#include <buzz/buzzvm.h>
+
+/*
+ * Loaded bytecode shared by many VMs.
+ *
+ * A program holds what buzzvm_set_bcode() would otherwise build for
+ * each VM: a copy of the bytecode, the decoded and verified
+ * instructions, the string table with the strings of the bytecode and
+ * of the standard library, and the list of the library C functions.
+ * None of it is modified after creation, so a program can be set into
+ * any number of VMs, in any thread, with buzzvm_set_program().
+ *
+ * Each VM keeps the strings it makes at run time in its own string
+ * manager, on top of the shared one (see buzzstrman_overlay_new()),
+ * its own inline caches, and its own heap. The library tables are heap
+ * objects, so they are still made by each VM, but their strings and
+ * functions are found in the program.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   /*
+    * Program data
+    */
+   struct buzzprogram_s {
+      /* Bytecode content */
+      uint8_t* bcode;
+      /* Size of the bytecode */
+      uint32_t bcode_size;
+      /* Decoded instructions, followed by an end marker */
+      buzzvm_dinstr_t* dcode;
+      /* Number of decoded instructions, end marker excluded */
+      uint32_t dcode_size;
+      /* Index of the decoded instruction at each bytecode offset */
+      uint32_t* dcode_index;
+      /* 1 if the decoded instructions passed buzzvm_verify() */
+      int verified;
+      /* Strings of the bytecode and of the library */
+      buzzstrman_t strings;
+      /* Library C functions (buzzvm_funp) */
+      buzzdarray_t flist;
+   };
+   typedef struct buzzprogram_s* buzzprogram_t;
+
+   /*
+    * Creates a program from bytecode.
+    * The bytecode is copied, so the passed buffer can be deleted.
+    * @param bcode The bytecode buffer.
+    * @param bcode_size The size (in bytes) of the bytecode.
+    * @return The program, or NULL if the bytecode can't be loaded.
+    */
+   extern buzzprogram_t buzzprogram_new(const uint8_t* bcode,
+                                        uint32_t bcode_size);
+
+   /*
+    * Destroys a program.
+    * The VMs the program was set into must be destroyed first.
+    * @param prog The program.
+    */
+   extern void buzzprogram_destroy(buzzprogram_t* prog);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
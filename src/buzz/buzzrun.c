@@ -9,7 +9,7 @@ void usage(const char* path, int status) {
 }
 
 int print(buzzvm_t vm) {
-   for(int i = 1; i < buzzdarray_size(vm->lsyms->syms); ++i) {
+   for(int i = 1; i <= buzzvm_lnum(vm); ++i) {
       buzzvm_lload(vm, i);
       buzzobj_t o = buzzvm_stack_at(vm, 1);
       buzzvm_pop(vm);
@@ -24,7 +24,7 @@ int print(buzzvm_t vm) {
             fprintf(stdout, "%f", o->f.value);
             break;
          case BUZZTYPE_TABLE:
-            fprintf(stdout, "[table with %d elems]", (buzzdict_size(o->t.value)));
+            fprintf(stdout, "[table with %d elems]", (buzztable_size(o)));
             break;
          case BUZZTYPE_CLOSURE:
             if(o->c.value.isnative)
@@ -38,6 +38,9 @@ int print(buzzvm_t vm) {
          case BUZZTYPE_USERDATA:
             fprintf(stdout, "[userdata @%p]", o->u.value);
             break;
+         case BUZZTYPE_COROUTINE:
+            fprintf(stdout, "[coroutine @%p]", o->r.value);
+            break;
          default:
             break;
       }
@@ -92,9 +95,12 @@ int main(int argc, char** argv) {
    buzzvm_pushs(vm, buzzvm_string_register(vm, "log", 1));
    buzzvm_pushcc(vm, buzzvm_function_register(vm, print));
    buzzvm_gstore(vm);
-   /* Run byte code */
-   do if(trace) buzzdebug_stack_dump(vm, 1, stdout);
-   while(buzzvm_step(vm) == BUZZVM_STATE_READY);
+   /* Run byte code, one step at a time when tracing */
+   if(trace) {
+      do buzzdebug_stack_dump(vm, 1, stdout);
+      while(buzzvm_step(vm) == BUZZVM_STATE_READY);
+   }
+   else buzzvm_execute_script(vm);
    /* Done running, check final state */
    int retval;
    if(vm->state == BUZZVM_STATE_DONE) {
@@ -0,0 +1,1187 @@
+#include "buzzsnapshot.h"
+#include "buzzcoroutine.h"
+#include "buzzmath.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/****************************************/
+/****************************************/
+
+/* Image identification */
+#define BUZZSNAPSHOT_MAGIC   0x425a534e /* "BZSN" */
+#define BUZZSNAPSHOT_VERSION 1
+
+/* Object index of a NULL reference */
+#define BUZZSNAPSHOT_NONE    0xFFFFFFFF
+
+/* Flag set in the type of a value that refers to an object */
+#define BUZZSNAPSHOT_BOXED   0x80
+
+/****************************************/
+/****************************************/
+
+/*
+ * Returns the FNV-1a hash of a buffer. It is used to check that a
+ * snapshot is restored into a VM that runs the same code, and that the
+ * image is not corrupted.
+ */
+static uint32_t buzzsnapshot_hash(const uint8_t* data,
+                                  uint32_t size) {
+   uint32_t h = 2166136261u;
+   uint32_t i;
+   for(i = 0; i < size; ++i) {
+      h ^= data[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+/*
+ * Appends the content of 'src' to 'dst'.
+ */
+static void buzzsnapshot_append(buzzmsg_payload_t dst,
+                                buzzmsg_payload_t src) {
+   buzzdarray_reserve(dst, buzzdarray_size(dst) + buzzdarray_size(src));
+   memcpy(buzzdarray_getp(dst, buzzdarray_size(dst), uint8_t),
+          buzzdarray_getp(src, 0, uint8_t),
+          buzzdarray_size(src));
+   dst->size += buzzdarray_size(src);
+}
+
+/*
+ * Appends a byte buffer, preceded by its size. Unlike
+ * buzzmsg_serialize_string(), the size is not limited to 16 bits.
+ */
+static void buzzsnapshot_serialize_bytes(buzzmsg_payload_t buf,
+                                         const void* data,
+                                         uint32_t size) {
+   buzzmsg_serialize_u32(buf, size);
+   buzzdarray_reserve(buf, buzzdarray_size(buf) + size);
+   memcpy(buzzdarray_getp(buf, buzzdarray_size(buf), uint8_t), data, size);
+   buf->size += size;
+}
+
+/*
+ * Appends a pointer. Pointers are only meaningful in the process that
+ * wrote them.
+ */
+static void buzzsnapshot_write_ptr(buzzmsg_payload_t buf,
+                                   void* ptr) {
+   uint64_t p = (uintptr_t)ptr;
+   buzzmsg_serialize_u32(buf, p >> 32);
+   buzzmsg_serialize_u32(buf, p & 0xFFFFFFFF);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * State of the snapshot writer.
+ * The objects are numbered as they are found. Their content is written
+ * once the roots are, so the numbering can go on while writing it.
+ */
+struct buzzsnapshot_writer_s {
+   /* Object -> index (uint32_t) */
+   buzzdict_t ids;
+   /* The objects, by index (buzzobj_t) */
+   buzzdarray_t objs;
+};
+typedef struct buzzsnapshot_writer_s* buzzsnapshot_writer_t;
+
+static uint32_t buzzsnapshot_ptr_hash(const void* key) {
+   uintptr_t p = (uintptr_t)(*(buzzobj_t*)key);
+   return (uint32_t)(p ^ (p >> 32));
+}
+
+static int buzzsnapshot_ptr_cmp(const void* a, const void* b) {
+   if((uintptr_t)(*(buzzobj_t*)a) < (uintptr_t)(*(buzzobj_t*)b)) return -1;
+   if((uintptr_t)(*(buzzobj_t*)a) > (uintptr_t)(*(buzzobj_t*)b)) return  1;
+   return 0;
+}
+
+/*
+ * Writes a reference to an object, numbering the object if it is new.
+ */
+static void buzzsnapshot_write_obj(buzzsnapshot_writer_t w,
+                                   buzzmsg_payload_t buf,
+                                   buzzobj_t o) {
+   if(!o) {
+      buzzmsg_serialize_u32(buf, BUZZSNAPSHOT_NONE);
+      return;
+   }
+   const uint32_t* id = buzzdict_get(w->ids, &o, uint32_t);
+   if(id) {
+      buzzmsg_serialize_u32(buf, *id);
+      return;
+   }
+   uint32_t nid = buzzdarray_size(w->objs);
+   buzzdict_set(w->ids, &o, &nid);
+   buzzdarray_push(w->objs, &o);
+   buzzmsg_serialize_u32(buf, nid);
+}
+
+/*
+ * Writes a value: its type, then the object it refers to or its
+ * unboxed content.
+ */
+static void buzzsnapshot_write_val(buzzsnapshot_writer_t w,
+                                   buzzmsg_payload_t buf,
+                                   const buzzval_t* v) {
+   if(v->o) {
+      buzzmsg_serialize_u8(buf, v->type | BUZZSNAPSHOT_BOXED);
+      buzzsnapshot_write_obj(w, buf, v->o);
+   }
+   else {
+      buzzmsg_serialize_u8(buf, v->type);
+      if(v->type != BUZZTYPE_NIL)
+         buzzmsg_serialize_u32(buf, v->v.i);
+   }
+}
+
+/*
+ * Writes a list of values (buzzval_t).
+ */
+static void buzzsnapshot_write_vals(buzzsnapshot_writer_t w,
+                                    buzzmsg_payload_t buf,
+                                    buzzdarray_t vals) {
+   buzzmsg_serialize_u32(buf, buzzdarray_size(vals));
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(vals); ++i)
+      buzzsnapshot_write_val(w, buf, buzzdarray_getp(vals, i, buzzval_t));
+}
+
+/*
+ * Writes a list of call frames (buzzvm_frame_t).
+ */
+static void buzzsnapshot_write_frames(buzzmsg_payload_t buf,
+                                      buzzdarray_t frames) {
+   buzzmsg_serialize_u32(buf, buzzdarray_size(frames));
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(frames); ++i) {
+      const buzzvm_frame_t* f = buzzdarray_getp(frames, i, buzzvm_frame_t);
+      buzzmsg_serialize_u32(buf, f->sbase);
+      buzzmsg_serialize_u32(buf, f->cbase);
+      buzzmsg_serialize_u32(buf, f->lbase);
+      buzzmsg_serialize_u32(buf, f->retpc);
+      buzzmsg_serialize_u8(buf, f->isswarm);
+      buzzmsg_serialize_u32(buf, f->tailcalls);
+   }
+}
+
+/*
+ * Parameters of the dictionary writers.
+ */
+struct buzzsnapshot_dict_s {
+   buzzsnapshot_writer_t w;
+   buzzmsg_payload_t buf;
+};
+
+/* buzzobj_t -> buzzobj_t (tables) */
+static void buzzsnapshot_write_objobj(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   buzzsnapshot_write_obj(p->w, p->buf, *(buzzobj_t*)key);
+   buzzsnapshot_write_obj(p->w, p->buf, *(buzzobj_t*)data);
+}
+
+/* int32_t -> buzzobj_t (global symbols) */
+static void buzzsnapshot_write_i32obj(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   buzzmsg_serialize_u32(p->buf, *(int32_t*)key);
+   buzzsnapshot_write_obj(p->w, p->buf, *(buzzobj_t*)data);
+}
+
+/* uint16_t -> buzzobj_t (listeners) */
+static void buzzsnapshot_write_u16obj(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   buzzmsg_serialize_u16(p->buf, *(uint16_t*)key);
+   buzzsnapshot_write_obj(p->w, p->buf, *(buzzobj_t*)data);
+}
+
+/* buzzobj_t -> buzzvstig_elem_t (virtual stigmergy content) */
+static void buzzsnapshot_write_vstig_elem(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   const buzzvstig_elem_t e = *(buzzvstig_elem_t*)data;
+   buzzsnapshot_write_obj(p->w, p->buf, *(buzzobj_t*)key);
+   buzzsnapshot_write_obj(p->w, p->buf, e->data);
+   buzzmsg_serialize_u16(p->buf, e->timestamp);
+   buzzmsg_serialize_u16(p->buf, e->robot);
+}
+
+/* uint16_t -> buzzvstig_t (virtual stigmergies) */
+static void buzzsnapshot_write_vstig(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   const buzzvstig_t vs = *(buzzvstig_t*)data;
+   buzzmsg_serialize_u16(p->buf, *(uint16_t*)key);
+   buzzsnapshot_write_obj(p->w, p->buf, vs->onconflict);
+   buzzsnapshot_write_obj(p->w, p->buf, vs->onconflictlost);
+   buzzmsg_serialize_u32(p->buf, buzzdict_size(vs->data));
+   buzzvstig_foreach_elem(vs, buzzsnapshot_write_vstig_elem, p);
+}
+
+/* uint16_t -> uint8_t (swarms) */
+static void buzzsnapshot_write_swarm(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   buzzmsg_serialize_u16(p->buf, *(uint16_t*)key);
+   buzzmsg_serialize_u8(p->buf, *(uint8_t*)data);
+}
+
+/* uint16_t -> buzzswarm_elem_t (swarm members) */
+static void buzzsnapshot_write_member(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   const buzzswarm_elem_t e = *(buzzswarm_elem_t*)data;
+   buzzmsg_serialize_u16(p->buf, *(uint16_t*)key);
+   buzzmsg_serialize_u16(p->buf, e->age);
+   buzzmsg_serialize_u32(p->buf, buzzdarray_size(e->swarms));
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(e->swarms); ++i)
+      buzzmsg_serialize_u16(p->buf, buzzdarray_get(e->swarms, i, uint16_t));
+}
+
+/* uint16_t -> buzzdarray_t of buzzmsg_payload_t (input messages) */
+static void buzzsnapshot_write_inmsgs(const void* key, void* data, void* params) {
+   struct buzzsnapshot_dict_s* p = (struct buzzsnapshot_dict_s*)params;
+   buzzdarray_t q = *(buzzdarray_t*)data;
+   buzzmsg_serialize_u16(p->buf, *(uint16_t*)key);
+   buzzmsg_serialize_u32(p->buf, buzzdarray_size(q));
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(q); ++i) {
+      buzzmsg_payload_t m = buzzdarray_get(q, i, buzzmsg_payload_t);
+      buzzsnapshot_serialize_bytes(p->buf, m->data, buzzmsg_payload_size(m));
+   }
+}
+
+/* Strings, counted as they are written */
+struct buzzsnapshot_strings_s {
+   buzzmsg_payload_t buf;
+   uint32_t count;
+};
+
+static void buzzsnapshot_write_string(uint16_t sid, const char* str, int protect, void* params) {
+   struct buzzsnapshot_strings_s* p = (struct buzzsnapshot_strings_s*)params;
+   buzzmsg_serialize_u16(p->buf, sid);
+   buzzmsg_serialize_u8(p->buf, protect != 0);
+   buzzsnapshot_serialize_bytes(p->buf, str, strlen(str));
+   ++p->count;
+}
+
+/*
+ * Writes the content of a table, closure or coroutine.
+ */
+static void buzzsnapshot_write_body(buzzsnapshot_writer_t w,
+                                    buzzmsg_payload_t buf,
+                                    buzzobj_t o) {
+   switch(o->o.type) {
+      case BUZZTYPE_TABLE: {
+         buzzmsg_serialize_u32(buf, o->t.holes);
+         if(o->t.array) buzzsnapshot_write_vals(w, buf, o->t.array);
+         else buzzmsg_serialize_u32(buf, BUZZSNAPSHOT_NONE);
+         struct buzzsnapshot_dict_s p = { .w = w, .buf = buf };
+         buzzmsg_serialize_u32(buf, buzzdict_size(o->t.value));
+         buzzdict_foreach(o->t.value, buzzsnapshot_write_objobj, &p);
+         break;
+      }
+      case BUZZTYPE_CLOSURE: {
+         buzzmsg_serialize_u32(buf, o->c.value.ref);
+         buzzmsg_serialize_u8(buf, o->c.value.isnative);
+         buzzsnapshot_write_vals(w, buf, o->c.value.actrec);
+         break;
+      }
+      case BUZZTYPE_COROUTINE: {
+         buzzcoroutine_state_t c = o->r.value;
+         buzzsnapshot_write_obj(w, buf, c->closure);
+         buzzsnapshot_write_frames(buf, c->frames);
+         buzzsnapshot_write_vals(w, buf, c->stack);
+         buzzsnapshot_write_vals(w, buf, c->lsyms);
+         buzzmsg_serialize_u32(buf, c->pc);
+         buzzmsg_serialize_u8(buf, c->status);
+         buzzmsg_serialize_u32(buf, c->framebase);
+         buzzmsg_serialize_u32(buf, c->loops);
+         buzzsnapshot_write_obj(w, buf, c->prev);
+         break;
+      }
+   }
+}
+
+/*
+ * Writes the scalar content of an object.
+ */
+static void buzzsnapshot_write_head(buzzmsg_payload_t buf,
+                                    buzzobj_t o) {
+   buzzmsg_serialize_u8(buf, o->o.type);
+   switch(o->o.type) {
+      case BUZZTYPE_INT:
+      case BUZZTYPE_FLOAT:
+         /* Floats are saved bit by bit */
+         buzzmsg_serialize_u32(buf, o->i.value);
+         break;
+      case BUZZTYPE_STRING:
+         buzzmsg_serialize_u16(buf, o->s.value.sid);
+         break;
+      case BUZZTYPE_USERDATA:
+         buzzsnapshot_write_ptr(buf, o->u.value);
+         break;
+   }
+}
+
+/*
+ * Writes the output message queues.
+ */
+static void buzzsnapshot_write_outmsgs(buzzsnapshot_writer_t w,
+                                       buzzmsg_payload_t buf,
+                                       buzzoutmsg_queue_t q) {
+   int t;
+   int64_t i;
+   uint16_t j;
+   for(t = 0; t < BUZZMSG_TYPE_COUNT; ++t) {
+      buzzmsg_serialize_u32(buf, buzzdarray_size(q->queues[t]));
+      for(i = 0; i < buzzdarray_size(q->queues[t]); ++i) {
+         buzzoutmsg_t m = buzzdarray_get(q->queues[t], i, buzzoutmsg_t);
+         switch(t) {
+            case BUZZMSG_BROADCAST:
+               buzzsnapshot_write_obj(w, buf, m->bc.topic);
+               buzzsnapshot_write_obj(w, buf, m->bc.value);
+               break;
+            case BUZZMSG_SWARM_LIST:
+            case BUZZMSG_SWARM_JOIN:
+            case BUZZMSG_SWARM_LEAVE:
+               buzzmsg_serialize_u16(buf, m->sw.size);
+               for(j = 0; j < m->sw.size; ++j)
+                  buzzmsg_serialize_u16(buf, m->sw.ids[j]);
+               break;
+            case BUZZMSG_VSTIG_PUT:
+            case BUZZMSG_VSTIG_QUERY:
+               buzzmsg_serialize_u16(buf, m->vs.id);
+               buzzsnapshot_write_obj(w, buf, m->vs.key);
+               buzzsnapshot_write_obj(w, buf, m->vs.data->data);
+               buzzmsg_serialize_u16(buf, m->vs.data->timestamp);
+               buzzmsg_serialize_u16(buf, m->vs.data->robot);
+               break;
+         }
+      }
+   }
+}
+
+/****************************************/
+/****************************************/
+
+buzzsnapshot_t buzzvm_snapshot(buzzvm_t vm) {
+   /* The VM must not be running */
+   if(vm->loops) return NULL;
+   struct buzzsnapshot_writer_s w;
+   w.ids = buzzdict_new(64,
+                        sizeof(buzzobj_t),
+                        sizeof(uint32_t),
+                        buzzsnapshot_ptr_hash,
+                        buzzsnapshot_ptr_cmp,
+                        NULL);
+   w.objs = buzzdarray_new(64, sizeof(buzzobj_t), NULL);
+   struct buzzsnapshot_dict_s p;
+   p.w = &w;
+   /*
+    * Roots
+    */
+   buzzmsg_payload_t roots = buzzmsg_payload_new(1024);
+   p.buf = roots;
+   /* Registers */
+   buzzmsg_serialize_u32(roots, vm->pc);
+   buzzmsg_serialize_u32(roots, vm->oldpc);
+   buzzmsg_serialize_u32(roots, vm->sbase);
+   buzzmsg_serialize_u32(roots, vm->lbase);
+   buzzmsg_serialize_u8(roots, vm->state);
+   buzzmsg_serialize_u8(roots, vm->error);
+   buzzmsg_serialize_u8(roots, vm->errormsg != NULL);
+   if(vm->errormsg)
+      buzzsnapshot_serialize_bytes(roots, vm->errormsg, strlen(vm->errormsg));
+   buzzmsg_serialize_u32(roots, vm->yielddepth);
+   buzzsnapshot_write_obj(&w, roots, vm->coroutine);
+   buzzmsg_serialize_u16(roots, vm->swarmbroadcast);
+   /* Random number generator */
+   buzzmsg_serialize_u8(roots, vm->rngstate != NULL);
+   if(vm->rngstate) {
+      int i;
+      buzzmsg_serialize_u32(roots, vm->rngidx);
+      for(i = 0; i < BUZZMATH_RNG_SIZE; ++i)
+         buzzmsg_serialize_u32(roots, vm->rngstate[i]);
+   }
+   /* Stacks */
+   buzzsnapshot_write_frames(roots, vm->frames);
+   buzzsnapshot_write_vals(&w, roots, vm->stack);
+   buzzsnapshot_write_vals(&w, roots, vm->lsyms);
+   /* Global symbols */
+   buzzmsg_serialize_u32(roots, buzzdict_size(vm->gsyms));
+   buzzdict_foreach(vm->gsyms, buzzsnapshot_write_i32obj, &p);
+   /* Virtual stigmergy */
+   buzzmsg_serialize_u32(roots, buzzdict_size(vm->vstigs));
+   buzzdict_foreach(vm->vstigs, buzzsnapshot_write_vstig, &p);
+   /* Neighbor value listeners */
+   buzzmsg_serialize_u32(roots, buzzdict_size(vm->listeners));
+   buzzdict_foreach(vm->listeners, buzzsnapshot_write_u16obj, &p);
+   /* Swarms */
+   buzzmsg_serialize_u32(roots, buzzdict_size(vm->swarms));
+   buzzdict_foreach(vm->swarms, buzzsnapshot_write_swarm, &p);
+   buzzmsg_serialize_u32(roots, buzzdarray_size(vm->swarmstack));
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(vm->swarmstack); ++i)
+      buzzmsg_serialize_u16(roots, buzzdarray_get(vm->swarmstack, i, uint16_t));
+   buzzmsg_serialize_u32(roots, buzzdict_size(vm->swarmmembers));
+   buzzdict_foreach(vm->swarmmembers, buzzsnapshot_write_member, &p);
+   /* Message queues */
+   buzzmsg_serialize_u32(roots, buzzinmsg_queue_size(vm->inmsgs));
+   buzzdict_foreach(vm->inmsgs, buzzsnapshot_write_inmsgs, &p);
+   buzzsnapshot_write_outmsgs(&w, roots, vm->outmsgs);
+   /*
+    * Content of the objects; this finds the objects they refer to
+    */
+   buzzmsg_payload_t bodies = buzzmsg_payload_new(1024);
+   for(i = 0; i < buzzdarray_size(w.objs); ++i)
+      buzzsnapshot_write_body(&w, bodies, buzzdarray_get(w.objs, i, buzzobj_t));
+   /*
+    * Put the image together
+    */
+   buzzsnapshot_t snap = buzzmsg_payload_new(buzzdarray_size(roots) + buzzdarray_size(bodies) + 1024);
+   /* Header */
+   buzzmsg_serialize_u32(snap, BUZZSNAPSHOT_MAGIC);
+   buzzmsg_serialize_u16(snap, BUZZSNAPSHOT_VERSION);
+   buzzmsg_serialize_u16(snap, vm->robot);
+   buzzmsg_serialize_u32(snap, vm->bcode_size);
+   buzzmsg_serialize_u32(snap, buzzsnapshot_hash(vm->bcode, vm->bcode_size));
+   /* C functions */
+   buzzsnapshot_write_ptr(snap, (void*)buzzvm_snapshot);
+   buzzmsg_serialize_u32(snap, buzzdarray_size(vm->flist));
+   for(i = 0; i < buzzdarray_size(vm->flist); ++i)
+      buzzsnapshot_write_ptr(snap, (void*)buzzdarray_get(vm->flist, i, buzzvm_funp));
+   /* Strings */
+   struct buzzsnapshot_strings_s s = { .buf = buzzmsg_payload_new(1024), .count = 0 };
+   buzzstrman_foreach(vm->strings, buzzsnapshot_write_string, &s);
+   buzzmsg_serialize_u32(snap, s.count);
+   buzzsnapshot_append(snap, s.buf);
+   buzzmsg_serialize_u16(snap, vm->strings->maxsid);
+   buzzmsg_payload_destroy(&s.buf);
+   /* Objects */
+   buzzmsg_serialize_u32(snap, buzzdarray_size(w.objs));
+   for(i = 0; i < buzzdarray_size(w.objs); ++i)
+      buzzsnapshot_write_head(snap, buzzdarray_get(w.objs, i, buzzobj_t));
+   buzzsnapshot_append(snap, bodies);
+   buzzsnapshot_append(snap, roots);
+   /* Checksum */
+   buzzmsg_serialize_u32(snap, buzzsnapshot_hash((const uint8_t*)snap->data, buzzdarray_size(snap)));
+   /* Cleanup */
+   buzzmsg_payload_destroy(&bodies);
+   buzzmsg_payload_destroy(&roots);
+   buzzdarray_destroy(&w.objs);
+   buzzdict_destroy(&w.ids);
+   return snap;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * State of the snapshot reader.
+ * The reading functions do nothing once an error occurred, so the
+ * checks can be made at the end of each part.
+ */
+struct buzzsnapshot_reader_s {
+   /* The image */
+   buzzsnapshot_t buf;
+   /* The read position, -1 in case of error */
+   int64_t pos;
+   /* The VM being built */
+   buzzvm_t vm;
+   /* The objects, by index */
+   buzzobj_t* objs;
+   /* The number of objects */
+   uint32_t nobjs;
+   /* The C functions of the image (buzzvm_funp) */
+   buzzdarray_t flist;
+   /* The id in the VM of each C function of the image */
+   uint32_t* fids;
+};
+typedef struct buzzsnapshot_reader_s* buzzsnapshot_reader_t;
+
+static uint8_t buzzsnapshot_read_u8(buzzsnapshot_reader_t r) {
+   uint8_t x = 0;
+   if(r->pos >= 0) r->pos = buzzmsg_deserialize_u8(&x, r->buf, r->pos);
+   return x;
+}
+
+static uint16_t buzzsnapshot_read_u16(buzzsnapshot_reader_t r) {
+   uint16_t x = 0;
+   if(r->pos >= 0) r->pos = buzzmsg_deserialize_u16(&x, r->buf, r->pos);
+   return x;
+}
+
+static uint32_t buzzsnapshot_read_u32(buzzsnapshot_reader_t r) {
+   uint32_t x = 0;
+   if(r->pos >= 0) r->pos = buzzmsg_deserialize_u32(&x, r->buf, r->pos);
+   return x;
+}
+
+/*
+ * Reads an element count. The elements take at least 'elemsize'
+ * bytes each, so a count that does not fit the rest of the image is
+ * an error.
+ */
+static uint32_t buzzsnapshot_read_count(buzzsnapshot_reader_t r,
+                                        uint32_t elemsize) {
+   uint32_t n = buzzsnapshot_read_u32(r);
+   if(r->pos >= 0 &&
+      (uint64_t)n * elemsize > (uint64_t)(buzzdarray_size(r->buf) - r->pos)) {
+      r->pos = -1;
+      return 0;
+   }
+   return n;
+}
+
+static void* buzzsnapshot_read_ptr(buzzsnapshot_reader_t r) {
+   uint64_t p = buzzsnapshot_read_u32(r);
+   p = (p << 32) | buzzsnapshot_read_u32(r);
+   return (void*)(uintptr_t)p;
+}
+
+/*
+ * Reads a byte buffer written by buzzsnapshot_serialize_bytes().
+ * Returns a pointer into the image and sets its size.
+ */
+static const uint8_t* buzzsnapshot_read_bytes(buzzsnapshot_reader_t r,
+                                              uint32_t* size) {
+   *size = buzzsnapshot_read_count(r, 1);
+   if(r->pos < 0) return NULL;
+   const uint8_t* data = buzzdarray_getp(r->buf, r->pos, uint8_t);
+   r->pos += *size;
+   return data;
+}
+
+/*
+ * Reads a string written by buzzsnapshot_serialize_bytes().
+ * The returned string is created with malloc(), or NULL in case of error.
+ */
+static char* buzzsnapshot_read_str(buzzsnapshot_reader_t r) {
+   uint32_t size;
+   const uint8_t* data = buzzsnapshot_read_bytes(r, &size);
+   if(!data) return NULL;
+   char* str = (char*)malloc(size + 1);
+   memcpy(str, data, size);
+   str[size] = 0;
+   return str;
+}
+
+/*
+ * Reads a reference to an object.
+ * If 'type' is not BUZZTYPE_NIL, the reference can be NULL, but the
+ * object must have the given type.
+ */
+static buzzobj_t buzzsnapshot_read_obj(buzzsnapshot_reader_t r,
+                                       uint16_t type) {
+   uint32_t id = buzzsnapshot_read_u32(r);
+   if(r->pos < 0) return NULL;
+   if(id == BUZZSNAPSHOT_NONE && type != BUZZTYPE_NIL) return NULL;
+   if(id >= r->nobjs ||
+      (type != BUZZTYPE_NIL && r->objs[id]->o.type != type)) {
+      r->pos = -1;
+      return NULL;
+   }
+   return r->objs[id];
+}
+
+/*
+ * Reads a reference to an object that can be used as a key. Table keys
+ * are numbers or strings, other keys can be anything but closures.
+ */
+static buzzobj_t buzzsnapshot_read_key(buzzsnapshot_reader_t r,
+                                       int table) {
+   buzzobj_t o = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+   if(o && (o->o.type == BUZZTYPE_CLOSURE ||
+            (table && o->o.type != BUZZTYPE_INT &&
+             o->o.type != BUZZTYPE_FLOAT &&
+             o->o.type != BUZZTYPE_STRING))) {
+      r->pos = -1;
+      return NULL;
+   }
+   return o;
+}
+
+/*
+ * Reads a value written by buzzsnapshot_write_val().
+ */
+static void buzzsnapshot_read_val(buzzsnapshot_reader_t r,
+                                  buzzval_t* v) {
+   uint8_t t = buzzsnapshot_read_u8(r);
+   uint16_t type = t & ~BUZZSNAPSHOT_BOXED;
+   buzzval_setnil(*v);
+   if(r->pos < 0 || type > BUZZTYPE_COROUTINE) {
+      r->pos = -1;
+      return;
+   }
+   if(t & BUZZSNAPSHOT_BOXED) {
+      v->o = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+      if(!v->o || v->o->o.type != type) {
+         buzzval_setnil(*v);
+         r->pos = -1;
+         return;
+      }
+      v->type = type;
+      if(type == BUZZTYPE_INT || type == BUZZTYPE_FLOAT)
+         v->v.i = v->o->i.value;
+   }
+   else if(type == BUZZTYPE_INT || type == BUZZTYPE_FLOAT) {
+      v->type = type;
+      v->v.i = buzzsnapshot_read_u32(r);
+   }
+   else if(type != BUZZTYPE_NIL) {
+      /* Only nil and numbers can be unboxed */
+      r->pos = -1;
+   }
+}
+
+/*
+ * Reads a list of values into an empty array.
+ */
+static void buzzsnapshot_read_vals(buzzsnapshot_reader_t r,
+                                   buzzdarray_t vals,
+                                   uint32_t n) {
+   buzzdarray_reserve(vals, n);
+   uint32_t i;
+   for(i = 0; i < n && r->pos >= 0; ++i)
+      buzzsnapshot_read_val(r, buzzdarray_makeslot(vals, i));
+}
+
+/*
+ * Reads a list of call frames into an empty array.
+ */
+static void buzzsnapshot_read_frames(buzzsnapshot_reader_t r,
+                                     buzzdarray_t frames) {
+   uint32_t n = buzzsnapshot_read_count(r, 21);
+   uint32_t i;
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      buzzvm_frame_t f;
+      f.sbase = buzzsnapshot_read_u32(r);
+      f.cbase = buzzsnapshot_read_u32(r);
+      f.lbase = buzzsnapshot_read_u32(r);
+      f.retpc = buzzsnapshot_read_u32(r);
+      f.isswarm = buzzsnapshot_read_u8(r);
+      f.tailcalls = buzzsnapshot_read_u32(r);
+      buzzdarray_push(frames, &f);
+   }
+}
+
+/*
+ * Checks that the call frames fit stacks of the given sizes and code of
+ * the given size. The frames must be in call order.
+ */
+static void buzzsnapshot_check_frames(buzzsnapshot_reader_t r,
+                                      buzzdarray_t frames,
+                                      int64_t ssize,
+                                      int64_t lsize,
+                                      uint32_t bsize) {
+   int64_t sbase = 0, lbase = 0, i;
+   for(i = 0; i < buzzdarray_size(frames) && r->pos >= 0; ++i) {
+      const buzzvm_frame_t* f = buzzdarray_getp(frames, i, buzzvm_frame_t);
+      if(f->sbase < sbase || f->sbase > ssize ||
+         f->cbase < lbase || f->cbase > f->lbase || f->lbase > lsize ||
+         (uint32_t)f->retpc > bsize)
+         r->pos = -1;
+      sbase = f->sbase;
+      lbase = f->lbase;
+   }
+}
+
+/*
+ * Reads the strings into the string manager of the VM being built.
+ * If the VM uses the strings of a program, they must have the same ids
+ * in the image.
+ */
+static void buzzsnapshot_read_strings(buzzsnapshot_reader_t r) {
+   buzzstrman_t sm = r->vm->strings;
+   uint32_t n = buzzsnapshot_read_count(r, 7);
+   uint32_t i;
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      uint16_t sid = buzzsnapshot_read_u16(r);
+      uint8_t protect = buzzsnapshot_read_u8(r);
+      char* str = buzzsnapshot_read_str(r);
+      if(!str) break;
+      if(sm->base) {
+         const char* s = buzzstrman_get(sm->base, sid);
+         if((s && strcmp(s, str) != 0) ||
+            (!s && buzzdict_exists(sm->base->str2id, &str)))
+            r->pos = -1;
+      }
+      if(r->pos >= 0) buzzstrman_set(sm, sid, str, protect);
+      free(str);
+   }
+   /* Next string id, which must be free */
+   sm->maxsid = buzzsnapshot_read_u16(r);
+   while(!sm->maxsid || buzzstrman_get(sm, sm->maxsid)) ++sm->maxsid;
+}
+
+/*
+ * Reads the object table and makes the objects.
+ */
+static void buzzsnapshot_read_objs(buzzsnapshot_reader_t r) {
+   buzzvm_t vm = r->vm;
+   r->nobjs = buzzsnapshot_read_count(r, 1);
+   if(r->pos < 0) return;
+   r->objs = (buzzobj_t*)calloc(r->nobjs + 1, sizeof(buzzobj_t));
+   uint32_t i;
+   for(i = 0; i < r->nobjs && r->pos >= 0; ++i) {
+      uint8_t type = buzzsnapshot_read_u8(r);
+      switch(type) {
+         case BUZZTYPE_NIL:
+            r->objs[i] = buzzheap_nil(vm);
+            break;
+         case BUZZTYPE_INT:
+            r->objs[i] = buzzheap_newint(vm, (int32_t)buzzsnapshot_read_u32(r));
+            break;
+         case BUZZTYPE_FLOAT:
+            r->objs[i] = buzzheap_newobj(vm, BUZZTYPE_FLOAT);
+            r->objs[i]->i.value = buzzsnapshot_read_u32(r);
+            break;
+         case BUZZTYPE_STRING: {
+            uint16_t sid = buzzsnapshot_read_u16(r);
+            const char* str = buzzstrman_get(vm->strings, sid);
+            if(!str) {
+               r->pos = -1;
+               break;
+            }
+            r->objs[i] = buzzheap_newobj(vm, BUZZTYPE_STRING);
+            r->objs[i]->s.value.sid = sid;
+            r->objs[i]->s.value.str = str;
+            break;
+         }
+         case BUZZTYPE_USERDATA:
+            r->objs[i] = buzzheap_newobj(vm, BUZZTYPE_USERDATA);
+            r->objs[i]->u.value = buzzsnapshot_read_ptr(r);
+            break;
+         case BUZZTYPE_TABLE:
+         case BUZZTYPE_CLOSURE:
+         case BUZZTYPE_COROUTINE:
+            r->objs[i] = buzzheap_newobj(vm, type);
+            break;
+         default:
+            r->pos = -1;
+      }
+   }
+}
+
+/*
+ * Reads the content of the tables, closures and coroutines.
+ */
+static void buzzsnapshot_read_bodies(buzzsnapshot_reader_t r,
+                                     buzzvm_t target) {
+   uint32_t i, j, n;
+   for(i = 0; i < r->nobjs && r->pos >= 0; ++i) {
+      buzzobj_t o = r->objs[i];
+      switch(o->o.type) {
+         case BUZZTYPE_TABLE: {
+            o->t.holes = buzzsnapshot_read_u32(r);
+            n = buzzsnapshot_read_u32(r);
+            if(n != BUZZSNAPSHOT_NONE) {
+               /* Same check as buzzsnapshot_read_count() */
+               if(r->pos >= 0 && n > buzzdarray_size(r->buf) - r->pos) r->pos = -1;
+               if(r->pos < 0) break;
+               o->t.array = buzzdarray_new(n ? n : 1, sizeof(buzzval_t), NULL);
+               buzzsnapshot_read_vals(r, o->t.array, n);
+            }
+            n = buzzsnapshot_read_count(r, 8);
+            for(j = 0; j < n && r->pos >= 0; ++j) {
+               buzzobj_t k = buzzsnapshot_read_key(r, 1);
+               buzzobj_t v = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+               if(r->pos >= 0) buzzdict_set(o->t.value, &k, &v);
+            }
+            break;
+         }
+         case BUZZTYPE_CLOSURE: {
+            uint32_t ref = buzzsnapshot_read_u32(r);
+            o->c.value.isnative = buzzsnapshot_read_u8(r);
+            /* The code or the function must exist */
+            if(o->c.value.isnative) {
+               if(ref >= target->bcode_size) r->pos = -1;
+               o->c.value.ref = ref;
+            }
+            else {
+               if(ref >= buzzdarray_size(r->flist)) r->pos = -1;
+               else o->c.value.ref = r->fids[ref];
+            }
+            /* The activation record starts with the self table */
+            n = buzzsnapshot_read_count(r, 1);
+            if(!n) r->pos = -1;
+            buzzsnapshot_read_vals(r, o->c.value.actrec, n);
+            break;
+         }
+         case BUZZTYPE_COROUTINE: {
+            buzzcoroutine_state_t c = o->r.value;
+            c->closure = buzzsnapshot_read_obj(r, BUZZTYPE_CLOSURE);
+            buzzsnapshot_read_frames(r, c->frames);
+            buzzsnapshot_read_vals(r, c->stack, buzzsnapshot_read_count(r, 1));
+            buzzsnapshot_read_vals(r, c->lsyms, buzzsnapshot_read_count(r, 1));
+            c->pc = buzzsnapshot_read_u32(r);
+            c->status = buzzsnapshot_read_u8(r);
+            c->framebase = buzzsnapshot_read_u32(r);
+            c->loops = buzzsnapshot_read_u32(r);
+            c->prev = buzzsnapshot_read_obj(r, BUZZTYPE_COROUTINE);
+            if(c->status > BUZZCOROUTINE_DEAD ||
+               (uint32_t)c->pc > target->bcode_size)
+               r->pos = -1;
+            /* Suspended frames are relative to the saved stacks */
+            buzzsnapshot_check_frames(r, c->frames,
+                                      buzzdarray_size(c->stack),
+                                      buzzdarray_size(c->lsyms),
+                                      target->bcode_size);
+            /* A started coroutine resumes from its saved frames */
+            if(c->status == BUZZCOROUTINE_SUSPENDED && !c->closure &&
+               buzzdarray_isempty(c->frames))
+               r->pos = -1;
+            break;
+         }
+      }
+   }
+}
+
+/*
+ * Reads the state of the VM, apart from the objects.
+ */
+static void buzzsnapshot_read_roots(buzzsnapshot_reader_t r,
+                                    buzzvm_t target) {
+   buzzvm_t vm = r->vm;
+   uint32_t i, j, n, m;
+   /* Registers */
+   vm->pc = buzzsnapshot_read_u32(r);
+   vm->oldpc = buzzsnapshot_read_u32(r);
+   vm->sbase = buzzsnapshot_read_u32(r);
+   vm->lbase = buzzsnapshot_read_u32(r);
+   vm->state = buzzsnapshot_read_u8(r);
+   vm->error = buzzsnapshot_read_u8(r);
+   if(buzzsnapshot_read_u8(r)) vm->errormsg = buzzsnapshot_read_str(r);
+   vm->yielddepth = buzzsnapshot_read_u32(r);
+   vm->coroutine = buzzsnapshot_read_obj(r, BUZZTYPE_COROUTINE);
+   vm->swarmbroadcast = buzzsnapshot_read_u16(r);
+   /* Random number generator */
+   if(buzzsnapshot_read_u8(r)) {
+      vm->rngidx = buzzsnapshot_read_u32(r);
+      vm->rngstate = (int32_t*)malloc(BUZZMATH_RNG_SIZE * sizeof(int32_t));
+      for(i = 0; i < BUZZMATH_RNG_SIZE; ++i)
+         vm->rngstate[i] = buzzsnapshot_read_u32(r);
+   }
+   /* Stacks */
+   buzzdarray_clear(vm->frames, 1);
+   buzzsnapshot_read_frames(r, vm->frames);
+   buzzsnapshot_read_vals(r, vm->stack, buzzsnapshot_read_count(r, 1));
+   buzzsnapshot_read_vals(r, vm->lsyms, buzzsnapshot_read_count(r, 1));
+   /* Global symbols */
+   n = buzzsnapshot_read_count(r, 8);
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      int32_t sid = buzzsnapshot_read_u32(r);
+      buzzobj_t o = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+      if(r->pos >= 0) buzzdict_set(vm->gsyms, &sid, &o);
+   }
+   /* Virtual stigmergy */
+   n = buzzsnapshot_read_count(r, 14);
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      uint16_t id = buzzsnapshot_read_u16(r);
+      buzzvstig_t vs = buzzvstig_new();
+      buzzdict_set(vm->vstigs, &id, &vs);
+      vs->onconflict = buzzsnapshot_read_obj(r, BUZZTYPE_CLOSURE);
+      vs->onconflictlost = buzzsnapshot_read_obj(r, BUZZTYPE_CLOSURE);
+      m = buzzsnapshot_read_count(r, 12);
+      for(j = 0; j < m && r->pos >= 0; ++j) {
+         buzzobj_t k = buzzsnapshot_read_key(r, 0);
+         buzzobj_t v = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+         uint16_t ts = buzzsnapshot_read_u16(r);
+         uint16_t robot = buzzsnapshot_read_u16(r);
+         if(r->pos < 0) break;
+         buzzvstig_elem_t e = buzzvstig_elem_new(v, ts, robot);
+         buzzvstig_store(vs, &k, &e);
+      }
+   }
+   /* Neighbor value listeners */
+   n = buzzsnapshot_read_count(r, 6);
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      uint16_t id = buzzsnapshot_read_u16(r);
+      buzzobj_t o = buzzsnapshot_read_obj(r, BUZZTYPE_CLOSURE);
+      if(r->pos >= 0) buzzdict_set(vm->listeners, &id, &o);
+   }
+   /* Swarms */
+   n = buzzsnapshot_read_count(r, 3);
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      uint16_t id = buzzsnapshot_read_u16(r);
+      uint8_t in = buzzsnapshot_read_u8(r);
+      if(r->pos >= 0) buzzdict_set(vm->swarms, &id, &in);
+   }
+   n = buzzsnapshot_read_count(r, 2);
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      uint16_t id = buzzsnapshot_read_u16(r);
+      buzzdarray_push(vm->swarmstack, &id);
+   }
+   n = buzzsnapshot_read_count(r, 8);
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      uint16_t robot = buzzsnapshot_read_u16(r);
+      uint16_t age = buzzsnapshot_read_u16(r);
+      m = buzzsnapshot_read_count(r, 2);
+      if(r->pos < 0) break;
+      buzzdarray_t swarms = buzzdarray_new(m ? m : 1, sizeof(uint16_t), NULL);
+      for(j = 0; j < m; ++j) {
+         uint16_t id = buzzsnapshot_read_u16(r);
+         buzzdarray_push(swarms, &id);
+      }
+      buzzswarm_members_refresh(vm->swarmmembers, robot, swarms);
+      (*buzzdict_get(vm->swarmmembers, &robot, buzzswarm_elem_t))->age = age;
+   }
+   /* Input messages, appended in the same order */
+   n = buzzsnapshot_read_count(r, 6);
+   for(i = 0; i < n && r->pos >= 0; ++i) {
+      uint16_t rid = buzzsnapshot_read_u16(r);
+      m = buzzsnapshot_read_count(r, 4);
+      for(j = 0; j < m && r->pos >= 0; ++j) {
+         uint32_t size;
+         const uint8_t* data = buzzsnapshot_read_bytes(r, &size);
+         if(data) buzzinmsg_queue_append(vm, rid, buzzmsg_payload_frombuffer(data, size));
+      }
+   }
+   /* Output messages */
+   buzzoutmsg_queue_t q = vm->outmsgs;
+   int t;
+   for(t = 0; t < BUZZMSG_TYPE_COUNT && r->pos >= 0; ++t) {
+      n = buzzsnapshot_read_count(r, 2);
+      for(i = 0; i < n && r->pos >= 0; ++i) {
+         switch(t) {
+            case BUZZMSG_BROADCAST: {
+               buzzobj_t topic = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+               buzzobj_t value = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+               if(r->pos >= 0) buzzoutmsg_queue_append_broadcast(vm, topic, value);
+               break;
+            }
+            case BUZZMSG_SWARM_LIST:
+            case BUZZMSG_SWARM_JOIN:
+            case BUZZMSG_SWARM_LEAVE: {
+               /* The append functions merge these messages, make them as they are */
+               uint16_t size = buzzsnapshot_read_u16(r);
+               if(r->pos < 0) break;
+               buzzoutmsg_t msg = (buzzoutmsg_t)malloc(sizeof(union buzzoutmsg_u));
+               msg->sw.type = t;
+               msg->sw.size = size;
+               msg->sw.ids = (uint16_t*)malloc((size ? size : 1) * sizeof(uint16_t));
+               for(j = 0; j < size; ++j) msg->sw.ids[j] = buzzsnapshot_read_u16(r);
+               buzzdarray_push(q->queues[t], &msg);
+               break;
+            }
+            case BUZZMSG_VSTIG_PUT:
+            case BUZZMSG_VSTIG_QUERY: {
+               uint16_t id = buzzsnapshot_read_u16(r);
+               buzzobj_t k = buzzsnapshot_read_key(r, 0);
+               buzzobj_t v = buzzsnapshot_read_obj(r, BUZZTYPE_NIL);
+               uint16_t ts = buzzsnapshot_read_u16(r);
+               uint16_t robot = buzzsnapshot_read_u16(r);
+               if(r->pos < 0) break;
+               buzzvstig_elem_t e = buzzvstig_elem_new(v, ts, robot);
+               buzzoutmsg_queue_append_vstig(vm, t, id, k, e);
+               free(e);
+               break;
+            }
+         }
+      }
+   }
+   /* The registers and the frames must fit the stacks and the code */
+   if(r->pos >= 0 &&
+      (buzzdarray_isempty(vm->frames) ||
+       (uint32_t)vm->pc > target->bcode_size ||
+       (uint32_t)vm->oldpc > target->bcode_size ||
+       vm->sbase > buzzdarray_size(vm->stack) ||
+       vm->lbase > buzzdarray_size(vm->lsyms) ||
+       vm->yielddepth > buzzdarray_size(vm->frames) ||
+       vm->state > BUZZVM_STATE_YIELDED))
+      r->pos = -1;
+   buzzsnapshot_check_frames(r, vm->frames,
+                             buzzdarray_size(vm->stack),
+                             buzzdarray_size(vm->lsyms),
+                             target->bcode_size);
+   /* The running coroutines start within the call stack, each one above
+    * the coroutine that resumed it */
+   buzzobj_t co;
+   int64_t top = buzzdarray_size(vm->frames);
+   for(co = vm->coroutine; co && r->pos >= 0; co = co->r.value->prev) {
+      if(co->r.value->status != BUZZCOROUTINE_RUNNING ||
+         co->r.value->framebase >= top)
+         r->pos = -1;
+      top = co->r.value->framebase;
+   }
+}
+
+/*
+ * Reads the C functions of the image, and finds their ids in the VM.
+ * Function pointers are only meaningful in the process that took the
+ * snapshot. In that process, the functions are looked up by pointer,
+ * and those the VM does not know yet get the next ids. In another
+ * process, the VM must have registered the same functions in the same
+ * order, and the ids are kept.
+ */
+static int buzzsnapshot_read_funs(buzzsnapshot_reader_t r,
+                                  buzzvm_t vm) {
+   int sameproc = buzzsnapshot_read_ptr(r) == (void*)buzzvm_snapshot;
+   uint32_t n = buzzsnapshot_read_count(r, 8);
+   if(r->pos < 0 || (!sameproc && n > buzzdarray_size(vm->flist)))
+      return 0;
+   r->flist = buzzdarray_new(n ? n : 1, sizeof(buzzvm_funp), NULL);
+   r->fids = (uint32_t*)malloc((n ? n : 1) * sizeof(uint32_t));
+   uint32_t next = buzzdarray_size(vm->flist), i, j;
+   for(i = 0; i < n; ++i) {
+      buzzvm_funp f = (buzzvm_funp)buzzsnapshot_read_ptr(r);
+      buzzdarray_push(r->flist, &f);
+      if(!sameproc) {
+         r->fids[i] = i;
+         continue;
+      }
+      for(j = 0; j < buzzdarray_size(vm->flist) &&
+             buzzdarray_get(vm->flist, j, buzzvm_funp) != f; ++j);
+      r->fids[i] = (j < buzzdarray_size(vm->flist)) ? j : next++;
+   }
+   return 1;
+}
+
+/*
+ * Exchanges a field of two VMs.
+ */
+#define buzzsnapshot_swap(a, b, field)                  \
+   {                                                    \
+      uint8_t t[sizeof((a)->field)];                    \
+      memcpy(t, &(a)->field, sizeof(t));                \
+      memcpy(&(a)->field, &(b)->field, sizeof(t));      \
+      memcpy(&(b)->field, t, sizeof(t));                \
+   }
+
+int buzzvm_restore(buzzvm_t vm,
+                   buzzsnapshot_t snap) {
+   /* The VM must not be running */
+   if(vm->loops) return 0;
+   struct buzzsnapshot_reader_s r = {
+      .buf = snap, .pos = 0, .vm = NULL, .objs = NULL, .nobjs = 0,
+      .flist = NULL, .fids = NULL
+   };
+   /* Check that the image is whole */
+   uint32_t size = buzzdarray_size(snap);
+   uint32_t sum;
+   if(size < sizeof(uint32_t) ||
+      buzzmsg_deserialize_u32(&sum, snap, size - sizeof(uint32_t)) < 0 ||
+      sum != buzzsnapshot_hash((const uint8_t*)snap->data, size - sizeof(uint32_t)))
+      return 0;
+   /* Check that the image was made for this code */
+   if(buzzsnapshot_read_u32(&r) != BUZZSNAPSHOT_MAGIC ||
+      buzzsnapshot_read_u16(&r) != BUZZSNAPSHOT_VERSION)
+      return 0;
+   uint16_t robot = buzzsnapshot_read_u16(&r);
+   if(buzzsnapshot_read_u32(&r) != vm->bcode_size ||
+      buzzsnapshot_read_u32(&r) != buzzsnapshot_hash(vm->bcode, vm->bcode_size) ||
+      r.pos < 0)
+      return 0;
+   if(!buzzsnapshot_read_funs(&r, vm)) return 0;
+   /*
+    * Build the state in a new VM, so nothing changes in case of error
+    */
+   r.vm = buzzvm_new(robot);
+   if(vm->strings->base) {
+      buzzstrman_destroy(&r.vm->strings);
+      r.vm->strings = buzzstrman_overlay_new(vm->strings->base);
+   }
+   /* No collection while building, the objects go straight to the old generation */
+   buzzheap_setnursery(r.vm, 0);
+   buzzsnapshot_read_strings(&r);
+   buzzsnapshot_read_objs(&r);
+   buzzsnapshot_read_bodies(&r, vm);
+   buzzsnapshot_read_roots(&r, vm);
+   free(r.objs);
+   if(r.pos != size - sizeof(uint32_t)) {
+      free(r.vm->errormsg);
+      buzzvm_destroy(&r.vm);
+      buzzdarray_destroy(&r.flist);
+      free(r.fids);
+      return 0;
+   }
+   /* Register the functions the VM did not know */
+   uint32_t i;
+   for(i = 0; i < buzzdarray_size(r.flist); ++i)
+      if(r.fids[i] >= buzzdarray_size(vm->flist))
+         buzzvm_function_register(vm, buzzdarray_get(r.flist, i, buzzvm_funp));
+   buzzdarray_destroy(&r.flist);
+   free(r.fids);
+   /* Collect when the heap doubles, as after a full collection */
+   buzzheap_t h = r.vm->heap;
+   h->nursery = vm->heap->nursery;
+   h->budget = vm->heap->budget;
+   if(buzzdarray_size(h->objs) >= h->max_objs)
+      h->max_objs = 2 * buzzdarray_size(h->objs);
+   h->gcpending = 0;
+   /*
+    * Give the new state to the VM, and get rid of the old one
+    */
+   buzzsnapshot_swap(vm, r.vm, pc);
+   buzzsnapshot_swap(vm, r.vm, oldpc);
+   buzzsnapshot_swap(vm, r.vm, stack);
+   buzzsnapshot_swap(vm, r.vm, lsyms);
+   buzzsnapshot_swap(vm, r.vm, frames);
+   buzzsnapshot_swap(vm, r.vm, sbase);
+   buzzsnapshot_swap(vm, r.vm, lbase);
+   buzzsnapshot_swap(vm, r.vm, gsyms);
+   buzzsnapshot_swap(vm, r.vm, strings);
+   buzzsnapshot_swap(vm, r.vm, heap);
+   buzzsnapshot_swap(vm, r.vm, swarms);
+   buzzsnapshot_swap(vm, r.vm, swarmstack);
+   buzzsnapshot_swap(vm, r.vm, swarmmembers);
+   buzzsnapshot_swap(vm, r.vm, swarmbroadcast);
+   buzzsnapshot_swap(vm, r.vm, inmsgs);
+   buzzsnapshot_swap(vm, r.vm, outmsgs);
+   buzzsnapshot_swap(vm, r.vm, vstigs);
+   buzzsnapshot_swap(vm, r.vm, listeners);
+   buzzsnapshot_swap(vm, r.vm, state);
+   buzzsnapshot_swap(vm, r.vm, error);
+   buzzsnapshot_swap(vm, r.vm, errormsg);
+   buzzsnapshot_swap(vm, r.vm, robot);
+   buzzsnapshot_swap(vm, r.vm, rngstate);
+   buzzsnapshot_swap(vm, r.vm, rngidx);
+   buzzsnapshot_swap(vm, r.vm, yielddepth);
+   buzzsnapshot_swap(vm, r.vm, coroutine);
+   free(r.vm->errormsg);
+   buzzvm_destroy(&r.vm);
+   return 1;
+}
+
+/****************************************/
+/****************************************/
+
+void buzzsnapshot_destroy(buzzsnapshot_t* snap) {
+   buzzmsg_payload_destroy(snap);
+}
+
+/****************************************/
+/****************************************/
+
+int buzzsnapshot_tofile(const char* fname,
+                        buzzsnapshot_t snap) {
+   FILE* fd = fopen(fname, "wb");
+   if(!fd) return 0;
+   int ok =
+      fwrite(snap->data, 1, buzzmsg_payload_size(snap), fd) == buzzmsg_payload_size(snap);
+   if(fclose(fd) != 0) ok = 0;
+   return ok;
+}
+
+/****************************************/
+/****************************************/
+
+buzzsnapshot_t buzzsnapshot_fromfile(const char* fname) {
+   FILE* fd = fopen(fname, "rb");
+   if(!fd) return NULL;
+   buzzsnapshot_t snap = buzzmsg_payload_new(4096);
+   uint8_t buf[4096];
+   size_t n;
+   while((n = fread(buf, 1, sizeof(buf), fd)) > 0) {
+      buzzdarray_reserve(snap, buzzdarray_size(snap) + n);
+      memcpy(buzzdarray_getp(snap, buzzdarray_size(snap), uint8_t), buf, n);
+      snap->size += n;
+   }
+   if(ferror(fd)) buzzsnapshot_destroy(&snap);
+   fclose(fd);
+   return snap;
+}
+
+/****************************************/
+/****************************************/
@@ -0,0 +1,88 @@
+#ifndef BUZZSNAPSHOT_H
+#define BUZZSNAPSHOT_H
+
+#include <buzz/buzzvm.h>
+
+/*
+ * VM snapshots.
+ *
+ * A snapshot is a binary image of the state of a VM: the strings, the
+ * objects reachable from the VM, the global symbols, the stacks and
+ * call frames, the virtual stigmergies, the neighbor value listeners,
+ * the swarm data, the message queues and the random number generator.
+ * Objects are numbered in the image, and references between them are
+ * turned back into pointers when the snapshot is restored.
+ *
+ * The code is not part of the image. A snapshot can be restored into
+ * any VM that runs the same bytecode. C functions and user data are
+ * saved as raw pointers. In the process that took the snapshot, C
+ * closures are matched to the functions of the VM by pointer. In
+ * another process, the VM must have registered the same C functions
+ * in the same order, and the user data must be set again by the host.
+ *
+ * The image is in network byte order and ends with a checksum. It can
+ * be saved to a file, for instance to checkpoint a long run and resume
+ * it later. Corrupted images and images made for other code are
+ * rejected, but the content of an image is trusted like the memory of
+ * the VM: a crafted image can still describe an invalid state.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   /*
+    * A snapshot is a byte buffer.
+    */
+   typedef buzzmsg_payload_t buzzsnapshot_t;
+
+   /*
+    * Takes a snapshot of the state of a VM.
+    * The VM can be ready, done, yielded or in error, but it can't be
+    * running: a snapshot can't be taken from within a C function.
+    * @param vm The VM data.
+    * @return The snapshot, or NULL if the VM is running.
+    */
+   extern buzzsnapshot_t buzzvm_snapshot(buzzvm_t vm);
+
+   /*
+    * Sets the state of a VM to that of a snapshot.
+    * The current state of the VM is discarded. The VM keeps its
+    * bytecode, its registered functions and its compiled code. If the
+    * snapshot does not fit the VM, or if it is corrupted, the VM is
+    * left untouched.
+    * @param vm The VM data.
+    * @param snap The snapshot.
+    * @return 1 if the snapshot was restored, 0 otherwise.
+    */
+   extern int buzzvm_restore(buzzvm_t vm,
+                             buzzsnapshot_t snap);
+
+   /*
+    * Destroys a snapshot.
+    * @param snap The snapshot.
+    */
+   extern void buzzsnapshot_destroy(buzzsnapshot_t* snap);
+
+   /*
+    * Saves a snapshot to a file.
+    * @param fname The file name.
+    * @param snap The snapshot.
+    * @return 1 if the snapshot was saved, 0 otherwise.
+    */
+   extern int buzzsnapshot_tofile(const char* fname,
+                                  buzzsnapshot_t snap);
+
+   /*
+    * Loads a snapshot from a file.
+    * The content is checked when the snapshot is restored.
+    * @param fname The file name.
+    * @return The snapshot, or NULL in case of error.
+    */
+   extern buzzsnapshot_t buzzsnapshot_fromfile(const char* fname);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
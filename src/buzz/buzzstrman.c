@@ -29,9 +29,7 @@ static buzzid2strdata_t buzzid2strdata_new(char* str,
 static void buzzid2strdata_destroy(const void* key,
                                    void* data,
                                    void* params) {
-   free((void*)key);
    free(*(buzzid2strdata_t*)data);
-   free(data);
 }
 
 /****************************************/
@@ -164,6 +162,18 @@ buzzstrman_t buzzstrman_new() {
                             buzzid2strdata_destroy);
    x->maxsid = 0;
    x->gcdata = NULL;
+   x->base = NULL;
+   return x;
+}
+
+/****************************************/
+/****************************************/
+
+buzzstrman_t buzzstrman_overlay_new(buzzstrman_t base) {
+   buzzstrman_t x = buzzstrman_new();
+   x->base = base;
+   /* New ids go after those of the base */
+   x->maxsid = base->maxsid;
    return x;
 }
 
@@ -191,8 +201,14 @@ void buzzstrman_destroy(buzzstrman_t* sm) {
 uint16_t buzzstrman_register(buzzstrman_t sm,
                              const char* str,
                              int protect) {
+   /* Look for the id in the base strings, they are all protected */
+   const uint16_t* id;
+   if(sm->base) {
+      id = buzzdict_get(sm->base->str2id, &str, uint16_t);
+      if(id) return *id;
+   }
    /* Look for the id */
-   const uint16_t* id = buzzdict_get(sm->str2id, &str, uint16_t);
+   id = buzzdict_get(sm->str2id, &str, uint16_t);
    /* Found? */
    if(id) {
       /* Yes; is the passed 'protect' flag set? */
@@ -212,7 +228,8 @@ uint16_t buzzstrman_register(buzzstrman_t sm,
    if( !sm->maxsid ) ++sm->maxsid;
 
    /* Avoid overwriting existing strings */
-   while(buzzdict_get(sm->id2str, &sm->maxsid, buzzid2strdata_t))
+   while(buzzdict_get(sm->id2str, &sm->maxsid, buzzid2strdata_t) ||
+         (sm->base && buzzdict_get(sm->base->id2str, &sm->maxsid, buzzid2strdata_t)))
      ++sm->maxsid;
 
    char* str2 = strdup(str);
@@ -225,10 +242,53 @@ uint16_t buzzstrman_register(buzzstrman_t sm,
 /****************************************/
 /****************************************/
 
+void buzzstrman_set(buzzstrman_t sm,
+                    uint16_t sid,
+                    const char* str,
+                    int protect) {
+   /* Nothing to do for the strings of the base */
+   if(sm->base) {
+      const char* s = buzzstrman_get(sm->base, sid);
+      if(s && strcmp(s, str) == 0) return;
+   }
+   char* str2 = strdup(str);
+   buzzid2strdata_t sd = buzzid2strdata_new(str2, protect);
+   buzzdict_set(sm->str2id, &str2, &sid);
+   buzzdict_set(sm->id2str, &sid, &sd);
+}
+
+/****************************************/
+/****************************************/
+
+struct buzzstrman_foreach_s {
+   buzzstrman_funp fun;
+   void* params;
+};
+
+static void buzzstrman_foreach_id2str(const void* key,
+                                      void* data,
+                                      void* params) {
+   struct buzzstrman_foreach_s* p = (struct buzzstrman_foreach_s*)params;
+   buzzid2strdata_t sd = *(buzzid2strdata_t*)data;
+   p->fun(*(uint16_t*)key, sd->str, sd->protect, p->params);
+}
+
+void buzzstrman_foreach(buzzstrman_t sm,
+                        buzzstrman_funp fun,
+                        void* params) {
+   if(sm->base) buzzstrman_foreach(sm->base, fun, params);
+   struct buzzstrman_foreach_s p = { .fun = fun, .params = params };
+   buzzdict_foreach(sm->id2str, buzzstrman_foreach_id2str, &p);
+}
+
+/****************************************/
+/****************************************/
+
 const char* buzzstrman_get(buzzstrman_t sm,
                            uint16_t sid) {
    const buzzid2strdata_t* x = buzzdict_get(sm->id2str, &sid, buzzid2strdata_t);
    if(x) return (*x)->str;
+   if(sm->base) return buzzstrman_get(sm->base, sid);
    return NULL;
 }
 
@@ -313,6 +373,10 @@ void buzzstrman_print_str2id(const void* key,
 }
 
 void buzzstrman_print(buzzstrman_t sm) {
+   if(sm->base) {
+      printf("BASE ");
+      buzzstrman_print(sm->base);
+   }
    printf("ID -> STRING (%" PRIu32 " elements)\n", buzzdict_size(sm->id2str));
    buzzdict_foreach(sm->id2str, buzzstrman_print_id2str, sm);
    printf("STRING -> ID (%" PRIu32 " elements)\n", buzzdict_size(sm->str2id));
@@ -12,6 +12,7 @@ extern "C" {
       buzzdict_t id2str;  /* id -> string data */
       uint16_t maxsid;    /* maximum string id ever assigned */
       void* gcdata;       /* pointer to data for garbage collection */
+      struct buzzstrman_s* base; /* frozen strings shared with other managers, or NULL */
    };
    typedef struct buzzstrman_s* buzzstrman_t;
 
@@ -21,6 +22,18 @@ extern "C" {
     */
    extern buzzstrman_t buzzstrman_new();
 
+   /**
+    * Creates a new string manager on top of a frozen one.
+    * The strings of the base manager are found as if they were
+    * registered in the new one, and new strings get ids the base
+    * manager does not use. The base manager is never modified, so it
+    * can be shared by many managers, and must be disposed of after
+    * them.
+    * @param base The frozen string manager.
+    * @return A new string manager.
+    */
+   extern buzzstrman_t buzzstrman_overlay_new(buzzstrman_t base);
+
    /**
     * Disposes of a string manager.
     * @param sm The string manager.
@@ -34,6 +47,7 @@ extern "C" {
     * returned. Only one copy of each string is kept.
     * If a previously unprotected string is re-registered as
     * protected, the protected flag is set.
+    * The strings of the base manager, if any, are always protected.
     * @param sm The string manager.
     * @param str The string.
     * @param protect Whether the string is protected (!= 0) or not (== 0).
@@ -43,6 +57,36 @@ extern "C" {
                                        const char* str,
                                        int protect);
 
+   /*
+    * Registers a string with the given id.
+    * This is meant to rebuild a string manager, as when restoring a
+    * snapshot: the id must not be in use. Nothing is done if the base
+    * manager already has the string with that id.
+    * @param sm The string manager.
+    * @param sid The id of the string.
+    * @param str The string.
+    * @param protect Whether the string is protected (!= 0) or not (== 0).
+    */
+   extern void buzzstrman_set(buzzstrman_t sm,
+                              uint16_t sid,
+                              const char* str,
+                              int protect);
+
+   /*
+    * Function pointer for buzzstrman_foreach().
+    */
+   typedef void (*buzzstrman_funp)(uint16_t sid, const char* str, int protect, void* params);
+
+   /*
+    * Calls a function for each string, base manager included.
+    * @param sm The string manager.
+    * @param fun The function to call.
+    * @param params A buffer to pass along.
+    */
+   extern void buzzstrman_foreach(buzzstrman_t sm,
+                                  buzzstrman_funp fun,
+                                  void* params);
+
    /*
     * Get the string corresponding to the given string id.
     * @param sm The string manager.
@@ -68,7 +112,7 @@ extern "C" {
    
    /*
     * Performs garbage collection on the unmarked strings.
-    * The strings whose id is lower than the protected id are exempt
+    * The protected strings and those of the base manager are exempt
     * from garbage collection.
     * @param sm The string manager.
     */
@@ -21,16 +21,6 @@
 /****************************************/
 /****************************************/
 
-/*
- * An element in the data structure that stores robot
- * membership data.
- */
-struct buzzswarm_elem_s {
-   buzzdarray_t swarms;
-   uint16_t age;
-};
-typedef struct buzzswarm_elem_s* buzzswarm_elem_t;
-
 buzzswarm_elem_t buzzswarm_elem_new() {
    buzzswarm_elem_t e = (buzzswarm_elem_t)malloc(sizeof(struct buzzswarm_elem_s));
    e->swarms = buzzdarray_new(1, sizeof(uint16_t), NULL);
@@ -42,8 +32,6 @@ void buzzswarm_elem_destroy(const void* key, void* data, void* params) {
    buzzswarm_elem_t e = *(buzzswarm_elem_t*)data;
    buzzdarray_destroy(&(e->swarms));
    free(e);
-   free((void*)key);
-   free(data);
 }
 
 /****************************************/
@@ -498,18 +486,16 @@ int buzzswarm_exec(buzzvm_t vm) {
       buzzobj_t c = buzzvm_stack_at(vm, 1);
       /* Get rid of the current call structure */
       if(buzzvm_ret0(vm) != BUZZVM_STATE_READY) return vm->state;
-      /* Save the current stack depth */
-      uint32_t stacks = buzzdarray_size(vm->stacks);
+      /* Save the current call depth */
+      uint32_t depth = buzzvm_frame_count(vm);
       /* Push the current swarm in the stack */
       buzzdarray_push(vm->swarmstack, &id);
       /* Call the closure */
       buzzvm_push(vm, c);
       int32_t numargs = 0;
       buzzvm_pushi(vm, numargs);
-      buzzvm_calls(vm);
-      do if(buzzvm_step(vm) != BUZZVM_STATE_READY) return vm->state;
-      while(stacks < buzzdarray_size(vm->stacks));
-      return vm->state;
+      if(buzzvm_calls(vm) != BUZZVM_STATE_READY) return vm->state;
+      return buzzvm_run_to_depth(vm, depth);
    }
    else {
       /* Get rid of the current call structure */
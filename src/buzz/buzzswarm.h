@@ -13,8 +13,21 @@ extern "C" {
     */
    struct buzzvm_s;
 
+   /*
+    * An element in the data structure that stores robot
+    * membership data.
+    */
+   struct buzzswarm_elem_s {
+      /* The swarms the robot is a member of (uint16_t) */
+      buzzdarray_t swarms;
+      /* The number of updates since the robot was last heard of */
+      uint16_t age;
+   };
+   typedef struct buzzswarm_elem_s* buzzswarm_elem_t;
+
    /*
     * Data type for the robot membership data structure.
+    * It maps robot ids (uint16_t) to buzzswarm_elem_t.
     */
    typedef buzzdict_t buzzswarm_members_t;
 
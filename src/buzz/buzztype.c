@@ -1,4 +1,5 @@
 #include "buzzvm.h"
+#include "buzzcoroutine.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,9 +7,9 @@
 /****************************************/
 /****************************************/
 
-#define BUZZTYPE_TABLE_BUCKETS 10
+#define BUZZTYPE_TABLE_CAPACITY 4
 
-const char *buzztype_desc[] = { "nil", "integer", "float", "string", "table", "closure", "userdata" };
+const char *buzztype_desc[] = { "nil", "integer", "float", "string", "table", "closure", "userdata", "coroutine" };
 
 /****************************************/
 /****************************************/
@@ -17,13 +18,14 @@ uint32_t buzzobj_table_hash(const void* key) {
    buzzobj_t k = *(buzzobj_t*)key;
    switch(k->o.type) {
       case BUZZTYPE_INT: {
-         return (k->i.value % BUZZTYPE_TABLE_BUCKETS);
+         return (uint32_t)(k->i.value);
       }
       case BUZZTYPE_FLOAT: {
-         return ((uint32_t)(k->f.value) % BUZZTYPE_TABLE_BUCKETS);
+         /* Must match the hash of an equal integer */
+         return (uint32_t)(int32_t)(k->f.value);
       }
       case BUZZTYPE_STRING: {
-         return ((uint32_t)(k->s.value.sid) % BUZZTYPE_TABLE_BUCKETS);
+         return (uint32_t)(k->s.value.sid);
       }
       default:
          fprintf(stderr, "Can't use a %s value as table key\n", buzztype_desc[k->o.type]);
@@ -32,42 +34,65 @@ uint32_t buzzobj_table_hash(const void* key) {
 }
 
 int buzzobj_table_keycmp(const void* a, const void* b) {
-   return buzzobj_cmp(*(buzzobj_t*)a, *(buzzobj_t*)b);
+   buzzobj_t x = *(buzzobj_t*)a;
+   buzzobj_t y = *(buzzobj_t*)b;
+   if(x == y) return 0;
+   /* Strings are interned, so equal strings have equal ids */
+   if(x->o.type == BUZZTYPE_STRING || y->o.type == BUZZTYPE_STRING) {
+      if(x->o.type != y->o.type) return 1;
+      return (int)x->s.value.sid - (int)y->s.value.sid;
+   }
+   if(x->o.type == BUZZTYPE_INT && y->o.type == BUZZTYPE_INT)
+      return (x->i.value > y->i.value) - (x->i.value < y->i.value);
+   return buzzobj_cmp(x, y);
 }
 
 buzzobj_t buzzobj_new(uint16_t type) {
    /* Create a new object. calloc() fills it with zeroes */
    buzzobj_t o = (buzzobj_t)calloc(1, sizeof(union buzzobj_u));
+   /* Initialize it */
+   buzzobj_init(o, type);
+   /* All done */
+   return o;
+}
+
+/****************************************/
+/****************************************/
+
+void buzzobj_init(buzzobj_t o, uint16_t type) {
    /* Set the object type */
    o->o.type = type;
    /* Set the object marker */
    o->o.marker = 0;
    /* Take care of special initialization for specific types */
    if(type == BUZZTYPE_TABLE) {
-      o->t.value = buzzdict_new(BUZZTYPE_TABLE_BUCKETS,
+      o->t.value = buzzdict_new(BUZZTYPE_TABLE_CAPACITY,
                                 sizeof(buzzobj_t),
                                 sizeof(buzzobj_t),
                                 buzzobj_table_hash,
                                 buzzobj_table_keycmp,
                                 NULL);
+      /* The array part is created on demand */
+      o->t.array = NULL;
+      o->t.holes = 0;
    }
    else if(type == BUZZTYPE_CLOSURE) {
-      o->c.value.actrec = buzzdarray_new(1, sizeof(buzzobj_t), NULL);
+      o->c.value.actrec = buzzdarray_new(1, sizeof(buzzval_t), NULL);
+   }
+   else if(type == BUZZTYPE_COROUTINE) {
+      buzzcoroutine_state_t c = (buzzcoroutine_state_t)calloc(1, sizeof(struct buzzcoroutine_s));
+      c->frames = buzzdarray_new(1, sizeof(buzzvm_frame_t), NULL);
+      c->stack = buzzdarray_new(1, sizeof(buzzval_t), NULL);
+      c->lsyms = buzzdarray_new(1, sizeof(buzzval_t), NULL);
+      o->r.value = c;
    }
-   /* All done */
-   return o;
 }
 
 /****************************************/
 /****************************************/
 
 void buzzobj_destroy(buzzobj_t* o) {
-   if((*o)->o.type == BUZZTYPE_TABLE) {
-      buzzdict_destroy(&((*o)->t.value));
-   }
-   else if((*o)->o.type == BUZZTYPE_CLOSURE) {
-      buzzdarray_destroy(&((*o)->c.value.actrec));
-   }
+   buzzobj_fini(*o);
    free(*o);
    *o = NULL;
 }
@@ -75,6 +100,25 @@ void buzzobj_destroy(buzzobj_t* o) {
 /****************************************/
 /****************************************/
 
+void buzzobj_fini(buzzobj_t o) {
+   if(o->o.type == BUZZTYPE_TABLE) {
+      buzzdict_destroy(&(o->t.value));
+      if(o->t.array) buzzdarray_destroy(&(o->t.array));
+   }
+   else if(o->o.type == BUZZTYPE_CLOSURE) {
+      buzzdarray_destroy(&(o->c.value.actrec));
+   }
+   else if(o->o.type == BUZZTYPE_COROUTINE) {
+      buzzdarray_destroy(&(o->r.value->frames));
+      buzzdarray_destroy(&(o->r.value->stack));
+      buzzdarray_destroy(&(o->r.value->lsyms));
+      free(o->r.value);
+   }
+}
+
+/****************************************/
+/****************************************/
+
 uint32_t buzzobj_hash(const buzzobj_t o) {
    switch(o->o.type) {
       case BUZZTYPE_NIL: {
@@ -88,7 +132,8 @@ uint32_t buzzobj_hash(const buzzobj_t o) {
          return buzzdict_int32keyhash(&x);
       }
       case BUZZTYPE_STRING: {
-         return buzzdict_strkeyhash(&(o->s.value.str));
+         /* Strings are interned, so the id identifies the string */
+         return buzzdict_uint16keyhash(&(o->s.value.sid));
       }
       case BUZZTYPE_TABLE: {
          uint32_t p = (uintptr_t)(o->t.value);
@@ -98,6 +143,10 @@ uint32_t buzzobj_hash(const buzzobj_t o) {
          uint32_t p = (uintptr_t)(o->u.value);
          return buzzdict_uint32keyhash(&p);
       }
+      case BUZZTYPE_COROUTINE: {
+         uint32_t p = (uintptr_t)(o->r.value);
+         return buzzdict_uint32keyhash(&p);
+      }
       case BUZZTYPE_CLOSURE:
       default:
          fprintf(stderr, "[BUG] %s:%d: Hash for Buzz object type %d\n", __FILE__, __LINE__, o->o.type);
@@ -117,13 +166,14 @@ int buzzobj_eq(const buzzobj_t a,
       case BUZZTYPE_NIL:    return 1;
       case BUZZTYPE_INT:    return (a->i.value == b->i.value);
       case BUZZTYPE_FLOAT:  return (a->f.value == b->f.value);
-      case BUZZTYPE_STRING: return 0; // TODO
+      case BUZZTYPE_STRING: return (a->s.value.sid == b->s.value.sid);
       case BUZZTYPE_TABLE:  return ((uintptr_t)(a->t.value) == (uintptr_t)(b->t.value));
       case BUZZTYPE_CLOSURE:
          return((a->c.value.isnative == b->c.value.isnative) &&
                 (a->c.value.ref      == b->c.value.ref)      &&
                 (a->c.value.actrec   == b->c.value.actrec));
       case BUZZTYPE_USERDATA: return ((uintptr_t)(a->u.value) == (uintptr_t)(b->u.value));
+      case BUZZTYPE_COROUTINE: return (a->r.value == b->r.value);
       default:
          fprintf(stderr, "[BUG] %s:%d: Equality test between wrong Buzz objects types %d and %d\n", __FILE__, __LINE__, a->o.type, b->o.type);
          abort();
@@ -165,6 +215,7 @@ int buzzobj_cmp(const buzzobj_t a,
    }
    /* String and other types */
    if(a->o.type == BUZZTYPE_STRING && b->o.type == BUZZTYPE_STRING) {
+      if(a->s.value.sid == b->s.value.sid) return 0;
       return strcmp(a->s.value.str, b->s.value.str);
    }
 
@@ -211,6 +262,12 @@ int buzzobj_cmp(const buzzobj_t a,
       if((uintptr_t)(a->u.value) > (uintptr_t)(b->u.value)) return 1;
       return 0;
    }
+   /* Coroutines */
+   if(a->o.type == BUZZTYPE_COROUTINE && b->o.type == BUZZTYPE_COROUTINE) {
+      if((uintptr_t)(a->r.value) < (uintptr_t)(b->r.value)) return -1;
+      if((uintptr_t)(a->r.value) > (uintptr_t)(b->r.value)) return 1;
+      return 0;
+   }
    // TODO better error management
    fprintf(stderr, "[TODO] %s:%d: Error for comparison between Buzz objects of types %d and %d\n", __FILE__, __LINE__, a->o.type, b->o.type);
    abort();
@@ -219,6 +276,174 @@ int buzzobj_cmp(const buzzobj_t a,
 /****************************************/
 /****************************************/
 
+#define BUZZTYPE_TABLE_ARRAY_CAPACITY 4
+
+/*
+ * Returns the array part index for a key, or -1 if the key is not a
+ * non-negative integer. Floats with an integer value count as integers.
+ */
+static int64_t buzztable_index(const buzzobj_t k) {
+   if(k->o.type == BUZZTYPE_INT) return k->i.value;
+   if(k->o.type == BUZZTYPE_FLOAT &&
+      k->f.value >= 0.0f && k->f.value < 2147483648.0f &&
+      k->f.value == (int32_t)k->f.value)
+      return (int32_t)k->f.value;
+   return -1;
+}
+
+/*
+ * Moves the elements following the array part from the hash part.
+ */
+static void buzztable_migrate(buzzobj_t t) {
+   union buzzobj_u tmp;
+   buzzobj_t k = &tmp;
+   tmp.o.type = BUZZTYPE_INT;
+   tmp.o.marker = 0;
+   while(!buzzdict_isempty(t->t.value)) {
+      tmp.i.value = buzzdarray_size(t->t.array);
+      const buzzobj_t* x = buzzdict_get(t->t.value, &k, buzzobj_t);
+      if(!x) return;
+      buzzval_t v;
+      v.type = (*x)->o.type;
+      v.v.i = (*x)->i.value;
+      v.o = *x;
+      buzzdarray_push(t->t.array, &v);
+      buzzdict_remove(t->t.value, &k);
+   }
+}
+
+/****************************************/
+/****************************************/
+
+buzzval_t buzztable_get(const buzzobj_t t,
+                        const buzzobj_t k) {
+   buzzval_t v;
+   /* Look in the array part */
+   int64_t i = buzztable_index(k);
+   if(i >= 0 && t->t.array && i < buzzdarray_size(t->t.array))
+      return buzzdarray_get(t->t.array, i, buzzval_t);
+   /* Look in the hash part */
+   const buzzobj_t* x = buzzdict_get(t->t.value, &k, buzzobj_t);
+   if(x) {
+      /* Heap objects can be referenced directly */
+      v.type = (*x)->o.type;
+      v.v.i = (v.type == BUZZTYPE_INT || v.type == BUZZTYPE_FLOAT) ? (*x)->i.value : 0;
+      v.o = *x;
+   }
+   else {
+      buzzval_setnil(v);
+   }
+   return v;
+}
+
+/****************************************/
+/****************************************/
+
+void buzztable_put(buzzvm_t vm,
+                   buzzobj_t t,
+                   const buzzobj_t k,
+                   buzzval_t v) {
+   /* Nil erases the entry */
+   if(v.type == BUZZTYPE_NIL) {
+      buzztable_remove(t, k);
+      return;
+   }
+   /* Array part: the key is inside it or right after its end */
+   int64_t i = buzztable_index(k);
+   uint32_t n = t->t.array ? buzzdarray_size(t->t.array) : 0;
+   if(i >= 0 && i <= n) {
+      if(v.o) buzzheap_wbarrier(vm, t, v.o);
+      if(i < n) {
+         buzzval_t* x = buzzdarray_getp(t->t.array, i, buzzval_t);
+         if(x->type == BUZZTYPE_NIL) --t->t.holes;
+         *x = v;
+      }
+      else {
+         if(!t->t.array)
+            t->t.array = buzzdarray_new(BUZZTYPE_TABLE_ARRAY_CAPACITY, sizeof(buzzval_t), NULL);
+         buzzdarray_push(t->t.array, &v);
+         buzztable_migrate(t);
+      }
+      return;
+   }
+   /* Hash part: values are stored as heap objects */
+   if(!v.o) buzzvm_val_box(vm, &v);
+   buzzheap_wbarrier(vm, t, v.o);
+   buzzobj_t* x = (buzzobj_t*)buzzdict_rawget(t->t.value, &k);
+   if(x) {
+      *x = v.o;
+      return;
+   }
+   /* New key: numeric keys might be temporary, store a copy */
+   buzzobj_t nk = k;
+   if(i >= 0) {
+      nk = buzzheap_newint(vm, i);
+   }
+   else if(k->o.type == BUZZTYPE_INT) {
+      nk = buzzheap_newint(vm, k->i.value);
+   }
+   else if(k->o.type == BUZZTYPE_FLOAT) {
+      nk = buzzheap_newobj(vm, k->o.type);
+      nk->i.value = k->i.value;
+   }
+   buzzheap_wbarrier(vm, t, nk);
+   buzzdict_set(t->t.value, &nk, &v.o);
+}
+
+/****************************************/
+/****************************************/
+
+int buzztable_remove(buzzobj_t t,
+                     const buzzobj_t k) {
+   int64_t i = buzztable_index(k);
+   if(i >= 0 && t->t.array && i < buzzdarray_size(t->t.array)) {
+      buzzval_t* x = buzzdarray_getp(t->t.array, i, buzzval_t);
+      if(x->type == BUZZTYPE_NIL) return 0;
+      if(i < buzzdarray_size(t->t.array) - 1) {
+         /* Leave a hole */
+         buzzval_setnil(*x);
+         ++t->t.holes;
+      }
+      else {
+         /* Shrink the array part, with the holes at its end */
+         buzzdarray_pop(t->t.array);
+         while(!buzzdarray_isempty(t->t.array) &&
+               buzzdarray_last(t->t.array, buzzval_t).type == BUZZTYPE_NIL) {
+            buzzdarray_pop(t->t.array);
+            --t->t.holes;
+         }
+      }
+      return 1;
+   }
+   return buzzdict_remove(t->t.value, &k);
+}
+
+/****************************************/
+/****************************************/
+
+void buzztable_foreach(buzzobj_t t,
+                       buzzdict_elem_funp fun,
+                       void* params) {
+   /* Array part, in order; fun() might modify the table */
+   union buzzobj_u ktmp, vtmp;
+   buzzobj_t k = &ktmp, d;
+   uint32_t i;
+   ktmp.o.type = BUZZTYPE_INT;
+   ktmp.o.marker = 0;
+   for(i = 0; t->t.array && i < buzzdarray_size(t->t.array); ++i) {
+      buzzval_t v = buzzdarray_get(t->t.array, i, buzzval_t);
+      if(v.type == BUZZTYPE_NIL) continue;
+      ktmp.i.value = i;
+      d = buzzval_peek(v, vtmp);
+      fun(&k, &d, params);
+   }
+   /* Hash part */
+   buzzdict_foreach(t->t.value, fun, params);
+}
+
+/****************************************/
+/****************************************/
+
 int buzzobj_type(buzzvm_t vm) {
    /* Get parameter */
    buzzvm_lnum_assert(vm, 1);
@@ -282,7 +507,7 @@ int buzzobj_size(buzzvm_t vm) {
    buzzvm_type_assert(vm, 1, BUZZTYPE_TABLE);
    buzzobj_t t = buzzvm_stack_at(vm, 1);
    buzzvm_pop(vm);
-   buzzvm_pushi(vm, buzzdict_size(t->t.value));
+   buzzvm_pushi(vm, buzztable_size(t));
    return buzzvm_ret1(vm);
 }
 
@@ -298,12 +523,11 @@ void buzzobj_foreach_entry(const void* key, void* data, void* params) {
    /* Cast params */
    struct buzzobj_foreach_params* p = (struct buzzobj_foreach_params*)params;
    if(p->vm->state != BUZZVM_STATE_READY) return;
-   /* Push closure and params (key and value) */
-   buzzvm_push(p->vm, p->fun);
-   buzzvm_push(p->vm, *(buzzobj_t*)key);
-   buzzvm_push(p->vm, *(buzzobj_t*)data);
-   /* Call closure */
-   p->vm->state = buzzvm_closure_call(p->vm, 2);
+   /* Call closure with key and value */
+   buzzval_t args[2];
+   buzzval_setobj(args[0], *(buzzobj_t*)key);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   p->vm->state = buzzvm_invoke(p->vm, p->fun, 2, args);
    if(p->vm->state != BUZZVM_STATE_READY) return;
    /* Get rid of return value */
    buzzvm_pop(p->vm);
@@ -322,7 +546,7 @@ int buzzobj_foreach(buzzvm_t vm) {
    buzzobj_t c = buzzvm_stack_at(vm, 1);
    /* Go through the table element and apply the closure */
    struct buzzobj_foreach_params p = { .vm = vm, .fun = c };
-   buzzdict_foreach(t->t.value, buzzobj_foreach_entry, &p);
+   buzztable_foreach(t, buzzobj_foreach_entry, &p);
    return buzzvm_ret0(vm);
 }
 
@@ -332,7 +556,7 @@ int buzzobj_foreach(buzzvm_t vm) {
 struct buzzobj_map_params {
    buzzvm_t vm;
    buzzobj_t fun;
-   buzzdict_t result;
+   buzzobj_t result;
 };
 
 void buzzobj_map_entry(const void* key, void* data, void* params) {
@@ -341,12 +565,11 @@ void buzzobj_map_entry(const void* key, void* data, void* params) {
    if(p->vm->state != BUZZVM_STATE_READY) return;
    /* Save current stack size */
    uint32_t ss = buzzvm_stack_top(p->vm);
-   /* Push closure and params (key and value) */
-   buzzvm_push(p->vm, p->fun);
-   buzzvm_push(p->vm, *(buzzobj_t*)key);
-   buzzvm_push(p->vm, *(buzzobj_t*)data);
-   /* Call closure */
-   p->vm->state = buzzvm_closure_call(p->vm, 2);
+   /* Call closure with key and value */
+   buzzval_t args[2];
+   buzzval_setobj(args[0], *(buzzobj_t*)key);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   p->vm->state = buzzvm_invoke(p->vm, p->fun, 2, args);
    if(p->vm->state != BUZZVM_STATE_READY) return;
    /* Make sure a value was returned */
    if(buzzvm_stack_top(p->vm) <= ss) {
@@ -356,14 +579,8 @@ void buzzobj_map_entry(const void* key, void* data, void* params) {
                       "map(table,function) expects the function to return a value");
       return;
    }
-   /* Manage return value */
-   buzzobj_t r = buzzvm_stack_at(p->vm, 1);
-   if(r->o.type != BUZZTYPE_NIL) {
-      buzzdict_set(p->result, key, &r);
-   }
-   else {
-      buzzdict_remove(p->result, key);
-   }
+   /* Manage return value; nil removes the entry */
+   buzztable_put(p->vm, p->result, *(buzzobj_t*)key, buzzvm_stack_val(p->vm, 1));
    /* Get rid of return value */
    buzzvm_pop(p->vm);
 }
@@ -379,17 +596,19 @@ int buzzobj_map(buzzvm_t vm) {
    buzzvm_lload(vm, 2);
    buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
    buzzobj_t c = buzzvm_stack_at(vm, 1);
-   /* Create a table as the return value */
+   /* Create a table as the return value, protected while the closure runs */
    buzzobj_t r = buzzheap_newobj(vm, BUZZTYPE_TABLE);
-   buzzvm_push(vm, r);
+   buzzheap_pushroot(vm, r);
    /* Go through the table element and apply the closure */
    struct buzzobj_map_params p = {
       .vm = vm,
       .fun = c,
-      .result = r->t.value
+      .result = r
    };
-   buzzdict_foreach(t->t.value, buzzobj_map_entry, &p);
+   buzztable_foreach(t, buzzobj_map_entry, &p);
+   buzzheap_poproots(vm, 1);
    /* Return the table */
+   buzzvm_push(vm, r);
    return buzzvm_ret1(vm);
 }
 
@@ -405,18 +624,15 @@ void buzzobj_reduce_entry(const void* key, void* data, void* params) {
    /* Cast params */
    struct buzzobj_reduce_params* p = (struct buzzobj_reduce_params*)params;
    if(p->vm->state != BUZZVM_STATE_READY) return;
-   /* Save and pop accumulator from the stack */
-   buzzobj_t accum = buzzvm_stack_at(p->vm, 1);
+   /* Call closure with key, value and accumulator */
+   buzzval_t args[3];
+   buzzval_setobj(args[0], *(buzzobj_t*)key);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   args[2] = buzzvm_stack_val(p->vm, 1);
+   /* Pop accumulator from the stack and save current stack size */
    buzzvm_pop(p->vm);
-   /* Save current stack size */
    uint32_t ss = buzzvm_stack_top(p->vm);
-   /* Push closure and params (key and value) */
-   buzzvm_push(p->vm, p->fun);
-   buzzvm_push(p->vm, *(buzzobj_t*)key);
-   buzzvm_push(p->vm, *(buzzobj_t*)data);
-   buzzvm_push(p->vm, accum);
-   /* Call closure */
-   p->vm->state = buzzvm_closure_call(p->vm, 3);
+   p->vm->state = buzzvm_invoke(p->vm, p->fun, 3, args);
    if(p->vm->state != BUZZVM_STATE_READY) return;
    /* Make sure a value was returned */
    if(buzzvm_stack_top(p->vm) <= ss)
@@ -441,7 +657,7 @@ int buzzobj_reduce(buzzvm_t vm) {
    buzzvm_lload(vm, 3);
    /* Go through the table element and apply the closure */
    struct buzzobj_reduce_params p = { .vm = vm, .fun = c };
-   buzzdict_foreach(t->t.value, buzzobj_reduce_entry, &p);
+   buzztable_foreach(t, buzzobj_reduce_entry, &p);
    /* The final value of the accumulator is on the stack */
    return buzzvm_ret1(vm);
 }
@@ -452,7 +668,7 @@ int buzzobj_reduce(buzzvm_t vm) {
 struct buzzobj_filter_params {
    buzzvm_t vm;
    buzzobj_t fun;
-   buzzdict_t result;
+   buzzobj_t result;
 };
 
 void buzzobj_filter_entry(const void* key, void* data, void* params) {
@@ -461,12 +677,11 @@ void buzzobj_filter_entry(const void* key, void* data, void* params) {
    if(p->vm->state != BUZZVM_STATE_READY) return;
    /* Save current stack size */
    uint32_t ss = buzzvm_stack_top(p->vm);
-   /* Push closure and params (key and value) */
-   buzzvm_push(p->vm, p->fun);
-   buzzvm_push(p->vm, *(buzzobj_t*)key);
-   buzzvm_push(p->vm, *(buzzobj_t*)data);
-   /* Call closure */
-   p->vm->state = buzzvm_closure_call(p->vm, 2);
+   /* Call closure with key and value */
+   buzzval_t args[2];
+   buzzval_setobj(args[0], *(buzzobj_t*)key);
+   buzzval_setobj(args[1], *(buzzobj_t*)data);
+   p->vm->state = buzzvm_invoke(p->vm, p->fun, 2, args);
    if(p->vm->state != BUZZVM_STATE_READY) return;
    /* Make sure a value was returned */
    if(buzzvm_stack_top(p->vm) <= ss) {
@@ -481,7 +696,9 @@ void buzzobj_filter_entry(const void* key, void* data, void* params) {
    if(retval->o.type != BUZZTYPE_NIL &&
       (retval->o.type != BUZZTYPE_INT ||
        retval->i.value != 0)) {
-      buzzdict_set(p->result, key, data);
+      buzzval_t v;
+      buzzval_setobj(v, *(buzzobj_t*)data);
+      buzztable_put(p->vm, p->result, *(buzzobj_t*)key, v);
    }
    /* Get rid of return value */
    buzzvm_pop(p->vm);
@@ -498,17 +715,19 @@ int buzzobj_filter(buzzvm_t vm) {
    buzzvm_lload(vm, 2);
    buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
    buzzobj_t c = buzzvm_stack_at(vm, 1);
-   /* Create a table as the return value */
+   /* Create a table as the return value, protected while the closure runs */
    buzzobj_t r = buzzheap_newobj(vm, BUZZTYPE_TABLE);
-   buzzvm_push(vm, r);
+   buzzheap_pushroot(vm, r);
    /* Go through the table element and apply the closure */
    struct buzzobj_filter_params p = {
       .vm = vm,
       .fun = c,
-      .result = r->t.value
+      .result = r
    };
-   buzzdict_foreach(t->t.value, buzzobj_filter_entry, &p);
+   buzztable_foreach(t, buzzobj_filter_entry, &p);
+   buzzheap_poproots(vm, 1);
    /* Return the table */
+   buzzvm_push(vm, r);
    return buzzvm_ret1(vm);
 }
 
@@ -540,14 +759,14 @@ void buzzobj_serialize(buzzdarray_t buf,
          break;
       }
       case BUZZTYPE_TABLE: {
-         buzzmsg_serialize_u8(buf, buzzdict_size(data->t.value));
-         buzzdict_foreach(data->t.value, buzzobj_serialize_tableelem, buf);
+         buzzmsg_serialize_u8(buf, buzztable_size(data));
+         buzztable_foreach(data, buzzobj_serialize_tableelem, buf);
          break;
       }
       case BUZZTYPE_CLOSURE: {
          // TODO here we assume that the first and only element of the
-         // activation record is nil, which is true only for basic
-         // functions. For table closures, we currently have no check,
+         // activation record is nil, which is true only for functions
+         // and lambdas that capture no variables. For table closures, we currently have no check,
          // so while table closures technically can pass the
          // subsequent test, they cannot in fact be serialized
          // correctly. More work is necessary to serialize the
@@ -579,14 +798,20 @@ int64_t buzzobj_deserialize(buzzobj_t* data,
    uint8_t type;
    p = buzzmsg_deserialize_u8(&type, buf, p);
    if(p < 0) return -1;
+   /* Nil and small integers are shared */
+   if(type == BUZZTYPE_NIL) {
+      *data = buzzheap_nil(vm);
+      return p;
+   }
+   if(type == BUZZTYPE_INT) {
+      int32_t i;
+      p = buzzmsg_deserialize_u32((uint32_t*)(&i), buf, p);
+      if(p < 0) return -1;
+      *data = buzzheap_newint(vm, i);
+      return p;
+   }
    *data = buzzheap_newobj(vm, type);
    switch(type) {
-      case BUZZTYPE_NIL: {
-         return p;
-      }
-      case BUZZTYPE_INT: {
-         return buzzmsg_deserialize_u32((uint32_t*)(&((*data)->i.value)), buf, p);
-      }
       case BUZZTYPE_FLOAT: {
          return buzzmsg_deserialize_float(&((*data)->f.value), buf, p);
       }
@@ -611,12 +836,15 @@ int64_t buzzobj_deserialize(buzzobj_t* data,
             if(p < 0) return -1;
             p = buzzobj_deserialize(&v, buf, p, vm);
             if(p < 0) return -1;
-            buzzdict_set((*data)->t.value, &k, &v);
+            buzzval_t x;
+            buzzval_setobj(x, v);
+            buzztable_put(vm, *data, k, x);
          }
          return p;
       }
       case BUZZTYPE_CLOSURE: {
-         buzzobj_t nil = buzzheap_newobj(vm, BUZZTYPE_NIL);
+         buzzval_t nil;
+         buzzval_setnil(nil);
          buzzdarray_push((*data)->c.value.actrec, &nil);
          p = buzzmsg_deserialize_u8(&((*data)->c.value.isnative), buf, p);
          if(p < 0) return -1;
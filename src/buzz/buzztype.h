@@ -8,13 +8,14 @@
 /*
  * Object types in Buzz
  */
-#define BUZZTYPE_NIL      0
-#define BUZZTYPE_INT      1
-#define BUZZTYPE_FLOAT    2
-#define BUZZTYPE_STRING   3
-#define BUZZTYPE_TABLE    4
-#define BUZZTYPE_CLOSURE  5
-#define BUZZTYPE_USERDATA 6
+#define BUZZTYPE_NIL       0
+#define BUZZTYPE_INT       1
+#define BUZZTYPE_FLOAT     2
+#define BUZZTYPE_STRING    3
+#define BUZZTYPE_TABLE     4
+#define BUZZTYPE_CLOSURE   5
+#define BUZZTYPE_USERDATA  6
+#define BUZZTYPE_COROUTINE 7
 
 #ifdef __cplusplus
 extern "C" {
@@ -62,11 +63,19 @@ extern "C" {
 
    /*
     * Table
+    * Elements with keys 0..n-1 are stored in order in an array part,
+    * as tagged values; the others are in a hash part. Setting the
+    * element right after the end of the array part moves the
+    * following keys from the hash part to the array part. Removed
+    * elements leave nil holes in the array part, until they reach
+    * its end.
     */
    typedef struct {
-      uint16_t   type;
-      uint16_t   marker;
-      buzzdict_t value;
+      uint16_t     type;
+      uint16_t     marker;
+      uint32_t     holes;  // nil elements in the array part
+      buzzdict_t   value;  // hash part: buzzobj_t -> buzzobj_t
+      buzzdarray_t array;  // array part: buzzval_t, or NULL
    } buzztable_t;
 
    /*
@@ -77,7 +86,7 @@ extern "C" {
       uint16_t marker;
       struct {
          int32_t ref;         // jump address or function id
-         buzzdarray_t actrec; // activation record
+         buzzdarray_t actrec; // activation record: self table, then captured variables
          uint8_t isnative;    // 1 for native closure, 0 for c closure
       } value;
    } buzzclosure_t;
@@ -91,6 +100,17 @@ extern "C" {
       void*    value;
    } buzzuserdata_t;
 
+   /*
+    * Coroutine
+    * The saved execution state is kept outside of the object, see
+    * buzzcoroutine.h.
+    */
+   typedef struct {
+      uint16_t type;
+      uint16_t marker;
+      struct buzzcoroutine_s* value;
+   } buzzcoroutine_t;
+
    /*
     * A handle for a object
     */
@@ -106,9 +126,28 @@ extern "C" {
       buzztable_t    t;    // as table
       buzzclosure_t  c;    // as closure
       buzzuserdata_t u;    // as user data
+      buzzcoroutine_t r;   // as coroutine
    };
    typedef union buzzobj_u* buzzobj_t;
 
+   /*
+    * A tagged value, as stored on the VM stack, in local symbol
+    * tables and in closure activation records.
+    * Nil, integer and floating-point values are kept unboxed: their
+    * value is in 'v' and 'o' stays NULL until a heap object is
+    * explicitly requested for them. For all the other types, 'o'
+    * points to the heap object. Boxed integers and floats still
+    * carry their value in 'v'.
+    */
+   typedef struct {
+      uint16_t type;    // value type
+      union {
+         int32_t i;     // as integer
+         float   f;     // as floating-point
+      }         v;      // unboxed value
+      buzzobj_t o;      // heap object, or NULL for unboxed values
+   } buzzval_t;
+
    /*
     * Forward declaration of the Buzz VM.
     */
@@ -127,8 +166,25 @@ extern "C" {
     */
    extern void buzzobj_destroy(buzzobj_t* o);
 
+   /*
+    * Initializes a Buzz object in already allocated, zeroed memory.
+    * The memory must be large enough for the given type.
+    * @param o The object to initialize.
+    * @param type The type of the Buzz object.
+    */
+   extern void buzzobj_init(buzzobj_t o,
+                            uint16_t type);
+
+   /*
+    * Releases the resources held by a Buzz object.
+    * The memory of the object itself is not freed.
+    * @param o The object to finalize.
+    */
+   extern void buzzobj_fini(buzzobj_t o);
+
    /*
     * Returns the hash of the passed Buzz object.
+    * Strings are hashed by id, which is unique as they are interned.
     * @param o The Buzz object to hash.
     * @return The calculated hash.
     */
@@ -137,9 +193,10 @@ extern "C" {
    /*
     * Returns 1 if two Buzz objects are equal, 0 otherwise.
     * To be equal, two objects must have the same type and equal value.
-    * For numeric types, value equality is as expected; for closures,
-    * equality means pointing to the same code; for tables, equality
-    * means having the same reference (no deep check).
+    * For numeric types, value equality is as expected; for strings,
+    * equality means having the same id; for closures, equality means
+    * pointing to the same code; for tables, equality means having the
+    * same reference (no deep check).
     * @param a The first object.
     * @param b The second object.
     * @return 1 if two Buzz objects are equal, 0 otherwise.
@@ -241,6 +298,53 @@ extern "C" {
                                       uint32_t pos,
                                       struct buzzvm_s* vm);
 
+   /*
+    * Returns the value with the given key in a table.
+    * The returned value is nil if the key is not found.
+    * @param t The table.
+    * @param k The key.
+    * @return The value.
+    */
+   extern buzzval_t buzztable_get(const buzzobj_t t,
+                                  const buzzobj_t k);
+
+   /*
+    * Sets the value with the given key in a table.
+    * A nil value removes the element. Numeric keys and values are
+    * copied, so they can be temporary objects.
+    * @param vm The Buzz VM data.
+    * @param t The table.
+    * @param k The key.
+    * @param v The value.
+    */
+   extern void buzztable_put(struct buzzvm_s* vm,
+                             buzzobj_t t,
+                             const buzzobj_t k,
+                             buzzval_t v);
+
+   /*
+    * Removes the element with the given key from a table.
+    * @param t The table.
+    * @param k The key.
+    * @return 1 if the element was found and removed; 0 otherwise
+    */
+   extern int buzztable_remove(buzzobj_t t,
+                               const buzzobj_t k);
+
+   /*
+    * Applies the given function to each element in a table.
+    * The key and data are passed as pointers to buzzobj_t. The array
+    * part is visited first, in order. Its keys, and its numeric
+    * values, are temporary objects that are only valid during the
+    * call; buzztable_put() and buzzvm_push() copy them as needed.
+    * @param t The table.
+    * @param fun The function.
+    * @param params A buffer to pass along.
+    */
+   extern void buzztable_foreach(buzzobj_t t,
+                                 buzzdict_elem_funp fun,
+                                 void* params);
+
    /*
     * Registers basic object methods into the virtual machine.
     * @param vm The Buzz VM data.
@@ -260,6 +364,71 @@ extern "C" {
 #define buzzobj_isclosure(OBJ) ((OBJ)->o.type == BUZZTYPE_CLOSURE)
 #define buzzobj_isuserdata(OBJ) ((OBJ)->o.type == BUZZTYPE_USERDATA)
 
+/*
+ * Sets a value to the given object.
+ * Nil, integers and floats are unboxed and the object is not
+ * referenced, so it may be a temporary one.
+ * @param VAL The value (an lvalue).
+ * @param OBJ The object.
+ */
+#define buzzval_setobj(VAL, OBJ)                                        \
+   {                                                                    \
+      (VAL).o = (OBJ);                                                  \
+      (VAL).type = (VAL).o->o.type;                                     \
+      if((VAL).type == BUZZTYPE_INT ||                                  \
+         (VAL).type == BUZZTYPE_FLOAT) {                                \
+         (VAL).v.i = (VAL).o->i.value;                                  \
+         (VAL).o = NULL;                                                \
+      }                                                                 \
+      else {                                                            \
+         (VAL).v.i = 0;                                                 \
+         if((VAL).type == BUZZTYPE_NIL) (VAL).o = NULL;                 \
+      }                                                                 \
+   }
+
+/*
+ * Sets a value to nil.
+ * @param VAL The value (an lvalue).
+ */
+#define buzzval_setnil(VAL) { (VAL).type = BUZZTYPE_NIL; (VAL).v.i = 0; (VAL).o = NULL; }
+
+/*
+ * Sets a value to an unboxed integer.
+ * @param VAL The value (an lvalue).
+ * @param X The integer.
+ */
+#define buzzval_setint(VAL, X) { (VAL).type = BUZZTYPE_INT; (VAL).v.i = (X); (VAL).o = NULL; }
+
+/*
+ * Sets a value to an unboxed float.
+ * @param VAL The value (an lvalue).
+ * @param X The float.
+ */
+#define buzzval_setfloat(VAL, X) { (VAL).type = BUZZTYPE_FLOAT; (VAL).v.f = (X); (VAL).o = NULL; }
+
+/*
+ * Returns a read-only view of a value as an object, without allocating.
+ * Unboxed values are copied into TMP, a union buzzobj_u that must
+ * outlive the returned pointer.
+ * @param VAL The value.
+ * @param TMP The scratch object.
+ */
+#define buzzval_peek(VAL, TMP)                                          \
+   ((VAL).o ? (VAL).o :                                                 \
+    ((TMP).o.type = (VAL).type, (TMP).o.marker = 0, (TMP).i.value = (VAL).v.i, &(TMP)))
+
+/*
+ * Returns 1 if the value is false (nil or integer zero), 0 otherwise.
+ * @param VAL The value.
+ */
+#define buzzval_isfalse(VAL) ((VAL).type == BUZZTYPE_NIL || ((VAL).type == BUZZTYPE_INT && (VAL).v.i == 0))
+
+/*
+ * Returns the number of elements in a table.
+ * @param OBJ The table.
+ */
+#define buzztable_size(OBJ) ((uint32_t)(buzzdict_size((OBJ)->t.value) + ((OBJ)->t.array ? buzzdarray_size((OBJ)->t.array) - (OBJ)->t.holes : 0)))
+
 #define buzzobj_getint(OBJ) ((OBJ)->i.value)
 #define buzzobj_getfloat(OBJ) ((OBJ)->f.value)
 #define buzzobj_getstring(OBJ) ((OBJ)->s.value.str)
@@ -4,6 +4,11 @@
 #include "buzzmath.h"
 #include "buzzio.h"
 #include "buzzstring.h"
+#include "buzzcoroutine.h"
+#include "buzzprogram.h"
+#ifdef BUZZ_JIT
+#include "buzzjit.h"
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -12,17 +17,46 @@
 /****************************************/
 /****************************************/
 
-const char *buzzvm_state_desc[] = { "no code", "ready", "done", "error", "stopped" };
+const char *buzzvm_state_desc[] = { "no code", "ready", "done", "error", "stopped", "yielded" };
 
-const char *buzzvm_error_desc[] = { "none", "unknown instruction", "stack error", "wrong number of local variables", "pc out of range", "function id out of range", "type mismatch", "unknown string id", "unknown swarm id" };
+const char *buzzvm_error_desc[] = { "none", "unknown instruction", "stack error", "wrong number of local variables", "pc out of range", "function id out of range", "type mismatch", "unknown string id", "unknown swarm id", "out of instruction budget" };
 
-const char *buzzvm_instr_desc[] = {"nop", "done", "pushnil", "dup", "pop", "ret0", "ret1", "add", "sub", "mul", "div", "mod", "pow", "unm", "land", "lor", "lnot", "band", "bor", "bnot", "lshift", "rshift", "eq", "neq", "gt", "gte", "lt", "lte", "gload", "gstore", "pusht", "tput", "tget", "callc", "calls", "pushf", "pushi", "pushs", "pushcn", "pushcc", "pushl", "lload", "lstore", "jump", "jumpz", "jumpnz"};
+const char *buzzvm_instr_desc[] = {"nop", "done", "pushnil", "dup", "pop", "ret0", "ret1", "add", "sub", "mul", "div", "mod", "pow", "unm", "land", "lor", "lnot", "band", "bor", "bnot", "lshift", "rshift", "eq", "neq", "gt", "gte", "lt", "lte", "gload", "gstore", "pusht", "tput", "tget", "callc", "calls", "pushf", "pushi", "pushs", "pushcn", "pushcc", "pushl", "lload", "lstore", "jump", "jumpz", "jumpnz", "gloads", "tgets", "callci", "addi", "ltjumpz", "gtjumpz", "eqjumpz", "neqjumpz", "lcap", "tailcall", "yield"};
+
+const uint8_t buzzvm_instr_hasarg[BUZZVM_INSTR_COUNT] = {
+   [BUZZVM_INSTR_PUSHF]    = 1,
+   [BUZZVM_INSTR_PUSHI]    = 1,
+   [BUZZVM_INSTR_PUSHS]    = 1,
+   [BUZZVM_INSTR_PUSHCN]   = 1,
+   [BUZZVM_INSTR_PUSHCC]   = 1,
+   [BUZZVM_INSTR_PUSHL]    = 1,
+   [BUZZVM_INSTR_LLOAD]    = 1,
+   [BUZZVM_INSTR_LSTORE]   = 1,
+   [BUZZVM_INSTR_JUMP]     = 1,
+   [BUZZVM_INSTR_JUMPZ]    = 1,
+   [BUZZVM_INSTR_JUMPNZ]   = 1,
+   [BUZZVM_INSTR_GLOADS]   = 1,
+   [BUZZVM_INSTR_TGETS]    = 1,
+   [BUZZVM_INSTR_CALLCI]   = 1,
+   [BUZZVM_INSTR_ADDI]     = 1,
+   [BUZZVM_INSTR_LTJUMPZ]  = 1,
+   [BUZZVM_INSTR_GTJUMPZ]  = 1,
+   [BUZZVM_INSTR_EQJUMPZ]  = 1,
+   [BUZZVM_INSTR_NEQJUMPZ] = 1,
+   [BUZZVM_INSTR_LCAP]     = 1
+};
 
 static uint16_t SWARM_BROADCAST_PERIOD = 10;
 
 /****************************************/
 /****************************************/
 
+/*
+ * Pops values from the stack.
+ * The stack is never shrunk, so that pushing again costs nothing.
+ */
+#define buzzvm_stack_drop(vm, n) ((vm)->stack->size -= (n))
+
 /*
  * Pops two numeric operands from the stack and pushes the result of a binary arithmethic operation on them.
  * The order of the operation is stack(#2) oper stack(#1).
@@ -34,40 +68,25 @@ static uint16_t SWARM_BROADCAST_PERIOD = 10;
  */
 #define buzzvm_binary_op_arith(vm, oper)                                \
    buzzvm_stack_assert((vm), 2);                                        \
-   buzzobj_t op1 = buzzvm_stack_at(vm, 1);                              \
-   buzzobj_t op2 = buzzvm_stack_at(vm, 2);                              \
-   if((op1->o.type != BUZZTYPE_INT &&                                   \
-       op1->o.type != BUZZTYPE_FLOAT) ||                                \
-      (op2->o.type != BUZZTYPE_INT &&                                   \
-       op2->o.type != BUZZTYPE_FLOAT))  {                               \
+   buzzval_t op1 = buzzvm_stack_val(vm, 1);                             \
+   buzzval_t op2 = buzzvm_stack_val(vm, 2);                             \
+   if((op1.type != BUZZTYPE_INT &&                                      \
+       op1.type != BUZZTYPE_FLOAT) ||                                   \
+      (op2.type != BUZZTYPE_INT &&                                      \
+       op2.type != BUZZTYPE_FLOAT))  {                                  \
       (vm)->state = BUZZVM_STATE_ERROR;                                 \
       (vm)->error = BUZZVM_ERROR_TYPE;                                  \
       return (vm)->state;                                               \
    }                                                                    \
-   buzzdarray_pop(vm->stack);                                           \
-   buzzdarray_pop(vm->stack);                                           \
-   if(op1->o.type == BUZZTYPE_INT &&                                    \
-      op2->o.type == BUZZTYPE_INT) {                                    \
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);              \
-      res->i.value = op2->i.value oper op1->i.value;                    \
-      buzzvm_push(vm, res);                                             \
-   }                                                                    \
-   else if(op1->o.type == BUZZTYPE_INT &&                               \
-           op2->o.type == BUZZTYPE_FLOAT) {                             \
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);            \
-      res->f.value = op2->f.value oper op1->i.value;                    \
-      buzzvm_push(vm, res);                                             \
-   }                                                                    \
-   else if(op1->o.type == BUZZTYPE_FLOAT &&                             \
-           op2->o.type == BUZZTYPE_INT) {                               \
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);            \
-      res->f.value = op2->i.value oper op1->f.value;                    \
-      buzzvm_push(vm, res);                                             \
+   buzzvm_stack_drop(vm, 1);                                           \
+   if(op1.type == BUZZTYPE_INT &&                                       \
+      op2.type == BUZZTYPE_INT) {                                       \
+      buzzval_setint(buzzvm_stack_val(vm, 1),                           \
+                     op2.v.i oper op1.v.i);                             \
    }                                                                    \
    else {                                                               \
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);            \
-      res->f.value = op2->f.value oper op1->f.value;                    \
-      buzzvm_push(vm, res);                                             \
+      buzzval_setfloat(buzzvm_stack_val(vm, 1),                         \
+                       buzzval_tofloat(op2) oper buzzval_tofloat(op1)); \
    }                                                                    \
    return (vm)->state;
 
@@ -82,18 +101,13 @@ static uint16_t SWARM_BROADCAST_PERIOD = 10;
  */
 #define buzzvm_binary_op_logic(vm, oper)                                \
    buzzvm_stack_assert((vm), 2);                                        \
-   buzzobj_t op1 = buzzvm_stack_at(vm, 1);                              \
-   buzzobj_t op2 = buzzvm_stack_at(vm, 2);                              \
-   buzzdarray_pop(vm->stack);                                           \
-   buzzdarray_pop(vm->stack);                                           \
-   buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);                 \
-   res->i.value =                                                       \
-      !(op2->o.type == BUZZTYPE_NIL ||                                  \
-        (op2->i.type == BUZZTYPE_INT && op2->i.value == 0))             \
+   int32_t res =                                                        \
+      !buzzval_isfalse(buzzvm_stack_val(vm, 2))                         \
       oper                                                              \
-      !(op1->o.type == BUZZTYPE_NIL ||                                  \
-        (op1->i.type == BUZZTYPE_INT && op1->i.value == 0));            \
-   return buzzvm_push(vm, res);
+      !buzzval_isfalse(buzzvm_stack_val(vm, 1));                        \
+   buzzvm_stack_drop(vm, 1);                                           \
+   buzzval_setint(buzzvm_stack_val(vm, 1), res);                        \
+   return (vm)->state;
 
 /*
  * Pops two operands from the stack and pushes the result of a bitwise operation on them.
@@ -108,13 +122,11 @@ static uint16_t SWARM_BROADCAST_PERIOD = 10;
    buzzvm_stack_assert((vm), 2);                                        \
    buzzvm_type_assert((vm), 1, BUZZTYPE_INT);                           \
    buzzvm_type_assert((vm), 2, BUZZTYPE_INT);                           \
-   buzzobj_t op1 = buzzvm_stack_at(vm, 1);                              \
-   buzzobj_t op2 = buzzvm_stack_at(vm, 2);                              \
-   buzzdarray_pop(vm->stack);                                           \
-   buzzdarray_pop(vm->stack);                                           \
-   buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);                 \
-   res->i.value = op2->i.value oper op1->i.value;                       \
-   return buzzvm_push(vm, res);
+   int32_t res =                                                        \
+      buzzvm_stack_val(vm, 2).v.i oper buzzvm_stack_val(vm, 1).v.i;     \
+   buzzvm_stack_drop(vm, 1);                                           \
+   buzzval_setint(buzzvm_stack_val(vm, 1), res);                        \
+   return (vm)->state;
 
 /*
  * Pops two numeric operands from the stack and pushes the result of a comparison operation on them.
@@ -127,14 +139,31 @@ static uint16_t SWARM_BROADCAST_PERIOD = 10;
  */
 #define buzzvm_binary_op_cmp(vm, oper)                                  \
    buzzvm_stack_assert((vm), 2);                                        \
-   buzzobj_t op1 = buzzvm_stack_at(vm, 1);                              \
-   buzzobj_t op2 = buzzvm_stack_at(vm, 2);                              \
-   buzzdarray_pop(vm->stack);                                           \
-   buzzdarray_pop(vm->stack);                                           \
-   buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);                 \
-   int cmp = buzzobj_cmp(op2, op1);                                     \
-   res->i.value = (cmp == 2 || cmp oper 0);                             \
-   return buzzvm_push(vm, res);
+   int cmp = buzzvm_val_cmp(&buzzvm_stack_val(vm, 2),                   \
+                            &buzzvm_stack_val(vm, 1));                  \
+   buzzvm_stack_drop(vm, 1);                                           \
+   buzzval_setint(buzzvm_stack_val(vm, 1), (cmp == 2 || cmp oper 0));   \
+   return (vm)->state;
+
+/*
+ * Returns the value of a numeric value as a float.
+ * @param VAL The value.
+ */
+#define buzzval_tofloat(VAL) ((VAL).type == BUZZTYPE_INT ? (float)(VAL).v.i : (VAL).v.f)
+
+/*
+ * Compares two values as buzzobj_cmp() does, without boxing them.
+ * @param a The first value.
+ * @param b The second value.
+ * @return -1,0,1,2 depending on types and values
+ */
+static int buzzvm_val_cmp(const buzzval_t* a,
+                          const buzzval_t* b) {
+   if(a->type == BUZZTYPE_INT && b->type == BUZZTYPE_INT)
+      return (a->v.i > b->v.i) - (a->v.i < b->v.i);
+   union buzzobj_u ta, tb;
+   return buzzobj_cmp(buzzval_peek(*a, ta), buzzval_peek(*b, tb));
+}
 
 /****************************************/
 /****************************************/
@@ -144,12 +173,15 @@ void buzzvm_dump(buzzvm_t vm) {
    fprintf(stderr, "============================================================\n");
    fprintf(stderr, "state: %d\terror: %d\n", vm->state, vm->error);
    fprintf(stderr, "code size: %u\tpc: %d\n", vm->bcode_size, vm->pc);
-   fprintf(stderr, "stacks: %" PRId64 "\tcur elem: %" PRId64 " (size %" PRId64 ")\n", buzzdarray_size(vm->stacks), buzzvm_stack_top(vm), buzzvm_stack_top(vm));
-   for(i = buzzdarray_size(vm->stacks)-1; i >= 0 ; --i) {
-      fprintf(stderr, "===== stack: %" PRId64 " =====\n", i);
-      for(j = buzzdarray_size(buzzdarray_get(vm->stacks, i, buzzdarray_t)) - 1; j >= 0; --j) {
-         fprintf(stderr, "\t%" PRId64 "\t", j);
-         buzzobj_t o = buzzdarray_get(buzzdarray_get(vm->stacks, i, buzzdarray_t), j, buzzobj_t);
+   fprintf(stderr, "frames: %" PRId64 "\tcur elem: %" PRId64 " (size %" PRId64 ")\n", buzzvm_frame_count(vm), buzzvm_stack_top(vm), buzzvm_stack_top(vm));
+   int64_t end = buzzdarray_size(vm->stack);
+   for(i = buzzvm_frame_count(vm)-1; i >= 0 ; --i) {
+      int64_t base = buzzdarray_get(vm->frames, i, buzzvm_frame_t).sbase;
+      fprintf(stderr, "===== frame: %" PRId64 " =====\n", i);
+      for(j = end - 1; j >= base; --j) {
+         fprintf(stderr, "\t%" PRId64 "\t", j - base);
+         union buzzobj_u tmp;
+         buzzobj_t o = buzzval_peek(buzzdarray_get(vm->stack, j, buzzval_t), tmp);
          switch(o->o.type) {
             case BUZZTYPE_NIL:
                fprintf(stderr, "[nil]\n");
@@ -161,7 +193,7 @@ void buzzvm_dump(buzzvm_t vm) {
                fprintf(stderr, "[float] %f\n", o->f.value);
                break;
             case BUZZTYPE_TABLE:
-               fprintf(stderr, "[table] %d elements\n", buzzdict_size(o->t.value));
+               fprintf(stderr, "[table] %d elements\n", buzztable_size(o));
                break;
             case BUZZTYPE_CLOSURE:
                if(o->c.value.isnative) {
@@ -178,6 +210,7 @@ void buzzvm_dump(buzzvm_t vm) {
                fprintf(stderr, "[TODO] type = %d\n", o->o.type);
          }
       }
+      end = base;
    }
    fprintf(stderr, "============================================================\n\n");
 }
@@ -196,38 +229,17 @@ const char* buzzvm_strerror(buzzvm_t vm) {
 /****************************************/
 /****************************************/
 
-#define BUZZVM_STACKS_INIT_CAPACITY  20
-#define BUZZVM_STACK_INIT_CAPACITY   20
-#define BUZZVM_LSYMTS_INIT_CAPACITY  20
+#define BUZZVM_FRAMES_INIT_CAPACITY  20
+#define BUZZVM_STACK_INIT_CAPACITY   256
+#define BUZZVM_LSYMS_INIT_CAPACITY   256
 #define BUZZVM_SYMS_INIT_CAPACITY    20
 #define BUZZVM_STRINGS_INIT_CAPACITY 20
 
 /****************************************/
 /****************************************/
 
-buzzvm_lsyms_t buzzvm_lsyms_new(uint8_t isswarm,
-                                buzzdarray_t syms) {
-   buzzvm_lsyms_t s = (buzzvm_lsyms_t)malloc(sizeof(struct buzzvm_lsyms_s));
-   s->isswarm = isswarm;
-   s->syms = syms;
-   return s;
-}
-
-void buzzvm_lsyms_destroy(uint32_t pos,
-                          void* data,
-                          void* params) {
-   buzzvm_lsyms_t s = *(buzzvm_lsyms_t*)data;
-   buzzdarray_destroy(&(s->syms));
-   free(s);
-}
-
-/****************************************/
-/****************************************/
-
 void buzzvm_vstig_destroy(const void* key, void* data, void* params) {
-   free((void*)key);
    buzzvstig_destroy((buzzvstig_t*)data);
-   free(data);
 }
 
 /****************************************/
@@ -261,14 +273,11 @@ void buzzvm_process_inmsgs(buzzvm_t vm) {
             /* Deserialize value */
             buzzobj_t value;
             pos = buzzobj_deserialize(&value, msg, pos, vm);
-            /* Make an object for the robot id */
-            buzzobj_t rido = buzzheap_newobj(vm, BUZZTYPE_INT);
-            rido->i.value = rid;
             /* Call listener */
             buzzvm_push(vm, *l);
             buzzvm_push(vm, topic);
             buzzvm_push(vm, value);
-            buzzvm_push(vm, rido);
+            buzzvm_pushi(vm, rid);
             buzzvm_closure_call(vm, 3);
             buzzvm_pop(vm);
             break;
@@ -295,6 +304,8 @@ void buzzvm_process_inmsgs(buzzvm_t vm) {
                break;
             }
             /* Deserialization successful */
+            buzzheap_wbarrier(vm, NULL, k);
+            buzzheap_wbarrier(vm, NULL, v->data);
             /* Fetch local vstig element */
             const buzzvstig_elem_t* l = buzzvstig_fetch(*vs, &k);
             if((!l)                             || /* Element not found */
@@ -307,21 +318,24 @@ void buzzvm_process_inmsgs(buzzvm_t vm) {
             else if(((*l)->timestamp == v->timestamp) && /* Same timestamp */
                     ((*l)->robot != v->robot)) {         /* Different robot */
                /* Conflict! */
+               /* The handler may modify the vstig and move its elements */
+               buzzvstig_elem_t le = *l;
                /* Call conflict manager */
                buzzvstig_elem_t c =
-                  buzzvstig_onconflict_call(vm, *vs, k, *l, v);
+                  buzzvstig_onconflict_call(vm, *vs, k, le, v);
                if(!c) {
                   fprintf(stderr, "[WARNING] [ROBOT %u] Error resolving PUT conflict\n", vm->robot);
                   break;
                }
+               buzzheap_wbarrier(vm, NULL, c->data);
                /* Get rid of useless vstig element */
                free(v);
                /* Did this robot lose the conflict? */
                if((c->robot != vm->robot) &&
-                  ((*l)->robot == vm->robot)) {
+                  (le->robot == vm->robot)) {
                   /* Yes */
                   /* Save current local entry */
-                  buzzvstig_elem_t ol = buzzvstig_elem_clone(vm, *l);
+                  buzzvstig_elem_t ol = buzzvstig_elem_clone(vm, le);
                   /* Store winning value */
                   buzzvstig_store(*vs, &k, &c);
                   /* Call conflict lost manager */
@@ -358,6 +372,8 @@ void buzzvm_process_inmsgs(buzzvm_t vm) {
                free(v);
                break;
             }
+            buzzheap_wbarrier(vm, NULL, k);
+            buzzheap_wbarrier(vm, NULL, v->data);
             /* Look for virtual stigmergy */
             const buzzvstig_t* vs = buzzdict_get(vm->vstigs, &id, buzzvstig_t);
             if(!vs) {
@@ -399,18 +415,21 @@ void buzzvm_process_inmsgs(buzzvm_t vm) {
             else if(((*l)->timestamp == v->timestamp) && /* Same timestamp */
                     ((*l)->robot != v->robot)) {         /* Different robot */
                /* Conflict! */
+               /* The handler may modify the vstig and move its elements */
+               buzzvstig_elem_t le = *l;
                /* Call conflict manager */
                buzzvstig_elem_t c =
-                  buzzvstig_onconflict_call(vm, *vs, k, *l, v);
+                  buzzvstig_onconflict_call(vm, *vs, k, le, v);
                free(v);
                /* Make sure conflict manager returned with an element to process */
                if(!c) break;
+               buzzheap_wbarrier(vm, NULL, c->data);
                /* Did this robot lose the conflict? */
                if((c->robot != vm->robot) &&
-                  ((*l)->robot == vm->robot)) {
+                  (le->robot == vm->robot)) {
                   /* Yes */
                   /* Save current local entry */
-                  buzzvstig_elem_t ol = buzzvstig_elem_clone(vm, *l);
+                  buzzvstig_elem_t ol = buzzvstig_elem_clone(vm, le);
                   /* Store winning value */
                   buzzvstig_store(*vs, &k, &c);
                   /* Call conflict lost manager */
@@ -503,29 +522,23 @@ void buzzvm_process_outmsgs(buzzvm_t vm) {
 /****************************************/
 /****************************************/
 
-void buzzvm_darray_destroy(uint32_t pos,
-                           void* data,
-                           void* params) {
-   buzzdarray_t* s = (buzzdarray_t*)data;
-   buzzdarray_destroy(s);
-}
-
 buzzvm_t buzzvm_new(uint16_t robot) {
    /* Create VM state. calloc() takes care of zeroing everything */
    buzzvm_t vm = (buzzvm_t)calloc(1, sizeof(struct buzzvm_s));
-   /* Create stacks */
-   vm->stacks = buzzdarray_new(BUZZVM_STACKS_INIT_CAPACITY,
-                               sizeof(buzzdarray_t),
-                               buzzvm_darray_destroy);
+   /* Create the value stack */
    vm->stack = buzzdarray_new(BUZZVM_STACK_INIT_CAPACITY,
-                              sizeof(buzzobj_t),
+                              sizeof(buzzval_t),
                               NULL);
-   buzzdarray_push(vm->stacks, &(vm->stack));
-   /* Create local variable tables */
-   vm->lsymts = buzzdarray_new(BUZZVM_LSYMTS_INIT_CAPACITY,
-                               sizeof(buzzvm_lsyms_t),
-                               buzzvm_lsyms_destroy);
-   vm->lsyms = NULL;
+   /* Create the local symbol stack */
+   vm->lsyms = buzzdarray_new(BUZZVM_LSYMS_INIT_CAPACITY,
+                              sizeof(buzzval_t),
+                              NULL);
+   /* Create the call frames, starting with that of the script */
+   vm->frames = buzzdarray_new(BUZZVM_FRAMES_INIT_CAPACITY,
+                               sizeof(buzzvm_frame_t),
+                               NULL);
+   buzzvm_frame_t f = { .sbase = 0, .cbase = 0, .lbase = 0, .retpc = 0, .isswarm = 0 };
+   buzzdarray_push(vm->frames, &f);
    /* Create global variable tables */
    vm->gsyms = buzzdict_new(BUZZVM_SYMS_INIT_CAPACITY,
                             sizeof(int32_t),
@@ -582,17 +595,39 @@ buzzvm_t buzzvm_new(uint16_t robot) {
 /****************************************/
 /****************************************/
 
+/*
+ * Gets rid of the decoded instructions, unless they belong to a program,
+ * and of the inline caches.
+ */
+static void buzzvm_dcode_free(buzzvm_t vm) {
+   if(!vm->program) {
+      free(vm->dcode);
+      free(vm->dcode_index);
+   }
+   vm->program = NULL;
+   vm->dcode = NULL;
+   vm->dcode_index = NULL;
+   free(vm->icache);
+   vm->icache = NULL;
+}
+
 void buzzvm_destroy(buzzvm_t* vm) {
    /* Get rid of the rng state */
    free((*vm)->rngstate);
+   /* Get rid of the decoded instructions */
+   buzzvm_dcode_free(*vm);
+#ifdef BUZZ_JIT
+   /* Get rid of the native code */
+   buzzjit_destroy(&(*vm)->jit);
+#endif
    /* Get rid of the stack */
    buzzstrman_destroy(&(*vm)->strings);
    /* Get rid of the global variable table */
    buzzdict_destroy(&(*vm)->gsyms);
-   /* Get rid of the local variable tables */
-   buzzdarray_destroy(&(*vm)->lsymts);
-   /* Get rid of the stack */
-   buzzdarray_destroy(&(*vm)->stacks);
+   /* Get rid of the call frames */
+   buzzdarray_destroy(&(*vm)->frames);
+   buzzdarray_destroy(&(*vm)->lsyms);
+   buzzdarray_destroy(&(*vm)->stack);
    /* Get rid of the heap */
    buzzheap_destroy(&(*vm)->heap);
    /* Get rid of the function list */
@@ -650,30 +685,362 @@ void buzzvm_seterror(buzzvm_t vm,
 /****************************************/
 /****************************************/
 
-int buzzvm_set_bcode(buzzvm_t vm,
-                     const uint8_t* bcode,
-                     uint32_t bcode_size) {
-   /* Fetch the string count */
-   uint16_t count;
-   memcpy(&count, bcode, sizeof(uint16_t));
-   /* Go through the strings and store them */
-   uint32_t i = sizeof(uint16_t);
-   long int c = 0;
-   for(; (c < count) && (i < bcode_size); ++c) {
-      /* Store string */
-      buzzvm_string_register(vm, (char*)(bcode + i), 1);
-      /* Advance to first character of next string */
-      while(*(bcode + i) != 0) ++i;
-      ++i;
+/*
+ * Returns 1 if the given opcode takes a jump target as argument.
+ */
+#define buzzvm_instr_isjump(op)                                         \
+   ((op) == BUZZVM_INSTR_JUMP ||                                        \
+    (op) == BUZZVM_INSTR_JUMPZ ||                                       \
+    (op) == BUZZVM_INSTR_JUMPNZ ||                                      \
+    ((op) >= BUZZVM_INSTR_LTJUMPZ && (op) <= BUZZVM_INSTR_NEQJUMPZ))
+
+/*
+ * Decodes the instructions of the bytecode, starting at the given offset.
+ * The decoded instructions are followed by an end marker.
+ */
+static void buzzvm_decode(buzzvm_t vm,
+                          uint32_t start) {
+   const uint8_t* bcode = vm->bcode;
+   uint32_t size = vm->bcode_size;
+   uint32_t off, n = 0;
+   if(start > size) start = size;
+   off = start;
+   buzzvm_dcode_free(vm);
+   vm->verified = 0;
+   /* There can't be more instructions than bytes */
+   vm->dcode = (buzzvm_dinstr_t*)calloc(size - start + 1, sizeof(buzzvm_dinstr_t));
+   vm->dcode_index = (uint32_t*)malloc(size * sizeof(uint32_t));
+   memset(vm->dcode_index, 0xFF, size * sizeof(uint32_t));
+   /* Decode instructions and their arguments */
+   while(off < size) {
+      buzzvm_dinstr_t* d = vm->dcode + n;
+      d->opcode = bcode[off];
+      d->offset = off;
+      vm->dcode_index[off] = n++;
+      if(d->opcode >= BUZZVM_INSTR_COUNT || !buzzvm_instr_hasarg[d->opcode]) {
+         ++off;
+         continue;
+      }
+      /* The argument must be followed by at least one more byte */
+      if(off + 1 + sizeof(uint32_t) >= size) {
+         d->opcode = BUZZVM_DINSTR_END;
+         break;
+      }
+      memcpy(&d->arg, bcode + off + 1, sizeof(uint32_t));
+      off += 1 + sizeof(uint32_t);
+   }
+   /* Add the end marker */
+   vm->dcode_size = n;
+   vm->dcode[n].opcode = BUZZVM_DINSTR_END;
+   vm->dcode[n].offset = size;
+   vm->dcode = (buzzvm_dinstr_t*)realloc(vm->dcode, (n + 1) * sizeof(buzzvm_dinstr_t));
+   vm->icache = (uint32_t*)calloc(n + 1, sizeof(uint32_t));
+   /* Offsets in the middle of an instruction lead to the end marker */
+   for(off = 0; off < size; ++off)
+      if(vm->dcode_index[off] == UINT32_MAX)
+         vm->dcode_index[off] = n;
+   /* Resolve jump targets and check string ids */
+   for(off = 0; off < n; ++off) {
+      buzzvm_dinstr_t* d = vm->dcode + off;
+      if(buzzvm_instr_isjump(d->opcode))
+         d->arg.u = buzzvm_dcode_index(vm, d->arg.i);
+      else if(d->opcode == BUZZVM_INSTR_PUSHS ||
+              d->opcode == BUZZVM_INSTR_GLOADS ||
+              d->opcode == BUZZVM_INSTR_TGETS) {
+         /* String ids are 16-bit */
+         d->arg.i = (uint16_t)d->arg.i;
+         if(!buzzstrman_get(vm->strings, d->arg.i))
+            d->opcode = BUZZVM_DINSTR_BADSTR;
+      }
+   }
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Number of values popped and pushed by the instructions with a fixed
+ * stack effect.
+ */
+static const uint8_t buzzvm_instr_effect[BUZZVM_INSTR_COUNT][2] = {
+   [BUZZVM_INSTR_NOP]     = { 0, 0 },
+   [BUZZVM_INSTR_PUSHNIL] = { 0, 1 },
+   [BUZZVM_INSTR_DUP]     = { 1, 2 },
+   [BUZZVM_INSTR_POP]     = { 1, 0 },
+   [BUZZVM_INSTR_ADD]     = { 2, 1 },
+   [BUZZVM_INSTR_SUB]     = { 2, 1 },
+   [BUZZVM_INSTR_MUL]     = { 2, 1 },
+   [BUZZVM_INSTR_DIV]     = { 2, 1 },
+   [BUZZVM_INSTR_MOD]     = { 2, 1 },
+   [BUZZVM_INSTR_POW]     = { 2, 1 },
+   [BUZZVM_INSTR_UNM]     = { 1, 1 },
+   [BUZZVM_INSTR_LAND]    = { 2, 1 },
+   [BUZZVM_INSTR_LOR]     = { 2, 1 },
+   [BUZZVM_INSTR_LNOT]    = { 1, 1 },
+   [BUZZVM_INSTR_BAND]    = { 2, 1 },
+   [BUZZVM_INSTR_BOR]     = { 2, 1 },
+   [BUZZVM_INSTR_BNOT]    = { 1, 1 },
+   [BUZZVM_INSTR_LSHIFT]  = { 2, 1 },
+   [BUZZVM_INSTR_RSHIFT]  = { 2, 1 },
+   [BUZZVM_INSTR_EQ]      = { 2, 1 },
+   [BUZZVM_INSTR_NEQ]     = { 2, 1 },
+   [BUZZVM_INSTR_GT]      = { 2, 1 },
+   [BUZZVM_INSTR_GTE]     = { 2, 1 },
+   [BUZZVM_INSTR_LT]      = { 2, 1 },
+   [BUZZVM_INSTR_LTE]     = { 2, 1 },
+   [BUZZVM_INSTR_GLOAD]   = { 1, 1 },
+   [BUZZVM_INSTR_GSTORE]  = { 2, 0 },
+   [BUZZVM_INSTR_PUSHT]   = { 0, 1 },
+   [BUZZVM_INSTR_TPUT]    = { 3, 0 },
+   [BUZZVM_INSTR_TGET]    = { 2, 1 },
+   [BUZZVM_INSTR_YIELD]   = { 1, 1 },
+   [BUZZVM_INSTR_PUSHF]   = { 0, 1 },
+   [BUZZVM_INSTR_PUSHI]   = { 0, 1 },
+   [BUZZVM_INSTR_PUSHS]   = { 0, 1 },
+   [BUZZVM_INSTR_PUSHCN]  = { 0, 1 },
+   [BUZZVM_INSTR_PUSHCC]  = { 0, 1 },
+   [BUZZVM_INSTR_PUSHL]   = { 0, 1 },
+   [BUZZVM_INSTR_LLOAD]   = { 0, 1 },
+   [BUZZVM_INSTR_LSTORE]  = { 1, 0 },
+   [BUZZVM_INSTR_LCAP]    = { 1, 1 },
+   [BUZZVM_INSTR_GLOADS]  = { 0, 1 },
+   [BUZZVM_INSTR_TGETS]   = { 1, 1 },
+   [BUZZVM_INSTR_ADDI]    = { 1, 1 }
+};
+
+/*
+ * State of the verifier at an instruction.
+ */
+struct buzzvm_vstate_s {
+   /* The code block being verified, 0 if the instruction wasn't reached */
+   uint32_t block;
+   /* Stack depth before the instruction */
+   int64_t depth;
+   /* Integer known to be on top of the stack, -1 if unknown */
+   int64_t top;
+};
+
+/*
+ * Records that an instruction is reached with the given state.
+ * Instructions reached for the first time, or whose known stack top
+ * is lost, are added to the work list.
+ * @return 0 if the stack depth differs from the recorded one, 1 otherwise.
+ */
+static int buzzvm_verify_reach(struct buzzvm_vstate_s* vs,
+                               buzzdarray_t work,
+                               uint32_t block,
+                               uint32_t i,
+                               int64_t depth,
+                               int64_t top) {
+   if(vs[i].block != block) {
+      vs[i].block = block;
+      vs[i].depth = depth;
+      vs[i].top = top;
+      buzzdarray_push(work, &i);
+      return 1;
+   }
+   if(vs[i].depth != depth) return 0;
+   if(vs[i].top != top && vs[i].top >= 0) {
+      vs[i].top = -1;
+      buzzdarray_push(work, &i);
+   }
+   return 1;
+}
+
+/*
+ * Verifies the code block starting at the given instruction.
+ * A block is the body of the script or of a function, and starts
+ * with an empty stack. Function entries found in the block are added
+ * to the given list.
+ * @return 1 if the block is verified, 0 otherwise.
+ */
+static int buzzvm_verify_block(buzzvm_t vm,
+                               struct buzzvm_vstate_s* vs,
+                               buzzdarray_t work,
+                               buzzdarray_t entries,
+                               uint32_t block,
+                               uint32_t start) {
+   /* The first block is the script, the others are functions */
+   int isfun = (block > 1);
+   uint32_t n = vm->dcode_size;
+   if(start >= n) return 0;
+   buzzdarray_clear(work, 16);
+   buzzvm_verify_reach(vs, work, block, start, 0, -1);
+   while(!buzzdarray_isempty(work)) {
+      uint32_t i = buzzdarray_last(work, uint32_t);
+      buzzdarray_pop(work);
+      const buzzvm_dinstr_t* d = vm->dcode + i;
+      int64_t depth = vs[i].depth;
+      int64_t top = vs[i].top;
+      uint32_t next = i + 1;
+      switch(d->opcode) {
+         case BUZZVM_INSTR_DONE:
+            /* End of the script */
+            continue;
+         case BUZZVM_INSTR_RET0:
+            if(!isfun) return 0;
+            continue;
+         case BUZZVM_INSTR_RET1:
+            if(!isfun || depth < 1) return 0;
+            continue;
+         case BUZZVM_INSTR_CALLC:
+         case BUZZVM_INSTR_CALLS:
+            /* The argument count, the arguments, the closure and self */
+            if(top < 0 || depth < top + 3) return 0;
+            depth -= top + 2;
+            top = -1;
+            break;
+         case BUZZVM_INSTR_TAILCALL:
+            /* As callc, the next instruction is reached by C closures */
+            if(!isfun || top < 0 || depth < top + 3) return 0;
+            depth -= top + 2;
+            top = -1;
+            break;
+         case BUZZVM_INSTR_CALLCI:
+            /* The arguments, the closure and self */
+            if(d->arg.i < 0 || depth < (int64_t)d->arg.i + 2) return 0;
+            depth -= d->arg.i + 1;
+            top = -1;
+            break;
+         case BUZZVM_INSTR_JUMP:
+            if(d->arg.u >= n) return 0;
+            if(!buzzvm_verify_reach(vs, work, block, d->arg.u, depth, top)) return 0;
+            continue;
+         case BUZZVM_INSTR_JUMPZ:
+         case BUZZVM_INSTR_JUMPNZ:
+            if(depth < 1 || d->arg.u >= n) return 0;
+            --depth;
+            top = -1;
+            if(!buzzvm_verify_reach(vs, work, block, d->arg.u, depth, top)) return 0;
+            break;
+         case BUZZVM_INSTR_LTJUMPZ:
+         case BUZZVM_INSTR_GTJUMPZ:
+         case BUZZVM_INSTR_EQJUMPZ:
+         case BUZZVM_INSTR_NEQJUMPZ:
+            if(depth < 2 || d->arg.u >= n) return 0;
+            depth -= 2;
+            top = -1;
+            if(!buzzvm_verify_reach(vs, work, block, d->arg.u, depth, top)) return 0;
+            break;
+         case BUZZVM_INSTR_LLOAD:
+         case BUZZVM_INSTR_LSTORE:
+         case BUZZVM_INSTR_LCAP:
+            /* Local symbols exist only in functions */
+            if(!isfun || depth < buzzvm_instr_effect[d->opcode][0]) return 0;
+            depth += buzzvm_instr_effect[d->opcode][1] - buzzvm_instr_effect[d->opcode][0];
+            if(depth < 0) return 0;
+            top = -1;
+            break;
+         case BUZZVM_INSTR_PUSHCN:
+         case BUZZVM_INSTR_PUSHL: {
+            /* The closure is another block to verify */
+            uint32_t e = buzzvm_dcode_index(vm, d->arg.i);
+            if(e >= n) return 0;
+            buzzdarray_push(entries, &e);
+            ++depth;
+            top = -1;
+            break;
+         }
+         case BUZZVM_INSTR_PUSHI:
+            ++depth;
+            top = d->arg.i;
+            break;
+         default:
+            /* Past the end, bad strings and invalid opcodes fail at run time */
+            if(d->opcode >= BUZZVM_INSTR_COUNT) continue;
+            if(depth < buzzvm_instr_effect[d->opcode][0]) return 0;
+            depth += buzzvm_instr_effect[d->opcode][1] - buzzvm_instr_effect[d->opcode][0];
+            top = -1;
+            break;
+      }
+      /* Running past the end fails at run time */
+      if(next < n && !buzzvm_verify_reach(vs, work, block, next, depth, top)) return 0;
+   }
+   return 1;
+}
+
+/*
+ * Returns the unchecked version of a checked opcode.
+ * Opcodes without an unchecked version are returned as they are.
+ */
+static uint8_t buzzvm_unchecked_opcode(uint8_t op) {
+   switch(op) {
+      case BUZZVM_INSTR_DUP:    return BUZZVM_DINSTR_VDUP;
+      case BUZZVM_INSTR_POP:    return BUZZVM_DINSTR_VPOP;
+      case BUZZVM_INSTR_ADD:    return BUZZVM_DINSTR_VADD;
+      case BUZZVM_INSTR_SUB:    return BUZZVM_DINSTR_VSUB;
+      case BUZZVM_INSTR_MUL:    return BUZZVM_DINSTR_VMUL;
+      case BUZZVM_INSTR_EQ:     return BUZZVM_DINSTR_VEQ;
+      case BUZZVM_INSTR_NEQ:    return BUZZVM_DINSTR_VNEQ;
+      case BUZZVM_INSTR_GT:     return BUZZVM_DINSTR_VGT;
+      case BUZZVM_INSTR_GTE:    return BUZZVM_DINSTR_VGTE;
+      case BUZZVM_INSTR_LT:     return BUZZVM_DINSTR_VLT;
+      case BUZZVM_INSTR_LTE:    return BUZZVM_DINSTR_VLTE;
+      case BUZZVM_INSTR_LLOAD:  return BUZZVM_DINSTR_VLLOAD;
+      case BUZZVM_INSTR_LSTORE: return BUZZVM_DINSTR_VLSTORE;
+      case BUZZVM_INSTR_JUMPZ:  return BUZZVM_DINSTR_VJUMPZ;
+      case BUZZVM_INSTR_JUMPNZ: return BUZZVM_DINSTR_VJUMPNZ;
+      default:                  return op;
+   }
+}
+
+int buzzvm_verify(buzzvm_t vm) {
+   if(vm->verified) return 1;
+   uint32_t n = vm->dcode_size;
+   if(n == 0) return 0;
+   struct buzzvm_vstate_s* vs =
+      (struct buzzvm_vstate_s*)calloc(n, sizeof(struct buzzvm_vstate_s));
+   /* Block number of each function entry, to verify it only once */
+   uint32_t* fblock = (uint32_t*)calloc(n, sizeof(uint32_t));
+   buzzdarray_t work = buzzdarray_new(16, sizeof(uint32_t), NULL);
+   buzzdarray_t entries = buzzdarray_new(16, sizeof(uint32_t), NULL);
+   /* The script starts at the first instruction */
+   uint32_t block = 1;
+   int ok = buzzvm_verify_block(vm, vs, work, entries, block, 0);
+   while(ok && !buzzdarray_isempty(entries)) {
+      uint32_t e = buzzdarray_last(entries, uint32_t);
+      buzzdarray_pop(entries);
+      if(fblock[e]) continue;
+      fblock[e] = ++block;
+      ok = buzzvm_verify_block(vm, vs, work, entries, block, e);
+   }
+   if(ok) {
+      /* Switch the reachable instructions to their unchecked version */
+      /* Stores into captured variables stay checked, as the number of
+       * captured variables is only known at run time */
+      uint32_t i;
+      for(i = 0; i < n; ++i)
+         if(vs[i].block &&
+            !(vm->dcode[i].opcode == BUZZVM_INSTR_LSTORE && vm->dcode[i].arg.i < 0))
+            vm->dcode[i].opcode = buzzvm_unchecked_opcode(vm->dcode[i].opcode);
+      vm->verified = 1;
    }
+   buzzdarray_destroy(&work);
+   buzzdarray_destroy(&entries);
+   free(fblock);
+   free(vs);
+   return ok;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Starts the loaded code at the given offset: runs the function
+ * definitions and registers the library.
+ */
+static int buzzvm_start(buzzvm_t vm,
+                        uint32_t start) {
    /* Initialize VM state */
    vm->state = BUZZVM_STATE_READY;
    vm->error = BUZZVM_ERROR_NONE;
-   /* Initialize bytecode data */
-   vm->bcode_size = bcode_size;
-   vm->bcode = bcode;
+#ifdef BUZZ_JIT
+   /* Start counting function entries for the new code */
+   buzzjit_destroy(&vm->jit);
+   vm->jit = buzzjit_new(vm);
+#endif
    /* Set program counter */
-   vm->pc = i;
+   vm->pc = start;
    vm->oldpc = vm->pc;
    /*
     * Register function definitions
@@ -700,6 +1067,8 @@ int buzzvm_set_bcode(buzzvm_t vm,
    buzzio_register(vm);
    /* Register string methods */
    buzzstring_register(vm);
+   /* Register coroutine methods */
+   buzzcoroutine_register(vm);
    /* All done */
    return BUZZVM_STATE_READY;
 }
@@ -707,357 +1076,1151 @@ int buzzvm_set_bcode(buzzvm_t vm,
 /****************************************/
 /****************************************/
 
-#define assert_pc(IDX) if((IDX) < 0 || (IDX) >= vm->bcode_size) { buzzvm_seterror(vm, BUZZVM_ERROR_PC, NULL); return vm->state; }
+int buzzvm_set_bcode(buzzvm_t vm,
+                     const uint8_t* bcode,
+                     uint32_t bcode_size) {
+   /* Fetch the string count */
+   uint16_t count;
+   memcpy(&count, bcode, sizeof(uint16_t));
+   /* Go through the strings and store them */
+   uint32_t i = sizeof(uint16_t);
+   long int c = 0;
+   for(; (c < count) && (i < bcode_size); ++c) {
+      /* Store string */
+      buzzvm_string_register(vm, (char*)(bcode + i), 1);
+      /* Advance to first character of next string */
+      while(*(bcode + i) != 0) ++i;
+      ++i;
+   }
+   /* Initialize bytecode data */
+   vm->bcode_size = bcode_size;
+   vm->bcode = bcode;
+   buzzvm_decode(vm, i);
+   buzzvm_verify(vm);
+   return buzzvm_start(vm, i);
+}
 
-#define inc_pc() vm->oldpc = vm->pc; ++vm->pc; assert_pc(vm->pc);
+/****************************************/
+/****************************************/
 
-#define get_arg(TYPE) assert_pc(vm->pc + sizeof(TYPE)); TYPE arg = *((TYPE*)(vm->bcode + vm->pc)); vm->pc += sizeof(TYPE);
+int buzzvm_set_program(buzzvm_t vm,
+                       buzzprogram_t prog) {
+   /* Use the strings of the program */
+   buzzstrman_destroy(&vm->strings);
+   vm->strings = buzzstrman_overlay_new(prog->strings);
+   /* Use the library functions of the program, with the same ids */
+   buzzdarray_clear(vm->flist, buzzdarray_size(prog->flist));
+   int64_t i;
+   for(i = 0; i < buzzdarray_size(prog->flist); ++i)
+      buzzdarray_push(vm->flist, buzzdarray_getp(prog->flist, i, buzzvm_funp));
+   /* Share the bytecode and the decoded instructions */
+   buzzvm_dcode_free(vm);
+   vm->program = prog;
+   vm->bcode_size = prog->bcode_size;
+   vm->bcode = prog->bcode;
+   vm->dcode = prog->dcode;
+   vm->dcode_size = prog->dcode_size;
+   vm->dcode_index = prog->dcode_index;
+   vm->verified = prog->verified;
+   vm->icache = (uint32_t*)calloc(prog->dcode_size + 1, sizeof(uint32_t));
+   /* The code starts after the strings */
+   return buzzvm_start(vm, prog->dcode[0].offset);
+}
 
-buzzvm_state buzzvm_step(buzzvm_t vm) {
-   /* buzzvm_dump(vm); */
+/****************************************/
+/****************************************/
+
+/*
+ * Pushes a string whose id is known to be registered.
+ */
+static buzzvm_state buzzvm_pushs_known(buzzvm_t vm, uint16_t sid) {
+   buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_STRING);
+   o->s.value.sid = sid;
+   o->s.value.str = buzzstrman_get(vm->strings, sid);
+   return buzzvm_push(vm, o);
+}
+
+/*
+ * Executes 'pushs sid; gload'.
+ * The inline cache holds the slot of the symbol in the global
+ * symbol table. The slot is checked against the key, so nothing needs
+ * to be done when the table is modified.
+ */
+static buzzvm_state buzzvm_gload_cached(buzzvm_t vm,
+                                        int32_t sid,
+                                        uint32_t* ic) {
+   buzzdict_t g = vm->gsyms;
+   if(!buzzdict_isusedat(g, *ic) ||
+      *buzzdict_keyat(g, *ic, int32_t) != sid) {
+      /* Cache miss */
+      int64_t i = buzzdict_index(g, &sid);
+      if(i < 0) return buzzvm_pushnil(vm);
+      *ic = i;
+   }
+   return buzzvm_push(vm, *buzzdict_dataat(g, *ic, buzzobj_t));
+}
+
+/*
+ * Executes 'pushs sid; tget' on the table at the top of the stack.
+ * The inline cache holds the slot of the key in the hash part of the
+ * last table read. Tables built the same way place their keys in the
+ * same slots, so the cache also works across different tables.
+ */
+static buzzvm_state buzzvm_tget_cached(buzzvm_t vm,
+                                       int32_t sid,
+                                       uint32_t* ic) {
+   buzzdict_t d = buzzvm_stack_val(vm, 1).o->t.value;
+   buzzobj_t x = NULL;
+   if(buzzdict_isusedat(d, *ic)) {
+      const buzzobj_t k = *buzzdict_keyat(d, *ic, buzzobj_t);
+      if(k->o.type == BUZZTYPE_STRING && k->s.value.sid == sid)
+         x = *buzzdict_dataat(d, *ic, buzzobj_t);
+   }
+   if(!x) {
+      /* Cache miss */
+      union buzzobj_u tmp;
+      buzzobj_t k = &tmp;
+      tmp.s.type = BUZZTYPE_STRING;
+      tmp.s.value.sid = sid;
+      tmp.s.value.str = NULL;
+      int64_t i = buzzdict_index(d, &k);
+      if(i >= 0) {
+         *ic = i;
+         x = *buzzdict_dataat(d, i, buzzobj_t);
+      }
+   }
+   buzzvm_pop(vm);
+   if(!x) return buzzvm_pushnil(vm);
+   /* Heap objects can be referenced directly, as in buzztable_get() */
+   buzzval_t v;
+   v.type = x->o.type;
+   v.v.i = (v.type == BUZZTYPE_INT || v.type == BUZZTYPE_FLOAT) ? x->i.value : 0;
+   v.o = x;
+   return buzzvm_pushv(vm, v);
+}
+
+/*
+ * Computed goto dispatch is used when the compiler supports it.
+ * Define BUZZVM_NO_COMPUTED_GOTO to use the portable switch instead.
+ */
+#if defined(__GNUC__) && !defined(BUZZVM_NO_COMPUTED_GOTO)
+#define BUZZVM_COMPUTED_GOTO
+#endif
+
+/* Leaves the loop, writing the program counter back */
+#define loop_exit() goto loop_out
+
+/* Leaves the loop if the VM is not ready after the given operation */
+#define loop_check(OP) if((OP) != BUZZVM_STATE_READY) loop_exit();
+
+/* Leaves the loop if the call stack is back to the wanted depth */
+#define loop_check_depth() if(depth && buzzvm_frame_count(vm) <= depth) loop_exit();
+
+/*
+ * Calls a closure. During a budgeted call, the instructions left are
+ * passed in vm->budget to the closures that C functions run, and read
+ * back when the call returns.
+ */
+#define loop_call(OP)                                                   \
+   if(vm->budget) vm->budget = max;                                     \
+   loop_check(OP);                                                      \
+   if(vm->budget) max = vm->budget;
+
+/* Continues at the instruction at vm->pc, after a call or a return */
+#define loop_jump_vm_pc() ip = vm->dcode + buzzvm_dcode_index(vm, vm->pc);
+
+/*
+ * Runs the native code of the instruction at ip, if any, and continues
+ * at the instruction it stopped at. 'count' is 1 when ip is the entry
+ * of a function, to count towards its compilation. Native code is only
+ * used when running without an instruction limit, so stepping through
+ * the code always uses the interpreter.
+ */
+#ifdef BUZZ_JIT
+#define loop_jit(count)                                                 \
+   if(vm->jit && !max) {                                                \
+      void* nat = buzzjit_lookup(vm, ip - vm->dcode, (count));          \
+      if(nat) {                                                         \
+         buzzvm_state s = buzzjit_run(vm, nat);                         \
+         ip = vm->dcode + buzzvm_dcode_index(vm, vm->pc);               \
+         if(s != BUZZVM_STATE_READY) {                                  \
+            cur = vm->dcode + buzzvm_dcode_index(vm, vm->oldpc);        \
+            loop_exit();                                                \
+         }                                                              \
+         cur = ip;                                                      \
+      }                                                                 \
+   }
+#else
+#define loop_jit(count)
+#endif
+
+#ifdef BUZZVM_COMPUTED_GOTO
+#define loop_instr(OP) instr_ ## OP
+#define loop_dinstr(OP) instr_ ## OP
+#define loop_dispatch() goto *dispatch[ip->opcode]
+#else
+#define loop_instr(OP) case BUZZVM_INSTR_ ## OP
+#define loop_dinstr(OP) case BUZZVM_DINSTR_ ## OP
+#define loop_dispatch() goto loop_switch
+#endif
+
+/* Moves on to the instruction pointed to by ip */
+#define loop_next()                                                     \
+   if(max && --max == 0) loop_exit();                                   \
+   cur = ip;                                                           \
+   loop_dispatch();
+
+/*
+ * Executes a comparison followed by jumpz. Integer operands are
+ * handled here, the others by the comparison function.
+ */
+#define loop_cmpjumpz(oper, FUN)                                        \
+   {                                                                    \
+      int res;                                                          \
+      buzzheap_safepoint(vm);                                           \
+      if(buzzvm_stack_top(vm) > 1 &&                                    \
+         buzzvm_stack_val(vm, 2).type == BUZZTYPE_INT &&                \
+         buzzvm_stack_val(vm, 1).type == BUZZTYPE_INT) {                \
+         res = buzzvm_stack_val(vm, 2).v.i oper buzzvm_stack_val(vm, 1).v.i; \
+         buzzvm_stack_drop(vm, 1);                                     \
+      }                                                                 \
+      else {                                                            \
+         loop_check(FUN(vm));                                           \
+         res = !buzzval_isfalse(buzzvm_stack_val(vm, 1));               \
+      }                                                                 \
+      buzzvm_stack_drop(vm, 1);                                        \
+      if(res) ++ip;                                                     \
+      else ip = vm->dcode + ip->arg.u;                                  \
+      loop_next();                                                      \
+   }
+
+/*
+ * Executes a verified binary operation. Integer operands are handled
+ * here, the others by the checked function.
+ */
+#define loop_vbinary(oper, FUN)                                         \
+   {                                                                    \
+      buzzval_t* a = &buzzvm_stack_val(vm, 2);                          \
+      const buzzval_t* b = &buzzvm_stack_val(vm, 1);                    \
+      if(a->type == BUZZTYPE_INT && b->type == BUZZTYPE_INT) {          \
+         buzzval_setint(*a, a->v.i oper b->v.i);                        \
+         buzzvm_stack_drop(vm, 1);                                     \
+      }                                                                 \
+      else loop_check(FUN(vm));                                         \
+      ++ip;                                                             \
+      loop_next();                                                      \
+   }
+
+/*
+ * Executes the bytecode until the VM is not ready anymore, 'max'
+ * instructions have been executed, or the call stack is back to
+ * 'depth' closures. Zero means no limit for 'max' and 'depth'.
+ * The loop runs on the decoded instructions. The current instruction is
+ * kept in a local variable; the program counter of the VM is only
+ * updated when calling closures and when leaving the loop.
+ */
+static buzzvm_state buzzvm_loop(buzzvm_t vm,
+                                uint32_t depth,
+                                uint32_t max) {
    /* Can't execute if not ready */
    if(vm->state != BUZZVM_STATE_READY) return vm->state;
-   /* Execute GC */
-   buzzheap_gc(vm);
-   /* Fetch instruction and (potential) argument */
-   uint8_t instr = vm->bcode[vm->pc];
-   /* Execute instruction */
-   switch(instr) {
-      case BUZZVM_INSTR_NOP: {
-         inc_pc();
-         break;
+   if(depth && buzzvm_frame_count(vm) <= depth) return vm->state;
+#ifdef BUZZVM_COMPUTED_GOTO
+   static const void* dispatch[256] = {
+      [0 ... 255]             = &&instr_INVALID,
+      [BUZZVM_INSTR_NOP]      = &&instr_NOP,
+      [BUZZVM_INSTR_DONE]     = &&instr_DONE,
+      [BUZZVM_INSTR_PUSHNIL]  = &&instr_PUSHNIL,
+      [BUZZVM_INSTR_DUP]      = &&instr_DUP,
+      [BUZZVM_INSTR_POP]      = &&instr_POP,
+      [BUZZVM_INSTR_RET0]     = &&instr_RET0,
+      [BUZZVM_INSTR_RET1]     = &&instr_RET1,
+      [BUZZVM_INSTR_ADD]      = &&instr_ADD,
+      [BUZZVM_INSTR_SUB]      = &&instr_SUB,
+      [BUZZVM_INSTR_MUL]      = &&instr_MUL,
+      [BUZZVM_INSTR_DIV]      = &&instr_DIV,
+      [BUZZVM_INSTR_MOD]      = &&instr_MOD,
+      [BUZZVM_INSTR_POW]      = &&instr_POW,
+      [BUZZVM_INSTR_UNM]      = &&instr_UNM,
+      [BUZZVM_INSTR_LAND]     = &&instr_LAND,
+      [BUZZVM_INSTR_LOR]      = &&instr_LOR,
+      [BUZZVM_INSTR_LNOT]     = &&instr_LNOT,
+      [BUZZVM_INSTR_BAND]     = &&instr_BAND,
+      [BUZZVM_INSTR_BOR]      = &&instr_BOR,
+      [BUZZVM_INSTR_BNOT]     = &&instr_BNOT,
+      [BUZZVM_INSTR_LSHIFT]   = &&instr_LSHIFT,
+      [BUZZVM_INSTR_RSHIFT]   = &&instr_RSHIFT,
+      [BUZZVM_INSTR_EQ]       = &&instr_EQ,
+      [BUZZVM_INSTR_NEQ]      = &&instr_NEQ,
+      [BUZZVM_INSTR_GT]       = &&instr_GT,
+      [BUZZVM_INSTR_GTE]      = &&instr_GTE,
+      [BUZZVM_INSTR_LT]       = &&instr_LT,
+      [BUZZVM_INSTR_LTE]      = &&instr_LTE,
+      [BUZZVM_INSTR_GLOAD]    = &&instr_GLOAD,
+      [BUZZVM_INSTR_GSTORE]   = &&instr_GSTORE,
+      [BUZZVM_INSTR_PUSHT]    = &&instr_PUSHT,
+      [BUZZVM_INSTR_TPUT]     = &&instr_TPUT,
+      [BUZZVM_INSTR_TGET]     = &&instr_TGET,
+      [BUZZVM_INSTR_CALLC]    = &&instr_CALLC,
+      [BUZZVM_INSTR_CALLS]    = &&instr_CALLS,
+      [BUZZVM_INSTR_TAILCALL] = &&instr_TAILCALL,
+      [BUZZVM_INSTR_YIELD]    = &&instr_YIELD,
+      [BUZZVM_INSTR_PUSHF]    = &&instr_PUSHF,
+      [BUZZVM_INSTR_PUSHI]    = &&instr_PUSHI,
+      [BUZZVM_INSTR_PUSHS]    = &&instr_PUSHS,
+      [BUZZVM_INSTR_PUSHCN]   = &&instr_PUSHCN,
+      [BUZZVM_INSTR_PUSHCC]   = &&instr_PUSHCC,
+      [BUZZVM_INSTR_PUSHL]    = &&instr_PUSHL,
+      [BUZZVM_INSTR_LLOAD]    = &&instr_LLOAD,
+      [BUZZVM_INSTR_LSTORE]   = &&instr_LSTORE,
+      [BUZZVM_INSTR_LCAP]     = &&instr_LCAP,
+      [BUZZVM_INSTR_JUMP]     = &&instr_JUMP,
+      [BUZZVM_INSTR_JUMPZ]    = &&instr_JUMPZ,
+      [BUZZVM_INSTR_JUMPNZ]   = &&instr_JUMPNZ,
+      [BUZZVM_INSTR_GLOADS]   = &&instr_GLOADS,
+      [BUZZVM_INSTR_TGETS]    = &&instr_TGETS,
+      [BUZZVM_INSTR_CALLCI]   = &&instr_CALLCI,
+      [BUZZVM_INSTR_ADDI]     = &&instr_ADDI,
+      [BUZZVM_INSTR_LTJUMPZ]  = &&instr_LTJUMPZ,
+      [BUZZVM_INSTR_GTJUMPZ]  = &&instr_GTJUMPZ,
+      [BUZZVM_INSTR_EQJUMPZ]  = &&instr_EQJUMPZ,
+      [BUZZVM_INSTR_NEQJUMPZ] = &&instr_NEQJUMPZ,
+      [BUZZVM_DINSTR_END]     = &&instr_END,
+      [BUZZVM_DINSTR_BADSTR]  = &&instr_BADSTR,
+      [BUZZVM_DINSTR_VDUP]    = &&instr_VDUP,
+      [BUZZVM_DINSTR_VPOP]    = &&instr_VPOP,
+      [BUZZVM_DINSTR_VADD]    = &&instr_VADD,
+      [BUZZVM_DINSTR_VSUB]    = &&instr_VSUB,
+      [BUZZVM_DINSTR_VMUL]    = &&instr_VMUL,
+      [BUZZVM_DINSTR_VEQ]     = &&instr_VEQ,
+      [BUZZVM_DINSTR_VNEQ]    = &&instr_VNEQ,
+      [BUZZVM_DINSTR_VGT]     = &&instr_VGT,
+      [BUZZVM_DINSTR_VGTE]    = &&instr_VGTE,
+      [BUZZVM_DINSTR_VLT]     = &&instr_VLT,
+      [BUZZVM_DINSTR_VLTE]    = &&instr_VLTE,
+      [BUZZVM_DINSTR_VLLOAD]  = &&instr_VLLOAD,
+      [BUZZVM_DINSTR_VLSTORE] = &&instr_VLSTORE,
+      [BUZZVM_DINSTR_VJUMPZ]  = &&instr_VJUMPZ,
+      [BUZZVM_DINSTR_VJUMPNZ] = &&instr_VJUMPNZ
+   };
+#endif
+   /* C functions that call closures run nested loops */
+   ++vm->loops;
+   /* The next and the current instruction */
+   const buzzvm_dinstr_t* ip = vm->dcode + buzzvm_dcode_index(vm, vm->pc);
+   const buzzvm_dinstr_t* cur = ip;
+   loop_jit(1);
+#ifndef BUZZVM_COMPUTED_GOTO
+  loop_switch:
+   switch(ip->opcode) {
+#else
+   loop_dispatch();
+   {
+#endif
+      loop_instr(NOP): {
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_DONE: {
-         buzzvm_done(vm);
-         break;
+      loop_instr(DONE): {
+         vm->state = BUZZVM_STATE_DONE;
+         loop_exit();
       }
-      case BUZZVM_INSTR_PUSHNIL: {
-         inc_pc();
+      loop_instr(PUSHNIL): {
+         ++ip;
          buzzvm_pushnil(vm);
-         break;
+         loop_next();
       }
-      case BUZZVM_INSTR_DUP: {
-         inc_pc();
-         buzzvm_dup(vm);
-         break;
+      loop_instr(DUP): {
+         ++ip;
+         loop_check(buzzvm_dup(vm));
+         loop_next();
       }
-      case BUZZVM_INSTR_POP: {
-         if(buzzvm_pop(vm) != BUZZVM_STATE_READY) return vm->state;
-         inc_pc();
-         break;
+      loop_instr(POP): {
+         loop_check(buzzvm_pop(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_RET0: {
-         if(buzzvm_ret0(vm) != BUZZVM_STATE_READY) return vm->state;
-         assert_pc(vm->pc);
-         break;
+      loop_instr(RET0): {
+         buzzheap_safepoint(vm);
+         loop_check(buzzvm_ret0(vm));
+         loop_jump_vm_pc();
+         loop_check_depth();
+         loop_jit(0);
+         loop_next();
       }
-      case BUZZVM_INSTR_RET1: {
-         if(buzzvm_ret1(vm) != BUZZVM_STATE_READY) return vm->state;
-         assert_pc(vm->pc);
-         break;
+      loop_instr(RET1): {
+         buzzheap_safepoint(vm);
+         loop_check(buzzvm_ret1(vm));
+         loop_jump_vm_pc();
+         loop_check_depth();
+         loop_jit(0);
+         loop_next();
       }
-      case BUZZVM_INSTR_ADD: {
-         buzzvm_add(vm);
-         inc_pc();
-         break;
+      loop_instr(ADD): {
+         loop_check(buzzvm_add(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_SUB: {
-         buzzvm_sub(vm);
-         inc_pc();
-         break;
+      loop_instr(SUB): {
+         loop_check(buzzvm_sub(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_MUL: {
-         buzzvm_mul(vm);
-         inc_pc();
-         break;
+      loop_instr(MUL): {
+         loop_check(buzzvm_mul(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_DIV: {
-         buzzvm_div(vm);
-         inc_pc();
-         break;
+      loop_instr(DIV): {
+         loop_check(buzzvm_div(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_MOD: {
-         buzzvm_mod(vm);
-         inc_pc();
-         break;
+      loop_instr(MOD): {
+         loop_check(buzzvm_mod(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_POW: {
-         buzzvm_pow(vm);
-         inc_pc();
-         break;
+      loop_instr(POW): {
+         loop_check(buzzvm_pow(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_UNM: {
-         buzzvm_unm(vm);
-         inc_pc();
-         break;
+      loop_instr(UNM): {
+         loop_check(buzzvm_unm(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LAND: {
-         buzzvm_land(vm);
-         inc_pc();
-         break;
+      loop_instr(LAND): {
+         loop_check(buzzvm_land(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LOR: {
-         buzzvm_lor(vm);
-         inc_pc();
-         break;
+      loop_instr(LOR): {
+         loop_check(buzzvm_lor(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LNOT: {
-         buzzvm_lnot(vm);
-         inc_pc();
-         break;
+      loop_instr(LNOT): {
+         loop_check(buzzvm_lnot(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_BAND: {
-         buzzvm_band(vm);
-         inc_pc();
-         break;
+      loop_instr(BAND): {
+         loop_check(buzzvm_band(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_BOR: {
-         buzzvm_bor(vm);
-         inc_pc();
-         break;
+      loop_instr(BOR): {
+         loop_check(buzzvm_bor(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_BNOT: {
-         buzzvm_bnot(vm);
-         inc_pc();
-         break;
+      loop_instr(BNOT): {
+         loop_check(buzzvm_bnot(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LSHIFT: {
-         buzzvm_lshift(vm);
-         inc_pc();
-         break;
+      loop_instr(LSHIFT): {
+         loop_check(buzzvm_lshift(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_RSHIFT: {
-         buzzvm_rshift(vm);
-         inc_pc();
-         break;
+      loop_instr(RSHIFT): {
+         loop_check(buzzvm_rshift(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_EQ: {
-         buzzvm_eq(vm);
-         inc_pc();
-         break;
+      loop_instr(EQ): {
+         loop_check(buzzvm_eq(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_NEQ: {
-         buzzvm_neq(vm);
-         inc_pc();
-         break;
+      loop_instr(NEQ): {
+         loop_check(buzzvm_neq(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_GT: {
-         buzzvm_gt(vm);
-         inc_pc();
-         break;
+      loop_instr(GT): {
+         loop_check(buzzvm_gt(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_GTE: {
-         buzzvm_gte(vm);
-         inc_pc();
-         break;
+      loop_instr(GTE): {
+         loop_check(buzzvm_gte(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LT: {
-         buzzvm_lt(vm);
-         inc_pc();
-         break;
+      loop_instr(LT): {
+         loop_check(buzzvm_lt(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LTE: {
-         buzzvm_lte(vm);
-         inc_pc();
-         break;
+      loop_instr(LTE): {
+         loop_check(buzzvm_lte(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_GLOAD: {
-         inc_pc();
-         buzzvm_gload(vm);
-         break;
+      loop_instr(GLOAD): {
+         ++ip;
+         loop_check(buzzvm_gload(vm));
+         loop_next();
       }
-      case BUZZVM_INSTR_GSTORE: {
-         inc_pc();
-         if(buzzvm_gstore(vm) != BUZZVM_STATE_READY) return vm->state;
-         break;
+      loop_instr(GSTORE): {
+         ++ip;
+         loop_check(buzzvm_gstore(vm));
+         loop_next();
       }
-      case BUZZVM_INSTR_PUSHT: {
+      loop_instr(PUSHT): {
          buzzvm_pusht(vm);
-         inc_pc();
-         break;
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_TPUT: {
-         if(buzzvm_tput(vm) != BUZZVM_STATE_READY) return vm->state;
-         inc_pc();
-         break;
+      loop_instr(TPUT): {
+         loop_check(buzzvm_tput(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_TGET: {
-         if(buzzvm_tget(vm) != BUZZVM_STATE_READY) return vm->state;
-         inc_pc();
-         break;
+      loop_instr(TGET): {
+         loop_check(buzzvm_tget(vm));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_CALLC: {
-         inc_pc();
-         if(buzzvm_callc(vm) != BUZZVM_STATE_READY) return vm->state;
-         assert_pc(vm->pc);
-         break;
+      loop_instr(CALLC): {
+         ++ip;
+         buzzheap_safepoint(vm);
+         vm->oldpc = cur->offset;
+         vm->pc = ip->offset;
+         loop_call(buzzvm_callc(vm));
+         loop_jump_vm_pc();
+         loop_check_depth();
+         loop_jit(ip != cur + 1);
+         loop_next();
       }
-      case BUZZVM_INSTR_CALLS: {
-         inc_pc();
-         if(buzzvm_calls(vm) != BUZZVM_STATE_READY) return vm->state;
-         assert_pc(vm->pc);
-         break;
+      loop_instr(CALLS): {
+         ++ip;
+         buzzheap_safepoint(vm);
+         vm->oldpc = cur->offset;
+         vm->pc = ip->offset;
+         loop_call(buzzvm_calls(vm));
+         loop_jump_vm_pc();
+         loop_check_depth();
+         loop_jit(ip != cur + 1);
+         loop_next();
       }
-      case BUZZVM_INSTR_PUSHF: {
-         inc_pc();
-         get_arg(float);
-         if(buzzvm_pushf(vm, arg) != BUZZVM_STATE_READY) return vm->state;
-         break;
+      loop_instr(TAILCALL): {
+         ++ip;
+         buzzheap_safepoint(vm);
+         vm->oldpc = cur->offset;
+         vm->pc = ip->offset;
+         loop_call(buzzvm_tailcall(vm));
+         loop_jump_vm_pc();
+         loop_check_depth();
+         loop_jit(ip != cur + 1);
+         loop_next();
       }
-      case BUZZVM_INSTR_PUSHI: {
-         inc_pc();
-         get_arg(int32_t);
-         if(buzzvm_pushi(vm, arg) != BUZZVM_STATE_READY) return vm->state;
-         break;
+      loop_instr(YIELD): {
+         ++ip;
+         vm->oldpc = cur->offset;
+         vm->pc = ip->offset;
+         loop_check(buzzcoroutine_yield(vm));
+         loop_jump_vm_pc();
+         loop_check_depth();
+         loop_jit(0);
+         loop_next();
       }
-      case BUZZVM_INSTR_PUSHS: {
-         inc_pc();
-         get_arg(int32_t);
-         if(buzzvm_pushs(vm, arg) != BUZZVM_STATE_READY) return vm->state;
-         break;
+      loop_instr(PUSHF): {
+         loop_check(buzzvm_pushf(vm, ip->arg.f));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_PUSHCN: {
-         inc_pc();
-         get_arg(uint32_t);
-         if(buzzvm_pushcn(vm, arg) != BUZZVM_STATE_READY) return vm->state;
-         break;
+      loop_instr(PUSHI): {
+         loop_check(buzzvm_pushi(vm, ip->arg.i));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_PUSHCC: {
-         inc_pc();
-         get_arg(uint32_t);
-         if(buzzvm_pushcc(vm, arg) != BUZZVM_STATE_READY) return vm->state;
-         break;
+      loop_instr(PUSHS): {
+         /* Reads with a constant key go through the inline cache */
+         if(ip[1].opcode == BUZZVM_INSTR_GLOAD) {
+            ip += 2;
+            loop_check(buzzvm_gload_cached(vm, cur->arg.i, vm->icache + (cur - vm->dcode)));
+            loop_next();
+         }
+         if(ip[1].opcode == BUZZVM_INSTR_TGET &&
+            buzzvm_stack_top(vm) > 0 &&
+            buzzvm_stack_val(vm, 1).type == BUZZTYPE_TABLE) {
+            ip += 2;
+            loop_check(buzzvm_tget_cached(vm, cur->arg.i, vm->icache + (cur - vm->dcode)));
+            loop_next();
+         }
+         loop_check(buzzvm_pushs_known(vm, ip->arg.i));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_PUSHL: {
-         inc_pc();
-         get_arg(uint32_t);
-         if(buzzvm_pushl(vm, arg) != BUZZVM_STATE_READY) return vm->state;
-         break;
+      loop_instr(PUSHCN): {
+         loop_check(buzzvm_pushcn(vm, ip->arg.u));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LLOAD: {
-         inc_pc();
-         get_arg(uint32_t);
-         buzzvm_lload(vm, arg);
-         break;
+      loop_instr(PUSHCC): {
+         loop_check(buzzvm_pushcc(vm, ip->arg.u));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_LSTORE: {
-         inc_pc();
-         get_arg(uint32_t);
-         buzzvm_lstore(vm, arg);
-         break;
+      loop_instr(PUSHL): {
+         loop_check(buzzvm_pushl(vm, ip->arg.u));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_JUMP: {
-         inc_pc();
-         get_arg(uint32_t);
-         vm->pc = arg;
-         assert_pc(vm->pc);
-         break;
+      loop_instr(LLOAD): {
+         loop_check(buzzvm_lload(vm, ip->arg.i));
+         ++ip;
+         loop_next();
       }
-      case BUZZVM_INSTR_JUMPZ: {
-         inc_pc();
-         get_arg(uint32_t);
-         buzzvm_stack_assert(vm, 1);
-         if(buzzvm_stack_at(vm, 1)->o.type == BUZZTYPE_NIL ||
-            (buzzvm_stack_at(vm, 1)->o.type == BUZZTYPE_INT &&
-             buzzvm_stack_at(vm, 1)->i.value == 0)) {
-            vm->pc = arg;
-            assert_pc(vm->pc);
+      loop_instr(LSTORE): {
+         loop_check(buzzvm_lstore(vm, ip->arg.i));
+         ++ip;
+         loop_next();
+      }
+      loop_instr(LCAP): {
+         loop_check(buzzvm_lcap(vm, ip->arg.i));
+         ++ip;
+         loop_next();
+      }
+      loop_instr(JUMP): {
+         buzzheap_safepoint(vm);
+         ip = vm->dcode + ip->arg.u;
+         loop_next();
+      }
+      loop_instr(JUMPZ): {
+         buzzheap_safepoint(vm);
+         if(buzzvm_stack_top(vm) == 0) {
+            buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "stack idx 1 out of bounds");
+            loop_exit();
          }
+         if(buzzval_isfalse(buzzvm_stack_val(vm, 1))) ip = vm->dcode + ip->arg.u;
+         else ++ip;
          buzzvm_pop(vm);
-         break;
+         loop_next();
       }
-      case BUZZVM_INSTR_JUMPNZ: {
-         inc_pc();
-         get_arg(uint32_t);
-         buzzvm_stack_assert(vm, 1);
-         if(buzzvm_stack_at(vm, 1)->o.type != BUZZTYPE_NIL &&
-            (buzzvm_stack_at(vm, 1)->o.type != BUZZTYPE_INT ||
-             buzzvm_stack_at(vm, 1)->i.value != 0)) {
-            vm->pc = arg;
-            assert_pc(vm->pc);
+      loop_instr(JUMPNZ): {
+         buzzheap_safepoint(vm);
+         if(buzzvm_stack_top(vm) == 0) {
+            buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "stack idx 1 out of bounds");
+            loop_exit();
          }
+         if(!buzzval_isfalse(buzzvm_stack_val(vm, 1))) ip = vm->dcode + ip->arg.u;
+         else ++ip;
          buzzvm_pop(vm);
-         break;
+         loop_next();
+      }
+      loop_instr(GLOADS): {
+         loop_check(buzzvm_gload_cached(vm, ip->arg.i, vm->icache + (ip - vm->dcode)));
+         ++ip;
+         loop_next();
+      }
+      loop_instr(TGETS): {
+         if(buzzvm_stack_top(vm) > 0 &&
+            buzzvm_stack_val(vm, 1).type == BUZZTYPE_TABLE) {
+            loop_check(buzzvm_tget_cached(vm, ip->arg.i, vm->icache + (ip - vm->dcode)));
+         }
+         else {
+            buzzvm_pushs_known(vm, ip->arg.i);
+            loop_check(buzzvm_tget(vm));
+         }
+         ++ip;
+         loop_next();
+      }
+      loop_instr(CALLCI): {
+         buzzvm_pushi(vm, ip->arg.i);
+         ++ip;
+         buzzheap_safepoint(vm);
+         vm->oldpc = cur->offset;
+         vm->pc = ip->offset;
+         loop_call(buzzvm_callc(vm));
+         loop_jump_vm_pc();
+         loop_check_depth();
+         loop_jit(ip != cur + 1);
+         loop_next();
+      }
+      loop_instr(ADDI): {
+         if(buzzvm_stack_top(vm) > 0 &&
+            buzzvm_stack_val(vm, 1).type == BUZZTYPE_INT) {
+            buzzval_t* a = &buzzvm_stack_val(vm, 1);
+            buzzval_setint(*a, a->v.i + ip->arg.i);
+         }
+         else {
+            buzzvm_pushi(vm, ip->arg.i);
+            loop_check(buzzvm_add(vm));
+         }
+         ++ip;
+         loop_next();
+      }
+      loop_instr(LTJUMPZ):  loop_cmpjumpz(<, buzzvm_lt);
+      loop_instr(GTJUMPZ):  loop_cmpjumpz(>, buzzvm_gt);
+      loop_instr(EQJUMPZ):  loop_cmpjumpz(==, buzzvm_eq);
+      loop_instr(NEQJUMPZ): loop_cmpjumpz(!=, buzzvm_neq);
+      loop_dinstr(END): {
+         /* Past the end of the bytecode */
+         buzzvm_seterror(vm, BUZZVM_ERROR_PC, NULL);
+         loop_exit();
+      }
+      loop_dinstr(BADSTR): {
+         buzzvm_seterror(vm,
+                         BUZZVM_ERROR_STRING,
+                         "id read = %" PRIu16,
+                         (uint16_t)ip->arg.i);
+         loop_exit();
+      }
+      /*
+       * Unchecked instructions of verified code: the stack is known
+       * to be deep enough, and local symbols to exist.
+       */
+      loop_dinstr(VDUP): {
+         buzzval_t x = buzzvm_stack_val(vm, 1);
+         buzzdarray_push(vm->stack, &x);
+         ++ip;
+         loop_next();
       }
+      loop_dinstr(VPOP): {
+         buzzvm_stack_drop(vm, 1);
+         ++ip;
+         loop_next();
+      }
+      loop_dinstr(VADD): loop_vbinary(+, buzzvm_add);
+      loop_dinstr(VSUB): loop_vbinary(-, buzzvm_sub);
+      loop_dinstr(VMUL): loop_vbinary(*, buzzvm_mul);
+      loop_dinstr(VEQ):  loop_vbinary(==, buzzvm_eq);
+      loop_dinstr(VNEQ): loop_vbinary(!=, buzzvm_neq);
+      loop_dinstr(VGT):  loop_vbinary(>, buzzvm_gt);
+      loop_dinstr(VGTE): loop_vbinary(>=, buzzvm_gte);
+      loop_dinstr(VLT):  loop_vbinary(<, buzzvm_lt);
+      loop_dinstr(VLTE): loop_vbinary(<=, buzzvm_lte);
+      loop_dinstr(VLLOAD): {
+         /* The number of parameters and captured variables is only known at run time */
+         if(ip->arg.i >= 0 && ip->arg.i <= buzzvm_lnum(vm))
+            buzzdarray_push(vm->stack, &buzzvm_lsym(vm, ip->arg.i));
+         else loop_check(buzzvm_lload(vm, ip->arg.i));
+         ++ip;
+         loop_next();
+      }
+      loop_dinstr(VLSTORE): {
+         /* New local variables and out-of-range indices take the checked path */
+         if(ip->arg.i >= 0 && ip->arg.i <= buzzvm_lnum(vm)) {
+            buzzvm_lsym(vm, ip->arg.i) = buzzvm_stack_val(vm, 1);
+            buzzvm_stack_drop(vm, 1);
+         }
+         else loop_check(buzzvm_lstore(vm, ip->arg.i));
+         ++ip;
+         loop_next();
+      }
+      loop_dinstr(VJUMPZ): {
+         buzzheap_safepoint(vm);
+         if(buzzval_isfalse(buzzvm_stack_val(vm, 1))) ip = vm->dcode + ip->arg.u;
+         else ++ip;
+         buzzvm_stack_drop(vm, 1);
+         loop_next();
+      }
+      loop_dinstr(VJUMPNZ): {
+         buzzheap_safepoint(vm);
+         if(!buzzval_isfalse(buzzvm_stack_val(vm, 1))) ip = vm->dcode + ip->arg.u;
+         else ++ip;
+         buzzvm_stack_drop(vm, 1);
+         loop_next();
+      }
+#ifdef BUZZVM_COMPUTED_GOTO
+     instr_INVALID:
+#else
       default:
+#endif
          buzzvm_seterror(vm, BUZZVM_ERROR_INSTR, NULL);
-         break;
+         loop_exit();
    }
+  loop_out:
+   if(cur->opcode != BUZZVM_DINSTR_END) vm->oldpc = cur->offset;
+   vm->pc = ip->offset;
+   /* Pass the instructions left back to the budgeted caller; a budget
+    * used up exactly still counts as running, so keep it non-zero */
+   if(vm->budget) vm->budget = max ? max : 1;
+   --vm->loops;
    return vm->state;
 }
 
 /****************************************/
 /****************************************/
 
+buzzvm_state buzzvm_step(buzzvm_t vm) {
+   return buzzvm_loop(vm, 0, 1);
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_run(buzzvm_t vm,
+                        uint32_t max_instructions) {
+   return buzzvm_loop(vm, 0, max_instructions);
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_run_to_depth(buzzvm_t vm,
+                                 uint32_t depth) {
+   return buzzvm_loop(vm, depth, 0);
+}
+
+/****************************************/
+/****************************************/
+
 buzzvm_state buzzvm_execute_script(buzzvm_t vm) {
-   while(buzzvm_step(vm) == BUZZVM_STATE_READY);
+   return buzzvm_loop(vm, 0, 0);
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Runs the code until the call stack is back to 'depth' frames, or
+ * 'budget' instructions have been executed. In the latter case, the VM
+ * is put in the yielded state, to be resumed by buzzvm_resume().
+ * @param vm The VM data.
+ * @param depth The call depth to return to.
+ * @param budget The maximum number of instructions to execute, 0 for no limit.
+ * @return The VM state.
+ */
+static buzzvm_state buzzvm_budget_run(buzzvm_t vm,
+                                      uint32_t depth,
+                                      uint32_t budget) {
+   uint32_t outer = vm->budget;
+   vm->budget = budget;
+   buzzvm_loop(vm, depth, budget);
+   vm->budget = outer;
+   if(vm->state == BUZZVM_STATE_READY &&
+      buzzvm_frame_count(vm) > depth) {
+      vm->state = BUZZVM_STATE_YIELDED;
+      vm->yielddepth = depth;
+   }
+   return vm->state;
+}
+
+/*
+ * Pushes a call frame for the given closure and jumps to its code, or
+ * executes it if it's a C closure.
+ * The arguments are copied into the local symbols of the frame, so
+ * they can be on the stack, but not among the local symbols.
+ * @param vm The VM data.
+ * @param c The closure.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @param sbase The stack size of the caller, without the arguments.
+ * @param isswrm 0 for a normal closure, 1 for a swarm closure
+ * @return The VM state.
+ */
+static buzzvm_state buzzvm_frame_push(buzzvm_t vm,
+                                      buzzobj_t c,
+                                      uint32_t argc,
+                                      const buzzval_t* argv,
+                                      int64_t sbase,
+                                      int isswrm) {
+   /* Make sure that that data about C closures is correct */
+   if((!c->c.value.isnative) &&
+      ((c->c.value.ref) >= buzzdarray_size(vm->flist))) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_FLIST, NULL);
+      return vm->state;
+   }
+   /* Make the new frame */
+   buzzvm_frame_t f;
+   const buzzval_t* env = buzzdarray_getp(c->c.value.actrec, 0, buzzval_t);
+   int64_t ncap = buzzdarray_size(c->c.value.actrec) - 1;
+   f.cbase = buzzdarray_size(vm->lsyms);
+   f.lbase = f.cbase + ncap;
+   f.retpc = vm->pc;
+   f.isswarm = isswrm;
+   f.tailcalls = 0;
+   /* The local symbols are the captured variables in reverse order,
+    * the self table and the arguments */
+   buzzdarray_reserve(vm->lsyms, f.lbase + 1 + argc);
+   buzzval_t* l = buzzdarray_getp(vm->lsyms, f.lbase, buzzval_t);
+   int64_t i;
+   for(i = 1; i <= ncap; ++i) l[-i] = env[i];
+   l[0] = env[0];
+   memcpy(l + 1, argv, argc * sizeof(buzzval_t));
+   vm->lsyms->size = f.lbase + 1 + argc;
+   /* The stack of the new frame starts empty */
+   vm->stack->size = sbase;
+   f.sbase = sbase;
+   buzzdarray_push(vm->frames, &f);
+   vm->sbase = f.sbase;
+   vm->lbase = f.lbase;
+   /* Jump to/execute the function */
+   if(c->c.value.isnative) {
+      vm->oldpc = vm->pc;
+      vm->pc = c->c.value.ref;
+   }
+   else buzzdarray_get(vm->flist,
+                       c->c.value.ref,
+                       buzzvm_funp)(vm);
    return vm->state;
 }
 
+/*
+ * Calls a closure and runs it until it returns.
+ * @param vm The VM data.
+ * @param c The closure.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @param sbase The stack size of the caller, without the arguments.
+ * @param budget The maximum number of instructions to execute, 0 for no limit.
+ * @return The VM state.
+ */
+static buzzvm_state buzzvm_frame_run(buzzvm_t vm,
+                                     buzzobj_t c,
+                                     uint32_t argc,
+                                     const buzzval_t* argv,
+                                     int64_t sbase,
+                                     uint32_t budget) {
+   /* Save the current call depth */
+   uint32_t depth = buzzvm_frame_count(vm);
+   /* Call the closure and keep running until
+    * the frame count is back to the saved value */
+   if(buzzvm_frame_push(vm, c, argc, argv, sbase, 0) != BUZZVM_STATE_READY)
+      return vm->state;
+   /* C closures are done already */
+   if(buzzvm_frame_count(vm) == depth) return vm->state;
+   /* A closure run by a C function during a budgeted call gets the
+    * instructions left. The C function can't be suspended, so running
+    * out of them is an error. */
+   if(!budget && vm->budget) {
+      buzzvm_loop(vm, depth, vm->budget);
+      if(vm->state == BUZZVM_STATE_READY &&
+         buzzvm_frame_count(vm) > depth)
+         buzzvm_seterror(vm,
+                         BUZZVM_ERROR_BUDGET,
+                         "out of instruction budget in a closure called from C");
+      return vm->state;
+   }
+   return buzzvm_budget_run(vm, depth, budget);
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_invoke(buzzvm_t vm,
+                           buzzobj_t c,
+                           uint32_t argc,
+                           const buzzval_t* argv) {
+   if(vm->state != BUZZVM_STATE_READY) return vm->state;
+   if(c->o.type != BUZZTYPE_CLOSURE) {
+      buzzvm_seterror(vm,
+                      BUZZVM_ERROR_TYPE,
+                      "expected closure, got %s",
+                      buzztype_desc[c->o.type]);
+      return vm->state;
+   }
+   return buzzvm_frame_run(vm, c, argc, argv, buzzdarray_size(vm->stack), 0);
+}
+
 /****************************************/
 /****************************************/
 
 buzzvm_state buzzvm_closure_call(buzzvm_t vm,
                                  uint32_t argc) {
-   /* Insert the self table right before the closure */
-   buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_NIL);
-   buzzdarray_insert(vm->stack,
-                     buzzdarray_size(vm->stack) - argc - 1,
-                     &o);
-   /* Push the argument count */
-   buzzvm_pushi(vm, argc);
-   /* Save the current stack depth */
-   uint32_t stacks = buzzdarray_size(vm->stacks);
-   /* Call the closure and keep stepping until
-    * the stack count is back to the saved value */
-   buzzvm_callc(vm);
-   do if(buzzvm_step(vm) != BUZZVM_STATE_READY) return vm->state;
-   while(stacks < buzzdarray_size(vm->stacks));
-   return vm->state;
+   /* Make sure the closure is where expected */
+   buzzvm_stack_assert(vm, argc + 1);
+   buzzvm_type_assert(vm, argc + 1, BUZZTYPE_CLOSURE);
+   buzzobj_t c = buzzvm_stack_val(vm, argc + 1).o;
+   /* The closure and the arguments are replaced by the return value */
+   return buzzvm_frame_run(vm, c, argc,
+                           &buzzvm_stack_val(vm, argc),
+                           buzzdarray_size(vm->stack) - argc - 1,
+                           0);
 }
 
 /****************************************/
 /****************************************/
 
-buzzvm_state buzzvm_function_call(buzzvm_t vm,
-                                  const char* fname,
-                                  uint32_t argc) {
-   /* Reset the VM state if it's DONE */
-   if(vm->state == BUZZVM_STATE_DONE)
-      vm->state = BUZZVM_STATE_READY;
-   /* Don't continue if the VM has an error */
-   if(vm->state != BUZZVM_STATE_READY)
-      return vm->state;
-   /* Push the function name (return with error if not found) */
-   buzzvm_pushs(vm, buzzvm_string_register(vm, fname, 0));
-   /* Get associated symbol */
-   buzzvm_gload(vm);
+/*
+ * Calls the closure bound to a global symbol. The arguments are at the
+ * top of the stack, they are replaced by the return value.
+ * @param vm The VM data.
+ * @param fname The function name, for error messages.
+ * @param sid The string id of the function name.
+ * @param slot The slot of the symbol in the global symbol table (a hint).
+ * @param argc The number of arguments.
+ * @param budget The maximum number of instructions to execute, 0 for no limit.
+ * @return The VM state.
+ */
+static buzzvm_state buzzvm_global_call(buzzvm_t vm,
+                                       const char* fname,
+                                       int32_t sid,
+                                       uint32_t slot,
+                                       uint32_t argc,
+                                       uint32_t budget) {
+   buzzvm_stack_assert(vm, argc);
+   /* Get the symbol, checking the slot against the key */
+   buzzdict_t g = vm->gsyms;
+   if(!buzzdict_isusedat(g, slot) ||
+      *buzzdict_keyat(g, slot, int32_t) != sid) {
+      int64_t i = buzzdict_index(g, &sid);
+      if(i < 0) {
+         buzzvm_seterror(vm,
+                         BUZZVM_ERROR_TYPE,
+                         "cannot find function '%s()'",
+                         fname);
+         return vm->state;
+      }
+      slot = i;
+   }
+   buzzobj_t c = *buzzdict_dataat(g, slot, buzzobj_t);
    /* Make sure it's a closure */
-   if(buzzvm_stack_at(vm, 1)->o.type == BUZZTYPE_NIL) {
+   if(c->o.type == BUZZTYPE_NIL) {
       buzzvm_seterror(vm,
                       BUZZVM_ERROR_TYPE,
                       "cannot find function '%s()'",
                       fname);
       return vm->state;
    }
-   if(buzzvm_stack_at(vm, 1)->o.type != BUZZTYPE_CLOSURE) {
+   if(c->o.type != BUZZTYPE_CLOSURE) {
       buzzvm_seterror(vm,
                       BUZZVM_ERROR_TYPE,
                       "function '%s()': expected closure, got %s",
                       fname,
-                      buzztype_desc[buzzvm_stack_at(vm, 1)->o.type]
+                      buzztype_desc[c->o.type]
          );
       return vm->state;
    }
-   /* Move closure before arguments */
-   if(argc > 0) {
-      buzzdarray_insert(vm->stack,
-                        buzzdarray_size(vm->stack) - argc - 1,
-                        buzzvm_stack_at(vm, 1));
-      buzzvm_pop(vm);
-   }
    /* Call the closure */
-   return buzzvm_closure_call(vm, argc);
+   buzzvm_frame_run(vm, c, argc,
+                    &buzzvm_stack_val(vm, argc),
+                    buzzdarray_size(vm->stack) - argc,
+                    budget);
+   /* Most of the objects created by the call are garbage by now */
+   if(vm->state != BUZZVM_STATE_YIELDED) buzzheap_gcminor(vm);
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_function_call(buzzvm_t vm,
+                                  const char* fname,
+                                  uint32_t argc) {
+   return buzzvm_function_call_budget(vm, fname, argc, 0);
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_function_call_budget(buzzvm_t vm,
+                                         const char* fname,
+                                         uint32_t argc,
+                                         uint32_t budget) {
+   /* Reset the VM state if it's DONE */
+   if(vm->state == BUZZVM_STATE_DONE)
+      vm->state = BUZZVM_STATE_READY;
+   /* Don't continue if the VM has an error */
+   if(vm->state != BUZZVM_STATE_READY)
+      return vm->state;
+   /* Collect garbage left over by the host code */
+   buzzheap_safepoint(vm);
+   /* Call the function */
+   return buzzvm_global_call(vm,
+                             fname,
+                             buzzvm_string_register(vm, fname, 0),
+                             0,
+                             argc,
+                             budget);
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_resume(buzzvm_t vm,
+                           uint32_t budget) {
+   if(vm->state != BUZZVM_STATE_YIELDED) return vm->state;
+   vm->state = BUZZVM_STATE_READY;
+   buzzvm_budget_run(vm, vm->yielddepth, budget);
+   /* The call is over, as in buzzvm_global_call() */
+   if(vm->state != BUZZVM_STATE_YIELDED) buzzheap_gcminor(vm);
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_fun_t buzzvm_function_lookup(buzzvm_t vm,
+                                    const char* fname) {
+   buzzvm_fun_t h;
+   /* The name must outlive the handle */
+   h.sid = buzzvm_string_register(vm, fname, 1);
+   int64_t i = buzzdict_index(vm->gsyms, &h.sid);
+   h.slot = (i < 0) ? 0 : i;
+   return h;
+}
+
+/****************************************/
+/****************************************/
+
+/*
+ * Pushes the arguments of buzzvm_function_invoke() and calls the function.
+ */
+static buzzvm_state buzzvm_function_vinvoke(buzzvm_t vm,
+                                            buzzvm_fun_t h,
+                                            uint32_t budget,
+                                            const char* fmt,
+                                            va_list ap) {
+   /* Reset the VM state if it's DONE */
+   if(vm->state == BUZZVM_STATE_DONE)
+      vm->state = BUZZVM_STATE_READY;
+   /* Don't continue if the VM has an error */
+   if(vm->state != BUZZVM_STATE_READY)
+      return vm->state;
+   /* Collect garbage left over by the host code */
+   buzzheap_safepoint(vm);
+   /* Push the arguments */
+   const char* fname = buzzvm_string_get(vm, h.sid);
+   uint32_t argc = 0;
+   for(; fmt[argc]; ++argc) {
+      switch(fmt[argc]) {
+         case 'i': buzzvm_pushi(vm, va_arg(ap, int)); break;
+         case 'f': buzzvm_pushf(vm, va_arg(ap, double)); break;
+         case 's': buzzvm_pushs(vm, buzzvm_string_register(vm, va_arg(ap, const char*), 0)); break;
+         case 'o': buzzvm_push(vm, va_arg(ap, buzzobj_t)); break;
+         default:
+            buzzvm_stack_drop(vm, argc);
+            buzzvm_seterror(vm,
+                            BUZZVM_ERROR_TYPE,
+                            "function '%s()': unknown argument type '%c'",
+                            fname,
+                            fmt[argc]);
+            return vm->state;
+      }
+   }
+   /* Call the function */
+   return buzzvm_global_call(vm, fname, h.sid, h.slot, argc, budget);
+}
+
+buzzvm_state buzzvm_function_invoke(buzzvm_t vm,
+                                    buzzvm_fun_t h,
+                                    const char* fmt,
+                                    ...) {
+   va_list ap;
+   va_start(ap, fmt);
+   buzzvm_state s = buzzvm_function_vinvoke(vm, h, 0, fmt, ap);
+   va_end(ap);
+   return s;
+}
+
+buzzvm_state buzzvm_function_invoke_budget(buzzvm_t vm,
+                                           buzzvm_fun_t h,
+                                           uint32_t budget,
+                                           const char* fmt,
+                                           ...) {
+   va_list ap;
+   va_start(ap, fmt);
+   buzzvm_state s = buzzvm_function_vinvoke(vm, h, budget, fmt, ap);
+   va_end(ap);
+   return s;
 }
 
 /****************************************/
@@ -1072,7 +2235,7 @@ int buzzvm_function_cmp(const void* a, const void* b) {
 uint32_t buzzvm_function_register(buzzvm_t vm,
                                   buzzvm_funp funp) {
    /* Look for function pointer to avoid duplicates */
-   uint32_t fpos = buzzdarray_find(vm->flist, buzzvm_function_cmp, funp);
+   uint32_t fpos = buzzdarray_find(vm->flist, buzzvm_function_cmp, &funp);
    if(fpos == buzzdarray_size(vm->flist)) {
       /* Add function to the list */
       buzzdarray_push(vm->flist, &funp);
@@ -1087,49 +2250,62 @@ buzzvm_state buzzvm_call(buzzvm_t vm, int isswrm) {
    /* Get argument number and pop it */
    buzzvm_stack_assert(vm, 1);
    buzzvm_type_assert(vm, 1, BUZZTYPE_INT);
-   int32_t argn = buzzvm_stack_at(vm, 1)->i.value;
+   int32_t argn = buzzvm_stack_val(vm, 1).v.i;
    buzzvm_pop(vm);
    /* Make sure the stack has enough elements */
    buzzvm_stack_assert(vm, argn+1);
    /* Make sure the closure is where expected */
    buzzvm_type_assert(vm, argn+1, BUZZTYPE_CLOSURE);
-   buzzobj_t c = buzzvm_stack_at(vm, argn+1);
-   /* Make sure that that data about C closures is correct */
-   if((!c->c.value.isnative) &&
-      ((c->c.value.ref) >= buzzdarray_size(vm->flist))) {
-      buzzvm_seterror(vm, BUZZVM_ERROR_FLIST, NULL);
+   buzzobj_t c = buzzvm_stack_val(vm, argn+1).o;
+   /* Get rid of the function arguments, the closure and the unused self table */
+   int64_t sbase = buzzdarray_size(vm->stack) - argn - 1;
+   if(sbase > vm->sbase) --sbase;
+   return buzzvm_frame_push(vm, c, argn,
+                            &buzzvm_stack_val(vm, argn),
+                            sbase, isswrm);
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_tailcall(buzzvm_t vm) {
+   /* Get argument number and pop it */
+   buzzvm_stack_assert(vm, 1);
+   buzzvm_type_assert(vm, 1, BUZZTYPE_INT);
+   int32_t argn = buzzvm_stack_val(vm, 1).v.i;
+   buzzvm_pop(vm);
+   /* Make sure the stack has enough elements */
+   buzzvm_stack_assert(vm, argn+1);
+   /* Make sure the closure is where expected */
+   buzzvm_type_assert(vm, argn+1, BUZZTYPE_CLOSURE);
+   buzzobj_t c = buzzvm_stack_val(vm, argn+1).o;
+   /* The frame of the script can't be replaced */
+   if(buzzvm_frame_count(vm) < 2) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "return outside of a closure");
       return vm->state;
    }
-   /* Create a new local symbol list copying the parent's */
-   vm->lsyms =
-      buzzvm_lsyms_new(isswrm,
-                       buzzdarray_clone(c->c.value.actrec));
-   buzzdarray_push(vm->lsymts, &(vm->lsyms));
-   /* Add function arguments to the local symbols */
-   int32_t i;
-   for(i = argn; i > 0; --i)
-      buzzdarray_push(vm->lsyms->syms,
-                      &buzzdarray_get(vm->stack,
-                                      buzzdarray_size(vm->stack) - i,
-                                      buzzobj_t));
-   /* Get rid of the function arguments */
-   for(i = argn+1; i > 0; --i)
-      buzzdarray_pop(vm->stack);
-   /* Pop unused self table */
-   buzzdarray_pop(vm->stack);
-   /* Push return address */
-   buzzvm_pushi((vm), vm->pc);
-   /* Make a new stack for the function */
-   vm->stack = buzzdarray_new(1, sizeof(buzzobj_t), NULL);
-   buzzdarray_push(vm->stacks, &(vm->stack));
-   /* Jump to/execute the function */
-   if(c->c.value.isnative) {
-      vm->oldpc = vm->pc;
-      vm->pc = c->c.value.ref;
+   /* C closures get a normal call, the next instruction returns */
+   if(!c->c.value.isnative) {
+      int64_t sbase = buzzdarray_size(vm->stack) - argn - 1;
+      if(sbase > vm->sbase) --sbase;
+      return buzzvm_frame_push(vm, c, argn,
+                               &buzzvm_stack_val(vm, argn),
+                               sbase, 0);
    }
-   else buzzdarray_get(vm->flist,
-                       c->c.value.ref,
-                       buzzvm_funp)(vm);
+   /* Pop the current frame, keeping the arguments on the stack
+    * memory, and call the closure from the frame beneath */
+   const buzzvm_frame_t* f = &buzzvm_frame_at(vm, 1);
+   int64_t sbase = f->sbase;
+   uint8_t isswarm = f->isswarm;
+   uint32_t tailcalls = f->tailcalls + 1;
+   const buzzval_t* argv = &buzzvm_stack_val(vm, argn);
+   vm->pc = f->retpc;
+   vm->lsyms->size = f->cbase;
+   --vm->frames->size;
+   /* The swarm of the current frame is left for the new one */
+   if(buzzvm_frame_push(vm, c, argn, argv, sbase, isswarm) != BUZZVM_STATE_READY)
+      return vm->state;
+   buzzvm_frame_at(vm, 1).tailcalls = tailcalls;
    return vm->state;
 }
 
@@ -1137,12 +2313,12 @@ buzzvm_state buzzvm_call(buzzvm_t vm, int isswrm) {
 /****************************************/
 
 buzzvm_state buzzvm_pop(buzzvm_t vm) {
-   if(buzzdarray_isempty(vm->stack)) {
+   if(buzzvm_stack_top(vm) == 0) {
       buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "empty stack");
       return vm->state;
    }
    else {
-      buzzdarray_pop(vm->stack);
+      buzzvm_stack_drop(vm, 1);
    }
    return vm->state;
 }
@@ -1151,12 +2327,12 @@ buzzvm_state buzzvm_pop(buzzvm_t vm) {
 /****************************************/
 
 buzzvm_state buzzvm_dup(buzzvm_t vm) {
-   if(buzzdarray_isempty(vm->stack)) {
+   if(buzzvm_stack_top(vm) == 0) {
       buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "empty stack");
       return vm->state;
    }
    else {
-      buzzobj_t x = buzzvm_stack_at(vm, 1);
+      buzzval_t x = buzzvm_stack_val(vm, 1);
       buzzdarray_push(vm->stack, &x);
    }
    return vm->state;
@@ -1166,6 +2342,16 @@ buzzvm_state buzzvm_dup(buzzvm_t vm) {
 /****************************************/
 
 buzzvm_state buzzvm_push(buzzvm_t vm, buzzobj_t v) {
+   buzzval_t x;
+   buzzval_setobj(x, v);
+   buzzdarray_push(vm->stack, &x);
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_pushv(buzzvm_t vm, buzzval_t v) {
    buzzdarray_push(vm->stack, &v);
    return vm->state;
 }
@@ -1173,6 +2359,23 @@ buzzvm_state buzzvm_push(buzzvm_t vm, buzzobj_t v) {
 /****************************************/
 /****************************************/
 
+buzzobj_t buzzvm_val_box(buzzvm_t vm, buzzval_t* v) {
+   if(!v->o) {
+      if(v->type == BUZZTYPE_NIL)
+         v->o = buzzheap_nil(vm);
+      else if(v->type == BUZZTYPE_INT)
+         v->o = buzzheap_newint(vm, v->v.i);
+      else {
+         v->o = buzzheap_newobj(vm, v->type);
+         v->o->i.value = v->v.i;
+      }
+   }
+   return v->o;
+}
+
+/****************************************/
+/****************************************/
+
 buzzvm_state buzzvm_pushu(buzzvm_t vm, void* v) {
    buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_USERDATA);
    o->u.value = v;
@@ -1184,9 +2387,9 @@ buzzvm_state buzzvm_pushu(buzzvm_t vm, void* v) {
 /****************************************/
 
 buzzvm_state buzzvm_pushnil(buzzvm_t vm) {
-   buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_NIL);
-   buzzvm_push(vm, o);
-   return vm->state;
+   buzzval_t x;
+   buzzval_setnil(x);
+   return buzzvm_pushv(vm, x);
 }
 
 /****************************************/
@@ -1196,7 +2399,8 @@ buzzvm_state buzzvm_pushc(buzzvm_t vm, int32_t rfrnc, int32_t nat) {
    buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_CLOSURE);
    o->c.value.isnative = nat;
    o->c.value.ref = rfrnc;
-   buzzobj_t nil = buzzheap_newobj(vm, BUZZTYPE_NIL);
+   buzzval_t nil;
+   buzzval_setnil(nil);
    buzzdarray_push(o->c.value.actrec, &nil);
    buzzvm_push(vm, o);
    return vm->state;
@@ -1206,20 +2410,18 @@ buzzvm_state buzzvm_pushc(buzzvm_t vm, int32_t rfrnc, int32_t nat) {
 /****************************************/
 
 buzzvm_state buzzvm_pushi(buzzvm_t vm, int32_t v) {
-   buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_INT);
-   o->i.value = v;
-   buzzvm_push(vm, o);
-   return vm->state;
+   buzzval_t x;
+   buzzval_setint(x, v);
+   return buzzvm_pushv(vm, x);
 }
 
 /****************************************/
 /****************************************/
 
 buzzvm_state buzzvm_pushf(buzzvm_t vm, float v) {
-   buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_FLOAT);
-   o->f.value = v;
-   buzzvm_push(vm, o);
-   return vm->state;
+   buzzval_t x;
+   buzzval_setfloat(x, v);
+   return buzzvm_pushv(vm, x);
 }
 
 /****************************************/
@@ -1247,15 +2449,14 @@ buzzvm_state buzzvm_pushl(buzzvm_t vm, int32_t addr) {
    buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_CLOSURE);
    o->c.value.isnative = 1;
    o->c.value.ref = addr;
-   if(vm->lsyms) {
-      int i;
-      for(i = 0; i < buzzdarray_size(vm->lsyms->syms); ++i)
-         buzzdarray_push(o->c.value.actrec,
-                         &buzzdarray_get(vm->lsyms->syms,
-                                         i, buzzobj_t));
+   /* The lambda shares the self table of the current function */
+   if(buzzvm_frame_count(vm) > 1) {
+      buzzdarray_push(o->c.value.actrec,
+                      &buzzvm_lsym(vm, 0));
    }
    else {
-      buzzobj_t nil = buzzheap_newobj(vm, BUZZTYPE_NIL);
+      buzzval_t nil;
+      buzzval_setnil(nil);
       buzzdarray_push(o->c.value.actrec,
                       &nil);
    }
@@ -1265,41 +2466,85 @@ buzzvm_state buzzvm_pushl(buzzvm_t vm, int32_t addr) {
 /****************************************/
 /****************************************/
 
+buzzvm_state buzzvm_lcap(buzzvm_t vm, int32_t idx) {
+   buzzvm_stack_assert(vm, 1);
+   buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
+   /* Make sure the local symbol exists */
+   if(buzzvm_frame_count(vm) < 2 ||
+      idx > buzzvm_lnum(vm) ||
+      vm->lbase + idx < buzzvm_frame_at(vm, 1).cbase) {
+      buzzvm_seterror(vm,
+                      BUZZVM_ERROR_LNUM,
+                      "no local symbol at position %" PRId32 " to capture",
+                      idx);
+      return vm->state;
+   }
+   buzzobj_t c = buzzvm_stack_val(vm, 1).o;
+   buzzdarray_push(c->c.value.actrec, &buzzvm_lsym(vm, idx));
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
 buzzvm_state buzzvm_tput(buzzvm_t vm) {
    buzzvm_stack_assert(vm, 3);
    buzzvm_type_assert(vm, 3, BUZZTYPE_TABLE);
-   buzzobj_t v = buzzvm_stack_at(vm, 1);
-   buzzobj_t k = buzzvm_stack_at(vm, 2);
-   buzzobj_t t = buzzvm_stack_at(vm, 3);
-   buzzvm_pop(vm);
-   buzzvm_pop(vm);
-   buzzvm_pop(vm);
-   if(k->o.type != BUZZTYPE_INT &&
-      k->o.type != BUZZTYPE_FLOAT &&
-      k->o.type != BUZZTYPE_STRING) {
-      buzzvm_seterror(vm, BUZZVM_ERROR_TYPE, "a %s value can't be used as table key", buzztype_desc[k->o.type]);
-      return vm->state;
+   buzzval_t* tv = &buzzvm_stack_val(vm, 3);
+   buzzval_t* kv = &buzzvm_stack_val(vm, 2);
+   buzzval_t* vv = &buzzvm_stack_val(vm, 1);
+   buzzobj_t t = tv->o;
+   /* Fast path: overwrite an element of the array part */
+   if(kv->type == BUZZTYPE_INT &&
+      t->t.array &&
+      kv->v.i >= 0 && kv->v.i < buzzdarray_size(t->t.array) &&
+      vv->type != BUZZTYPE_NIL &&
+      vv->type != BUZZTYPE_CLOSURE) {
+      buzzval_t* x = buzzdarray_getp(t->t.array, kv->v.i, buzzval_t);
+      if(x->type == BUZZTYPE_NIL) --t->t.holes;
+      *x = *vv;
+      if(vv->o) buzzheap_wbarrier(vm, t, vv->o);
+      buzzvm_pop(vm);
+      buzzvm_pop(vm);
+      buzzvm_pop(vm);
+      return BUZZVM_STATE_READY;
    }
-   if(v->o.type == BUZZTYPE_NIL) {
-      /* Nil, erase entry */
-      buzzdict_remove(t->t.value, &k);
+   uint16_t ktype = kv->type;
+   if(ktype != BUZZTYPE_INT &&
+      ktype != BUZZTYPE_FLOAT &&
+      ktype != BUZZTYPE_STRING) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_TYPE, "a %s value can't be used as table key", buzztype_desc[ktype]);
+      return vm->state;
    }
-   else if(v->o.type == BUZZTYPE_CLOSURE) {
-      /* Method call */
-      int i;
-      buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_CLOSURE);
-      o->c.value.isnative = v->c.value.isnative;
-      o->c.value.ref = v->c.value.ref;
-      buzzdarray_push(o->c.value.actrec, &t);
-      for(i = 1; i < buzzdarray_size(v->c.value.actrec); ++i)
-         buzzdarray_push(o->c.value.actrec,
-                         &buzzdarray_get(v->c.value.actrec,
-                                         i, buzzobj_t));
-      buzzdict_set(t->t.value, &k, &o);
+   union buzzobj_u tmp;
+   buzzobj_t k = buzzval_peek(*kv, tmp);
+   if(vv->type == BUZZTYPE_CLOSURE) {
+      /* Method call: the closure gets the table as self table */
+      buzzobj_t v = vv->o;
+      buzzval_t m = *vv;
+      const buzzval_t* self = buzzdarray_getp(v->c.value.actrec, 0, buzzval_t);
+      if(self->type != BUZZTYPE_TABLE || self->o != t) {
+         /* Bind a copy of the closure, along with its captured variables */
+         int i;
+         buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_CLOSURE);
+         o->c.value.isnative = v->c.value.isnative;
+         o->c.value.ref = v->c.value.ref;
+         buzzdarray_push(o->c.value.actrec, tv);
+         for(i = 1; i < buzzdarray_size(v->c.value.actrec); ++i)
+            buzzdarray_push(o->c.value.actrec,
+                            buzzdarray_getp(v->c.value.actrec,
+                                            i, buzzval_t));
+         buzzval_setobj(m, o);
+      }
+      buzztable_put(vm, t, k, m);
    }
    else {
-      buzzdict_set(t->t.value, &k, &v);
+      /* Nil erases the entry */
+      buzztable_put(vm, t, k, *vv);
    }
+   buzzvm_pop(vm);
+   buzzvm_pop(vm);
+   buzzvm_pop(vm);
    return BUZZVM_STATE_READY;
 }
 
@@ -1309,20 +2554,28 @@ buzzvm_state buzzvm_tput(buzzvm_t vm) {
 buzzvm_state buzzvm_tget(buzzvm_t vm) {
    buzzvm_stack_assert(vm, 2);
    buzzvm_type_assert(vm, 2, BUZZTYPE_TABLE);
-   buzzobj_t k = buzzvm_stack_at(vm, 1);
-   buzzobj_t t = buzzvm_stack_at(vm, 2);
+   buzzval_t* kv = &buzzvm_stack_val(vm, 1);
+   buzzobj_t t = buzzvm_stack_val(vm, 2).o;
+   buzzval_t v;
+   /* Fast path: read from the array part */
+   if(kv->type == BUZZTYPE_INT &&
+      t->t.array &&
+      kv->v.i >= 0 && kv->v.i < buzzdarray_size(t->t.array)) {
+      v = buzzdarray_get(t->t.array, kv->v.i, buzzval_t);
+   }
+   else {
+      if(kv->type != BUZZTYPE_INT &&
+         kv->type != BUZZTYPE_FLOAT &&
+         kv->type != BUZZTYPE_STRING) {
+         buzzvm_seterror(vm, BUZZVM_ERROR_TYPE, "a %s value can't be used as table key", buzztype_desc[kv->type]);
+         return vm->state;
+      }
+      union buzzobj_u tmp;
+      v = buzztable_get(t, buzzval_peek(*kv, tmp));
+   }
    buzzvm_pop(vm);
    buzzvm_pop(vm);
-   if(k->o.type != BUZZTYPE_INT &&
-      k->o.type != BUZZTYPE_FLOAT &&
-      k->o.type != BUZZTYPE_STRING) {
-      buzzvm_seterror(vm, BUZZVM_ERROR_TYPE, "a %s value can't be used as table key", k->o.type);
-      return vm->state;
-   }
-   const buzzobj_t* v = buzzdict_get(t->t.value, &k, buzzobj_t);
-   if(v) buzzvm_push(vm, *v);
-   else buzzvm_pushnil(vm);
-   return BUZZVM_STATE_READY;
+   return buzzvm_pushv(vm, v);
 }
 
 /****************************************/
@@ -1331,9 +2584,9 @@ buzzvm_state buzzvm_tget(buzzvm_t vm) {
 buzzvm_state buzzvm_gload(buzzvm_t vm) {
    buzzvm_stack_assert(vm, 1);
    buzzvm_type_assert(vm, 1, BUZZTYPE_STRING);
-   buzzobj_t str = buzzvm_stack_at(vm, 1);
+   int32_t sid = buzzvm_stack_val(vm, 1).o->s.value.sid;
    buzzvm_pop(vm);
-   const buzzobj_t* o = buzzdict_get(vm->gsyms, &(str->s.value.sid), buzzobj_t);
+   const buzzobj_t* o = buzzdict_get(vm->gsyms, &sid, buzzobj_t);
    if(!o) { buzzvm_pushnil(vm); }
    else { buzzvm_push(vm, (*o)); }
    return BUZZVM_STATE_READY;
@@ -1345,40 +2598,69 @@ buzzvm_state buzzvm_gload(buzzvm_t vm) {
 buzzvm_state buzzvm_gstore(buzzvm_t vm) {
    buzzvm_stack_assert((vm), 2);
    buzzvm_type_assert((vm), 2, BUZZTYPE_STRING);
-   buzzobj_t str = buzzvm_stack_at((vm), 2);
+   int32_t sid = buzzvm_stack_val((vm), 2).o->s.value.sid;
    buzzobj_t o = buzzvm_stack_at((vm), 1);
    buzzvm_pop(vm);
    buzzvm_pop(vm);
-   buzzdict_set((vm)->gsyms, &(str->s.value.sid), &o);
+   buzzheap_wbarrier(vm, NULL, o);
+   buzzdict_set((vm)->gsyms, &sid, &o);
    return BUZZVM_STATE_READY;
 }
 
 /****************************************/
 /****************************************/
 
-buzzvm_state buzzvm_ret0(buzzvm_t vm) {
+/*
+ * Pops the current call frame, along with its values and local symbols.
+ * The program counter is set to the return address of the frame.
+ */
+static buzzvm_state buzzvm_frame_pop(buzzvm_t vm) {
+   /* The frame of the script can't be popped */
+   if(buzzvm_frame_count(vm) < 2) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_STACK, "return outside of a closure");
+      return vm->state;
+   }
+   const buzzvm_frame_t* f = &buzzvm_frame_at(vm, 1);
    /* Pop swarm stack */
-   if(vm->lsyms->isswarm)
+   if(f->isswarm)
       buzzdarray_pop(vm->swarmstack);
-   /* Pop local symbol table */
-   buzzdarray_pop(vm->lsymts);
-   /* Set local symbol table pointer */
-   vm->lsyms = !buzzdarray_isempty(vm->lsymts) ?
-      buzzdarray_last(vm->lsymts, buzzvm_lsyms_t) :
-      NULL;
-   /* Pop stack */
-   buzzdarray_pop(vm->stacks);
-   /* Set stack pointer */
-   vm->stack = buzzdarray_last(vm->stacks, buzzdarray_t);
-   /* Make sure the stack contains at least one element */
-   buzzvm_stack_assert(vm, 1);
-   /* Make sure that element is an integer */
-   buzzvm_type_assert(vm, 1, BUZZTYPE_INT);
-   /* Use that element as program counter */
+   /* Go back to the return address */
    vm->oldpc = vm->pc;
-   vm->pc = buzzvm_stack_at(vm, 1)->i.value;
-   /* Pop the return address */
-   buzzvm_pop(vm);
+   vm->pc = f->retpc;
+   /* Pop the values and the local symbols of the frame */
+   vm->stack->size = f->sbase;
+   vm->lsyms->size = f->cbase;
+   --vm->frames->size;
+   /* Go back to the frame beneath */
+   vm->sbase = buzzvm_frame_at(vm, 1).sbase;
+   vm->lbase = buzzvm_frame_at(vm, 1).lbase;
+   /* A coroutine is over when its first frame returns */
+   if(vm->coroutine &&
+      buzzvm_frame_count(vm) == vm->coroutine->r.value->framebase)
+      buzzcoroutine_end(vm);
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_abort(buzzvm_t vm) {
+   if(vm->state != BUZZVM_STATE_YIELDED) return vm->state;
+   /* Pop the frames of the call, with the coroutines it resumed */
+   vm->state = BUZZVM_STATE_READY;
+   while(buzzvm_frame_count(vm) > vm->yielddepth)
+      buzzvm_frame_pop(vm);
+   /* The call is over, as in buzzvm_global_call() */
+   buzzheap_gcminor(vm);
+   return vm->state;
+}
+
+/****************************************/
+/****************************************/
+
+buzzvm_state buzzvm_ret0(buzzvm_t vm) {
+   /* Pop the frame */
+   if(buzzvm_frame_pop(vm) != BUZZVM_STATE_READY) return vm->state;
    /* Push nil as the return value */
    return buzzvm_pushnil(vm);
 }
@@ -1387,34 +2669,14 @@ buzzvm_state buzzvm_ret0(buzzvm_t vm) {
 /****************************************/
 
 buzzvm_state buzzvm_ret1(buzzvm_t vm) {
-   /* Pop swarm stack */
-   if(vm->lsyms->isswarm)
-      buzzdarray_pop(vm->swarmstack);
-   /* Pop local symbol table */
-   buzzdarray_pop(vm->lsymts);
-   /* Set local symbol table pointer */
-   vm->lsyms = !buzzdarray_isempty(vm->lsymts) ?
-      buzzdarray_last(vm->lsymts, buzzvm_lsyms_t) :
-      NULL;
    /* Make sure there's an element on the stack */
    buzzvm_stack_assert(vm, 1);
-   /* Save it, it's the return value to pass to the lower stack */
-   buzzobj_t ret = buzzvm_stack_at(vm, 1);
-   /* Pop stack */
-   buzzdarray_pop(vm->stacks);
-   /* Set stack pointer */
-   vm->stack = buzzdarray_last(vm->stacks, buzzdarray_t);
-   /* Make sure the stack contains at least one element */
-   buzzvm_stack_assert(vm, 1);
-   /* Make sure that element is an integer */
-   buzzvm_type_assert(vm, 1, BUZZTYPE_INT);
-   /* Use that element as program counter */
-   vm->oldpc = vm->pc;
-   vm->pc = buzzvm_stack_at(vm, 1)->i.value;
-   /* Pop the return address */
-   buzzvm_pop(vm);
+   /* Save it, it's the return value to pass to the frame beneath */
+   buzzval_t ret = buzzvm_stack_val(vm, 1);
+   /* Pop the frame */
+   if(buzzvm_frame_pop(vm) != BUZZVM_STATE_READY) return vm->state;
    /* Push the return value */
-   return buzzvm_push(vm, ret);
+   return buzzvm_pushv(vm, ret);
 }
 
 /****************************************/
@@ -1450,43 +2712,31 @@ buzzvm_state buzzvm_div(buzzvm_t vm) {
 
 buzzvm_state buzzvm_mod(buzzvm_t vm) {
    buzzvm_stack_assert((vm), 2);
-   buzzobj_t op1 = buzzvm_stack_at(vm, 1);
-   buzzobj_t op2 = buzzvm_stack_at(vm, 2);
-   buzzdarray_pop(vm->stack);
-   buzzdarray_pop(vm->stack);
-   if(op1->o.type == BUZZTYPE_INT &&
-      op2->o.type == BUZZTYPE_INT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);
-      res->i.value = op2->i.value % op1->i.value;
-      if(res->i.value < 0) res->i.value += op1->i.value;
-      return buzzvm_push(vm, res);
-   }
-   else if(op1->o.type == BUZZTYPE_FLOAT &&
-           op2->o.type == BUZZTYPE_FLOAT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = fmodf(op2->f.value, op1->f.value);
-      if(res->f.value < 0.) res->f.value += op1->f.value;
-      return buzzvm_push(vm, res);
-   }
-   else if(op1->o.type == BUZZTYPE_INT &&
-           op2->o.type == BUZZTYPE_FLOAT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = fmodf(op2->f.value, op1->i.value);
-      if(res->f.value < 0.) res->f.value += op1->f.value;
-      return buzzvm_push(vm, res);
-   }
-   else if(op1->o.type == BUZZTYPE_FLOAT &&
-           op2->o.type == BUZZTYPE_INT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = fmodf(op2->i.value, op1->f.value);
-      if(res->f.value < 0.) res->f.value += op1->i.value;
-      return buzzvm_push(vm, res);
-   }
-   else {
+   buzzval_t op1 = buzzvm_stack_val(vm, 1);
+   buzzval_t op2 = buzzvm_stack_val(vm, 2);
+   if((op1.type != BUZZTYPE_INT &&
+       op1.type != BUZZTYPE_FLOAT) ||
+      (op2.type != BUZZTYPE_INT &&
+       op2.type != BUZZTYPE_FLOAT)) {
+      buzzvm_stack_drop(vm, 1);
+      buzzvm_stack_drop(vm, 1);
       (vm)->state = BUZZVM_STATE_ERROR;
       (vm)->error = BUZZVM_ERROR_TYPE;
       return (vm)->state;
    }
+   buzzvm_stack_drop(vm, 1);
+   if(op1.type == BUZZTYPE_INT &&
+      op2.type == BUZZTYPE_INT) {
+      int32_t res = op2.v.i % op1.v.i;
+      if(res < 0) res += op1.v.i;
+      buzzval_setint(buzzvm_stack_val(vm, 1), res);
+   }
+   else {
+      float res = fmodf(buzzval_tofloat(op2), buzzval_tofloat(op1));
+      if(res < 0.) res += buzzval_tofloat(op1);
+      buzzval_setfloat(buzzvm_stack_val(vm, 1), res);
+   }
+   return vm->state;
 }
 
 /****************************************/
@@ -1494,39 +2744,22 @@ buzzvm_state buzzvm_mod(buzzvm_t vm) {
 
 buzzvm_state buzzvm_pow(buzzvm_t vm) {
    buzzvm_stack_assert((vm), 2);
-   buzzobj_t op1 = buzzvm_stack_at(vm, 1);
-   buzzobj_t op2 = buzzvm_stack_at(vm, 2);
-   buzzdarray_pop(vm->stack);
-   buzzdarray_pop(vm->stack);
-   if(op1->o.type == BUZZTYPE_INT &&
-      op2->o.type == BUZZTYPE_INT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = powf(op2->i.value, op1->i.value);
-      return buzzvm_push(vm, res);
-   }
-   else if(op1->o.type == BUZZTYPE_FLOAT &&
-           op2->o.type == BUZZTYPE_FLOAT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = powf(op2->f.value, op1->f.value);
-      return buzzvm_push(vm, res);
-   }
-   else if(op1->o.type == BUZZTYPE_INT &&
-           op2->o.type == BUZZTYPE_FLOAT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = powf(op2->f.value, op1->i.value);
-      return buzzvm_push(vm, res);
-   }
-   else if(op1->o.type == BUZZTYPE_FLOAT &&
-           op2->o.type == BUZZTYPE_INT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = powf(op2->i.value, op1->f.value);
-      return buzzvm_push(vm, res);
-   }
-   else {
+   buzzval_t op1 = buzzvm_stack_val(vm, 1);
+   buzzval_t op2 = buzzvm_stack_val(vm, 2);
+   if((op1.type != BUZZTYPE_INT &&
+       op1.type != BUZZTYPE_FLOAT) ||
+      (op2.type != BUZZTYPE_INT &&
+       op2.type != BUZZTYPE_FLOAT)) {
+      buzzvm_stack_drop(vm, 1);
+      buzzvm_stack_drop(vm, 1);
       (vm)->state = BUZZVM_STATE_ERROR;
       (vm)->error = BUZZVM_ERROR_TYPE;
       return (vm)->state;
    }
+   buzzvm_stack_drop(vm, 1);
+   buzzval_setfloat(buzzvm_stack_val(vm, 1),
+                    powf(buzzval_tofloat(op2), buzzval_tofloat(op1)));
+   return vm->state;
 }
 
 /****************************************/
@@ -1534,23 +2767,19 @@ buzzvm_state buzzvm_pow(buzzvm_t vm) {
 
 buzzvm_state buzzvm_unm(buzzvm_t vm) {
    buzzvm_stack_assert(vm, 1);
-   buzzobj_t op = buzzvm_stack_at(vm, 1);
-   buzzdarray_pop(vm->stack);
-   if(op->o.type == BUZZTYPE_INT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);
-      res->i.value = -op->i.value;
-      return buzzvm_push(vm, res);
+   buzzval_t* op = &buzzvm_stack_val(vm, 1);
+   if(op->type == BUZZTYPE_INT) {
+      buzzval_setint(*op, -op->v.i);
    }
-   else if(op->o.type == BUZZTYPE_FLOAT) {
-      buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_FLOAT);
-      res->f.value = -op->f.value;
-      return buzzvm_push(vm, res);
+   else if(op->type == BUZZTYPE_FLOAT) {
+      buzzval_setfloat(*op, -op->v.f);
    }
    else {
+      buzzvm_stack_drop(vm, 1);
       (vm)->state = BUZZVM_STATE_ERROR;
       (vm)->error = BUZZVM_ERROR_TYPE;
-      return (vm)->state;
    }
+   return (vm)->state;
 }
 
 /****************************************/
@@ -1572,13 +2801,9 @@ buzzvm_state buzzvm_lor(buzzvm_t vm) {
 
 buzzvm_state buzzvm_lnot(buzzvm_t vm) {
    buzzvm_stack_assert((vm), 1);
-   buzzobj_t op = buzzvm_stack_at(vm, 1);
-   buzzdarray_pop(vm->stack);
-   buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);
-   res->i.value =
-      (op->o.type == BUZZTYPE_NIL ||
-       (op->i.type == BUZZTYPE_INT && op->i.value == 0));
-   return buzzvm_push(vm, res);
+   int32_t res = buzzval_isfalse(buzzvm_stack_val(vm, 1));
+   buzzval_setint(buzzvm_stack_val(vm, 1), res);
+   return vm->state;
 }
 
 /****************************************/
@@ -1601,11 +2826,9 @@ buzzvm_state buzzvm_bor(buzzvm_t vm) {
 buzzvm_state buzzvm_bnot(buzzvm_t vm) {
    buzzvm_stack_assert((vm), 1);
    buzzvm_type_assert((vm), 1, BUZZTYPE_INT);
-   buzzobj_t op = buzzvm_stack_at(vm, 1);
-   buzzdarray_pop(vm->stack);
-   buzzobj_t res = buzzheap_newobj((vm), BUZZTYPE_INT);
-   res->i.value = ~op->i.value;
-   return buzzvm_push(vm, res);
+   buzzval_t* op = &buzzvm_stack_val(vm, 1);
+   buzzval_setint(*op, ~op->v.i);
+   return vm->state;
 }
 
 /****************************************/
@@ -1667,9 +2890,11 @@ buzzvm_state buzzvm_lte(buzzvm_t vm) {
 /****************************************/
 /****************************************/
 
-buzzvm_state buzzvm_lload(buzzvm_t vm, uint32_t idx) {
+buzzvm_state buzzvm_lload(buzzvm_t vm, int32_t idx) {
    /* Make sure there are sufficient local symbols in the stack */
-   if(buzzvm_lnum(vm) < idx) {
+   if(buzzvm_frame_count(vm) < 2 ||
+      buzzvm_lnum(vm) < idx ||
+      vm->lbase + idx < buzzvm_frame_at(vm, 1).cbase) {
       buzzvm_seterror(vm,
                       BUZZVM_ERROR_LNUM,
                       "not enough local symbols in stack (maybe you called a function with an insufficient number of parameters?)"
@@ -1677,18 +2902,33 @@ buzzvm_state buzzvm_lload(buzzvm_t vm, uint32_t idx) {
       return vm->state;
    }
    /* Return the local symbol */
-   buzzvm_push(vm, buzzdarray_get(vm->lsyms->syms, idx, buzzobj_t));
+   buzzvm_pushv(vm, buzzvm_lsym(vm, idx));
    return vm->state;
 }
 
 /****************************************/
 /****************************************/
 
-buzzvm_state buzzvm_lstore(buzzvm_t vm, uint32_t idx) {
+buzzvm_state buzzvm_lstore(buzzvm_t vm, int32_t idx) {
    buzzvm_stack_assert((vm), 1);
-   buzzobj_t o = buzzvm_stack_at(vm, 1);
+   /* Local symbols exist only within closures */
+   if(buzzvm_frame_count(vm) < 2) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_LNUM, "no local symbols outside of closures");
+      return vm->state;
+   }
+   /* Captured variables must exist */
+   if(vm->lbase + idx < buzzvm_frame_at(vm, 1).cbase) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_LNUM, "no captured variable at position %" PRId32, idx);
+      return vm->state;
+   }
+   /* A new local variable goes right after the existing ones */
+   if(idx > buzzvm_lnum(vm) + 1) {
+      buzzvm_seterror(vm, BUZZVM_ERROR_LNUM, "no local symbol at position %" PRId32, idx);
+      return vm->state;
+   }
+   buzzval_t o = buzzvm_stack_val(vm, 1);
    buzzvm_pop(vm);
-   buzzdarray_set((vm)->lsyms->syms, idx, &o);
+   buzzdarray_set((vm)->lsyms, (vm)->lbase + idx, &o);
    return vm->state;
 }
 
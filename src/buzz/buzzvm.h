@@ -28,7 +28,8 @@ extern "C" {
       BUZZVM_STATE_READY,      // Ready to execute next instruction
       BUZZVM_STATE_DONE,       // Program finished
       BUZZVM_STATE_ERROR,      // Error occurred
-      BUZZVM_STATE_STOPPED     // Stopped due to a breakpoint
+      BUZZVM_STATE_STOPPED,    // Stopped due to a breakpoint
+      BUZZVM_STATE_YIELDED     // Out of instruction budget, see buzzvm_resume()
    } buzzvm_state;
    extern const char *buzzvm_state_desc[];
 
@@ -44,7 +45,8 @@ extern "C" {
       BUZZVM_ERROR_FLIST,    // Function call id out of range
       BUZZVM_ERROR_TYPE,     // Type mismatch
       BUZZVM_ERROR_STRING,   // Unknown string id
-      BUZZVM_ERROR_SWARM     // Unknown swarm id
+      BUZZVM_ERROR_SWARM,    // Unknown swarm id
+      BUZZVM_ERROR_BUDGET    // Out of instruction budget where the call can't be suspended
    } buzzvm_error;
    extern const char *buzzvm_error_desc[];
 
@@ -106,10 +108,33 @@ extern "C" {
       BUZZVM_INSTR_JUMP,     // Set PC to argument
       BUZZVM_INSTR_JUMPZ,    // Set PC to argument if stack top is zero, pop operand
       BUZZVM_INSTR_JUMPNZ,   // Set PC to argument if stack top is not zero, pop operand
+      /*
+       * Superinstructions, emitted by the compiler for common sequences
+       */
+      BUZZVM_INSTR_GLOADS,   // Same as pushs + gload
+      BUZZVM_INSTR_TGETS,    // Same as pushs + tget
+      BUZZVM_INSTR_CALLCI,   // Same as pushi + callc
+      BUZZVM_INSTR_ADDI,     // Same as pushi + add
+      BUZZVM_INSTR_LTJUMPZ,  // Same as lt + jumpz
+      BUZZVM_INSTR_GTJUMPZ,  // Same as gt + jumpz
+      BUZZVM_INSTR_EQJUMPZ,  // Same as eq + jumpz
+      BUZZVM_INSTR_NEQJUMPZ, // Same as neq + jumpz
+      /*
+       * Opcodes added after the superinstructions, numbered last to keep
+       * older bytecode valid
+       */
+      BUZZVM_INSTR_LCAP,     // Capture local variable at given position in the closure at stack top
+      BUZZVM_INSTR_TAILCALL, // Calls the closure on top of the stack in place of the current one
+      BUZZVM_INSTR_YIELD,    // Suspends the running coroutine, see buzzcoroutine_yield()
       BUZZVM_INSTR_COUNT     // Used to count how many instructions have been defined
    } buzzvm_instr;
    extern const char *buzzvm_instr_desc[];
 
+   /*
+    * For each opcode, 1 if the instruction has an argument, 0 otherwise.
+    */
+   extern const uint8_t buzzvm_instr_hasarg[];
+
    /*
     * Function pointer for BUZZVM_INSTR_CALL.
     * @param vm The VM data.
@@ -119,24 +144,62 @@ extern "C" {
    typedef int (*buzzvm_funp)(struct buzzvm_s* vm);
 
    /*
-    * Data for local symbols
+    * A call frame.
+    * All the frames share the value stack and the local symbol stack
+    * of the VM. A frame records where its part of each stack begins.
+    * The local symbols of a frame are the variables captured by the
+    * closure, in reverse order, then the self table, the arguments and
+    * the local variables. The self table is at position 0, so the
+    * captured variables are at negative positions, starting at -1.
     */
-   struct buzzvm_lsyms_s {
-      /* The symbol list */
-      buzzdarray_t syms;
+   struct buzzvm_frame_s {
+      /* Position of the first value of the frame in vm->stack */
+      int64_t sbase;
+      /* Position of the first captured variable of the frame in vm->lsyms */
+      int64_t cbase;
+      /* Position of the self table of the frame in vm->lsyms */
+      int64_t lbase;
+      /* Return address */
+      int32_t retpc;
       /* 1 if this is a swarm closure, 0 if not */
       uint8_t isswarm;
+      /* Number of frames this frame replaced through tail calls */
+      uint32_t tailcalls;
    };
-   typedef struct buzzvm_lsyms_s* buzzvm_lsyms_t;
+   typedef struct buzzvm_frame_s buzzvm_frame_t;
 
    /*
-    * Creates a new local symbol table.
-    * @param isswarm 0 if this is a normal symbol table, 1 if it's for a swarm closure call.
-    * @param syms A list fo symbols.
-    * @return A new local symbol table.
+    * An instruction decoded from the bytecode.
+    * The argument is taken out of the bytecode once, when the bytecode
+    * is set. Jump targets are turned into instruction indices.
     */
-   extern buzzvm_lsyms_t buzzvm_lsyms_new(uint8_t isswarm,
-                                          buzzdarray_t syms);
+   struct buzzvm_dinstr_s {
+      /* The opcode (see buzzvm_instr) */
+      uint8_t opcode;
+      /* Offset of the instruction in the bytecode */
+      int32_t offset;
+      /* The argument, if any */
+      union {
+         int32_t i;
+         uint32_t u;
+         float f;
+      } arg;
+   };
+   typedef struct buzzvm_dinstr_s buzzvm_dinstr_t;
+
+   /*
+    * A handle to a global Buzz function.
+    * The handle refers to the global symbol, not to the closure, so it
+    * always calls the value currently assigned to it.
+    * See buzzvm_function_lookup() and buzzvm_function_invoke().
+    */
+   struct buzzvm_fun_s {
+      /* The string id of the function name */
+      int32_t sid;
+      /* Slot of the symbol in the global symbol table (a hint) */
+      uint32_t slot;
+   };
+   typedef struct buzzvm_fun_s buzzvm_fun_t;
 
    /*
     * VM data
@@ -146,18 +209,34 @@ extern "C" {
       const uint8_t* bcode;
       /* Size of the loaded bytecode */
       uint32_t bcode_size;
+      /* Decoded instructions, followed by an end marker */
+      buzzvm_dinstr_t* dcode;
+      /* Number of decoded instructions, end marker excluded */
+      uint32_t dcode_size;
+      /* Index of the decoded instruction at each bytecode offset */
+      uint32_t* dcode_index;
+      /* 1 if the decoded instructions passed buzzvm_verify() */
+      int verified;
+      /* Inline cache of each decoded instruction (a dictionary slot hint) */
+      uint32_t* icache;
+      /* The program the code belongs to, NULL if it belongs to the VM (see buzzprogram.h) */
+      struct buzzprogram_s* program;
+      /* Native code of the hot functions, NULL if there is none (see buzzjit.h) */
+      struct buzzjit_s* jit;
       /* Program counter */
       int32_t pc;
       /* Old program counter (for error reporting) */
       int32_t oldpc;
-      /* Current stack content */
+      /* Value stack of all the frames (buzzval_t) */
       buzzdarray_t stack;
-      /* Stack list */
-      buzzdarray_t stacks;
-      /* Current local variable table */
-      buzzvm_lsyms_t lsyms;
-      /* Local variable table list */
-      buzzdarray_t lsymts;
+      /* Local symbols of all the frames (buzzval_t) */
+      buzzdarray_t lsyms;
+      /* Call frames (buzzvm_frame_t), the script is at the bottom */
+      buzzdarray_t frames;
+      /* Position of the current frame in vm->stack */
+      int64_t sbase;
+      /* Position of the current frame in vm->lsyms */
+      int64_t lbase;
       /* Global symbols */
       buzzdict_t gsyms;
       /* Strings */
@@ -194,6 +273,14 @@ extern "C" {
       int32_t* rngstate;
       /* Random number generator index */
       uint32_t rngidx;
+      /* Call depth the yielded call returns to (see buzzvm_resume()) */
+      uint32_t yielddepth;
+      /* The running coroutine, NULL if none (see buzzcoroutine.h) */
+      buzzobj_t coroutine;
+      /* Number of nested runs of the interpreter loop */
+      uint32_t loops;
+      /* Instructions left to the budgeted call in progress, 0 if none */
+      uint32_t budget;
    };
    typedef struct buzzvm_s* buzzvm_t;
 
@@ -253,6 +340,37 @@ extern "C" {
                                const uint8_t* bcode,
                                uint32_t bcode_size);
 
+   /*
+    * Sets the code of a program in the VM.
+    * This does what buzzvm_set_bcode() does, but the bytecode, the
+    * decoded instructions and the constant strings are shared with the
+    * program instead of being made again.
+    * The VM must be new, and the program can't be destroyed until the
+    * VM is.
+    * @param vm The VM data.
+    * @param prog The program (see buzzprogram.h).
+    * @return 0 if everything OK, a non-zero value in case of error
+    */
+   extern int buzzvm_set_program(buzzvm_t vm,
+                                 struct buzzprogram_s* prog);
+
+   /*
+    * Verifies the loaded bytecode.
+    * The stack depth is computed for every instruction of the script
+    * and of each function it defines. Verification fails if the depth
+    * at some instruction depends on the path taken to reach it, if an
+    * instruction pops more values than the stack holds, if a call is
+    * not preceded by a push of its argument count, if a jump or a
+    * closure does not point to an instruction, or if the script
+    * accesses local symbols or returns outside of a function.
+    * Verified code runs without stack depth checks. Host code must
+    * then leave alone the values pushed by the running script.
+    * This function is called by buzzvm_set_bcode().
+    * @param vm The VM data.
+    * @return 1 if the bytecode is verified, 0 otherwise.
+    */
+   extern int buzzvm_verify(buzzvm_t vm);
+
    /*
     * Processes the input message queue.
     * @param vm The VM data.
@@ -267,11 +385,35 @@ extern "C" {
 
    /*
     * Executes the next step in the bytecode, if possible.
+    * This is meant for debuggers; use buzzvm_run() to execute code.
     * @param vm The VM data.
     * @return The updated VM state.
     */
    extern buzzvm_state buzzvm_step(buzzvm_t vm);
 
+   /*
+    * Executes the bytecode for at most the given number of instructions.
+    * Execution stops earlier if the script ends or an error occurs.
+    * @param vm The VM data.
+    * @param max_instructions The maximum number of instructions, or 0 for no limit.
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzvm_run(buzzvm_t vm,
+                                  uint32_t max_instructions);
+
+   /*
+    * Executes the bytecode until the number of call frames goes back to
+    * the given depth.
+    * This completes a closure call started with buzzvm_callc() or
+    * buzzvm_calls() from C code.
+    * Execution stops earlier if the script ends or an error occurs.
+    * @param vm The VM data.
+    * @param depth The call stack depth before the call.
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzvm_run_to_depth(buzzvm_t vm,
+                                           uint32_t depth);
+
    /*
     * Executes the script up to completion.
     * @param vm The VM data.
@@ -287,7 +429,8 @@ extern "C" {
     * ...
     * #N   argN
     * #N+1 closure
-    * This function pops all arguments.
+    * This function pops the closure and all arguments, and pushes
+    * the return value.
     * @param vm The VM data.
     * @param argc The number of arguments.
     * @return 0 if everything OK, a non-zero value in case of error
@@ -295,6 +438,24 @@ extern "C" {
    extern buzzvm_state buzzvm_closure_call(buzzvm_t vm,
                                            uint32_t argc);
 
+   /*
+    * Calls a Buzz closure with the given arguments.
+    * The call frame is set up directly from the arguments, which are
+    * not pushed on the stack. When the closure returns, its return
+    * value is pushed on the stack.
+    * The arguments may point into the stack, but not into the
+    * local symbols of the current frame.
+    * @param vm The VM data.
+    * @param c The closure.
+    * @param argc The number of arguments.
+    * @param argv The arguments.
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzvm_invoke(buzzvm_t vm,
+                                     buzzobj_t c,
+                                     uint32_t argc,
+                                     const buzzval_t* argv);
+
    /*
     * Calls a function defined in Buzz.
     * It expects the stack to be as follows:
@@ -303,6 +464,8 @@ extern "C" {
     * ...
     * #N argN
     * This function pops all arguments.
+    * When the call is over, the nursery is collected: objects that are
+    * not reachable from the VM state must not be used afterwards.
     * @param vm The VM data.
     * @param fname The function name.
     * @param argc The number of arguments.
@@ -312,6 +475,99 @@ extern "C" {
                                             const char* fname,
                                             uint32_t argc);
 
+   /*
+    * Calls a function defined in Buzz, executing at most 'budget'
+    * instructions.
+    * This is buzzvm_function_call(), except that when the budget runs
+    * out before the function returns, the VM enters the
+    * BUZZVM_STATE_YIELDED state. The call then goes on with
+    * buzzvm_resume(), and the return value is on the stack once the VM
+    * is ready again. Closures run by C functions (such as those passed
+    * to foreach()) count against the same budget. A C function can't
+    * be suspended, so running out of budget in one of these closures
+    * stops the VM with a BUZZVM_ERROR_BUDGET error.
+    * @param vm The VM data.
+    * @param fname The function name.
+    * @param argc The number of arguments.
+    * @param budget The maximum number of instructions, 0 for no limit.
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzvm_function_call_budget(buzzvm_t vm,
+                                                   const char* fname,
+                                                   uint32_t argc,
+                                                   uint32_t budget);
+
+   /*
+    * Resumes a call that ran out of instruction budget.
+    * Does nothing if the VM is not in the BUZZVM_STATE_YIELDED state.
+    * @param vm The VM data.
+    * @param budget The maximum number of instructions, 0 for no limit.
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzvm_resume(buzzvm_t vm,
+                                     uint32_t budget);
+
+   /*
+    * Drops a call that ran out of instruction budget.
+    * The frames of the call are popped, the coroutines it resumed are
+    * left dead, and the VM is ready again. Nothing is pushed on the
+    * stack. Does nothing if the VM is not in the BUZZVM_STATE_YIELDED
+    * state.
+    * @param vm The VM data.
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzvm_abort(buzzvm_t vm);
+
+   /*
+    * Returns a handle to a function defined in Buzz.
+    * The function need not be defined yet. Looking up the handle once
+    * saves registering the name and looking up the symbol at each call.
+    * @param vm The VM data.
+    * @param fname The function name.
+    * @return The function handle.
+    */
+   extern buzzvm_fun_t buzzvm_function_lookup(buzzvm_t vm,
+                                              const char* fname);
+
+   /*
+    * Calls a function defined in Buzz through its handle.
+    * The arguments are given after the format string, which has one
+    * character per argument:
+    * 'i' int
+    * 'f' float or double
+    * 's' C string
+    * 'o' buzzobj_t
+    * When the call is over, the return value is on the stack, and the
+    * nursery is collected as in buzzvm_function_call().
+    * @param vm The VM data.
+    * @param h The function handle.
+    * @param fmt The argument types.
+    * @return 0 if everything OK, a non-zero value in case of error
+    */
+   extern buzzvm_state buzzvm_function_invoke(buzzvm_t vm,
+                                              buzzvm_fun_t h,
+                                              const char* fmt,
+                                              ...);
+
+   /*
+    * Calls a function defined in Buzz through its handle, stopping
+    * after a given number of instructions.
+    * This is buzzvm_function_invoke() with the budget of
+    * buzzvm_function_call_budget(): if the budget runs out, the VM is
+    * left in the BUZZVM_STATE_YIELDED state, and buzzvm_resume() goes
+    * on with the call.
+    * @param vm The VM data.
+    * @param h The function handle.
+    * @param budget The maximum number of instructions, 0 for no limit.
+    * @param fmt The argument types.
+    * @return The updated VM state.
+    */
+   extern buzzvm_state buzzvm_function_invoke_budget(buzzvm_t vm,
+                                                     buzzvm_fun_t h,
+                                                     uint32_t budget,
+                                                     const char* fmt,
+                                                     ...);
+
    /*
     * Registers a function in the VM.
     * @param vm The VM data.
@@ -330,16 +586,28 @@ extern "C" {
     * ...
     * #1+N Closure argN
     * #2+N The closure
-    * This function pushes a new stack and a new local variable table filled with the
-    * activation record entries and the closure arguments. In addition, it leaves the stack
-    * beneath as follows:
-    * #1 An integer for the return address
+    * This function pops the closure, its arguments and the self table beneath it,
+    * and pushes a new call frame. The local symbols of the frame are the variables
+    * captured by the closure and its self table, followed by the closure arguments.
     * @param vm The VM data.
     * @param isswrm 0 for a normal closure, 1 for a swarm closure
     * @return The VM state.
     */
    extern buzzvm_state buzzvm_call(buzzvm_t vm, int isswrm);
 
+   /*
+    * Calls a closure in place of the current one.
+    * This function expects the stack to be as buzzvm_call() does. For
+    * a Buzz closure, the frame of the current closure is reused for the
+    * called one, so that tail recursion runs in constant space. The
+    * called closure returns to the caller of the current one. A C
+    * closure is called as buzzvm_call() does: the compiler emits a ret1
+    * after the tailcall instruction, which returns its value.
+    * @param vm The VM data.
+    * @return The VM state.
+    */
+   extern buzzvm_state buzzvm_tailcall(buzzvm_t vm);
+
    /*
     * Pops the stack.
     * Internally checks whether the operation is valid.
@@ -363,6 +631,27 @@ extern "C" {
     */
    extern buzzvm_state buzzvm_push(buzzvm_t vm, buzzobj_t v);
 
+   /*
+    * Pushes a tagged value on the stack.
+    * @param vm The VM data.
+    * @param v The value.
+    * @return The VM state.
+    */
+   extern buzzvm_state buzzvm_pushv(buzzvm_t vm, buzzval_t v);
+
+   /*
+    * Returns the heap object for the given value.
+    * Unboxed values are boxed on demand and the resulting object is
+    * cached in the value itself. The object of a nil, integer or
+    * floating-point value is read-only: the value keeps its own copy of
+    * the number, and small integers share one object per VM. To change
+    * the value, store a new one instead.
+    * @param vm The VM data.
+    * @param v The value.
+    * @return The heap object.
+    */
+   extern buzzobj_t buzzvm_val_box(buzzvm_t vm, buzzval_t* v);
+
    /*
     * Pushes a userdata on the stack.
     * @param vm The VM data.
@@ -417,6 +706,9 @@ extern "C" {
 
    /*
     * Pushes a lambda native closure on the stack.
+    * The self table of the closure is that of the current frame. The
+    * variables the lambda uses from the current frame are then added
+    * with buzzvm_lcap().
     * Internally checks whether the operation is valid.
     * This function is designed to be used within int-returning functions such as
     * BuzzVM hook functions or buzzvm_step().
@@ -426,6 +718,20 @@ extern "C" {
     */
    extern buzzvm_state buzzvm_pushl(buzzvm_t vm, int32_t addr);
 
+   /*
+    * Captures a local variable in the lambda closure at the stack top.
+    * The variable is copied: the closure keeps its value at the time of
+    * the capture. Inside the closure, the n-th captured variable is the
+    * local variable at position -n.
+    * Internally checks whether the operation is valid.
+    * This function is designed to be used within int-returning functions such as
+    * BuzzVM hook functions or buzzvm_step().
+    * @param vm The VM data.
+    * @param idx The local variable index.
+    * @return The VM state.
+    */
+   extern buzzvm_state buzzvm_lcap(buzzvm_t vm, int32_t idx);
+
    /*
     * Stores a (idx,value) pair in a table.
     * Internally checks whether the operation is valid.
@@ -476,11 +782,10 @@ extern "C" {
    /*
     * Returns from a closure without setting a return value.
     * Internally checks whether the operation is valid.
-    * This function expects at least two stacks to be present. The
-    * first stack is popped. The stack beneath, now the top stack, is
-    * expected to have at least one element: the return address at
-    * #1. The return address is popped and used to update the program
-    * counter.
+    * This function expects a closure frame to be present. The frame
+    * is popped along with its values and local symbols, and the
+    * program counter is set to the return address of the frame. Nil
+    * is pushed as the return value.
     * @param vm The VM data.
     * @return The VM state.
     */
@@ -489,13 +794,10 @@ extern "C" {
    /*
     * Returns from a closure setting a return value.
     * Internally checks whether the operation is valid.
-    * This function expects at least two stacks to be present. The
-    * first stack must have at least one element, which is saved as
-    * the return value of the call. The stack is then popped. The
-    * stack beneath, now the top stack, is expected to have at least
-    * one element: the return address at #1. The return address is
-    * popped and used to update the program counter. Then, the saved
-    * return value is pushed on the stack.
+    * This function expects a closure frame to be present, with at
+    * least one value on its stack. That value is saved as the return
+    * value of the call. The frame is then popped as in buzzvm_ret0(),
+    * and the saved return value is pushed on the stack.
     * @param vm The VM data.
     * @return The VM state.
     */
@@ -696,24 +998,57 @@ extern "C" {
     * This function is designed to be used within int-returning functions such as
     * BuzzVM hook functions or buzzvm_step().
     * @param vm The VM data.
-    * @param idx The local variable index.
+    * @param idx The local variable index, negative for captured variables.
     */
-   extern buzzvm_state buzzvm_lload(buzzvm_t vm, uint32_t idx);
+   extern buzzvm_state buzzvm_lload(buzzvm_t vm, int32_t idx);
 
    /*
     * Stores the object located at the stack top into the a local variable, pops operand.
-    * Internally checks whether the operation is valid.
+    * Internally checks whether the operation is valid. The index may be
+    * one past the last local variable, which adds a new one.
     * This function is designed to be used within int-returning functions such as
     * BuzzVM hook functions or buzzvm_step().
     * @param vm The VM data.
-    * @param idx The local variable index.
+    * @param idx The local variable index, negative for captured variables.
     */
-   extern buzzvm_state buzzvm_lstore(buzzvm_t vm, uint32_t idx);
+   extern buzzvm_state buzzvm_lstore(buzzvm_t vm, int32_t idx);
 
 #ifdef __cplusplus
 }
 #endif
 
+/*
+ * Opcodes used only in decoded instructions.
+ */
+#define BUZZVM_DINSTR_END    BUZZVM_INSTR_COUNT       // Past the end of the bytecode
+#define BUZZVM_DINSTR_BADSTR (BUZZVM_INSTR_COUNT + 1) // Push of an unknown string id
+
+/*
+ * Opcodes of the unchecked instructions used in verified code.
+ */
+#define BUZZVM_DINSTR_VDUP    (BUZZVM_INSTR_COUNT + 2)
+#define BUZZVM_DINSTR_VPOP    (BUZZVM_INSTR_COUNT + 3)
+#define BUZZVM_DINSTR_VADD    (BUZZVM_INSTR_COUNT + 4)
+#define BUZZVM_DINSTR_VSUB    (BUZZVM_INSTR_COUNT + 5)
+#define BUZZVM_DINSTR_VMUL    (BUZZVM_INSTR_COUNT + 6)
+#define BUZZVM_DINSTR_VEQ     (BUZZVM_INSTR_COUNT + 7)
+#define BUZZVM_DINSTR_VNEQ    (BUZZVM_INSTR_COUNT + 8)
+#define BUZZVM_DINSTR_VGT     (BUZZVM_INSTR_COUNT + 9)
+#define BUZZVM_DINSTR_VGTE    (BUZZVM_INSTR_COUNT + 10)
+#define BUZZVM_DINSTR_VLT     (BUZZVM_INSTR_COUNT + 11)
+#define BUZZVM_DINSTR_VLTE    (BUZZVM_INSTR_COUNT + 12)
+#define BUZZVM_DINSTR_VLLOAD  (BUZZVM_INSTR_COUNT + 13)
+#define BUZZVM_DINSTR_VLSTORE (BUZZVM_INSTR_COUNT + 14)
+#define BUZZVM_DINSTR_VJUMPZ  (BUZZVM_INSTR_COUNT + 15)
+#define BUZZVM_DINSTR_VJUMPNZ (BUZZVM_INSTR_COUNT + 16)
+
+/*
+ * Returns the index of the decoded instruction at the given offset.
+ * Offsets that are not the start of an instruction give the end marker.
+ */
+#define buzzvm_dcode_index(vm, off)                                      \
+   ((off) >= 0 && (off) < (vm)->bcode_size ? (vm)->dcode_index[(off)] : (vm)->dcode_size)
+
 /*
  * Checks whether the given stack idx is valid.
  * If the idx is not valid, it updates the VM state and exits the current function.
@@ -741,12 +1076,12 @@ extern "C" {
  * @param tpe The type to check
  */
 #define buzzvm_type_assert(vm, idx, tpe)                                \
-   if(buzzvm_stack_at((vm), (idx))->o.type != tpe) {                    \
+   if(buzzvm_stack_type((vm), (idx)) != tpe) {                          \
       buzzvm_seterror((vm),                                             \
                       BUZZVM_ERROR_TYPE,                                \
                       "expected %s, got %s",                            \
                       buzztype_desc[tpe],                               \
-                      buzztype_desc[buzzvm_stack_at((vm), (idx))->o.type] \
+                      buzztype_desc[buzzvm_stack_type((vm), (idx))]     \
          );                                                             \
       return (vm)->state;                                               \
    }
@@ -760,30 +1095,61 @@ extern "C" {
  * @param idx The stack index, where 0 is the stack top and >0 goes down the stack.
  */
 #define buzzvm_type_assert_number(vm, idx)                              \
-   if(buzzvm_stack_at((vm), (idx))->o.type != BUZZTYPE_INT &&           \
-      buzzvm_stack_at((vm), (idx))->o.type != BUZZTYPE_FLOAT) {         \
+   if(buzzvm_stack_type((vm), (idx)) != BUZZTYPE_INT &&                 \
+      buzzvm_stack_type((vm), (idx)) != BUZZTYPE_FLOAT) {               \
       buzzvm_seterror((vm),                                             \
                       BUZZVM_ERROR_TYPE,                                \
                       "expected int or float, got %s",                  \
-                      buzztype_desc[buzzvm_stack_at((vm), (idx))->o.type] \
+                      buzztype_desc[buzzvm_stack_type((vm), (idx))]     \
          );                                                             \
       return (vm)->state;                                               \
    }
 
 /*
- * Returns the size of the stack.
- * The most recently pushed element in the stack is at top - 1.
+ * Returns the size of the stack of the current frame.
  * @param vm The VM data.
  */
-#define buzzvm_stack_top(vm) buzzdarray_size((vm)->stack)
+#define buzzvm_stack_top(vm) (buzzdarray_size((vm)->stack) - (vm)->sbase)
 
 /*
- * Returns the stack element at the passed index.
+ * Returns the tagged value at the passed stack index (as an lvalue).
  * Does not perform any check on the validity of the index.
  * @param vm The VM data.
  * @param idx The stack index, where 0 is the stack top and >0 goes down the stack.
  */
-#define buzzvm_stack_at(vm, idx) buzzdarray_get((vm)->stack, (buzzvm_stack_top(vm) - (idx)), buzzobj_t)
+#define buzzvm_stack_val(vm, idx) (*buzzdarray_getp((vm)->stack, (buzzdarray_size((vm)->stack) - (idx)), buzzval_t))
+
+/*
+ * Returns the number of call frames, including that of the script.
+ * @param vm The VM data.
+ */
+#define buzzvm_frame_count(vm) buzzdarray_size((vm)->frames)
+
+/*
+ * Returns the call frame at the passed index (as an lvalue).
+ * Does not perform any check on the validity of the index.
+ * @param vm The VM data.
+ * @param idx The frame index, where 1 is the current frame and >1 goes down the call stack.
+ */
+#define buzzvm_frame_at(vm, idx) (*buzzdarray_getp((vm)->frames, (buzzvm_frame_count(vm) - (idx)), buzzvm_frame_t))
+
+/*
+ * Returns the type of the stack element at the passed index.
+ * Does not perform any check on the validity of the index.
+ * @param vm The VM data.
+ * @param idx The stack index, where 0 is the stack top and >0 goes down the stack.
+ */
+#define buzzvm_stack_type(vm, idx) (buzzvm_stack_val(vm, idx).type)
+
+/*
+ * Returns the stack element at the passed index as a heap object.
+ * Unboxed values are boxed on demand. The object of a nil, integer or
+ * floating-point value is read-only, see buzzvm_val_box().
+ * Does not perform any check on the validity of the index.
+ * @param vm The VM data.
+ * @param idx The stack index, where 0 is the stack top and >0 goes down the stack.
+ */
+#define buzzvm_stack_at(vm, idx) buzzvm_val_box((vm), &buzzvm_stack_val(vm, idx))
 
 /*
  * Converts a number at the given position in the stack to int.
@@ -792,10 +1158,10 @@ extern "C" {
  * @param vm The VM data.
  * @param idx The stack index, where 0 is the stack top and >0 goes down the stack.
  */
-#define buzzvm_stack_number_to_int(vm, idx)                 \
-   (buzzvm_stack_at((vm), (idx))->o.type == BUZZTYPE_INT ?  \
-    buzzvm_stack_at((vm), (idx))->i.value :                 \
-    (int32_t)buzzvm_stack_at((vm), (idx))->f.value)
+#define buzzvm_stack_number_to_int(vm, idx)              \
+   (buzzvm_stack_type((vm), (idx)) == BUZZTYPE_INT ?     \
+    buzzvm_stack_val((vm), (idx)).v.i :                  \
+    (int32_t)buzzvm_stack_val((vm), (idx)).v.f)
 
 /*
  * Converts a number at the given position in the stack to float.
@@ -804,10 +1170,10 @@ extern "C" {
  * @param vm The VM data.
  * @param idx The stack index, where 0 is the stack top and >0 goes down the stack.
  */
-#define buzzvm_stack_number_to_float(vm, idx)                       \
-   (buzzvm_stack_at((vm), (idx))->o.type == BUZZTYPE_FLOAT ?  \
-    buzzvm_stack_at((vm), (idx))->f.value :                   \
-    (float)buzzvm_stack_at((vm), (idx))->i.value)
+#define buzzvm_stack_number_to_float(vm, idx)            \
+   (buzzvm_stack_type((vm), (idx)) == BUZZTYPE_FLOAT ?   \
+    buzzvm_stack_val((vm), (idx)).v.f :                  \
+    (float)buzzvm_stack_val((vm), (idx)).v.i)
 
 /*
  * Terminates the current Buzz script.
@@ -843,7 +1209,15 @@ extern "C" {
  * Returns the number of local variables in the current local symbol stack.
  * @param vm The VM data.
  */
-#define buzzvm_lnum(vm) (buzzdarray_size((vm)->lsyms->syms)-1)
+#define buzzvm_lnum(vm) (buzzdarray_size((vm)->lsyms) - (vm)->lbase - 1)
+
+/*
+ * Returns the local symbol of the current frame at the passed index (as an lvalue).
+ * Does not perform any check on the validity of the index.
+ * @param vm The VM data.
+ * @param idx The local symbol index, where 0 is the self table.
+ */
+#define buzzvm_lsym(vm, idx) (*buzzdarray_getp((vm)->lsyms, (vm)->lbase + (idx), buzzval_t))
 
 /*
  * Checks whether the current function was passed a certain number of parameters.
@@ -866,10 +1240,8 @@ extern "C" {
  * ...
  * #1+N Closure argN
  * #2+N The closure
- * This function pushes a new stack and a new local variable table filled with the
- * activation record entries and the closure arguments. In addition, it leaves the stack
- * beneath as follows:
- * #1 An integer for the return address
+ * This function pops the closure, its arguments and the self table beneath it,
+ * and pushes a new call frame.
  */
 #define buzzvm_callc(vm) buzzvm_call(vm, 0)
 
@@ -884,10 +1256,8 @@ extern "C" {
  * ...
  * #1+N Closure argN
  * #2+N The closure
- * This function pushes a new stack and a new local variable table filled with the
- * activation record entries and the closure arguments. In addition, it leaves the stack
- * beneath as follows:
- * #1 An integer for the return address
+ * This function pops the closure, its arguments and the self table beneath it,
+ * and pushes a new call frame.
  */
 #define buzzvm_calls(vm) buzzvm_call(vm, 1)
 
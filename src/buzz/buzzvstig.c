@@ -81,9 +81,7 @@ buzzvstig_elem_t buzzvstig_elem_clone(buzzvm_t vm, const buzzvstig_elem_t e) {
 /****************************************/
 
 void buzzvstig_elem_destroy(const void* key, void* data, void* params) {
-   free((void*)key);
    free(*(buzzvstig_elem_t*)data);
-   free(data);
 }
 
 /****************************************/
@@ -198,6 +196,9 @@ int buzzvstig_put(buzzvm_t vm) {
    /* Get value */
    buzzvm_lload(vm, 2);
    buzzobj_t v = buzzvm_stack_at(vm, 1);
+   /* Key and value may end up in the virtual stigmergy */
+   buzzheap_wbarrier(vm, NULL, k);
+   buzzheap_wbarrier(vm, NULL, v);
    /* Look for virtual stigmergy */
    const buzzvstig_t* vs = buzzdict_get(vm->vstigs, &id, buzzvstig_t);
    if(vs) {
@@ -250,13 +251,15 @@ void buzzvstig_foreach_entry(const void* key, void* data, void* params) {
    /* Cast params */
    struct buzzvstig_foreach_params* p = (struct buzzvstig_foreach_params*)params;
    if(p->vm->state != BUZZVM_STATE_READY) return;
-   /* Push closure and params (key, value, robot) */
-   buzzvm_push(p->vm, p->fun);
-   buzzvm_push(p->vm, *(buzzobj_t*)key);
-   buzzvm_push(p->vm, (*(buzzvstig_elem_t*)data)->data);
-   buzzvm_pushi(p->vm, (*(buzzvstig_elem_t*)data)->robot);
-   /* Call closure */
-   p->vm->state = buzzvm_closure_call(p->vm, 3);
+   /* Call closure with key, value and robot */
+   buzzval_t args[3];
+   buzzval_setobj(args[0], *(buzzobj_t*)key);
+   buzzval_setobj(args[1], (*(buzzvstig_elem_t*)data)->data);
+   buzzval_setint(args[2], (*(buzzvstig_elem_t*)data)->robot);
+   p->vm->state = buzzvm_invoke(p->vm, p->fun, 3, args);
+   if(p->vm->state != BUZZVM_STATE_READY) return;
+   /* Get rid of return value */
+   buzzvm_pop(p->vm);
 }
 
 int buzzvstig_foreach(struct buzzvm_s* vm) {
@@ -358,9 +361,9 @@ int buzzvstig_onconflict(struct buzzvm_s* vm) {
       /* Get closure */
       buzzvm_lload(vm, 1);
       buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
-      /* Clone the closure */
-      if((*vs)->onconflict) free((*vs)->onconflict);
+      /* Clone the closure; the previous one is left to the GC */
       (*vs)->onconflict = buzzheap_clone(vm, buzzvm_stack_at(vm, 1));
+      buzzheap_wbarrier(vm, NULL, (*vs)->onconflict);
    }
    else {
       /* No virtual stigmergy found, just push false */
@@ -386,9 +389,9 @@ int buzzvstig_onconflictlost(struct buzzvm_s* vm) {
       /* Get closure */
       buzzvm_lload(vm, 1);
       buzzvm_type_assert(vm, 1, BUZZTYPE_CLOSURE);
-      /* Clone the closure */
-      if((*vs)->onconflictlost) free((*vs)->onconflictlost);
+      /* Clone the closure; the previous one is left to the GC */
       (*vs)->onconflictlost = buzzheap_clone(vm, buzzvm_stack_at(vm, 1));
+      buzzheap_wbarrier(vm, NULL, (*vs)->onconflictlost);
    }
    else {
       /* No virtual stigmergy found, just push false */
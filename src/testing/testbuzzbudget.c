@@ -0,0 +1,131 @@
+#include <buzz/buzzvm.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Instruction budget test.
+ * Calls the functions in testbuzzbudget.bo with budgets too small for
+ * them to finish, and resumes or aborts them. The result must be the
+ * same as without budget. Closures run from C count against the budget
+ * too, and running out of it there is an error.
+ * Usage: testbuzzbudget [file.bo]
+ */
+
+static int ok = 1;
+
+static void check(const char* name, int cond) {
+   printf("%-40s %s\n", name, cond ? "OK" : "FAILED");
+   if(!cond) ok = 0;
+}
+
+/*
+ * Reads a bytecode file. Returns the buffer, or NULL in case of error.
+ */
+static uint8_t* load(const char* fname, uint32_t* size) {
+   FILE* fd = fopen(fname, "rb");
+   if(!fd) { perror(fname); return NULL; }
+   fseek(fd, 0, SEEK_END);
+   *size = ftell(fd);
+   rewind(fd);
+   uint8_t* buf = (uint8_t*)malloc(*size);
+   if(fread(buf, 1, *size, fd) < *size) {
+      perror(fname);
+      free(buf);
+      buf = NULL;
+   }
+   fclose(fd);
+   return buf;
+}
+
+/*
+ * Returns the value of the integer global 'count'.
+ */
+static int32_t count(buzzvm_t vm) {
+   buzzvm_pushs(vm, buzzvm_string_register(vm, "count", 1));
+   buzzvm_gload(vm);
+   int32_t c = buzzvm_stack_at(vm, 1)->i.value;
+   buzzvm_pop(vm);
+   return c;
+}
+
+/*
+ * Pops the integer return value of a call.
+ */
+static int32_t result(buzzvm_t vm) {
+   int32_t r = buzzvm_stack_at(vm, 1)->i.value;
+   buzzvm_pop(vm);
+   return r;
+}
+
+/*
+ * Resumes a call until it is over. Returns the number of resumes.
+ */
+static int resume_all(buzzvm_t vm, uint32_t budget) {
+   int n = 0;
+   while(vm->state == BUZZVM_STATE_YIELDED) {
+      buzzvm_resume(vm, budget);
+      ++n;
+   }
+   return n;
+}
+
+int main(int argc, char** argv) {
+   const char* fname = (argc > 1) ? argv[1] : "testbuzzbudget.bo";
+   uint32_t size;
+   uint8_t* bcode = load(fname, &size);
+   if(!bcode) return 1;
+   buzzvm_t vm = buzzvm_new(0);
+   buzzvm_set_bcode(vm, bcode, size);
+   check("script", buzzvm_execute_script(vm) == BUZZVM_STATE_DONE);
+   buzzvm_fun_t sum = buzzvm_function_lookup(vm, "sum");
+   /* No limit */
+   buzzvm_function_invoke_budget(vm, sum, 0, "i", 100);
+   check("no limit", vm->state == BUZZVM_STATE_READY && result(vm) == 4950);
+   /* A budget large enough */
+   buzzvm_function_invoke_budget(vm, sum, 100000, "i", 100);
+   check("large budget", vm->state == BUZZVM_STATE_READY && result(vm) == 4950);
+   /* Out of budget: the call stops partway */
+   int32_t c0 = count(vm);
+   buzzvm_pushi(vm, 100);
+   buzzvm_function_call_budget(vm, "sum", 1, 50);
+   int32_t c1 = count(vm);
+   check("out of budget", vm->state == BUZZVM_STATE_YIELDED);
+   check("partial progress", c1 > c0 && c1 < c0 + 100);
+   /* Another call must wait for the current one to end */
+   check("call while yielded",
+         buzzvm_function_invoke(vm, sum, "i", 1) == BUZZVM_STATE_YIELDED &&
+         count(vm) == c1);
+   /* Resume until the call is over */
+   int n = resume_all(vm, 50);
+   check("resumed several times", n > 1);
+   check("result after resuming",
+         vm->state == BUZZVM_STATE_READY && result(vm) == 4950);
+   check("loop done once", count(vm) == c0 + 100);
+   /* Same through a handle */
+   buzzvm_function_invoke_budget(vm, sum, 20, "i", 10);
+   check("handle out of budget", vm->state == BUZZVM_STATE_YIELDED);
+   resume_all(vm, 20);
+   check("handle result", vm->state == BUZZVM_STATE_READY && result(vm) == 45);
+   /* Resuming a call that is over does nothing */
+   check("resume when ready", buzzvm_resume(vm, 20) == BUZZVM_STATE_READY);
+   /* Aborting drops the call and leaves the VM usable */
+   int64_t stack = buzzvm_stack_top(vm);
+   buzzvm_function_invoke_budget(vm, sum, 20, "i", 100);
+   check("abort", buzzvm_abort(vm) == BUZZVM_STATE_READY);
+   check("abort pops the call",
+         buzzvm_stack_top(vm) == stack && buzzvm_frame_count(vm) == 1);
+   buzzvm_function_invoke(vm, sum, "i", 10);
+   check("call after abort", vm->state == BUZZVM_STATE_READY && result(vm) == 45);
+   /* Closures run from C share the budget */
+   buzzvm_pushi(vm, 100);
+   buzzvm_function_call(vm, "fill", 1);
+   buzzvm_pop(vm);
+   buzzvm_function_call_budget(vm, "each", 0, 100000);
+   check("closure run from C", vm->state == BUZZVM_STATE_READY && result(vm) == 4950);
+   buzzvm_function_call_budget(vm, "each", 0, 100);
+   check("closure run from C out of budget",
+         vm->state == BUZZVM_STATE_ERROR && vm->error == BUZZVM_ERROR_BUDGET);
+   buzzvm_destroy(&vm);
+   free(bcode);
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+#include <buzz/buzzvm.h>
+#include <buzz/buzzcoroutine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Coroutine test.
+ * Runs testcoroutine.bo, which checks the values passed in and out of
+ * coroutines, then calls its functions to check that misused coroutines
+ * stop the VM with an error, that suspended coroutines are kept by the
+ * garbage collector while reachable and collected afterwards, and that
+ * a coroutine resumed from another one keeps the resumer alive.
+ * Usage: testbuzzcoroutine [file.bo]
+ */
+
+static int ok = 1;
+
+static void check(const char* name, int cond) {
+   printf("%-40s %s\n", name, cond ? "OK" : "FAILED");
+   if(!cond) ok = 0;
+}
+
+/*
+ * Reads a bytecode file. Returns the buffer, or NULL in case of error.
+ */
+static uint8_t* load(const char* fname, uint32_t* size) {
+   FILE* fd = fopen(fname, "rb");
+   if(!fd) { perror(fname); return NULL; }
+   fseek(fd, 0, SEEK_END);
+   *size = ftell(fd);
+   rewind(fd);
+   uint8_t* buf = (uint8_t*)malloc(*size);
+   if(fread(buf, 1, *size, fd) < *size) {
+      perror(fname);
+      free(buf);
+      buf = NULL;
+   }
+   fclose(fd);
+   return buf;
+}
+
+/*
+ * Quiet version of log(), the script output is not checked here.
+ */
+static int quiet(buzzvm_t vm) {
+   return buzzvm_ret0(vm);
+}
+
+/* Set by collect_young() if the resumer survived the collection */
+static int resumer_kept = 0;
+
+/*
+ * collect() for the script: collects the nursery, and checks that the
+ * coroutine that resumed the running one is still in the heap.
+ */
+static int collect_young(buzzvm_t vm) {
+   buzzobj_t prev = vm->coroutine ? vm->coroutine->r.value->prev : NULL;
+   buzzheap_gcminor(vm);
+   int64_t i;
+   for(i = 0; prev && i < buzzdarray_size(vm->heap->objs); ++i)
+      if(buzzdarray_get(vm->heap->objs, i, buzzobj_t) == prev)
+         resumer_kept = 1;
+   return buzzvm_ret0(vm);
+}
+
+/*
+ * Makes a VM and runs the script.
+ */
+static buzzvm_t setup(const uint8_t* bcode, uint32_t size) {
+   buzzvm_t vm = buzzvm_new(0);
+   buzzvm_set_bcode(vm, bcode, size);
+   buzzvm_pushs(vm, buzzvm_string_register(vm, "log", 1));
+   buzzvm_pushcc(vm, buzzvm_function_register(vm, quiet));
+   buzzvm_gstore(vm);
+   buzzvm_pushs(vm, buzzvm_string_register(vm, "collect", 1));
+   buzzvm_pushcc(vm, buzzvm_function_register(vm, collect_young));
+   buzzvm_gstore(vm);
+   buzzvm_execute_script(vm);
+   return vm;
+}
+
+/*
+ * Calls a function of the script and pops its return value.
+ * Returns the value if it is an integer, -1 otherwise.
+ */
+static int32_t call(buzzvm_t vm, const char* fname) {
+   buzzvm_function_call(vm, fname, 0);
+   if(vm->state != BUZZVM_STATE_READY) return -1;
+   buzzobj_t o = buzzvm_stack_at(vm, 1);
+   int32_t r = (o->o.type == BUZZTYPE_INT) ? o->i.value : -1;
+   buzzvm_pop(vm);
+   return r;
+}
+
+/*
+ * Calls a function that must stop the VM with the given error message.
+ */
+static void check_error(const char* name,
+                        const uint8_t* bcode,
+                        uint32_t size,
+                        const char* fname,
+                        const char* msg) {
+   buzzvm_t vm = setup(bcode, size);
+   buzzvm_function_call(vm, fname, 0);
+   check(name,
+         vm->state == BUZZVM_STATE_ERROR &&
+         strstr(vm->errormsg, msg) != NULL);
+   buzzvm_destroy(&vm);
+}
+
+/*
+ * Runs a full collection and returns the number of live objects.
+ */
+static uint32_t collect(buzzvm_t vm) {
+   buzzheap_gc(vm);
+   vm->heap->max_objs = 0;
+   buzzheap_gc(vm);
+   buzzheap_stats_t stats;
+   buzzheap_stats(vm, &stats);
+   return stats.objs;
+}
+
+int main(int argc, char** argv) {
+   const char* fname = (argc > 1) ? argv[1] : "testcoroutine.bo";
+   uint32_t size;
+   uint8_t* bcode = load(fname, &size);
+   if(!bcode) return 1;
+   /* The checks of the script itself */
+   buzzvm_t vm = setup(bcode, size);
+   check("script", vm->state == BUZZVM_STATE_DONE);
+   /* A suspended coroutine survives collections while reachable */
+   call(vm, "drop");
+   uint32_t base = collect(vm);
+   check("suspend", call(vm, "suspend") == 41);
+   check("suspended coroutine kept", collect(vm) > base);
+   check("resume after collection", call(vm, "finish") == 42);
+   /* It is collected when no longer reachable */
+   call(vm, "suspend");
+   call(vm, "drop");
+   check("suspended coroutine collected", collect(vm) == base);
+   /* The resumer is kept by the old coroutine it resumed */
+   call(vm, "make_old");
+   check("collection in a nested resume", call(vm, "nested_gc") == 11);
+   check("resumer kept", resumer_kept);
+   buzzvm_destroy(&vm);
+   /* Errors */
+   check_error("resume a dead coroutine", bcode, size,
+               "resume_dead", "cannot resume a dead coroutine");
+   check_error("yield outside of a coroutine", bcode, size,
+               "yield_outside", "yield outside of a coroutine");
+   free(bcode);
+   return ok ? 0 : 1;
+}
@@ -1,5 +1,6 @@
 #include <buzz/buzzdict.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 void di_print_elem(const void* key, void* data, void* params) {
    int16_t k = *(const int16_t*)key;
@@ -25,6 +26,59 @@ int di_cmp(const void* a, const void* b) {
    return 0;
 }
 
+#define STRESS_KEYS 20000
+
+/*
+ * Inserts, overwrites and removes many keys, checking the contents
+ * against a plain array. Returns 0 on success.
+ */
+int di_stress() {
+   buzzdict_t di = buzzdict_new(4,
+                                sizeof(int32_t),
+                                sizeof(int32_t),
+                                buzzdict_int32keyhash,
+                                buzzdict_int32keycmp,
+                                NULL);
+   static int32_t shadow[STRESS_KEYS]; /* 0 means absent */
+   uint32_t size = 0, maxcap = 0;
+   int32_t i, k, d;
+   srand(42);
+   for(i = 0; i < 20 * STRESS_KEYS; ++i) {
+      k = rand() % STRESS_KEYS;
+      /* Insert in the first half, mostly remove in the second */
+      if(i < 10 * STRESS_KEYS || rand() % 4 == 0) {
+         d = i + 1;
+         if(!shadow[k]) ++size;
+         shadow[k] = d;
+         buzzdict_set(di, &k, &d);
+      }
+      else {
+         if(buzzdict_remove(di, &k) != (shadow[k] != 0)) {
+            fprintf(stdout, "stress: wrong removal of %d\n", k);
+            return 1;
+         }
+         if(shadow[k]) --size;
+         shadow[k] = 0;
+      }
+      if(di->capacity > maxcap) maxcap = di->capacity;
+   }
+   if(buzzdict_size(di) != size) {
+      fprintf(stdout, "stress: size %u, expected %u\n", buzzdict_size(di), size);
+      return 1;
+   }
+   for(k = 0; k < STRESS_KEYS; ++k) {
+      const int32_t* x = buzzdict_get(di, &k, int32_t);
+      if((x ? *x : 0) != shadow[k]) {
+         fprintf(stdout, "stress: wrong data for %d\n", k);
+         return 1;
+      }
+   }
+   fprintf(stdout, "stress: %u elements, capacity %u (max %u)\n",
+           buzzdict_size(di), di->capacity, maxcap);
+   buzzdict_destroy(&di);
+   return 0;
+}
+
 int main() {
    buzzdict_t di = buzzdict_new(4,
                                 sizeof(int16_t),
@@ -67,5 +121,5 @@ int main() {
    di_print(di);
 
    buzzdict_destroy(&di);
-   return 0;
+   return di_stress();
 }
@@ -0,0 +1,121 @@
+#include <buzz/buzzvm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Function handle test.
+ * Loads the functions in testbuzzfunction.bo and calls them from C
+ * through handles: with each argument type, through a handle looked up
+ * before the function is defined, and after the global symbol of the
+ * function is assigned again.
+ * Usage: testbuzzfunction [file.bo]
+ */
+
+static int ok = 1;
+
+static void check(const char* name, int cond) {
+   printf("%-40s %s\n", name, cond ? "OK" : "FAILED");
+   if(!cond) ok = 0;
+}
+
+/*
+ * Reads a bytecode file. Returns the buffer, or NULL in case of error.
+ */
+static uint8_t* load(const char* fname, uint32_t* size) {
+   FILE* fd = fopen(fname, "rb");
+   if(!fd) { perror(fname); return NULL; }
+   fseek(fd, 0, SEEK_END);
+   *size = ftell(fd);
+   rewind(fd);
+   uint8_t* buf = (uint8_t*)malloc(*size);
+   if(fread(buf, 1, *size, fd) < *size) {
+      perror(fname);
+      free(buf);
+      buf = NULL;
+   }
+   fclose(fd);
+   return buf;
+}
+
+/*
+ * Pops the return value of a call.
+ */
+static buzzobj_t result(buzzvm_t vm) {
+   buzzobj_t o = buzzvm_stack_at(vm, 1);
+   buzzvm_pop(vm);
+   return o;
+}
+
+/*
+ * C function put in place of echo().
+ */
+static int answer(buzzvm_t vm) {
+   buzzvm_pushi(vm, 42);
+   return buzzvm_ret1(vm);
+}
+
+int main(int argc, char** argv) {
+   const char* fname = (argc > 1) ? argv[1] : "testbuzzfunction.bo";
+   uint32_t size;
+   uint8_t* bcode = load(fname, &size);
+   if(!bcode) return 1;
+   buzzvm_t vm = buzzvm_new(0);
+   buzzvm_set_bcode(vm, bcode, size);
+   /* Look up a function the script has not defined yet */
+   buzzvm_fun_t later = buzzvm_function_lookup(vm, "later");
+   check("script", buzzvm_execute_script(vm) == BUZZVM_STATE_DONE);
+   buzzobj_t o;
+   /* A handle looked up before the definition */
+   buzzvm_function_invoke(vm, later, "i", 21);
+   o = result(vm);
+   check("handle looked up before definition",
+         vm->state == BUZZVM_STATE_READY &&
+         o->o.type == BUZZTYPE_INT && o->i.value == 42);
+   /* One argument of each type */
+   buzzvm_fun_t echo = buzzvm_function_lookup(vm, "echo");
+   buzzvm_function_invoke(vm, echo, "i", -7);
+   o = result(vm);
+   check("int argument",
+         o->o.type == BUZZTYPE_INT && o->i.value == -7);
+   buzzvm_function_invoke(vm, echo, "f", 2.5);
+   o = result(vm);
+   check("float argument",
+         o->o.type == BUZZTYPE_FLOAT && o->f.value == 2.5);
+   buzzvm_function_invoke(vm, echo, "s", "hello");
+   o = result(vm);
+   check("string argument",
+         o->o.type == BUZZTYPE_STRING && strcmp(o->s.value.str, "hello") == 0);
+   buzzvm_pusht(vm);
+   buzzobj_t t = buzzvm_stack_at(vm, 1);
+   buzzvm_function_invoke(vm, echo, "o", t);
+   o = result(vm);
+   buzzvm_pop(vm);
+   check("object argument", o == t);
+   buzzvm_function_invoke(vm, buzzvm_function_lookup(vm, "last"), "ifso", 1, 2.0, "three", t);
+   o = result(vm);
+   check("mixed arguments", o == t);
+   /* Add enough globals to move the symbols in the table */
+   char name[16];
+   for(int i = 0; i < 100; ++i) {
+      snprintf(name, sizeof(name), "g%d", i);
+      buzzvm_pushs(vm, buzzvm_string_register(vm, name, 1));
+      buzzvm_pushi(vm, i);
+      buzzvm_gstore(vm);
+   }
+   buzzvm_function_invoke(vm, echo, "i", 3);
+   o = result(vm);
+   check("handle after new globals",
+         o->o.type == BUZZTYPE_INT && o->i.value == 3);
+   /* Assign the global again */
+   buzzvm_pushs(vm, buzzvm_string_register(vm, "echo", 1));
+   buzzvm_pushcc(vm, buzzvm_function_register(vm, answer));
+   buzzvm_gstore(vm);
+   buzzvm_function_invoke(vm, echo, "i", 3);
+   o = result(vm);
+   check("handle after reassignment",
+         o->o.type == BUZZTYPE_INT && o->i.value == 42);
+   buzzvm_destroy(&vm);
+   free(bcode);
+   return ok ? 0 : 1;
+}
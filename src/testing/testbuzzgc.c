@@ -0,0 +1,215 @@
+#include <buzz/buzzvm.h>
+#include <stdio.h>
+#include <time.h>
+#include <inttypes.h>
+
+/*
+ * GC stress benchmark.
+ * Fills the heap with a mix of reachable and unreachable objects and
+ * measures the time taken by a full collection. The cost per object
+ * must stay roughly constant as the heap grows: the test fails if it is
+ * more than MAX_RATIO times higher on the largest heap than on the
+ * smallest one.
+ */
+
+#define MIN_OBJS   1000
+#define MAX_OBJS   512000
+#define REPEATS    5
+#define MAX_RATIO  4.0
+
+static double now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Runs a collection on a heap of nobjs objects, one in four reachable.
+ * Returns the duration in seconds, or a negative value if the wrong
+ * number of objects survived. The allocator statistics after the
+ * collection are stored in stats.
+ */
+static double gc_run(uint32_t nobjs, buzzheap_stats_t* stats) {
+   buzzvm_t vm = buzzvm_new(0);
+   /* Measure the major collection only */
+   buzzheap_setnursery(vm, 0);
+   /* A table keeps some objects reachable, the stack keeps the rest */
+   buzzvm_pusht(vm);
+   buzzobj_t t = buzzvm_stack_at(vm, 1);
+   uint32_t i, live = 1;
+   for(i = 0; i < nobjs; ++i) {
+      buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_FLOAT);
+      o->f.value = i;
+      if(i % 8 == 0) {
+         /* Reachable from the table; the key is reachable too */
+         buzzobj_t k = buzzheap_newobj(vm, BUZZTYPE_INT);
+         k->i.value = i;
+         buzzdict_set(t->t.value, &k, &o);
+         live += 2;
+      }
+      else if(i % 8 == 4) {
+         /* Reachable from the stack, as a boxed value */
+         buzzval_t v;
+         buzzval_setfloat(v, i);
+         v.o = o;
+         buzzvm_pushv(vm, v);
+         ++live;
+      }
+   }
+   /* Force a full collection */
+   vm->heap->max_objs = 0;
+   double start = now();
+   buzzheap_gc(vm);
+   double elapsed = now() - start;
+   if(buzzdarray_size(vm->heap->objs) != live) {
+      fprintf(stderr, "%u objects survived, expected %u\n",
+              (uint32_t)buzzdarray_size(vm->heap->objs), live);
+      elapsed = -1.0;
+   }
+   buzzheap_stats(vm, stats);
+   if(stats->objs != live) {
+      fprintf(stderr, "allocator reports %u objects, expected %u\n",
+              stats->objs, live);
+      elapsed = -1.0;
+   }
+   buzzvm_destroy(&vm);
+   return elapsed;
+}
+
+/*
+ * Runs an incremental collection on a heap of nobjs objects, storing a
+ * new entry in an already marked table between steps. Returns the number
+ * of steps, or -1 if the wrong number of objects survived. The allocator
+ * statistics after the collection are stored in stats.
+ */
+static int gc_incremental(uint32_t nobjs, uint32_t budget, buzzheap_stats_t* stats) {
+   buzzvm_t vm = buzzvm_new(0);
+   buzzheap_setnursery(vm, 0);
+   buzzheap_setbudget(vm, budget);
+   buzzvm_pusht(vm);
+   buzzobj_t t = buzzvm_stack_at(vm, 1);
+   uint32_t i, live = 1;
+   for(i = 0; i < nobjs; ++i) {
+      buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_FLOAT);
+      if(i % 4 == 0) {
+         buzzobj_t k = buzzheap_newobj(vm, BUZZTYPE_INT);
+         k->i.value = i;
+         buzzdict_set(t->t.value, &k, &o);
+         live += 2;
+      }
+   }
+   /* Start a cycle and run it step by step */
+   vm->heap->max_objs = 0;
+   int steps = 0;
+   do {
+      buzzheap_gcstep(vm);
+      ++steps;
+      /* The write barrier must keep the new key and value; the key is
+         above the small integers, which are not allocated */
+      buzzvm_push(vm, t);
+      buzzvm_pushi(vm, BUZZHEAP_SMALLINT_MAX + nobjs + steps);
+      buzzvm_pushf(vm, steps);
+      buzzvm_tput(vm);
+      live += 2;
+   } while(vm->heap->phase != BUZZHEAP_PHASE_IDLE);
+   buzzheap_stats(vm, stats);
+   if(stats->objs != live) {
+      fprintf(stderr, "%u objects survived the incremental collection, expected %u\n",
+              stats->objs, live);
+      steps = -1;
+   }
+   buzzvm_destroy(&vm);
+   return steps;
+}
+
+/*
+ * Allocates nobjs short-lived objects, one in 64 stored in a table,
+ * collecting at every safe point as the VM would. The nursery size is
+ * given by nursery, 0 to disable it. Returns the duration in seconds,
+ * or a negative value if the wrong number of objects survived.
+ */
+static double gc_nursery(uint32_t nobjs, uint32_t nursery) {
+   buzzvm_t vm = buzzvm_new(0);
+   buzzheap_setnursery(vm, nursery);
+   buzzvm_pusht(vm);
+   buzzobj_t t = buzzvm_stack_at(vm, 1);
+   uint32_t i, live = 1;
+   double start = now();
+   for(i = 0; i < nobjs; ++i) {
+      buzzobj_t o = buzzheap_newobj(vm, BUZZTYPE_FLOAT);
+      if(i % 64 == 0) {
+         /* The key is boxed by the table, which keeps the value box;
+            the key is above the small integers, which are not allocated */
+         buzzval_t v;
+         buzzval_setfloat(v, i);
+         v.o = o;
+         buzzvm_push(vm, t);
+         buzzvm_pushi(vm, BUZZHEAP_SMALLINT_MAX + 1 + i);
+         buzzvm_pushv(vm, v);
+         buzzvm_tput(vm);
+         live += 2;
+      }
+      buzzheap_safepoint(vm);
+   }
+   double elapsed = now() - start;
+   /* Finish the current cycle, then force a fresh one */
+   buzzheap_gc(vm);
+   vm->heap->max_objs = 0;
+   buzzheap_gc(vm);
+   buzzheap_stats_t stats;
+   buzzheap_stats(vm, &stats);
+   if(stats.objs != live) {
+      fprintf(stderr, "%u objects survived with nursery %u, expected %u\n",
+              stats.objs, nursery, live);
+      elapsed = -1.0;
+   }
+   buzzvm_destroy(&vm);
+   return elapsed;
+}
+
+int main() {
+   uint32_t n;
+   int r;
+   double first = 0.0, last = 0.0;
+   buzzheap_stats_t stats;
+   printf("%10s %12s %12s %8s %8s\n", "objects", "time (ms)", "ns/object", "slabs", "frag");
+   for(n = MIN_OBJS; n <= MAX_OBJS; n *= 2) {
+      /* Take the best of a few runs to filter out noise */
+      double best = -1.0;
+      for(r = 0; r < REPEATS; ++r) {
+         double t = gc_run(n, &stats);
+         if(t < 0.0) return 1;
+         if(best < 0.0 || t < best) best = t;
+      }
+      /* Objects in the heap, including table keys */
+      uint32_t total = n + n / 8 + 1;
+      last = best * 1e9 / total;
+      if(n == MIN_OBJS) first = last;
+      printf("%10u %12.3f %12.1f %8u %8.2f\n", total, best * 1e3, last,
+             stats.slabs, stats.fragmentation);
+   }
+   printf("\ncost per object, largest/smallest heap: %.2f\n", last / first);
+   if(last > first * MAX_RATIO) {
+      fprintf(stderr, "collection cost is not linear in the number of objects\n");
+      return 1;
+   }
+   /* Incremental collection: the pause depends on the budget, not on the heap */
+   printf("\n%10s %8s %8s %14s\n", "objects", "budget", "steps", "max pause (us)");
+   for(n = MIN_OBJS; n <= MAX_OBJS / 8; n *= 8) {
+      uint32_t b;
+      for(b = 0; b <= 10000; b = b ? b * 10 : 1000) {
+         int steps = gc_incremental(n, b, &stats);
+         if(steps < 0) return 1;
+         printf("%10u %8u %8d %14u\n", n + n / 4 + 1, b, steps, stats.max_pause_us);
+      }
+   }
+   /* Nursery: short-lived objects must be cheaper to collect */
+   printf("\n%10s %14s %14s\n", "objects", "old only (ms)", "nursery (ms)");
+   for(n = MIN_OBJS * 8; n <= MAX_OBJS; n *= 4) {
+      double old = gc_nursery(n, 0);
+      double young = gc_nursery(n, 4096);
+      if(old < 0.0 || young < 0.0) return 1;
+      printf("%10u %14.3f %14.3f\n", n, old * 1e3, young * 1e3);
+   }
+   return 0;
+}
@@ -0,0 +1,122 @@
+#include <buzz/buzzvm.h>
+#include <buzz/buzzjit.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compiled code test.
+ * Runs each script twice, once with the interpreter only and once
+ * compiling every function at its first call, and compares what the
+ * two runs log and how they end.
+ * Usage: testbuzzjit <file.bo> ...
+ */
+
+/* Where log() writes */
+static FILE* out;
+
+/*
+ * Like log() in bzzrun, without the addresses, which change between
+ * runs.
+ */
+static int print(buzzvm_t vm) {
+   for(int i = 1; i <= buzzvm_lnum(vm); ++i) {
+      buzzvm_lload(vm, i);
+      buzzobj_t o = buzzvm_stack_at(vm, 1);
+      buzzvm_pop(vm);
+      switch(o->o.type) {
+         case BUZZTYPE_NIL:
+            fprintf(out, "[nil]");
+            break;
+         case BUZZTYPE_INT:
+            fprintf(out, "%d", o->i.value);
+            break;
+         case BUZZTYPE_FLOAT:
+            fprintf(out, "%f", o->f.value);
+            break;
+         case BUZZTYPE_TABLE:
+            fprintf(out, "[table with %d elems]", (buzztable_size(o)));
+            break;
+         case BUZZTYPE_CLOSURE:
+            if(o->c.value.isnative)
+               fprintf(out, "[n-closure @%d]", o->c.value.ref);
+            else
+               fprintf(out, "[c-closure @%d]", o->c.value.ref);
+            break;
+         case BUZZTYPE_STRING:
+            fprintf(out, "%s", o->s.value.str);
+            break;
+         case BUZZTYPE_USERDATA:
+            fprintf(out, "[userdata]");
+            break;
+         case BUZZTYPE_COROUTINE:
+            fprintf(out, "[coroutine]");
+            break;
+         default:
+            break;
+      }
+   }
+   fprintf(out, "\n");
+   return buzzvm_ret0(vm);
+}
+
+/*
+ * Runs a script. If 'threshold' is 0, compiled code is disabled,
+ * otherwise functions are compiled after that many calls.
+ * Returns the log and the final state, to be freed by the caller.
+ */
+static char* run(const uint8_t* bcode, uint32_t size, uint32_t threshold) {
+   char* buf;
+   size_t len;
+   out = open_memstream(&buf, &len);
+   buzzvm_t vm = buzzvm_new(1);
+   buzzvm_set_bcode(vm, bcode, size);
+   if(threshold == 0) buzzjit_destroy(&vm->jit);
+   else if(vm->jit) vm->jit->threshold = threshold;
+   buzzvm_pushs(vm, buzzvm_string_register(vm, "log", 1));
+   buzzvm_pushcc(vm, buzzvm_function_register(vm, print));
+   buzzvm_gstore(vm);
+   buzzvm_execute_script(vm);
+   fprintf(out, "state: %s\n", buzzvm_state_desc[vm->state]);
+   if(vm->state == BUZZVM_STATE_ERROR)
+      fprintf(out, "error at %u: %s\n", vm->oldpc, vm->errormsg);
+   buzzvm_destroy(&vm);
+   fclose(out);
+   return buf;
+}
+
+int main(int argc, char** argv) {
+   if(argc < 2) {
+      fprintf(stderr, "Usage:\n\t%s <file.bo> ...\n\n", argv[0]);
+      return 1;
+   }
+   int ok = 1;
+   for(int i = 1; i < argc; ++i) {
+      /* Read the bytecode */
+      FILE* fd = fopen(argv[i], "rb");
+      if(!fd) {
+         perror(argv[i]);
+         ok = 0;
+         continue;
+      }
+      fseek(fd, 0, SEEK_END);
+      uint32_t size = ftell(fd);
+      rewind(fd);
+      uint8_t* bcode = (uint8_t*)malloc(size);
+      if(fread(bcode, 1, size, fd) < size) perror(argv[i]);
+      fclose(fd);
+      /* Run it both ways */
+      char* interp = run(bcode, size, 0);
+      char* jit = run(bcode, size, 1);
+      int same = (strcmp(interp, jit) == 0);
+      printf("%-40s %s\n", argv[i], same ? "OK" : "FAILED");
+      if(!same) {
+         printf("--- interpreter\n%s--- compiled\n%s", interp, jit);
+         ok = 0;
+      }
+      free(interp);
+      free(jit);
+      free(bcode);
+   }
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+#include <buzz/buzzvm.h>
+#include <buzz/buzzprogram.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Shared program test.
+ * Sets one program made from testbuzzprogram.bo into two VMs, and
+ * checks that the strings of the program are shared while the strings
+ * made at run time stay in the VM that made them. The VMs are destroyed
+ * before the program, as buzzprogram_destroy() requires.
+ * Usage: testbuzzprogram [file.bo]
+ */
+
+static int ok = 1;
+
+static void check(const char* name, int cond) {
+   printf("%-40s %s\n", name, cond ? "OK" : "FAILED");
+   if(!cond) ok = 0;
+}
+
+/*
+ * Reads a bytecode file. Returns the buffer, or NULL in case of error.
+ */
+static uint8_t* load(const char* fname, uint32_t* size) {
+   FILE* fd = fopen(fname, "rb");
+   if(!fd) { perror(fname); return NULL; }
+   fseek(fd, 0, SEEK_END);
+   *size = ftell(fd);
+   rewind(fd);
+   uint8_t* buf = (uint8_t*)malloc(*size);
+   if(fread(buf, 1, *size, fd) < *size) {
+      perror(fname);
+      free(buf);
+      buf = NULL;
+   }
+   fclose(fd);
+   return buf;
+}
+
+/*
+ * Returns 1 if the global 'greeting' of a VM is "hello".
+ */
+static int greeting_ok(buzzvm_t vm) {
+   buzzvm_pushs(vm, buzzvm_string_register(vm, "greeting", 1));
+   buzzvm_gload(vm);
+   buzzobj_t o = buzzvm_stack_at(vm, 1);
+   int r = (o->o.type == BUZZTYPE_STRING && strcmp(o->s.value.str, "hello") == 0);
+   buzzvm_pop(vm);
+   return r;
+}
+
+/*
+ * Calls make(n) and returns 1 if the result is "made <n>".
+ */
+static int make_ok(buzzvm_t vm, int n) {
+   char want[32];
+   snprintf(want, sizeof(want), "made %d", n);
+   buzzvm_pushi(vm, n);
+   if(buzzvm_function_call(vm, "make", 1) != BUZZVM_STATE_READY) return 0;
+   buzzobj_t o = buzzvm_stack_at(vm, 1);
+   int r = (o->o.type == BUZZTYPE_STRING && strcmp(o->s.value.str, want) == 0);
+   buzzvm_pop(vm);
+   return r;
+}
+
+int main(int argc, char** argv) {
+   const char* fname = (argc > 1) ? argv[1] : "testbuzzprogram.bo";
+   uint32_t size;
+   uint8_t* bcode = load(fname, &size);
+   if(!bcode) return 1;
+   /* The program keeps its own copy of the bytecode */
+   buzzprogram_t prog = buzzprogram_new(bcode, size);
+   free(bcode);
+   check("program", prog != NULL);
+   if(!prog) return 1;
+   buzzvm_t vm1 = buzzvm_new(1);
+   buzzvm_t vm2 = buzzvm_new(2);
+   buzzvm_set_program(vm1, prog);
+   buzzvm_set_program(vm2, prog);
+   check("script in vm 1", buzzvm_execute_script(vm1) == BUZZVM_STATE_DONE);
+   check("script in vm 2", buzzvm_execute_script(vm2) == BUZZVM_STATE_DONE);
+   /* The strings of the program are the same in both VMs */
+   uint16_t s1 = buzzvm_string_register(vm1, "hello", 0);
+   uint16_t s2 = buzzvm_string_register(vm2, "hello", 0);
+   check("constant string id", s1 == s2);
+   check("constant string in program",
+         buzzstrman_get(prog->strings, s1) != NULL &&
+         strcmp(buzzstrman_get(prog->strings, s1), "hello") == 0);
+   check("constant string shared",
+         buzzvm_string_get(vm1, s1) == buzzstrman_get(prog->strings, s1) &&
+         buzzvm_string_get(vm2, s2) == buzzstrman_get(prog->strings, s2));
+   check("library string shared",
+         buzzvm_string_register(vm1, "string", 1) ==
+         buzzvm_string_register(vm2, "string", 1));
+   check("global in vm 1", greeting_ok(vm1));
+   check("global in vm 2", greeting_ok(vm2));
+   /* Strings made at run time stay in their VM */
+   uint16_t r1 = buzzvm_string_register(vm1, "only in vm 1", 1);
+   uint16_t r2 = buzzvm_string_register(vm2, "only in vm 2", 1);
+   check("run-time string not in program",
+         buzzstrman_get(prog->strings, r1) == NULL &&
+         buzzstrman_get(prog->strings, r2) == NULL);
+   check("run-time string lookup",
+         strcmp(buzzvm_string_get(vm1, r1), "only in vm 1") == 0 &&
+         strcmp(buzzvm_string_get(vm2, r2), "only in vm 2") == 0);
+   check("run-time string registered once",
+         buzzvm_string_register(vm1, "only in vm 1", 1) == r1);
+   check("run-time string private",
+         buzzvm_string_get(vm2, r1) == NULL ||
+         strcmp(buzzvm_string_get(vm2, r1), "only in vm 1") != 0);
+   check("make in vm 1", make_ok(vm1, 1));
+   check("make in vm 2", make_ok(vm2, 2));
+   /* Collections prune the strings of a VM, not those of the program */
+   buzzheap_gc(vm1);
+   buzzheap_gc(vm2);
+   check("constant string after collection",
+         strcmp(buzzvm_string_get(vm1, s1), "hello") == 0 &&
+         greeting_ok(vm1) && greeting_ok(vm2));
+   /* A VM goes on when the other one is destroyed */
+   buzzvm_destroy(&vm1);
+   check("vm 2 after vm 1 is destroyed", make_ok(vm2, 3) && greeting_ok(vm2));
+   /* The program goes last */
+   buzzvm_destroy(&vm2);
+   buzzprogram_destroy(&prog);
+   check("program destroyed", prog == NULL);
+   return ok ? 0 : 1;
+}
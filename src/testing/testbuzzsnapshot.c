@@ -0,0 +1,201 @@
+#include <buzz/buzzvm.h>
+#include <buzz/buzzsnapshot.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Snapshot test.
+ * Takes snapshots of a VM running testbuzzsnapshot.bo, and checks that
+ * restoring them, in the same VM or in a fresh one, gives the same
+ * results as the VM they were taken from. Also checks that images that
+ * are corrupted, out of range or made for other bytecode are rejected.
+ * Usage: testbuzzsnapshot [file.bo]
+ */
+
+#define STEPS 3
+#define IMAGE "testbuzzsnapshot.snap"
+
+static int ok = 1;
+
+static uint8_t* bcode;
+static uint32_t bcode_size;
+
+static void check(const char* name, int cond) {
+   printf("%-40s %s\n", name, cond ? "OK" : "FAILED");
+   if(!cond) ok = 0;
+}
+
+/*
+ * Reads a bytecode file. Returns the buffer, or NULL in case of error.
+ */
+static uint8_t* load(const char* fname, uint32_t* size) {
+   FILE* fd = fopen(fname, "rb");
+   if(!fd) { perror(fname); return NULL; }
+   fseek(fd, 0, SEEK_END);
+   *size = ftell(fd);
+   rewind(fd);
+   uint8_t* buf = (uint8_t*)malloc(*size);
+   if(fread(buf, 1, *size, fd) < *size) {
+      perror(fname);
+      free(buf);
+      buf = NULL;
+   }
+   fclose(fd);
+   return buf;
+}
+
+/*
+ * Makes a VM with the bytecode. If 'init' is set, runs the script and
+ * init().
+ */
+static buzzvm_t setup(const uint8_t* code, int init) {
+   buzzvm_t vm = buzzvm_new(1);
+   buzzvm_set_bcode(vm, code, bcode_size);
+   if(init) {
+      buzzvm_execute_script(vm);
+      buzzvm_function_call(vm, "init", 0);
+      buzzvm_pop(vm);
+   }
+   return vm;
+}
+
+/*
+ * Runs STEPS steps and stores the string returned by each one.
+ * Returns 0 if a step failed.
+ */
+static int run(buzzvm_t vm, char out[STEPS][256]) {
+   int i;
+   for(i = 0; i < STEPS; ++i) {
+      if(buzzvm_function_call(vm, "step", 0) != BUZZVM_STATE_READY ||
+         buzzvm_stack_at(vm, 1)->o.type != BUZZTYPE_STRING)
+         return 0;
+      snprintf(out[i], 256, "%s", buzzvm_stack_at(vm, 1)->s.value.str);
+      buzzvm_pop(vm);
+      /* Collect the objects the step dropped */
+      buzzheap_gc(vm);
+   }
+   return 1;
+}
+
+/*
+ * Returns 1 if two runs gave the same results.
+ */
+static int same_run(char a[STEPS][256], char b[STEPS][256]) {
+   return memcmp(a, b, STEPS * 256) == 0;
+}
+
+/*
+ * Returns 1 if two snapshots have the same content.
+ */
+static int same_image(buzzsnapshot_t a, buzzsnapshot_t b) {
+   return a && b &&
+      buzzmsg_payload_size(a) == buzzmsg_payload_size(b) &&
+      memcmp(a->data, b->data, buzzmsg_payload_size(a)) == 0;
+}
+
+/*
+ * Resumes the call to work() until it is over, returns its result, or -1
+ * if it failed.
+ */
+static int32_t finish_work(buzzvm_t vm) {
+   while(vm->state == BUZZVM_STATE_YIELDED)
+      buzzvm_resume(vm, 100);
+   if(vm->state != BUZZVM_STATE_READY ||
+      buzzvm_stack_at(vm, 1)->o.type != BUZZTYPE_INT)
+      return -1;
+   int32_t r = buzzvm_stack_at(vm, 1)->i.value;
+   buzzvm_pop(vm);
+   return r;
+}
+
+int main(int argc, char** argv) {
+   const char* fname = (argc > 1) ? argv[1] : "testbuzzsnapshot.bo";
+   bcode = load(fname, &bcode_size);
+   if(!bcode) return 1;
+   char first[STEPS][256], again[STEPS][256];
+   memset(first, 0, sizeof(first));
+   memset(again, 0, sizeof(again));
+   /* Round trip in the same VM */
+   buzzvm_t vm = setup(bcode, 1);
+   buzzsnapshot_t snap = buzzvm_snapshot(vm);
+   check("snapshot", snap != NULL);
+   check("steps", run(vm, first));
+   check("restore", buzzvm_restore(vm, snap));
+   check("steps after restore", run(vm, again) && same_run(first, again));
+   /* Restore into a VM that never ran */
+   buzzvm_t fresh = setup(bcode, 0);
+   memset(again, 0, sizeof(again));
+   check("restore into fresh VM", buzzvm_restore(fresh, snap));
+   check("steps in fresh VM", run(fresh, again) && same_run(first, again));
+   buzzvm_destroy(&fresh);
+   /* Restore a VM that ran out of instruction budget */
+   buzzvm_restore(vm, snap);
+   buzzvm_pushi(vm, 1000);
+   buzzvm_function_call_budget(vm, "work", 1, 500);
+   check("out of budget", vm->state == BUZZVM_STATE_YIELDED);
+   buzzsnapshot_t ysnap = buzzvm_snapshot(vm);
+   int32_t r = finish_work(vm);
+   fresh = setup(bcode, 0);
+   check("restore yielded VM",
+         buzzvm_restore(fresh, ysnap) && fresh->state == BUZZVM_STATE_YIELDED);
+   check("resume restored VM", r >= 0 && finish_work(fresh) == r);
+   buzzvm_destroy(&fresh);
+   buzzsnapshot_destroy(&ysnap);
+   /* Corrupted images leave the VM untouched */
+   buzzvm_restore(vm, snap);
+   buzzsnapshot_t bad = buzzvm_snapshot(vm);
+   uint32_t size = buzzmsg_payload_size(bad);
+   *buzzdarray_getp(bad, size / 2, uint8_t) ^= 0xFF;
+   check("corrupted image rejected", !buzzvm_restore(vm, bad));
+   *buzzdarray_getp(bad, size / 2, uint8_t) ^= 0xFF;
+   bad->size = size - 1;
+   check("truncated image rejected", !buzzvm_restore(vm, bad));
+   buzzsnapshot_destroy(&bad);
+   /* Whole images whose registers or frames do not fit are rejected too */
+   int32_t pc = vm->pc;
+   vm->pc = bcode_size + 1;
+   bad = buzzvm_snapshot(vm);
+   vm->pc = pc;
+   check("program counter out of range rejected", !buzzvm_restore(vm, bad));
+   buzzsnapshot_destroy(&bad);
+   buzzvm_frame_t* f = buzzdarray_getp(vm->frames, 0, buzzvm_frame_t);
+   buzzvm_frame_t saved = *f;
+   f->retpc = bcode_size + 1;
+   bad = buzzvm_snapshot(vm);
+   *f = saved;
+   check("return address out of range rejected", !buzzvm_restore(vm, bad));
+   buzzsnapshot_destroy(&bad);
+   f->lbase = buzzdarray_size(vm->lsyms) + 1;
+   bad = buzzvm_snapshot(vm);
+   *f = saved;
+   check("frame out of range rejected", !buzzvm_restore(vm, bad));
+   buzzsnapshot_destroy(&bad);
+   memset(again, 0, sizeof(again));
+   check("VM untouched", run(vm, again) && same_run(first, again));
+   /* Files */
+   check("save to file", buzzsnapshot_tofile(IMAGE, snap));
+   buzzsnapshot_t snap2 = buzzsnapshot_fromfile(IMAGE);
+   check("load from file", same_image(snap, snap2));
+   fresh = setup(bcode, 0);
+   memset(again, 0, sizeof(again));
+   check("restore from file",
+         buzzvm_restore(fresh, snap2) && run(fresh, again) && same_run(first, again));
+   buzzvm_destroy(&fresh);
+   buzzsnapshot_destroy(&snap2);
+   remove(IMAGE);
+   check("load missing file", buzzsnapshot_fromfile(IMAGE) == NULL);
+   /* Other bytecode: change a character of the first string */
+   uint8_t* other = (uint8_t*)malloc(bcode_size);
+   memcpy(other, bcode, bcode_size);
+   other[sizeof(uint16_t)] ^= 0x20;
+   fresh = setup(other, 0);
+   check("image of other bytecode rejected", !buzzvm_restore(fresh, snap));
+   buzzvm_destroy(&fresh);
+   free(other);
+   /* Cleanup */
+   buzzsnapshot_destroy(&snap);
+   buzzvm_destroy(&vm);
+   free(bcode);
+   return ok ? 0 : 1;
+}
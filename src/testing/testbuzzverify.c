@@ -0,0 +1,149 @@
+#include <buzz/buzzvm.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Bytecode verifier test.
+ * Builds small programs by hand and checks which ones the verifier
+ * accepts. The rejected ones keep their run-time checks, so running
+ * them must end in an error instead of a crash.
+ */
+
+/*
+ * A program being built. The bytecode starts with an empty string
+ * table and an empty function definition part, ended by a nop.
+ */
+struct program_s {
+   uint8_t code[256];
+   uint32_t size;
+};
+
+static void prog_init(struct program_s* p) {
+   memset(p->code, 0, sizeof(p->code));
+   p->size = sizeof(uint16_t);
+   p->code[p->size++] = BUZZVM_INSTR_NOP;
+}
+
+/*
+ * Appends an instruction without argument, returns its offset.
+ */
+static int32_t op(struct program_s* p, uint8_t opcode) {
+   p->code[p->size] = opcode;
+   return p->size++;
+}
+
+/*
+ * Appends an instruction with an integer argument, returns its offset.
+ */
+static int32_t opi(struct program_s* p, uint8_t opcode, int32_t arg) {
+   int32_t off = op(p, opcode);
+   memcpy(p->code + p->size, &arg, sizeof(int32_t));
+   p->size += sizeof(int32_t);
+   return off;
+}
+
+/*
+ * Sets the argument of the instruction at the given offset.
+ */
+static void setarg(struct program_s* p, int32_t off, int32_t arg) {
+   memcpy(p->code + off + 1, &arg, sizeof(int32_t));
+}
+
+/*
+ * Loads a program and checks the verifier's verdict. Programs that are
+ * rejected are also run, and must stop with an error unless 'mayrun'
+ * is set.
+ * Returns 1 if the program behaved as expected, 0 otherwise.
+ */
+static int check(const char* name,
+                 struct program_s* p,
+                 int expected,
+                 int mayrun) {
+   buzzvm_t vm = buzzvm_new(0);
+   buzzvm_set_bcode(vm, p->code, p->size);
+   int verified = buzzvm_verify(vm);
+   int ok = (verified == expected);
+   if(!verified) {
+      buzzvm_state s = buzzvm_execute_script(vm);
+      if(!mayrun && s != BUZZVM_STATE_ERROR) ok = 0;
+   }
+   printf("%-32s %-9s %s\n", name, verified ? "verified" : "rejected", ok ? "OK" : "FAILED");
+   buzzvm_destroy(&vm);
+   return ok;
+}
+
+/*
+ * Loads a program that the verifier must accept, runs it, and checks
+ * that the checks left at run time stop it with an error.
+ * Returns 1 if the program behaved as expected, 0 otherwise.
+ */
+static int check_run(const char* name,
+                     struct program_s* p) {
+   buzzvm_t vm = buzzvm_new(0);
+   buzzvm_set_bcode(vm, p->code, p->size);
+   int verified = buzzvm_verify(vm);
+   int ok = verified && buzzvm_execute_script(vm) == BUZZVM_STATE_ERROR;
+   printf("%-32s %-9s %s\n", name, verified ? "verified" : "rejected", ok ? "OK" : "FAILED");
+   buzzvm_destroy(&vm);
+   return ok;
+}
+
+int main() {
+   struct program_s p;
+   int32_t at;
+   int ok = 1;
+   /* A valid script with a function */
+   prog_init(&p);
+   at = opi(&p, BUZZVM_INSTR_PUSHCN, 0);
+   op(&p, BUZZVM_INSTR_POP);
+   op(&p, BUZZVM_INSTR_DONE);
+   setarg(&p, at, opi(&p, BUZZVM_INSTR_LLOAD, 0));
+   op(&p, BUZZVM_INSTR_RET1);
+   ok &= check("valid", &p, 1, 0);
+   /* A jump target reached with two stack depths */
+   prog_init(&p);
+   opi(&p, BUZZVM_INSTR_PUSHI, 0);
+   at = opi(&p, BUZZVM_INSTR_JUMPZ, 0);
+   opi(&p, BUZZVM_INSTR_PUSHI, 1);
+   setarg(&p, at, op(&p, BUZZVM_INSTR_DONE));
+   ok &= check("inconsistent depth at jump", &p, 0, 1);
+   /* A pop from the empty stack */
+   prog_init(&p);
+   op(&p, BUZZVM_INSTR_POP);
+   op(&p, BUZZVM_INSTR_DONE);
+   ok &= check("pop below empty", &p, 0, 0);
+   /* A call without a constant argument count on top */
+   prog_init(&p);
+   op(&p, BUZZVM_INSTR_PUSHNIL);
+   op(&p, BUZZVM_INSTR_PUSHNIL);
+   op(&p, BUZZVM_INSTR_PUSHNIL);
+   op(&p, BUZZVM_INSTR_CALLC);
+   op(&p, BUZZVM_INSTR_DONE);
+   ok &= check("call without argument count", &p, 0, 0);
+   /* A jump into the argument of an instruction */
+   prog_init(&p);
+   at = opi(&p, BUZZVM_INSTR_PUSHI, 0);
+   op(&p, BUZZVM_INSTR_POP);
+   opi(&p, BUZZVM_INSTR_JUMP, at + 1);
+   op(&p, BUZZVM_INSTR_DONE);
+   ok &= check("jump into an instruction", &p, 0, 0);
+   /* A local symbol read in the script body */
+   prog_init(&p);
+   opi(&p, BUZZVM_INSTR_LLOAD, 1);
+   op(&p, BUZZVM_INSTR_POP);
+   op(&p, BUZZVM_INSTR_DONE);
+   ok &= check("local access outside a function", &p, 0, 0);
+   /* A store past the local symbols of the function */
+   prog_init(&p);
+   op(&p, BUZZVM_INSTR_PUSHNIL);
+   at = opi(&p, BUZZVM_INSTR_PUSHCN, 0);
+   opi(&p, BUZZVM_INSTR_PUSHI, 0);
+   op(&p, BUZZVM_INSTR_CALLC);
+   op(&p, BUZZVM_INSTR_POP);
+   op(&p, BUZZVM_INSTR_DONE);
+   setarg(&p, at, opi(&p, BUZZVM_INSTR_PUSHI, 1));
+   opi(&p, BUZZVM_INSTR_LSTORE, 5);
+   op(&p, BUZZVM_INSTR_RET0);
+   ok &= check_run("local store out of range", &p);
+   return ok ? 0 : 1;
+}
@@ -70,7 +70,7 @@ For detail, see `comment-dwim'."
 ;; Constants
 (setq buzz-constant-regexp "[[:upper:]][[:upper:][:digit:]_]*")
 ;; Keywords
-(setq buzz-keywords '("var" "nil" "if" "else" "function" "return" "for" "while" "and" "or" "not" "size" "foreach" "map" "reduce" "include"))
+(setq buzz-keywords '("var" "nil" "if" "else" "function" "return" "yield" "for" "while" "and" "or" "not" "size" "foreach" "map" "reduce" "include"))
 (setq buzz-keywords-regexp (regexp-opt buzz-keywords 'words))
 (setq buzz-keywords nil)
 ;; Builtins